@@ -2,29 +2,41 @@
 #include <stdio.h>
 #include <string.h>
 
+#if !defined(WIN32)
+#include <unistd.h>
+#endif
+
 #include "searpc-client.h"
 #include "searpc-utils.h"
+#include "searpc-param-reader.h"
+
+struct _SearpcCallWriter {
+    GString *buf;
+    gboolean invalid;
+    // Descriptors of the fd parameters, sent with the call.
+    int fds[SEARPC_MAX_CALL_FDS];
+    int n_fds;
+    // Values of the bytes parameters, sent after the JSON text.
+    GBytes *bytes[SEARPC_MAX_CALL_BYTES];
+    int n_bytes;
+};
+
+// Larger buffers aren't kept after the call.
+#define MAX_CACHED_CALL_SIZE (1024 * 1024)
+
+static void
+call_writer_free (gpointer data)
+{
+    SearpcCallWriter *call = data;
 
-static char*
-searpc_client_fret__string (char *data, size_t len, GError **error);
-
-static int
-searpc_client_fret__int (char *data, size_t len, GError **error);
-
-static gint64
-searpc_client_fret__int64 (char *data, size_t len, GError **error);
-
-static GObject*
-searpc_client_fret__object (GType gtype, char *data,
-                            size_t len, GError **error);
-
-static GList*
-searpc_client_fret__objlist (GType gtype, char *data,
-                             size_t len, GError **error);
-
-static json_t *
-searpc_client_fret__json (char *data, size_t len, GError **error);
+    g_string_free (call->buf, TRUE);
+    g_free (call);
+}
 
+// A writer is kept per thread and reused, so writing a call doesn't
+// allocate. It's taken out while a call is written, so calls made from a
+// transport get their own.
+static GPrivate cached_writer = G_PRIVATE_INIT (call_writer_free);
 
 static void clean_objlist(GList *list)
 {
@@ -94,6 +106,283 @@ fcall_to_str (const char *fname, int n_params, va_list args, gsize *len)
     return data;
 }
 
+SearpcCallWriter *
+searpc_client_begin_call (const char *fname)
+{
+    SearpcCallWriter *call = g_private_get (&cached_writer);
+
+    if (call) {
+        g_private_set (&cached_writer, NULL);
+    } else {
+        call = g_new0 (SearpcCallWriter, 1);
+        call->buf = g_string_sized_new (256);
+    }
+
+    g_string_truncate (call->buf, 0);
+    g_string_append_c (call->buf, '[');
+    call->invalid = !searpc_json_write_string (call->buf, fname);
+    call->n_fds = 0;
+    call->n_bytes = 0;
+
+    return call;
+}
+
+void
+searpc_call_writer_add_string (SearpcCallWriter *call, const char *value)
+{
+    g_string_append_c (call->buf, ',');
+    if (!searpc_json_write_string (call->buf, value))
+        call->invalid = TRUE;
+}
+
+void
+searpc_call_writer_add_int (SearpcCallWriter *call, gint64 value)
+{
+    g_string_append_c (call->buf, ',');
+    searpc_json_write_int (call->buf, value);
+}
+
+void
+searpc_call_writer_add_json (SearpcCallWriter *call, const json_t *value)
+{
+    g_string_append_c (call->buf, ',');
+    searpc_json_write_json (call->buf, value);
+}
+
+// The parameter is the index of the descriptor among those of the call.
+void
+searpc_call_writer_add_fd (SearpcCallWriter *call, int fd)
+{
+    g_string_append_c (call->buf, ',');
+    if (fd < 0) {
+        g_string_append (call->buf, "-1");
+        return;
+    }
+    if (call->n_fds == SEARPC_MAX_CALL_FDS) {
+        call->invalid = TRUE;
+        return;
+    }
+    searpc_json_write_int (call->buf, call->n_fds);
+    call->fds[call->n_fds++] = fd;
+}
+
+// The parameter is the index of the value in the section that follows
+// the call. The data isn't copied, @value must stay valid until the call
+// is sent.
+void
+searpc_call_writer_add_bytes (SearpcCallWriter *call, GBytes *value)
+{
+    g_string_append_c (call->buf, ',');
+    if (!value) {
+        g_string_append (call->buf, "-1");
+        return;
+    }
+    if (call->n_bytes == SEARPC_MAX_CALL_BYTES) {
+        call->invalid = TRUE;
+        return;
+    }
+    searpc_json_write_int (call->buf, call->n_bytes);
+    call->bytes[call->n_bytes++] = value;
+}
+
+// Close the parameter list and append the bytes values.
+static void
+finish_call (SearpcCallWriter *call)
+{
+    g_string_append_c (call->buf, ']');
+    if (call->n_bytes > 0 &&
+        !searpc_bytes_section_write (call->buf, call->bytes, call->n_bytes))
+        call->invalid = TRUE;
+}
+
+static void
+close_fds (const int *fds, int n_fds)
+{
+#if !defined(WIN32)
+    int i;
+
+    for (i = 0; i < n_fds; i++)
+        close (fds[i]);
+#endif
+}
+
+// Send a call whose parameters are written, with its descriptors. The
+// descriptors of the response are stored in @ret_fds.
+static char *
+send_call_with_fds (SearpcClient *client, SearpcCallWriter *call,
+                    size_t *ret_len, int *ret_fds, int *n_ret_fds,
+                    GError **error)
+{
+    char *fret;
+
+    *n_ret_fds = 0;
+    if (!client->send_fds) {
+        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE,
+                     "Transport can't pass file descriptors");
+        return NULL;
+    }
+
+    fret = client->send_fds (client->arg, call->buf->str, call->buf->len,
+                             call->fds, call->n_fds, ret_len,
+                             ret_fds, n_ret_fds);
+    if (!fret)
+        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
+    return fret;
+}
+
+static void
+release_call_writer (SearpcCallWriter *call)
+{
+    if (call->buf->allocated_len <= MAX_CACHED_CALL_SIZE &&
+        !g_private_get (&cached_writer))
+        g_private_set (&cached_writer, call);
+    else
+        call_writer_free (call);
+}
+
+typedef struct {
+    GType gtype;
+    SearpcObjlistChunkFunc callback;
+    void *user_data;
+    GError *error;
+} ObjstreamCall;
+
+static void
+deliver_objlist_chunk (char *data, size_t len, void *vdata)
+{
+    ObjstreamCall *oc = vdata;
+    GList *objects;
+
+    // The parts after a malformed one are dropped.
+    if (oc->error)
+        return;
+
+    objects = searpc_client_fret__objlist (oc->gtype, data, len, &oc->error);
+    if (objects)
+        oc->callback (objects, oc->user_data);
+}
+
+static int
+send_objstream_call (SearpcClient *client, const char *fcall, size_t len,
+                     GType gtype, SearpcObjlistChunkFunc callback,
+                     void *user_data, GError **error)
+{
+    ObjstreamCall oc = { gtype, callback, user_data, NULL };
+    size_t ret_len;
+    char *fret;
+
+    if (client->send_chunked)
+        fret = client->send_chunked (client->arg, fcall, len, &ret_len,
+                                     deliver_objlist_chunk, &oc);
+    else
+        fret = searpc_client_transport_send (client, fcall, len, &ret_len);
+    if (!fret) {
+        g_clear_error (&oc.error);
+        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
+        return -1;
+    }
+
+    deliver_objlist_chunk (fret, ret_len, &oc);
+    g_free (fret);
+    if (oc.error) {
+        g_propagate_error (error, oc.error);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+searpc_client_end_call_objstream (SearpcClient *client, SearpcCallWriter *call,
+                                  GType object_type,
+                                  SearpcObjlistChunkFunc callback,
+                                  void *user_data, GError **error)
+{
+    int ret = -1;
+
+    if (!call->invalid)
+        finish_call (call);
+    if (call->invalid) {
+        g_set_error (error, DFT_DOMAIN, 0, "Invalid Parameter");
+    } else {
+        ret = send_objstream_call (client, call->buf->str, call->buf->len,
+                                   object_type, callback, user_data, error);
+    }
+
+    release_call_writer (call);
+    return ret;
+}
+
+char *
+searpc_client_end_call (SearpcClient *client, SearpcCallWriter *call,
+                        size_t *ret_len, GError **error)
+{
+    char *fret = NULL;
+    int ret_fds[SEARPC_MAX_CALL_FDS];
+    int n_ret_fds;
+
+    if (!call->invalid)
+        finish_call (call);
+    if (call->invalid) {
+        g_set_error (error, DFT_DOMAIN, 0, "Invalid Parameter");
+    } else if (call->n_fds > 0) {
+        fret = send_call_with_fds (client, call, ret_len,
+                                   ret_fds, &n_ret_fds, error);
+        // The function doesn't return a descriptor.
+        close_fds (ret_fds, n_ret_fds);
+    } else {
+        fret = searpc_client_transport_send (client, call->buf->str,
+                                             call->buf->len, ret_len);
+        if (!fret)
+            g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
+    }
+
+    release_call_writer (call);
+
+    return fret;
+}
+
+int
+searpc_client_end_call_fd (SearpcClient *client, SearpcCallWriter *call,
+                           GError **error)
+{
+    char *fret = NULL;
+    size_t ret_len;
+    int ret_fds[SEARPC_MAX_CALL_FDS];
+    int n_ret_fds = 0;
+    GError *local_error = NULL;
+    int index, i, ret = -1;
+
+    if (!call->invalid)
+        finish_call (call);
+    if (call->invalid) {
+        g_set_error (error, DFT_DOMAIN, 0, "Invalid Parameter");
+    } else {
+        fret = send_call_with_fds (client, call, &ret_len,
+                                   ret_fds, &n_ret_fds, error);
+    }
+    release_call_writer (call);
+    if (!fret)
+        return -1;
+
+    // The response holds the index of the returned descriptor.
+    index = searpc_client_fret__int (fret, ret_len, &local_error);
+    g_free (fret);
+    for (i = 0; i < n_ret_fds; i++) {
+        if (i == index && !local_error)
+            ret = ret_fds[i];
+        else
+            close_fds (&ret_fds[i], 1);
+    }
+    if (!local_error && index >= 0 && ret < 0)
+        g_set_error (&local_error, DFT_DOMAIN, TRANSPORT_ERROR_CODE,
+                     "File descriptor missing from the response");
+    if (local_error)
+        g_propagate_error (error, local_error);
+
+    return ret;
+}
+
 void
 searpc_client_call (SearpcClient *client, const char *fname,
                     const char *ret_type, GType gobject_type,
@@ -334,6 +623,35 @@ searpc_client_call__json (SearpcClient *client, const char *fname,
     return ret;
 }
 
+int
+searpc_client_call__objstream (SearpcClient *client, const char *fname,
+                               GType object_type,
+                               SearpcObjlistChunkFunc callback,
+                               void *user_data,
+                               GError **error, int n_params, ...)
+{
+    g_return_val_if_fail (fname != NULL, -1);
+    g_return_val_if_fail (object_type != 0, -1);
+
+    va_list args;
+    gsize len;
+    char *fstr;
+    int ret;
+
+    va_start (args, n_params);
+    fstr = fcall_to_str (fname, n_params, args, &len);
+    va_end (args);
+    if (!fstr) {
+        g_set_error (error, DFT_DOMAIN, 0, "Invalid Parameter");
+        return -1;
+    }
+
+    ret = send_objstream_call (client, fstr, len, object_type,
+                               callback, user_data, error);
+    g_free (fstr);
+    return ret;
+}
+
 
 
 typedef struct {
@@ -667,6 +985,15 @@ searpc_client_fret__objlist (GType gtype, char *data, size_t len, GError **error
 
         g_assert (array);
 
+        // Columnar form, see searpc_server_set_columnar_objlists().
+        if (json_is_object (array)) {
+            if (!json_gobject_deserialize_rows (gtype, (json_t *)array, &ret))
+                g_set_error (error, DFT_DOMAIN, 503,
+                             "Invalid data: malformed object list");
+            json_decref(object);
+            return ret;
+        }
+
         int i;
         for (i = 0; i < json_array_size(array); i++) {
             json_t *member = json_array_get (array, i);
@@ -686,6 +1013,39 @@ searpc_client_fret__objlist (GType gtype, char *data, size_t len, GError **error
     return NULL;
 }
 
+GBytes *
+searpc_client_fret__bytes (char *data, size_t len, GError **error)
+{
+    SearpcBytesSection section;
+    json_t *object = NULL;
+    GBytes *ret = NULL;
+    gssize json_len;
+    json_int_t index = -1;
+    json_t *member;
+
+    json_len = searpc_bytes_section_read (data, len, &section);
+    if (json_len < 0) {
+        g_set_error (error, DFT_DOMAIN, 503,
+                     "Invalid data: malformed bytes values");
+        return NULL;
+    }
+
+    if (handle_ret_common(data, json_len, &object, error) == 0) {
+        // Servers that don't know the function returns bytes send null.
+        member = json_object_get (object, "ret");
+        if (json_is_integer (member))
+            index = json_integer_value (member);
+        if (index >= section.n_values)
+            g_set_error (error, DFT_DOMAIN, 503,
+                         "Invalid data: bytes value missing");
+        else if (index >= 0)
+            ret = g_bytes_new (section.values[index], section.sizes[index]);
+        json_decref (object);
+    }
+
+    return ret;
+}
+
 json_t *
 searpc_client_fret__json (char *data, size_t len, GError **error)
 {
@@ -706,3 +1066,196 @@ searpc_client_fret__json (char *data, size_t len, GError **error)
     }
     return NULL;
 }
+
+typedef struct {
+    char *data;
+    size_t len;
+} BatchResponse;
+
+struct _SearpcBatch {
+    SearpcClient *client;
+    // The calls, without the closing bracket of the batch.
+    GString *buf;
+    int n_calls;
+    char *response;
+    GArray *responses;
+    // Set when the calls were sent one at a time, each response is then
+    // allocated on its own.
+    gboolean split;
+};
+
+SearpcBatch *
+searpc_client_batch_new (SearpcClient *client)
+{
+    SearpcBatch *batch = g_new0 (SearpcBatch, 1);
+
+    batch->client = client;
+    batch->buf = g_string_new ("[");
+    batch->responses = g_array_new (FALSE, FALSE, sizeof(BatchResponse));
+
+    return batch;
+}
+
+static void
+clear_batch_responses (SearpcBatch *batch)
+{
+    guint i;
+
+    if (batch->split) {
+        for (i = 0; i < batch->responses->len; i++)
+            g_free (g_array_index (batch->responses, BatchResponse, i).data);
+        batch->split = FALSE;
+    }
+    g_free (batch->response);
+    batch->response = NULL;
+    g_array_set_size (batch->responses, 0);
+}
+
+static int
+batch_append (SearpcBatch *batch, const char *call, gsize len)
+{
+    if (batch->n_calls > 0)
+        g_string_append_c (batch->buf, ',');
+    g_string_append_len (batch->buf, call, len);
+    return batch->n_calls++;
+}
+
+int
+searpc_client_batch_add (SearpcBatch *batch, SearpcCallWriter *call)
+{
+    int index = -1;
+
+    if (!call->invalid && call->n_fds == 0 && call->n_bytes == 0) {
+        g_string_append_c (call->buf, ']');
+        index = batch_append (batch, call->buf->str, call->buf->len);
+    }
+
+    release_call_writer (call);
+    return index;
+}
+
+int
+searpc_client_batch_add_call (SearpcBatch *batch, const char *fname,
+                              int n_params, ...)
+{
+    va_list args;
+    gsize len;
+    char *fstr;
+    int index;
+
+    g_return_val_if_fail (fname != NULL, -1);
+
+    va_start (args, n_params);
+    fstr = fcall_to_str (fname, n_params, args, &len);
+    va_end (args);
+    if (!fstr)
+        return -1;
+
+    index = batch_append (batch, fstr, len);
+    g_free (fstr);
+    return index;
+}
+
+// Send the calls of @batch one at a time, for servers that can't run it.
+static int
+execute_batch_split (SearpcBatch *batch, GError **error)
+{
+    BatchResponse response;
+    const char *elem;
+    gsize elem_len;
+    gsize pos = 0;
+    char *call;
+
+    batch->split = TRUE;
+    g_string_append_c (batch->buf, ']');
+    while (searpc_json_array_next (batch->buf->str, batch->buf->len, &pos,
+                                   &elem, &elem_len) > 0) {
+        call = g_strndup (elem, elem_len);
+        response.data = searpc_client_transport_send (batch->client, call,
+                                                      elem_len, &response.len);
+        g_free (call);
+        if (!response.data)
+            break;
+        g_array_append_val (batch->responses, response);
+    }
+    g_string_truncate (batch->buf, batch->buf->len - 1);
+
+    if (batch->responses->len != batch->n_calls) {
+        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
+        clear_batch_responses (batch);
+        return -1;
+    }
+    return 0;
+}
+
+int
+searpc_client_batch_execute (SearpcBatch *batch, GError **error)
+{
+    BatchResponse response;
+    json_t *object = NULL;
+    const char *elem;
+    size_t ret_len;
+    gsize pos = 0;
+    int r;
+
+    clear_batch_responses (batch);
+    if (batch->n_calls == 0)
+        return 0;
+
+    if (batch->client->supports_batch &&
+        !batch->client->supports_batch (batch->client->arg))
+        return execute_batch_split (batch, error);
+
+    g_string_append_c (batch->buf, ']');
+    batch->response = searpc_client_transport_send (batch->client,
+                                                    batch->buf->str,
+                                                    batch->buf->len, &ret_len);
+    g_string_truncate (batch->buf, batch->buf->len - 1);
+    if (!batch->response) {
+        g_set_error (error, DFT_DOMAIN, TRANSPORT_ERROR_CODE, TRANSPORT_ERROR);
+        return -1;
+    }
+
+    while ((r = searpc_json_array_next (batch->response, ret_len, &pos,
+                                        &elem, &response.len)) > 0) {
+        response.data = (char *)elem;
+        g_array_append_val (batch->responses, response);
+    }
+    if (r == 0 && batch->responses->len == batch->n_calls)
+        return 0;
+
+    // The server failed the whole batch.
+    if (r < 0 && handle_ret_common (batch->response, ret_len, &object, error) < 0) {
+        clear_batch_responses (batch);
+        return -1;
+    }
+    json_decref (object);
+    g_set_error (error, DFT_DOMAIN, 503, "Invalid data: malformed batch response");
+    clear_batch_responses (batch);
+    return -1;
+}
+
+char *
+searpc_client_batch_get_response (SearpcBatch *batch, int index, size_t *len)
+{
+    BatchResponse *response;
+
+    if (index < 0 || index >= batch->responses->len)
+        return NULL;
+
+    response = &g_array_index (batch->responses, BatchResponse, index);
+    *len = response->len;
+    return response->data;
+}
+
+void
+searpc_client_batch_free (SearpcBatch *batch)
+{
+    if (!batch)
+        return;
+
+    clear_batch_responses (batch);
+    g_array_free (batch->responses, TRUE);
+    g_string_free (batch->buf, TRUE);
+    g_free (batch);
+}
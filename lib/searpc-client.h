@@ -33,12 +33,51 @@ typedef int (*AsyncTransportSend)(void *arg, gchar *fcall_str,
 
 typedef void (*AsyncCallback) (void *result, void *user_data, GError *error);
 
+typedef void (*SearpcResponseChunkFunc) (char *chunk, size_t len,
+                                         void *user_data);
+
+/**
+ * Like TransportCB, for transports that can receive a streamed response
+ * in parts as the server sends them. Every part but the last is passed
+ * to @chunk_func, which may modify it but doesn't own it, and the last
+ * one is returned.
+ */
+typedef char *(*ChunkedTransportCB)(void *arg, const gchar *fcall_str,
+                                    size_t fcall_len, size_t *ret_len,
+                                    SearpcResponseChunkFunc chunk_func,
+                                    void *user_data);
+
+#ifndef SEARPC_MAX_CALL_FDS
+#define SEARPC_MAX_CALL_FDS 8
+#endif
+
+/**
+ * Like TransportCB, for transports that can pass file descriptors with a
+ * call. @fds are sent with the request and stay owned by the caller. The
+ * descriptors that come with the response, at most %SEARPC_MAX_CALL_FDS,
+ * are stored in @ret_fds and owned by the caller.
+ */
+typedef char *(*FdTransportCB)(void *arg, const gchar *fcall_str,
+                               size_t fcall_len, const int *fds, int n_fds,
+                               size_t *ret_len, int *ret_fds, int *n_ret_fds);
+
 struct _SearpcClient {
     TransportCB send;
     void *arg;
     
     AsyncTransportSend async_send;
     void *async_arg;
+
+    /* Optional, used by calls of functions returning objstream. */
+    ChunkedTransportCB send_chunked;
+
+    /* Optional, used by calls with parameters or return values of type
+     * fd, which other transports fail. */
+    FdTransportCB send_fds;
+
+    /* Optional, tells whether the server can run a batch of calls sent
+     * in one request. Without it, batches are always sent whole. */
+    gboolean (*supports_batch) (void *arg);
 };
 
 typedef struct _SearpcClient LIBSEARPC_API SearpcClient;
@@ -81,6 +120,25 @@ LIBSEARPC_API json_t *
 searpc_client_call__json (SearpcClient *client, const char *fname,
                           GError **error, int n_params, ...);
 
+/**
+ * SearpcObjlistChunkFunc:
+ * @objects: part of the list, owned by the callback.
+ *
+ * Receives the objects returned by a function of type objstream, in the
+ * parts the server sent them in. Transports that can't receive parts, and
+ * servers that don't send them, deliver the whole list at once.
+ */
+typedef void (*SearpcObjlistChunkFunc) (GList *objects, void *user_data);
+
+/* Returns 0, or -1 with @error set. Parts received before an error have
+ * already been passed to @callback. */
+LIBSEARPC_API int
+searpc_client_call__objstream (SearpcClient *client, const char *fname,
+                               GType object_type,
+                               SearpcObjlistChunkFunc callback,
+                               void *user_data,
+                               GError **error, int n_params, ...);
+
 
 LIBSEARPC_API char*
 searpc_client_transport_send (SearpcClient *client,
@@ -88,6 +146,116 @@ searpc_client_transport_send (SearpcClient *client,
                               size_t fcall_len,
                               size_t *ret_len);
 
+/*
+ * Used by the client stubs generated by searpc-codegen.py, which write the
+ * parameters of a call directly instead of going through the varargs of
+ * searpc_client_call__*().
+ */
+typedef struct _SearpcCallWriter SearpcCallWriter;
+
+LIBSEARPC_API SearpcCallWriter *
+searpc_client_begin_call (const char *fname);
+
+LIBSEARPC_API void
+searpc_call_writer_add_string (SearpcCallWriter *call, const char *value);
+
+LIBSEARPC_API void
+searpc_call_writer_add_int (SearpcCallWriter *call, gint64 value);
+
+LIBSEARPC_API void
+searpc_call_writer_add_json (SearpcCallWriter *call, const json_t *value);
+
+/* The descriptor is sent with the call, and stays owned by the caller.
+ * Pass -1 for none. */
+LIBSEARPC_API void
+searpc_call_writer_add_fd (SearpcCallWriter *call, int fd);
+
+/* Sent without escaping after the JSON text of the call. @value isn't
+ * copied or referenced, and must stay valid until the call is sent. Pass
+ * NULL for none. */
+LIBSEARPC_API void
+searpc_call_writer_add_bytes (SearpcCallWriter *call, GBytes *value);
+
+/* Send the call and return the response, or NULL with @error set if a
+ * parameter couldn't be written or the transport failed. @call is freed. */
+LIBSEARPC_API char *
+searpc_client_end_call (SearpcClient *client, SearpcCallWriter *call,
+                        size_t *ret_len, GError **error);
+
+/* Send a call of a function returning fd. Returns the descriptor, owned
+ * by the caller, or -1 with @error set if the call failed. The function
+ * may also return -1 without an error. @call is freed. */
+LIBSEARPC_API int
+searpc_client_end_call_fd (SearpcClient *client, SearpcCallWriter *call,
+                           GError **error);
+
+/* Like searpc_client_call__objstream(). @call is freed. */
+LIBSEARPC_API int
+searpc_client_end_call_objstream (SearpcClient *client, SearpcCallWriter *call,
+                                  GType object_type,
+                                  SearpcObjlistChunkFunc callback,
+                                  void *user_data, GError **error);
+
+/* Get the value returned by a call from its response @data. */
+LIBSEARPC_API char*
+searpc_client_fret__string (char *data, size_t len, GError **error);
+
+LIBSEARPC_API int
+searpc_client_fret__int (char *data, size_t len, GError **error);
+
+LIBSEARPC_API gint64
+searpc_client_fret__int64 (char *data, size_t len, GError **error);
+
+LIBSEARPC_API GObject*
+searpc_client_fret__object (GType gtype, char *data,
+                            size_t len, GError **error);
+
+LIBSEARPC_API GList*
+searpc_client_fret__objlist (GType gtype, char *data,
+                             size_t len, GError **error);
+
+LIBSEARPC_API json_t *
+searpc_client_fret__json (char *data, size_t len, GError **error);
+
+LIBSEARPC_API GBytes *
+searpc_client_fret__bytes (char *data, size_t len, GError **error);
+
+/*
+ * A batch sends several calls to the service of a client in one request.
+ * The server runs them and answers with all their responses, so they take
+ * a single round trip. Calls in a batch can't pass descriptors or bytes
+ * values, and streams are returned whole. If the transport tells that the
+ * server can't run batches, the calls are sent one at a time instead.
+ */
+typedef struct _SearpcBatch SearpcBatch;
+
+LIBSEARPC_API SearpcBatch *
+searpc_client_batch_new (SearpcClient *client);
+
+/* Add a call written with searpc_client_begin_call(). Returns its index in
+ * the batch, or -1 if it can't be sent in a batch. @call is freed. */
+LIBSEARPC_API int
+searpc_client_batch_add (SearpcBatch *batch, SearpcCallWriter *call);
+
+/* Add a call with parameters given like searpc_client_call(). */
+LIBSEARPC_API int
+searpc_client_batch_add_call (SearpcBatch *batch, const char *fname,
+                              int n_params, ...);
+
+/* Send the calls and read their responses. Returns -1 with @error set if
+ * the batch wasn't answered, the errors of each call are in its response. */
+LIBSEARPC_API int
+searpc_client_batch_execute (SearpcBatch *batch, GError **error);
+
+/* Get the response to the call @index of an executed batch, to decode with
+ * searpc_client_fret__*(). It's owned by the batch. Returns NULL if there's
+ * no such call. */
+LIBSEARPC_API char *
+searpc_client_batch_get_response (SearpcBatch *batch, int index, size_t *len);
+
+LIBSEARPC_API void
+searpc_client_batch_free (SearpcBatch *batch);
+
 
 
 LIBSEARPC_API int
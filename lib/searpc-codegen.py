@@ -5,6 +5,8 @@ Generate function define macros.
 """
 
 from __future__ import print_function
+import hashlib
+import re
 import string
 import sys
 import os
@@ -12,77 +14,137 @@ import os
 
 # type -> (<c type if used as parameter>, <c type if used as ret type>,
 #          <function to get value from array>,
-#          <function to set value to the ret_object>,
+#          <function to get value from a SearpcParamReader, empty if it
+#           can't be read from one>,
+#          <function to write the response for the returned value>,
 #          <function to set value to array>,
+#          <function to add value to a call in client stubs>,
 #          <default_ret_value>)
 type_table = {
     "string": ("const char*",
                "char*",
                "json_array_get_string_or_null_element",
-               "searpc_set_string_to_ret_object",
+               "searpc_param_reader_get_string",
+               "searpc_marshal_write_ret_string",
                "json_array_add_string_or_null_element",
+               "searpc_call_writer_add_string",
                "NULL"),
     "int": ("int",
             "int",
             "json_array_get_int_element",
-            "searpc_set_int_to_ret_object",
+            "searpc_param_reader_get_int",
+            "searpc_marshal_write_ret_int",
             "json_array_add_int_element",
+            "searpc_call_writer_add_int",
             "-1"),
     "int64": ("gint64",
               "gint64",
               "json_array_get_int_element",
-              "searpc_set_int_to_ret_object",
+              "searpc_param_reader_get_int",
+              "searpc_marshal_write_ret_int",
               "json_array_add_int_element",
+              "searpc_call_writer_add_int",
               "-1"),
     "object": ("GObject*",
                "GObject*",
                "",
-               "searpc_set_object_to_ret_object",
+               "",
+               "searpc_marshal_write_ret_object",
+               "",
                "",
                "NULL"),
     "objlist": ("GList*",
                 "GList*",
                 "",
-                "searpc_set_objlist_to_ret_object",
+                "",
+                "searpc_marshal_write_ret_objlist",
+                "",
                 "",
                 "NULL"),
+    # Only a return type, see searpc_obj_stream_new().
+    "objstream": ("",
+                  "SearpcObjStream*",
+                  "",
+                  "",
+                  "searpc_marshal_write_ret_objstream",
+                  "",
+                  "",
+                  "NULL"),
     "json": ("const json_t*",
              "json_t*",
              "json_array_get_json_or_null_element",
-             "searpc_set_json_to_ret_object",
+             "",
+             "searpc_marshal_write_ret_json",
              "json_array_add_json_or_null_element",
+             "searpc_call_writer_add_json",
              "NULL"),
+    # A file descriptor passed alongside the call, for transports that can,
+    # see SearpcCallFds.
+    "fd": ("int",
+           "int",
+           "searpc_marshal_get_fd_param",
+           "searpc_param_reader_get_fd",
+           "searpc_marshal_write_ret_fd",
+           "",
+           "searpc_call_writer_add_fd",
+           "-1"),
+    # Binary data sent after the JSON text instead of as an escaped
+    # string, see SearpcBytesSection.
+    "bytes": ("GBytes*",
+              "GBytes*",
+              "searpc_marshal_get_bytes_param",
+              "searpc_param_reader_get_bytes",
+              "searpc_marshal_write_ret_bytes",
+              "",
+              "searpc_call_writer_add_bytes",
+              "NULL"),
 }
 
 marshal_template = r"""
 static char *
-${marshal_name} (void *func, json_t *param_array, gsize *ret_len)
+${marshal_name} (void *func, ${params_type}${params_name}, gsize *ret_len)
 {
     GError *error = NULL;
 ${get_parameters}
     ${func_call}
 
-    json_t *object = json_object ();
-    ${convert_ret}
-    return searpc_marshal_set_ret_common (object, ret_len, error);
+    return ${convert_ret}
 }
 """
 
-def generate_marshal(ret_type, arg_types):
+def get_type_suffix(ret_type, arg_types):
+    if len(arg_types) == 0:
+        return ret_type + "__void"
+    else:
+        return ret_type + "__" + ('_'.join(arg_types))
+
+def get_marshal_name(ret_type, arg_types):
+    return "marshal_" + get_type_suffix(ret_type, arg_types)
+
+def has_raw_marshal(arg_types):
+    return all(type_table[arg_type][3] for arg_type in arg_types)
+
+def generate_marshal(ret_type, arg_types, raw=False):
     ret_type_item = type_table[ret_type]
     ret_type_in_c = ret_type_item[1]
 
     template = string.Template(marshal_template)
 
-    if len(arg_types) == 0:
-        marshal_name = "marshal_" + ret_type + "__void"
+    marshal_name = get_marshal_name(ret_type, arg_types)
+    if raw:
+        marshal_name = "raw_" + marshal_name
+        params_type = "SearpcParamReader *"
+        params_name = "params"
+        getter_column = 3
     else:
-        marshal_name = "marshal_" + ret_type + "__" + ('_'.join(arg_types))
+        params_type = "json_t *"
+        params_name = "param_array"
+        getter_column = 2
     get_parameters = ""
     for i, arg_type in enumerate(arg_types):
         type_item = type_table[arg_type]
-        stmt = "    %s param%d = %s (param_array, %d);\n" %(
-            type_item[0], i+1, type_item[2], i+1)
+        stmt = "    %s param%d = %s (%s, %d);\n" %(
+            type_item[0], i+1, type_item[getter_column], params_name, i+1)
         get_parameters += stmt
 
     # func_prototype should be something like
@@ -100,9 +162,11 @@ def generate_marshal(ret_type, arg_types):
     func_call = "%s ret = ((%s)func) (%s);" % (ret_type_in_c, func_prototype,
                                               func_args)
 
-    convert_ret = "%s (object, ret);" % ret_type_item[3]
+    convert_ret = "%s (ret, ret_len, error);" % ret_type_item[4]
 
     return template.substitute(marshal_name=marshal_name,
+                               params_type=params_type,
+                               params_name=params_name,
                                get_parameters=get_parameters,
                                func_call=func_call,
                                convert_ret=convert_ret)
@@ -114,61 +178,236 @@ def write_file(f, s):
 def gen_marshal_functions(f):
     for item in func_table:
         write_file(f, generate_marshal(item[0], item[1]))
+        if has_raw_marshal(item[1]):
+            write_file(f, generate_marshal(item[0], item[1], raw=True))
 
 
-marshal_register_item = r"""
-    {
-        searpc_server_register_marshal (${signature_name}(), ${marshal_name});
-    }
-"""
+def get_signature_macro(ret_type, arg_types):
+    return "SEARPC_SIGNATURE_" + get_type_suffix(ret_type, arg_types).upper()
 
-def generate_marshal_register_item(ret_type, arg_types):
-    if len(arg_types) == 0:
-        marshal_name = "marshal_" + ret_type + "__void"
-    else:
-        marshal_name = "marshal_" + ret_type + "__" + ('_'.join(arg_types))
+marshal_table_item = r"""    { ${signature_macro}, ${marshal_name}, ${raw_marshal_name} },"""
 
-    if len(arg_types) == 0:
-        signature_name = "searpc_signature_" + ret_type + "__void"
+def generate_marshal_table_item(ret_type, arg_types):
+    marshal_name = get_marshal_name(ret_type, arg_types)
+    if has_raw_marshal(arg_types):
+        raw_marshal_name = "raw_" + marshal_name
     else:
-        signature_name = "searpc_signature_" + ret_type + "__" + (
-            '_'.join(arg_types))
+        raw_marshal_name = "NULL"
 
-    return string.Template(marshal_register_item).substitute(
+    return string.Template(marshal_table_item).substitute(
+        signature_macro=get_signature_macro(ret_type, arg_types),
         marshal_name=marshal_name,
-        signature_name=signature_name)
+        raw_marshal_name=raw_marshal_name)
+
+def gen_marshal_table(f):
+    # Sorted by signature, for searpc_server_register_marshal_table().
+    items = sorted(func_table, key=lambda item: compute_signature(item[0], item[1]))
+    write_file(f, "enum {")
+    for item in items:
+        write_file(f, "    SEARPC_MARSHAL_%s," %
+                   get_type_suffix(item[0], item[1]).upper())
+    write_file(f, "    SEARPC_N_MARSHALS")
+    write_file(f, "};")
+    write_file(f, "")
+    write_file(f, "static const SearpcMarshalEntry searpc_marshal_table[] = {")
+    for item in items:
+        write_file(f, generate_marshal_table_item(item[0], item[1]))
+    write_file(f, "};")
+    write_file(f, "")
 
 def gen_marshal_register_function(f):
     write_file(f, "static void register_marshals(void)""")
     write_file(f,  "{")
-    for item in func_table:
-        write_file(f, generate_marshal_register_item(item[0], item[1]))
+    write_file(f,  "    searpc_server_register_marshal_table (searpc_marshal_table, SEARPC_N_MARSHALS);")
     write_file(f,  "}")
 
 signature_template = r"""
+#define ${signature_macro} "${signature}"
+
 inline static gchar *
 ${signature_name}(void)
 {
-    return searpc_compute_signature (${args});
+    return g_strdup (${signature_macro});
 }
 """
 
+# Same as searpc_compute_signature().
+def compute_signature(ret_type, arg_types):
+    return hashlib.md5(':'.join([ret_type] + arg_types).encode()).hexdigest()
+
 def generate_signature(ret_type, arg_types):
+    signature_name = "searpc_signature_" + get_type_suffix(ret_type, arg_types)
+
+    template = string.Template(signature_template)
+    return template.substitute(signature_name=signature_name,
+                               signature_macro=get_signature_macro(ret_type, arg_types),
+                               signature=compute_signature(ret_type, arg_types))
+
+client_stub_template = r"""
+inline static ${ret_type_in_c}
+${stub_name} (SearpcClient *client, const char *fname,${object_type}
+    GError **error${params})
+{
+    SearpcCallWriter *call = searpc_client_begin_call (fname);
+    ${ret_type_in_c} ret;
+    size_t ret_len;
+    char *fret;
+
+${add_params}
+    fret = searpc_client_end_call (client, call, &ret_len, error);
+    if (!fret)
+        return ${default_ret};
+
+    ret = searpc_client_fret__${ret_type} (${fret_args}fret, ret_len, error);
+    g_free (fret);
+    return ret;
+}
+"""
+
+# The objects are passed to the callback as the parts of the list arrive.
+objstream_client_stub_template = r"""
+inline static int
+${stub_name} (SearpcClient *client, const char *fname, GType object_type,
+    SearpcObjlistChunkFunc callback, void *user_data,
+    GError **error${params})
+{
+    SearpcCallWriter *call = searpc_client_begin_call (fname);
+
+${add_params}
+    return searpc_client_end_call_objstream (client, call, object_type,
+                                             callback, user_data, error);
+}
+"""
+
+# The descriptor is returned to the caller, who owns it.
+fd_client_stub_template = r"""
+inline static int
+${stub_name} (SearpcClient *client, const char *fname,
+    GError **error${params})
+{
+    SearpcCallWriter *call = searpc_client_begin_call (fname);
+
+${add_params}
+    return searpc_client_end_call_fd (client, call, error);
+}
+"""
+
+def generate_client_stub(ret_type, arg_types):
     ret_type_item = type_table[ret_type]
-    ret_type_in_c = ret_type_item[1]
 
-    if len(arg_types) == 0:
-        signature_name = "searpc_signature_" + ret_type + "__void"
+    stub_name = "searpc_call_" + get_type_suffix(ret_type, arg_types)
+
+    if ret_type in ("object", "objlist"):
+        object_type = " GType object_type,"
+        fret_args = "object_type, "
     else:
-        signature_name = "searpc_signature_" + ret_type + "__" + (
-            '_'.join(arg_types))
+        object_type = ""
+        fret_args = ""
 
-    args = "\"" + ret_type + "\"" + ", " + str(len(arg_types))
-    for arg_type in arg_types:
-        args += ", " + "\"" + arg_type + "\""
+    params = ""
+    add_params = ""
+    for i, arg_type in enumerate(arg_types):
+        type_item = type_table[arg_type]
+        params += ", %s param%d" % (type_item[0], i+1)
+        add_params += "    %s (call, param%d);\n" % (type_item[6], i+1)
 
-    template = string.Template(signature_template)
-    return template.substitute(signature_name=signature_name, args=args)
+    if ret_type == "objstream":
+        template = string.Template(objstream_client_stub_template)
+        return template.substitute(stub_name=stub_name,
+                                   params=params,
+                                   add_params=add_params)
+
+    if ret_type == "fd":
+        template = string.Template(fd_client_stub_template)
+        return template.substitute(stub_name=stub_name,
+                                   params=params,
+                                   add_params=add_params)
+
+    template = string.Template(client_stub_template)
+    return template.substitute(ret_type_in_c=ret_type_item[1],
+                               stub_name=stub_name,
+                               object_type=object_type,
+                               params=params,
+                               add_params=add_params,
+                               default_ret=ret_type_item[7],
+                               ret_type=ret_type,
+                               fret_args=fret_args)
+
+def gen_client_stubs():
+    with open('searpc-client-stubs.h', 'w') as f:
+        for item in func_table:
+            write_file(f, generate_client_stub(item[0], item[1]))
+
+# field type -> (<statement to write the field, a char*, int, gint64 or
+#                 gboolean>,
+#                <statement to read the field from a json_t member>)
+object_field_table = {
+    "string": ("if (!searpc_json_write_string (out, obj->${field}))\n"
+               "        g_string_append (out, \"null\");",
+               "g_free (obj->${field});\n"
+               "        obj->${field} = g_strdup (json_string_value (member));"),
+    "int": ("searpc_json_write_int (out, obj->${field});",
+            "obj->${field} = (int)json_integer_value (member);"),
+    "int64": ("searpc_json_write_int (out, obj->${field});",
+              "obj->${field} = json_integer_value (member);"),
+    "bool": ("g_string_append (out, obj->${field} ? \"true\" : \"false\");",
+             "obj->${field} = json_is_true (member);"),
+}
+
+object_serializer_template = r"""
+static void
+write_object_${c_type} (GString *out, GObject *gobject)
+{
+    ${c_type} *obj = (${c_type} *)gobject;
+
+${write_fields}
+}
+
+static GObject *
+read_object_${c_type} (GType gtype, json_t *json)
+{
+    ${c_type} *obj = g_object_new (gtype, NULL);
+    json_t *member;
+
+${read_fields}
+    return (GObject *)obj;
+}
+"""
+
+def generate_object_serializer(c_type, gtype, fields):
+    write_fields = ""
+    read_fields = ""
+    sep = "{"
+    for json_name, field_type, field in fields:
+        # Names are pasted into C strings as they are.
+        assert re.match(r'^[A-Za-z0-9_-]+$', json_name), json_name
+        write_stmt = string.Template(object_field_table[field_type][0])
+        read_stmt = string.Template(object_field_table[field_type][1])
+        write_fields += "    g_string_append (out, \"%s\\\"%s\\\":\");\n" % (sep, json_name)
+        write_fields += "    %s\n" % write_stmt.substitute(field=field)
+        read_fields += "    if ((member = json_object_get (json, \"%s\")) != NULL) {\n" % json_name
+        read_fields += "        %s\n" % read_stmt.substitute(field=field)
+        read_fields += "    }\n"
+        sep = ","
+    if sep == "{":
+        write_fields += "    g_string_append (out, \"{\");\n"
+    write_fields += "    g_string_append_c (out, '}');"
+
+    template = string.Template(object_serializer_template)
+    return template.substitute(c_type=c_type,
+                               write_fields=write_fields,
+                               read_fields=read_fields)
+
+def gen_object_serializers():
+    with open('searpc-object-serializers.h', 'w') as f:
+        for c_type, gtype, fields in object_table:
+            write_file(f, generate_object_serializer(c_type, gtype, fields))
+        write_file(f, "static void register_object_serializers(void)")
+        write_file(f, "{")
+        for c_type, gtype, fields in object_table:
+            write_file(f, "    searpc_register_object_serializer (%s, write_object_%s, read_object_%s);"
+                       % (gtype, c_type, c_type))
+        write_file(f, "}")
 
 def gen_signature_list():
     with open('searpc-signature.h', 'w') as f:
@@ -178,6 +417,9 @@ def gen_signature_list():
 if __name__ == "__main__":
     sys.path.append(os.getcwd())
 
+    # [ <struct type>, <GType>, [ [<json name>, <field type>, <struct field>] ] ]
+    object_table = []
+
     # load function table
     if len(sys.argv) == 2:
         abspath = os.path.abspath(sys.argv[1])
@@ -187,9 +429,16 @@ if __name__ == "__main__":
     else:
         # load from default rpc_table.py
         from rpc_table import func_table
+        try:
+            from rpc_table import object_table
+        except ImportError:
+            pass
 
     # gen code
     with open('searpc-marshal.h', 'w') as marshal:
         gen_marshal_functions(marshal)
+        gen_marshal_table(marshal)
         gen_marshal_register_function(marshal)
     gen_signature_list()
+    gen_client_stubs()
+    gen_object_serializers()
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
@@ -6,6 +7,8 @@
 #if !defined(WIN32)
   #include <sys/types.h>
   #include <sys/socket.h>
+  #include <sys/uio.h>
+  #include <poll.h>
   #include <sys/un.h>
   #include <unistd.h>
 #ifdef __linux__
@@ -22,6 +25,8 @@
 #include "searpc-client.h"
 #include "searpc-server.h"
 #include "searpc-named-pipe-transport.h"
+#include "searpc-scheduler.h"
+#include "searpc-shm-ring.h"
 
 #if defined(WIN32)
 static const int kPipeBufSize = 1024;
@@ -36,12 +41,117 @@ static char* formatErrorMessage();
 
 #endif // defined(WIN32)
 
+// Wire protocol.
+//
+// Older peers exchange "<32-bit length><json envelope>" messages, where the
+// envelope is {"service": ..., "request": ...} and the request is the fcall
+// string escaped once more as a JSON string. A client may instead negotiate
+// binary frames right after connecting: it sends a legacy request for the
+// reserved SEARPC_TRANSPORT_SERVICE, and if the server answers with a frame
+// version both sides switch the connection to frames of the form
+//
+//   <32-bit length><8-bit version><8-bit flags><16-bit service length>
+//   [<32-bit request id>]<service name><raw fcall string or response>
+//
+// The length covers everything after the length field itself. Responses carry
+// an empty service name. Servers that don't know the reserved service answer
+// with an error, and the client keeps using the legacy envelope. Both sides
+// use the lower of their frame versions.
+//
+// The request id is present since frame version 2. The server copies it into
+// the response, which lets a client send more requests on the connection
+// before reading the responses, and lets the server answer them in any
+// order. Without it, responses come in request order.
+//
+// On connections using frames, a client may ask for the ids of a service and
+// its functions with ["function_ids", <service>]. Requests with
+// FRAME_FLAG_SERVICE_ID then carry the service id in the service length
+// field and no service name, and their fcall string may start with the id
+// of the function instead of its name.
+//
+// A client also asks with ["batch"] before sending a batch of calls in one
+// request (see searpc_client_batch_execute()). Servers that run batches
+// answer with 1, others with an error or anything else, and the client
+// then sends the calls one at a time.
+//
+// Since frame version 2, a request with FRAME_FLAG_CHUNKS accepts a
+// streamed response in several frames. Each frame but the last carries the
+// flag and a complete response holding part of the list. Servers that don't
+// stream answer with one frame.
+//
+// Since frame version 3, messages longer than SEARPC_MAX_FRAME_BODY are
+// sent as several frames back to back, so their size isn't limited by the
+// 32-bit length. Every frame but the last has FRAME_FLAG_CONTINUED. The
+// frames after the first have the same request id, no other flag, a
+// service length of 0, and carry the rest of the message. A side reading a
+// message longer than its max_message_size closes the connection.
+//
+// On Linux, a client using frame version 2 or later may move the connection
+// to shared memory (see searpc-shm-ring.h) with ["shm", <ring size>]. The
+// descriptors of the memory and of its eventfds are attached to the request
+// with SCM_RIGHTS. Once the server answers with the ring size, both sides
+// exchange the same frames through the rings instead of the socket, which
+// is only watched to tell whether the peer is gone.
+//
+// On unix sockets, the parameters and return values of type fd are file
+// descriptors attached to the first frame of the request or the response
+// with SCM_RIGHTS, and the call carries their index. That frame has
+// FRAME_FLAG_FDS. On connections using shared memory, the descriptors are
+// sent through the socket with a single byte before the frame is written.
+//
+// Values of type bytes follow the JSON text of a call or a response after a
+// NUL (see SearpcBytesSection), which the frames carry as they are. The
+// legacy envelope can't hold them in a request.
+
+#define SEARPC_TRANSPORT_SERVICE "searpc-transport"
+#define SEARPC_FRAME_VERSION 3
+#define SEARPC_MAX_SERVICE_LEN 255
+#define SEARPC_MAX_FUNC_NAME_LEN 255
+// Bytes of a message carried by one frame, since frame version 3.
+#define SEARPC_MAX_FRAME_BODY (16 * 1024 * 1024)
+// Descriptors a request or a response may carry.
+#define SEARPC_MAX_REQUEST_FDS SEARPC_MAX_CALL_FDS
+#define SEARPC_SHM_DEFAULT_RING_SIZE (1024 * 1024)
+#define SEARPC_SHM_DEFAULT_SPIN_US 50
+
+#define FRAME_FLAG_SERVICE_ID 0x01
+#define FRAME_FLAG_CHUNKS 0x02
+#define FRAME_FLAG_CONTINUED 0x04
+#define FRAME_FLAG_FDS 0x08
+
+typedef struct {
+    guint32 len;
+    guint8 version;
+    guint8 flags;
+    guint16 service_len;
+    // Since frame version 2.
+    guint32 req_id;
+} SearpcFrameHeader;
+
+#define FRAME_HEADER_SIZE(version)                                      \
+    ((version) >= 2 ? sizeof(SearpcFrameHeader) : offsetof(SearpcFrameHeader, req_id))
+#define FRAME_HEADER_REST(version) (FRAME_HEADER_SIZE(version) - sizeof(guint32))
+#define FRAME_SERVICE_NAME_LEN(hdr)                                     \
+    ((hdr)->flags & FRAME_FLAG_SERVICE_ID ? 0 : (hdr)->service_len)
+#define FRAME_IS_CONTINUED(version, hdr)                                \
+    ((version) >= 3 && ((hdr)->flags & FRAME_FLAG_CONTINUED))
+
 static void* named_pipe_listen(void *arg);
 static void* handle_named_pipe_client_with_thread (void *arg);
-static void handle_named_pipe_client_with_threadpool(void *data, void *user_data);
+static void handle_named_pipe_client_with_scheduler(void *data, void *user_data);
 static void named_pipe_client_handler (void *data);
 static char* searpc_named_pipe_send(void *arg, const gchar *fcall_str, size_t fcall_len, size_t *ret_len);
+static char* searpc_named_pipe_send_chunked(void *arg, const gchar *fcall_str, size_t fcall_len,
+                                            size_t *ret_len, SearpcResponseChunkFunc chunk_func,
+                                            void *user_data);
+#if !defined(WIN32)
+static char* searpc_named_pipe_send_fds(void *arg, const gchar *fcall_str, size_t fcall_len,
+                                        const int *fds, int n_fds, size_t *ret_len,
+                                        int *ret_fds, int *n_ret_fds);
+#endif
 
+static int negotiate_frame_version (SearpcNamedPipeClient *client);
+static gboolean searpc_named_pipe_supports_batch (void *arg);
 static char * request_to_json(const char *service, const char *fcall_str, size_t fcall_len);
 static int request_from_json (const char *content, size_t len, char **service, char **fcall_str);
 static void json_object_set_string_member (json_t *object, const char *key, const char *value);
@@ -49,10 +159,34 @@ static const char * json_object_get_string_member (json_t *object, const char *k
 
 static gssize pipe_write_n(SearpcNamedPipe fd, const void *vptr, size_t n);
 static gssize pipe_read_n(SearpcNamedPipe fd, void *vptr, size_t n);
+static gssize pipe_write_frame(SearpcNamedPipe fd, const SearpcFrameHeader *hdr, gsize hdr_size,
+                               const char *prefix, gsize prefix_len,
+                               const char *body, size_t body_len);
+#if !defined(WIN32)
+// Space for the descriptors a message may carry.
+typedef union {
+    char buf[CMSG_SPACE(sizeof(int) * SEARPC_MAX_REQUEST_FDS)];
+    struct cmsghdr align;
+} FdControl;
+
+static void set_fds_control(struct msghdr *msg, FdControl *control, const int *fds, int n_fds);
+static gssize pipe_write_frame_with_fds(int fd, const SearpcFrameHeader *hdr, gsize hdr_size,
+                                        const char *prefix, gsize prefix_len,
+                                        const char *body, size_t body_len,
+                                        const int *fds, int n_fds);
+static gssize recv_with_fds(int fd, void *buf, size_t n, int *fds, int *n_fds);
+static gssize recv_n(int fd, void *buf, size_t n, int *fds, int *n_fds);
+static int send_fds_with_byte(int fd, const int *fds, int n_fds);
+static int recv_fds_with_byte(int fd, int *fds, int *n_fds);
+#endif
 
 typedef struct {
     SearpcNamedPipeClient* client;
     char *service;
+    // Loaded by searpc_client_load_pipe_function_ids(). The table maps
+    // function names to their ids plus one.
+    int service_id;
+    GHashTable *func_ids;
 } ClientTransportData;
 
 SearpcClient*
@@ -61,10 +195,17 @@ searpc_client_with_named_pipe_transport(SearpcNamedPipeClient *pipe_client,
 {
     SearpcClient *client= searpc_client_new();
     client->send = searpc_named_pipe_send;
+    client->send_chunked = searpc_named_pipe_send_chunked;
+#if !defined(WIN32)
+    client->send_fds = searpc_named_pipe_send_fds;
+#endif
+    client->supports_batch = searpc_named_pipe_supports_batch;
 
     ClientTransportData *data = g_malloc(sizeof(ClientTransportData));
     data->client = pipe_client;
     data->service = g_strdup(service);
+    data->service_id = -1;
+    data->func_ids = NULL;
 
     client->arg = data;
     return client;
@@ -74,6 +215,11 @@ SearpcNamedPipeClient* searpc_create_named_pipe_client(const char *path)
 {
     SearpcNamedPipeClient *client = g_malloc0(sizeof(SearpcNamedPipeClient));
     memcpy(client->path, path, strlen(path) + 1);
+    client->max_message_size = SEARPC_DEFAULT_MAX_MESSAGE_SIZE;
+    pthread_mutex_init (&client->lock, NULL);
+    pthread_mutex_init (&client->write_lock, NULL);
+    pthread_cond_init (&client->cond, NULL);
+    client->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
     return client;
 }
 
@@ -81,38 +227,62 @@ SearpcNamedPipeServer* searpc_create_named_pipe_server(const char *path)
 {
     SearpcNamedPipeServer *server = g_malloc0(sizeof(SearpcNamedPipeServer));
     memcpy(server->path, path, strlen(path) + 1);
+    server->shm_spin_us = SEARPC_SHM_DEFAULT_SPIN_US;
+    server->max_message_size = SEARPC_DEFAULT_MAX_MESSAGE_SIZE;
+    pthread_mutex_init (&server->lock, NULL);
+    pthread_cond_init (&server->conns_cond, NULL);
+    server->connections = g_hash_table_new (g_direct_hash, g_direct_equal);
 
     return server;
 }
 
 SearpcNamedPipeServer* searpc_create_named_pipe_server_with_threadpool (const char *path, int named_pipe_server_thread_pool_size)
 {
-    GError *error = NULL;
+    return searpc_create_named_pipe_server_with_scheduler (path, named_pipe_server_thread_pool_size, FALSE);
+}
 
-    SearpcNamedPipeServer *server = g_malloc0(sizeof(SearpcNamedPipeServer));
-    memcpy(server->path, path, strlen(path) + 1);
-    server->pool_size = named_pipe_server_thread_pool_size;
-    server->named_pipe_server_thread_pool = g_thread_pool_new (handle_named_pipe_client_with_threadpool,
-                                                               NULL,
-                                                               named_pipe_server_thread_pool_size,
-                                                               FALSE,
-                                                               &error);
-    if (!server->named_pipe_server_thread_pool) {
-        if (error) {
-            g_warning ("Falied to create named pipe server thread pool : %s\n", error->message);
-            g_clear_error (&error);
-        } else {
-            g_warning ("Falied to create named pipe server thread pool.\n");
-        }
-        g_free (server);
+SearpcNamedPipeServer* searpc_create_named_pipe_server_with_scheduler (const char *path, int n_workers, gboolean pin_workers)
+{
+    SearpcNamedPipeServer *server = searpc_create_named_pipe_server (path);
+    server->scheduler = searpc_scheduler_new (handle_named_pipe_client_with_scheduler,
+                                              server, n_workers, pin_workers);
+    if (!server->scheduler) {
+        searpc_free_named_pipe_server (server);
         return NULL;
     }
+    server->pool_size = searpc_scheduler_get_num_workers (server->scheduler);
 
     return server;
 }
 
+static void
+start_detached_thread (void *(*thread_func) (void *), void *data)
+{
+    pthread_t handler;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&handler, &attr, thread_func, data);
+}
+
+// Run @data on a worker of the server, or on a new thread if the server has
+// no workers.
+static void
+server_dispatch (SearpcNamedPipeServer *server, void *data,
+                 void *(*thread_func) (void *))
+{
+    if (server->scheduler) {
+        if (searpc_scheduler_get_num_busy (server->scheduler) >= server->pool_size) {
+            g_warning("The rpc server thread pool is full, the maximum number of threads is %d\n", server->pool_size);
+        }
+        searpc_scheduler_push (server->scheduler, data);
+    } else {
+        start_detached_thread (thread_func, data);
+    }
+}
+
 #ifdef __linux__
-int set_nonblocking(int fd) {
+static int set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags < 0) {
         return -1;
@@ -192,7 +362,7 @@ int searpc_named_pipe_server_start(SearpcNamedPipeServer *server)
         }
 
         event.events = EPOLLIN;
-        event.data.fd = pipe_fd;
+        event.data.ptr = server;
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fd, &event) == -1) {
             g_warning ("failed to add pipe fd to epoll list: %s\n", strerror(errno));
             goto failed;
@@ -207,458 +377,2566 @@ int searpc_named_pipe_server_start(SearpcNamedPipeServer *server)
 #endif // !defined(WIN32)
 
     /* TODO: use glib thread pool */
-    pthread_create(&server->listener_thread, NULL, named_pipe_listen, server);
+    int ret = pthread_create(&server->listener_thread, NULL, named_pipe_listen, server);
+    if (ret != 0) {
+        g_warning ("Failed to start the named pipe listener: %s\n", strerror(ret));
+#if !defined(WIN32)
+        goto failed;
+#else
+        return -1;
+#endif
+    }
+    server->started = TRUE;
     return 0;
 
 #if !defined(WIN32)
 failed:
+#ifdef __linux__
+    if (server->epoll_fd > 0) {
+        close (server->epoll_fd);
+        server->epoll_fd = 0;
+    }
+#endif
     close(pipe_fd);
     return -1;
 #endif
 }
 
 typedef struct {
-    SearpcNamedPipe connfd;
-    SearpcNamedPipeServer *server;
-    gboolean use_epoll;
-} ServerHandlerData;
-
-// EPOLL
-#ifdef __linux__
+    char service[SEARPC_MAX_SERVICE_LEN + 1];
+    // Set if the request names its service by id, -1 otherwise.
+    int service_id;
+    char *body;
+    gsize body_len;
+    // Copied into the response frame, 0 before frame version 2.
+    guint32 req_id;
+    // Set if the client accepts a streamed response in several frames.
+    gboolean chunked;
+    // Legacy envelopes are decoded into a separately allocated body.
+    char *legacy_body;
+    // The buffer @body points into, if owned by the request.
+    char *buf;
+    // Descriptors passed with the request, closed when it's finished
+    // unless a function takes them.
+    int fds[SEARPC_MAX_REQUEST_FDS];
+    int n_fds;
+    // Descriptors returned by the function, sent with the response and
+    // closed when the request is finished.
+    int ret_fds[SEARPC_MAX_CALL_FDS];
+    int n_ret_fds;
+    SearpcCallTiming timing;
+} PipeRequest;
 
-static void epoll_handler(void *data)
+static void
+close_fds (int *fds, int *n_fds)
 {
-    ServerHandlerData *handler_data = data;
-    SearpcNamedPipe connfd = handler_data->connfd;
-    SearpcNamedPipeServer *server = handler_data->server;
-    char *buf = NULL;
-    guint32 len = 0;
-    char *ret_str = NULL;
-    int ret = 0;
-    int n;
-
-    if (pipe_read_n(connfd, &len, sizeof(guint32)) < 0) {
-        g_warning("failed to read rpc request size: %s\n", strerror(errno));
-        ret = -1;
-        goto out;
-    }
-
-    if (len <= 0) {
-        ret = -1;
-        goto out;
-    }
+#if !defined(WIN32)
+    int i;
 
-    buf = g_new0 (char, len);
-    n = pipe_read_n (connfd, buf, len); 
-    if (n < 0) {
-        g_warning ("failed to read rpc request: %s\n", strerror(errno));
-        ret = -1;
-        goto out;
-    }
+    for (i = 0; i < *n_fds; i++)
+        close (fds[i]);
+#endif
+    *n_fds = 0;
+}
 
-    char *service, *body;
-    if (request_from_json (buf, len, &service, &body) < 0) {
-        ret = -1;
-        goto out;
-    }
+// Record the call once its response is written or dropped, and free the
+// buffers of the request.
+static void
+finish_request (PipeRequest *req)
+{
+    searpc_server_call_finished (req->service, req->body, req->body_len,
+                                 &req->timing);
+    close_fds (req->fds, &req->n_fds);
+    close_fds (req->ret_fds, &req->n_ret_fds);
+    g_free (req->legacy_body);
+    req->legacy_body = NULL;
+    g_free (req->buf);
+    req->buf = NULL;
+}
 
-    gsize ret_len;
-    ret_str = searpc_server_call_function (service, body, strlen(body), &ret_len);
-    g_free (service);
-    g_free (body);
+// A response queued for writing in epoll mode.
+typedef struct {
+    union {
+        guint32 len;
+        SearpcFrameHeader frame;
+    } hdr;
+    gsize hdr_len;
+    char *body;
+    gsize body_len;
+    // The buffer @body points into. A response split into continuation
+    // frames is queued as one response per frame, and the last one owns
+    // the buffer.
+    char *buf;
+    // Descriptors sent with the first bytes of the frame, owned by the
+    // request. Cleared once sent.
+    const int *fds;
+    int n_fds;
+    // Kept until the response is written, to record the call.
+    PipeRequest *req;
+} PipeResponse;
 
-    len = (guint32)ret_len;
-    if (pipe_write_n (connfd, &len, sizeof(guint32)) < 0) {
-        ret = -1;
-        goto out;
+static void
+free_response (PipeResponse *resp)
+{
+    if (resp->req) {
+        finish_request (resp->req);
+        g_free (resp->req);
     }
+    g_free (resp->buf);
+    g_free (resp);
+}
 
-    if (pipe_write_n (connfd, ret_str, ret_len) < 0) {
-        ret = -1;
-        goto out;
-    }
+static void
+free_responses (GList *parts)
+{
+    GList *ptr;
 
-    struct epoll_event event;
-    event.events = EPOLLIN | EPOLLRDHUP;
-    event.data.ptr = (void *)handler_data;
+    for (ptr = parts; ptr; ptr = ptr->next)
+        free_response (ptr->data);
+    g_list_free (parts);
+}
 
-    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, connfd, &event) == -1) {
-        ret = -1;
-        g_warning ("failed to add client fd to epoll list: %s\n", strerror(errno));
-        goto out;
-    }
+// Per-connection state. It's created when the connection is accepted and
+// freed when the connection is closed.
+typedef struct {
+    SearpcNamedPipe connfd;
+    SearpcNamedPipeServer *server;
+    gboolean use_epoll;
+    // 0 until the client negotiates binary frames.
+    int frame_version;
+    // Request buffer, reused across requests on this connection.
+    char *buf;
+    gsize bufsize;
+    // Descriptors received with the request being read.
+    int in_fds[SEARPC_MAX_REQUEST_FDS];
+    int n_in_fds;
+    // Set once the client moved the connection to shared memory. In epoll
+    // mode the listener then reads requests from the ring when its eventfd
+    // fires, and only watches the socket for hang-ups.
+    SearpcShmChannel *shm;
+    // When the connection was accepted, until its first call takes it.
+    gint64 accepted_at;
+
+    // In epoll mode the listener thread assembles requests with non-blocking
+    // reads, so the state of a partially read request is kept here. These
+    // fields are only used by the listener thread.
+    union {
+        guint32 len;
+        SearpcFrameHeader frame;
+    } in_hdr;
+    guint32 in_hdr_read;
+    // Header of the first frame of the request, and whether more frames
+    // of it are expected.
+    SearpcFrameHeader in_first;
+    gboolean in_continued;
+    // End of the current frame and bytes read so far, in the buffer.
+    gsize in_len;
+    gsize in_read;
+
+    // Several requests of a connection may run on different workers at
+    // once, and their responses are queued until the socket accepts them.
+    // The fields below are protected by the lock. The epoll registration
+    // and each running request hold a reference to the connection.
+    pthread_mutex_t lock;
+    int ref_count;
+    gboolean closed;
+    int n_calls;
+    GQueue *out_queue;
+    // Bytes of the first queued response already written.
+    gsize out_sent;
+    // Signaled when queued responses are written or the connection closes.
+    pthread_cond_t out_cond;
+    // Set once the eventfd of the ring is in the epoll set.
+    gboolean shm_watched;
+    // The client only signals the eventfd when it finds the listener
+    // waiting for requests. Set when the listener stops reading the ring
+    // otherwise, so that the eventfd is signaled once reading resumes.
+    gboolean shm_paused;
+    // Workers write responses to the ring themselves, one at a time.
+    pthread_mutex_t shm_write_lock;
+} ServerHandlerData;
 
-out:
-    g_free (buf);
-    if (ret < 0) {
-        close (connfd);
-        g_free (handler_data);
-    }
-    g_free (ret_str);
+// Connections are added by the listener thread when they are accepted.
+static void
+server_add_connection (SearpcNamedPipeServer *server, ServerHandlerData *data)
+{
+    pthread_mutex_lock (&server->lock);
+    g_hash_table_insert (server->connections, data, data);
+    pthread_mutex_unlock (&server->lock);
 }
 
 static void
-epoll_listen (SearpcNamedPipeServer *server)
+close_connection (ServerHandlerData *data)
 {
-#define MAX_EVENTS 1000
-    struct epoll_event event;
-    struct epoll_event events[MAX_EVENTS];
-    int connfd;
-    int n_events;
-    int i;
+    SearpcNamedPipeServer *server = data->server;
 
-    while (1) {
-        n_events = epoll_wait (server->epoll_fd, events, MAX_EVENTS, 1000);
-        if (n_events <= 0) {
-            if (n_events < 0) {
-                g_warning ("Failed to call waits for events on the epoll: %s\n", strerror(errno));
-            }
-            continue;
-        }
-        for (i = 0; i < n_events; i++) {
-            if (events[i].data.fd == server->pipe_fd) {
-                if (!(events[i].events & EPOLLIN)) {
-                    continue;
-                }
+    // The calls whose responses were queued are recorded when they're
+    // freed, before searpc_free_named_pipe_server() may return.
+    if (data->use_epoll)
+        g_queue_free_full (data->out_queue, (GDestroyNotify)free_response);
 
-                // new client connection
-                // Accept all connections currently queued in the accept backlog.
-                while (1) {
-                    connfd = accept(server->pipe_fd, NULL, 0);
-                    if (connfd < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            break;
-                        } else {
-                            g_warning ("Failed to accept new client connection: %s\n", strerror(errno));
-                            break;
-                        }
-                    }
+    // The connection is forgotten before the socket is closed, so that
+    // searpc_free_named_pipe_server() never shuts down a closed descriptor.
+    pthread_mutex_lock (&server->lock);
+    g_hash_table_remove (server->connections, data);
+    if (g_hash_table_size (server->connections) == 0)
+        pthread_cond_broadcast (&server->conns_cond);
+    pthread_mutex_unlock (&server->lock);
 
-                    event.events = EPOLLIN | EPOLLRDHUP;
-                    ServerHandlerData *data = g_new0(ServerHandlerData, 1);
-                    data->use_epoll = TRUE;
-                    data->connfd = connfd;
-                    data->server = server;
-                    event.data.ptr = (void *)data;
-                    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, connfd, &event) == -1) {
-                        g_warning ("Failed to add client fd to epoll list: %s\n", strerror(errno));
-                        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connfd, NULL);
-                        close (connfd);
-                        g_free (data);
-                        continue;
-                    }
-                }
-            } else {
-                ServerHandlerData *data = (ServerHandlerData *)events[i].data.ptr;
-                connfd = data->connfd;
-                if (events[i].events & (EPOLLHUP | EPOLLRDHUP)) {
-                    g_free (data);
-                    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connfd, NULL);
-                    close (connfd);
-                    continue;
-                }
-                // After socket is readable, remove the socket from the epoll.
-                // After the worker finishes processing the current request, we will add the socket back into the epoll.
-                epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connfd, NULL);
-                if (server->named_pipe_server_thread_pool) {
-                    if (g_thread_pool_get_num_threads (server->named_pipe_server_thread_pool) >= server->pool_size) {
-                        g_warning("The rpc server thread pool is full, the maximum number of threads is %d\n", server->pool_size);
-                    }
-                    g_thread_pool_push (server->named_pipe_server_thread_pool, data, NULL);
-                } else {
-                    pthread_t handler;
-                    pthread_attr_t attr;
-                    pthread_attr_init(&attr);
-                    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-                    pthread_create(&handler, &attr, handle_named_pipe_client_with_thread, data);
-                }
-            }
-        }
+#if !defined(WIN32)
+    close(data->connfd);
+#else // !defined(WIN32)
+    DisconnectNamedPipe(data->connfd);
+    CloseHandle(data->connfd);
+#endif // !defined(WIN32)
+    if (data->use_epoll) {
+        pthread_mutex_destroy (&data->lock);
+        pthread_cond_destroy (&data->out_cond);
+        pthread_mutex_destroy (&data->shm_write_lock);
     }
+    close_fds (data->in_fds, &data->n_in_fds);
+    searpc_shm_channel_free (data->shm);
+    g_free (data->buf);
+    g_free (data);
 }
-#endif
 
-static void* named_pipe_listen(void *arg)
+// Read from the client of @data, or from the shared memory once the
+// connection moved there.
+static gssize
+conn_read_n (ServerHandlerData *data, void *buf, size_t n)
 {
-    SearpcNamedPipeServer *server = arg;
-
 #if !defined(WIN32)
-#ifdef __linux__
-    if (server->use_epoll) {
-        epoll_listen (server);
-        return NULL;
-    }
+    if (data->shm)
+        return searpc_shm_channel_read_n (data->shm, buf, n);
+    return recv_n (data->connfd, buf, n, data->in_fds, &data->n_in_fds);
+#else
+    return pipe_read_n (data->connfd, buf, n);
 #endif
-    while (1) {
-        int connfd = accept (server->pipe_fd, NULL, 0);
-        ServerHandlerData *data = g_malloc(sizeof(ServerHandlerData));
-        data->connfd = connfd;
-        data->use_epoll = FALSE;
-        if (server->named_pipe_server_thread_pool) {
-            if (g_thread_pool_get_num_threads (server->named_pipe_server_thread_pool) >= server->pool_size) {
-                g_warning("The rpc server thread pool is full, the maximum number of threads is %d\n", server->pool_size);
-            }
-            g_thread_pool_push (server->named_pipe_server_thread_pool, data, NULL);
-        } else {
-            pthread_t handler;
-            pthread_attr_t attr;
-            pthread_attr_init(&attr);
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-            pthread_create(&handler, &attr, handle_named_pipe_client_with_thread, data);
-        }
-    }
-#else // !defined(WIN32)
-    while (1) {
-        HANDLE connfd = INVALID_HANDLE_VALUE;
-        BOOL connected = FALSE;
-
-        connfd = CreateNamedPipe(
-            server->path,             // pipe name
-            PIPE_ACCESS_DUPLEX,       // read/write access
-            PIPE_TYPE_MESSAGE |       // message type pipe
-            PIPE_READMODE_MESSAGE |   // message-read mode
-            PIPE_WAIT,                // blocking mode
-            PIPE_UNLIMITED_INSTANCES, // max. instances
-            kPipeBufSize,             // output buffer size
-            kPipeBufSize,             // input buffer size
-            0,                        // client time-out
-            NULL);                    // default security attribute
+}
 
-        if (connfd == INVALID_HANDLE_VALUE) {
-            G_WARNING_WITH_LAST_ERROR ("Failed to create named pipe");
-            break;
-        }
+// Hand the descriptors received with a request over to it.
+static void
+take_request_fds (int *fds, int *n_fds, PipeRequest *req)
+{
+    memcpy (req->fds, fds, *n_fds * sizeof(int));
+    req->n_fds = *n_fds;
+    *n_fds = 0;
+}
 
-        /* listening on this pipe */
-        connected = ConnectNamedPipe(connfd, NULL) ?
-            TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+static void
+grow_buffer (char **buf, gsize *bufsize, gsize len)
+{
+    if (*bufsize >= len)
+        return;
+    if (*bufsize == 0)
+        *bufsize = 4096;
+    while (*bufsize < len)
+        *bufsize *= 2;
+    *buf = g_realloc (*buf, *bufsize);
+}
 
-        if (!connected) {
-            G_WARNING_WITH_LAST_ERROR ("failed to ConnectNamedPipe()");
-            CloseHandle(connfd);
-            break;
-        }
+// Messages are parsed as a whole, so their frames are gathered in one
+// buffer. Check that it stays under @max bytes, 0 meaning no limit.
+static gboolean
+message_size_is_valid (gsize len, gsize max)
+{
+    if (max > 0 && len > max) {
+        g_warning("rpc message longer than %" G_GSIZE_FORMAT " bytes\n", max);
+        return FALSE;
+    }
+    return TRUE;
+}
 
-        /* g_debug ("Accepted a named pipe client\n"); */
+static int
+decode_legacy_request (const char *buf, guint32 len, PipeRequest *req)
+{
+    char *service, *body;
 
-        ServerHandlerData *data = g_malloc(sizeof(ServerHandlerData));
-        data->connfd = connfd;
-        data->use_epoll = FALSE;
-        if (server->named_pipe_server_thread_pool)
-            g_thread_pool_push (server->named_pipe_server_thread_pool, data, NULL);
-        else {
-            pthread_t handler;
-            pthread_attr_t attr;
-            pthread_attr_init(&attr);
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-            pthread_create(&handler, &attr, handle_named_pipe_client_with_thread, data);
-        }
+    if (request_from_json (buf, len, &service, &body) < 0) {
+        return -1;
     }
-#endif // !defined(WIN32)
-    return NULL;
+    g_strlcpy (req->service, service, sizeof(req->service));
+    g_free (service);
+    req->legacy_body = body;
+    req->body = body;
+    req->body_len = strlen(body);
+    return 0;
 }
 
-static void* handle_named_pipe_client_with_thread(void *arg)
+static gboolean
+frame_header_is_valid (int frame_version, const SearpcFrameHeader *hdr)
 {
-#ifdef __linux__
-    ServerHandlerData *handler_data = arg;
-    if (handler_data->use_epoll) {
-        epoll_handler (arg);
-        return NULL;
+    if (hdr->version != frame_version ||
+        FRAME_SERVICE_NAME_LEN(hdr) > SEARPC_MAX_SERVICE_LEN ||
+        hdr->len < FRAME_HEADER_REST(frame_version) + FRAME_SERVICE_NAME_LEN(hdr)) {
+        g_warning("invalid rpc request frame\n");
+        return FALSE;
     }
-#endif
-    named_pipe_client_handler(arg);
-
-    return NULL;
+    return TRUE;
 }
 
-static void handle_named_pipe_client_with_threadpool(void *data, void *user_data)
+// Check a frame following @first, which has FRAME_FLAG_CONTINUED.
+static gboolean
+continuation_is_valid (int frame_version, const SearpcFrameHeader *first,
+                       const SearpcFrameHeader *hdr)
 {
-#ifdef __linux__
-    ServerHandlerData *handler_data = data;
-    if (handler_data->use_epoll) {
-        epoll_handler (data);
-        return;
+    if (hdr->version != frame_version || hdr->service_len != 0 ||
+        (hdr->flags & ~FRAME_FLAG_CONTINUED) != 0 || hdr->req_id != first->req_id ||
+        hdr->len < FRAME_HEADER_REST(frame_version)) {
+        g_warning("invalid rpc continuation frame\n");
+        return FALSE;
     }
-#endif
-    named_pipe_client_handler(data);
+    return TRUE;
 }
 
-static void named_pipe_client_handler(void *data)
+static gssize
+shm_write_frame (SearpcShmChannel *shm, const SearpcFrameHeader *hdr, gsize hdr_size,
+                 const char *prefix, gsize prefix_len,
+                 const char *body, gsize body_len)
 {
-    ServerHandlerData *handler_data = data;
-    SearpcNamedPipe connfd = handler_data->connfd;
+    // The reader is woken up once the frame is complete.
+    if (searpc_shm_channel_write_n (shm, hdr, hdr_size, prefix_len + body_len > 0) < 0 ||
+        (prefix_len > 0 &&
+         searpc_shm_channel_write_n (shm, prefix, prefix_len, body_len > 0) < 0) ||
+        (body_len > 0 && searpc_shm_channel_write_n (shm, body, body_len, FALSE) < 0))
+        return -1;
+    return 0;
+}
 
-    guint32 len;
-    guint32 bufsize = 4096;
-    char *buf = g_malloc(bufsize);
+// Write a message starting with @prefix followed by @body, to @shm if the
+// connection moved to shared memory. Since frame version 3, messages
+// longer than SEARPC_MAX_FRAME_BODY are split into continuation frames.
+// @hdr is the header of the first frame, its length is set here. @fds are
+// passed with the first frame.
+static int
+write_frames (SearpcNamedPipe fd, SearpcShmChannel *shm, int frame_version,
+              SearpcFrameHeader *hdr, const char *prefix, gsize prefix_len,
+              const char *body, gsize body_len, const int *fds, int n_fds)
+{
+    gsize part;
+    gssize ret;
 
+    if (n_fds > 0)
+        hdr->flags |= FRAME_FLAG_FDS;
     while (1) {
-        len = 0;
-        if (pipe_read_n(connfd, &len, sizeof(guint32)) < 0) {
-            g_warning("failed to read rpc request size: %s\n", strerror(errno));
-            break;
+        part = body_len;
+        if (frame_version >= 3 && part > SEARPC_MAX_FRAME_BODY) {
+            part = SEARPC_MAX_FRAME_BODY;
+            hdr->flags |= FRAME_FLAG_CONTINUED;
         }
-
-        if (len == 0) {
-            /* g_debug("EOF reached, pipe connection lost"); */
-            break;
+        if (FRAME_HEADER_REST(frame_version) + prefix_len + part > G_MAXUINT32) {
+            g_warning("rpc message of %" G_GSIZE_FORMAT " bytes is too long\n", body_len);
+            errno = EMSGSIZE;
+            return -1;
         }
+        hdr->len = (guint32)(FRAME_HEADER_REST(frame_version) + prefix_len + part);
 
-        while (bufsize < len) {
-            bufsize *= 2;
-            buf = g_realloc(buf, bufsize);
+#if !defined(WIN32)
+        if (shm)
+            ret = n_fds > 0 && send_fds_with_byte(fd, fds, n_fds) < 0 ? -1 :
+                shm_write_frame(shm, hdr, FRAME_HEADER_SIZE(frame_version),
+                                prefix, prefix_len, body, part);
+        else
+            ret = pipe_write_frame_with_fds(fd, hdr, FRAME_HEADER_SIZE(frame_version),
+                                            prefix, prefix_len, body, part, fds, n_fds);
+#else
+        if (shm)
+            ret = shm_write_frame(shm, hdr, FRAME_HEADER_SIZE(frame_version),
+                                  prefix, prefix_len, body, part);
+        else
+            ret = pipe_write_frame(fd, hdr, FRAME_HEADER_SIZE(frame_version),
+                                   prefix, prefix_len, body, part);
+#endif
+        if (ret < 0) {
+            return -1;
         }
+        n_fds = 0;
+        if (!(hdr->flags & FRAME_FLAG_CONTINUED))
+            return 0;
 
-        if (pipe_read_n(connfd, buf, len) < 0 || len == 0) {
+        body += part;
+        body_len -= part;
+        hdr->flags = 0;
+        hdr->service_len = 0;
+        prefix = NULL;
+        prefix_len = 0;
+    }
+}
+
+// Requests that name their service by id get the name for the slow log.
+static void
+set_service_id (PipeRequest *req, int service_id)
+{
+    const char *name = searpc_server_get_service_name (service_id);
+
+    req->service_id = service_id;
+    g_strlcpy (req->service, name ? name : "", sizeof(req->service));
+}
+
+static void
+init_response_header (SearpcFrameHeader *hdr, int frame_version,
+                      guint32 req_id, guint8 flags, gsize ret_len)
+{
+    hdr->len = (guint32)(FRAME_HEADER_REST(frame_version) + ret_len);
+    hdr->version = frame_version;
+    hdr->flags = flags;
+    hdr->service_len = 0;
+    hdr->req_id = req_id;
+}
+
+// Read one request from the connection into the connection's buffer.
+// Returns 1 if a request is read, 0 if the client closed the connection,
+// and -1 on errors.
+static int
+read_request (ServerHandlerData *data, PipeRequest *req)
+{
+    char **buf = &data->buf;
+    gsize *bufsize = &data->bufsize;
+    guint32 len = 0;
+    gsize total = 0;
+
+    req->legacy_body = NULL;
+    req->buf = NULL;
+    req->req_id = 0;
+    req->chunked = FALSE;
+    req->service_id = -1;
+    req->n_fds = 0;
+    req->n_ret_fds = 0;
+    memset (&req->timing, 0, sizeof(req->timing));
+
+    if (data->frame_version == 0) {
+        if (conn_read_n(data, &len, sizeof(guint32)) < 0) {
+            g_warning("failed to read rpc request size: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (len == 0) {
+            /* g_debug("EOF reached, pipe connection lost"); */
+            return 0;
+        }
+        if (!message_size_is_valid (len, data->server->max_message_size)) {
+            return -1;
+        }
+
+        grow_buffer (buf, bufsize, len);
+        if (conn_read_n(data, *buf, len) < 0) {
+            g_warning("failed to read rpc request: %s\n", strerror(errno));
+            return -1;
+        }
+        req->timing.received = g_get_monotonic_time ();
+
+        if (decode_legacy_request (*buf, len, req) < 0)
+            return -1;
+        take_request_fds (data->in_fds, &data->n_in_fds, req);
+        return 1;
+    }
+
+    SearpcFrameHeader hdr;
+    gsize hdr_size = FRAME_HEADER_SIZE(data->frame_version);
+    gssize n = conn_read_n(data, &hdr, hdr_size);
+    if (n < 0) {
+        g_warning("failed to read rpc request header: %s\n", strerror(errno));
+        return -1;
+    }
+    if (n < hdr_size) {
+        return 0;
+    }
+
+    if (!frame_header_is_valid (data->frame_version, &hdr)) {
+        return -1;
+    }
+#if !defined(WIN32)
+    if (data->shm && (hdr.flags & FRAME_FLAG_FDS) &&
+        recv_fds_with_byte (data->connfd, data->in_fds, &data->n_in_fds) < 0) {
+        g_warning("failed to read rpc request descriptors: %s\n", strerror(errno));
+        return -1;
+    }
+#endif
+    if (data->frame_version >= 2) {
+        req->req_id = hdr.req_id;
+        req->chunked = (hdr.flags & FRAME_FLAG_CHUNKS) != 0;
+    }
+
+    guint16 name_len = FRAME_SERVICE_NAME_LEN(&hdr);
+    if (name_len > 0 && conn_read_n(data, req->service, name_len) < name_len) {
+        g_warning("failed to read rpc request service: %s\n", strerror(errno));
+        return -1;
+    }
+    req->service[name_len] = '\0';
+    if (hdr.flags & FRAME_FLAG_SERVICE_ID) {
+        set_service_id (req, hdr.service_len);
+    }
+
+    len = hdr.len - FRAME_HEADER_REST(data->frame_version) - name_len;
+    while (1) {
+        if (!message_size_is_valid (total + len, data->server->max_message_size)) {
+            return -1;
+        }
+        // The buffer grows with the frames read, not the whole message at once.
+        grow_buffer (buf, bufsize, total + len);
+        if (conn_read_n(data, *buf + total, len) < len) {
             g_warning("failed to read rpc request: %s\n", strerror(errno));
+            return -1;
+        }
+        total += len;
+        if (!FRAME_IS_CONTINUED(data->frame_version, &hdr))
             break;
+
+        SearpcFrameHeader first = hdr;
+        if (conn_read_n(data, &hdr, hdr_size) < hdr_size) {
+            g_warning("failed to read rpc request header: %s\n", strerror(errno));
+            return -1;
+        }
+        if (!continuation_is_valid (data->frame_version, &first, &hdr)) {
+            return -1;
+        }
+        len = hdr.len - FRAME_HEADER_REST(data->frame_version);
+    }
+    req->body = *buf;
+    req->body_len = total;
+    req->timing.received = g_get_monotonic_time ();
+    take_request_fds (data->in_fds, &data->n_in_fds, req);
+
+    return 1;
+}
+
+static int
+write_response (ServerHandlerData *data, guint32 req_id, guint8 flags,
+                const char *ret_str, gsize ret_len, const int *fds, int n_fds)
+{
+    if (data->frame_version == 0) {
+        guint32 len = (guint32)ret_len;
+        if (ret_len > G_MAXUINT32) {
+            g_warning("rpc response of %" G_GSIZE_FORMAT " bytes is too long\n", ret_len);
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (pipe_write_n(data->connfd, &len, sizeof(guint32)) < 0) {
+            return -1;
+        }
+        return pipe_write_n(data->connfd, ret_str, ret_len) < 0 ? -1 : 0;
+    }
+
+    SearpcFrameHeader hdr;
+    init_response_header (&hdr, data->frame_version, req_id, flags, 0);
+
+    return write_frames (data->connfd, data->shm, data->frame_version, &hdr,
+                         NULL, 0, ret_str, ret_len, fds, n_fds);
+}
+
+// Changes a transport request makes to its connection, applied once the
+// response is sent.
+typedef struct {
+    // The new frame version, or 0.
+    int frame_version;
+    // The shared memory to use from now on, or NULL.
+    SearpcShmChannel *shm;
+} ConnSwitch;
+
+// Whether @conn may move to shared memory. In epoll mode, once it moves,
+// the client reads responses from the ring only, so the move is refused
+// while other requests of the connection are running.
+static gboolean
+conn_can_use_shm (ServerHandlerData *conn)
+{
+    gboolean ret;
+
+    if (!conn->use_epoll)
+        return conn->shm == NULL;
+
+    pthread_mutex_lock (&conn->lock);
+    ret = conn->shm == NULL && conn->n_calls == 1;
+    pthread_mutex_unlock (&conn->lock);
+    return ret;
+}
+
+// Map the shared memory whose descriptors come with @req.
+static SearpcShmChannel *
+open_shm_channel (ServerHandlerData *conn, PipeRequest *req, json_int_t ring_size)
+{
+#ifdef __linux__
+    if (req->n_fds != SEARPC_SHM_N_FDS || ring_size <= 0)
+        return NULL;
+    req->n_fds = 0;
+    return searpc_shm_channel_open (req->fds, (gsize)ring_size,
+                                    conn->server->shm_spin_us, conn->connfd);
+#else
+    return NULL;
+#endif
+}
+
+// Handle requests for SEARPC_TRANSPORT_SERVICE on the connection @conn,
+// which uses frame version @conn_version. The functions are
+// ["negotiate", <max frame version of the client>], which returns the frame
+// version to use on a legacy connection, ["function_ids", <service>],
+// which returns searpc_server_get_function_ids() on connections using
+// frames, ["batch"], which returns 1 on connections using frames, and
+// ["shm", <ring size>], which returns the ring size if the connection
+// moves to shared memory.
+static char *
+transport_call_function (ServerHandlerData *conn, int conn_version,
+                         PipeRequest *req, gsize *ret_len, ConnSwitch *sw)
+{
+    json_error_t jerror;
+    json_t *array = json_loadb (req->body, req->body_len, 0, &jerror);
+    const char *fname = json_string_value (json_array_get (array, 0));
+    const char *service = json_string_value (json_array_get (array, 1));
+
+    json_int_t client_version = json_integer_value (json_array_get (array, 1));
+    json_int_t ring_size = client_version;
+    json_t *object = json_object ();
+    json_t *ids = NULL;
+
+    if (g_strcmp0 (fname, "negotiate") == 0 && conn_version == 0 &&
+        client_version > 0) {
+        sw->frame_version = (int)MIN(client_version, SEARPC_FRAME_VERSION);
+        json_object_set_new (object, "ret", json_integer (sw->frame_version));
+    } else if (g_strcmp0 (fname, "function_ids") == 0 && conn_version > 0 &&
+               service && (ids = searpc_server_get_function_ids (service)) != NULL) {
+        json_object_set_new (object, "ret", ids);
+    } else if (g_strcmp0 (fname, "batch") == 0 && conn_version > 0) {
+        json_object_set_new (object, "ret", json_integer (1));
+    } else if (g_strcmp0 (fname, "shm") == 0 && conn_version >= 2 && conn_can_use_shm (conn) &&
+               (sw->shm = open_shm_channel (conn, req, ring_size)) != NULL) {
+        json_object_set_new (object, "ret", json_integer (ring_size));
+    } else {
+        json_object_set_new (object, "err_code", json_integer (500));
+        json_object_set_new (object, "err_msg",
+                             json_string ("unsupported transport request"));
+    }
+    json_decref (array);
+
+    return searpc_marshal_set_ret_common (object, ret_len, NULL);
+}
+
+static void
+run_batch_task (void *data, void *user_data)
+{
+    searpc_server_run_batch_task (data);
+}
+
+// Calls of a batch only go to idle workers, the thread of the batch runs
+// the others.
+static gboolean
+run_batch_task_on_worker (void *task, void *user_data)
+{
+    SearpcScheduler *sched = user_data;
+
+    if (searpc_scheduler_get_num_busy (sched) >= searpc_scheduler_get_num_workers (sched))
+        return FALSE;
+    searpc_scheduler_push_func (sched, run_batch_task, task);
+    return TRUE;
+}
+
+// Run a request that arrived on @conn with frame version @conn_version.
+// Changes to the connection asked by the client are stored in @sw, to be
+// applied after the response is sent. If the client accepts streamed
+// responses, their parts are sent with @chunk_func. The descriptors the
+// function returns are stored in @req.
+static char *
+call_request (ServerHandlerData *conn, int conn_version, PipeRequest *req,
+              gsize *ret_len, ConnSwitch *sw,
+              SearpcChunkFunc chunk_func, void *chunk_data)
+{
+    char *ret_str;
+#if !defined(WIN32)
+    SearpcCallFds call_fds;
+#endif
+
+    sw->frame_version = 0;
+    sw->shm = NULL;
+    if (req->chunked)
+        searpc_server_set_chunk_func (chunk_func, chunk_data);
+#if !defined(WIN32)
+    call_fds.fds = req->fds;
+    call_fds.n_fds = req->n_fds;
+    call_fds.n_ret_fds = 0;
+    searpc_server_set_call_fds (&call_fds);
+#endif
+    if (conn->server->scheduler)
+        searpc_server_set_batch_runner (run_batch_task_on_worker,
+                                        conn->server->scheduler);
+
+    if (req->service_id >= 0) {
+        ret_str = searpc_server_call_function_by_id_with_timing (req->service_id, req->body,
+                                                                 req->body_len, ret_len,
+                                                                 &req->timing);
+    } else if (strcmp (req->service, SEARPC_TRANSPORT_SERVICE) == 0) {
+        ret_str = transport_call_function (conn, conn_version, req, ret_len, sw);
+    } else {
+        ret_str = searpc_server_call_function_with_timing (req->service, req->body,
+                                                           req->body_len, ret_len,
+                                                           &req->timing);
+    }
+
+    if (req->chunked)
+        searpc_server_set_chunk_func (NULL, NULL);
+    searpc_server_set_batch_runner (NULL, NULL);
+#if !defined(WIN32)
+    searpc_server_set_call_fds (NULL);
+    memcpy (req->ret_fds, call_fds.ret_fds, call_fds.n_ret_fds * sizeof(int));
+    req->n_ret_fds = call_fds.n_ret_fds;
+#endif
+
+    return ret_str;
+}
+
+typedef struct {
+    ServerHandlerData *data;
+    guint32 req_id;
+} ChunkTarget;
+
+// Send a part of a streamed response. The call blocks while the client
+// doesn't read, so the rest of the list isn't produced meanwhile.
+static int
+write_chunk (const char *chunk, gsize len, void *user_data)
+{
+    ChunkTarget *target = user_data;
+
+    if (write_response (target->data, target->req_id, FRAME_FLAG_CHUNKS,
+                        chunk, len, NULL, 0) < 0) {
+        g_warning("failed to send rpc response: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Run a request and send back the response. Returns -1 if the connection
+// should be closed.
+static int
+serve_request (ServerHandlerData *data, PipeRequest *req)
+{
+    char *ret_str;
+    gsize ret_len;
+    ConnSwitch sw;
+    int ret;
+    ChunkTarget target = { data, req->req_id };
+
+    ret_str = call_request (data, data->frame_version, req, &ret_len, &sw,
+                            write_chunk, &target);
+
+    ret = write_response (data, req->req_id, 0, ret_str, ret_len,
+                          req->ret_fds, req->n_ret_fds);
+    if (ret < 0) {
+        g_warning("failed to send rpc response: %s\n", strerror(errno));
+    } else {
+        req->timing.flushed = g_get_monotonic_time ();
+        if (sw.frame_version > 0)
+            data->frame_version = sw.frame_version;
+        if (sw.shm) {
+            data->shm = sw.shm;
+            sw.shm = NULL;
+        }
+    }
+    finish_request (req);
+    searpc_shm_channel_free (sw.shm);
+
+    g_free (ret_str);
+    return ret;
+}
+
+// EPOLL
+#ifdef __linux__
+
+#define EPOLL_CONN_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+// Maximum number of requests of one connection running at the same time.
+// Reading from the connection pauses when it's reached.
+#define SEARPC_MAX_PIPELINED_REQUESTS 64
+
+// A complete request handed from the listener thread to a worker.
+typedef struct {
+    ServerHandlerData *conn;
+    // Frame version the request was read with.
+    int frame_version;
+    guint16 service_len;
+    // -1 unless the request names its service by id.
+    int service_id;
+    guint32 req_id;
+    gboolean chunked;
+    char *buf;
+    gsize len;
+    int fds[SEARPC_MAX_REQUEST_FDS];
+    int n_fds;
+    SearpcCallTiming timing;
+} PipeCall;
+
+static void
+conn_unref (ServerHandlerData *data)
+{
+    int ref_count;
+
+    pthread_mutex_lock (&data->lock);
+    ref_count = --data->ref_count;
+    pthread_mutex_unlock (&data->lock);
+
+    if (ref_count == 0)
+        close_connection (data);
+}
+
+// Responses to the legacy envelope and to version 1 frames can't be told
+// apart, so such connections run one request at a time.
+static int
+epoll_max_calls (ServerHandlerData *data)
+{
+    return data->frame_version >= 2 ? SEARPC_MAX_PIPELINED_REQUESTS : 1;
+}
+
+// Watch the eventfd of the ring of a connection using shared memory for
+// requests. Called with the connection locked.
+static void
+epoll_rearm_shm_locked (ServerHandlerData *data)
+{
+    struct epoll_event event;
+    int fd = searpc_shm_channel_get_read_fd (data->shm);
+    int op = data->shm_watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = (void *)data;
+    if (epoll_ctl (data->server->epoll_fd, op, fd, &event) == -1) {
+        g_warning ("failed to rearm rpc shared memory in epoll list: %s\n", strerror(errno));
+        return;
+    }
+    data->shm_watched = TRUE;
+
+    if (data->shm_paused) {
+        guint64 one = 1;
+        if (write (fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            g_warning ("failed to signal eventfd: %s\n", strerror(errno));
+        data->shm_paused = FALSE;
+    }
+}
+
+// Re-arm the connection for the events it's ready for. Called with the
+// connection locked. Writing is watched while responses are queued, and
+// reading unless too many requests are running. If neither applies, the
+// connection stays disarmed until a worker finishes a request. Once the
+// connection moved to shared memory, requests are read from the ring, and
+// the socket is only watched for hang-ups and the responses queued before.
+static void
+epoll_rearm_locked (ServerHandlerData *data)
+{
+    struct epoll_event event;
+    gboolean can_read;
+
+    if (data->closed)
+        return;
+
+    can_read = data->n_calls < epoll_max_calls (data);
+    event.events = 0;
+    if (!g_queue_is_empty (data->out_queue))
+        event.events |= EPOLLOUT;
+    if (data->shm) {
+        if (can_read)
+            epoll_rearm_shm_locked (data);
+    } else if (can_read) {
+        event.events |= EPOLLIN;
+    }
+    if (event.events == 0 && !data->shm)
+        return;
+
+    event.events |= EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = (void *)data;
+    if (epoll_ctl (data->server->epoll_fd, EPOLL_CTL_MOD, data->connfd, &event) == -1) {
+        g_warning ("failed to rearm client fd in epoll list: %s\n", strerror(errno));
+    }
+}
+
+// Take the connection out of the epoll set. Called with the connection
+// locked.
+static void
+epoll_unwatch_locked (ServerHandlerData *data)
+{
+    epoll_ctl (data->server->epoll_fd, EPOLL_CTL_DEL, data->connfd, NULL);
+    if (data->shm_watched) {
+        epoll_ctl (data->server->epoll_fd, EPOLL_CTL_DEL,
+                   searpc_shm_channel_get_read_fd (data->shm), NULL);
+        data->shm_watched = FALSE;
+    }
+}
+
+static gssize
+read_nonblocking (ServerHandlerData *data, SearpcShmChannel *shm, void *buf, size_t n)
+{
+    if (shm)
+        return searpc_shm_channel_read (shm, buf, n);
+    return recv_with_fds (data->connfd, buf, n, data->in_fds, &data->n_in_fds);
+}
+
+// Continue reading the current request without blocking, from @shm if the
+// connection moved to shared memory. Returns 1 when the whole request is
+// buffered, 0 if more data is needed, and -1 if the connection should be
+// closed.
+static int
+epoll_read_request (ServerHandlerData *data, SearpcShmChannel *shm)
+{
+    guint32 hdr_size = data->frame_version ? FRAME_HEADER_SIZE(data->frame_version)
+                                           : sizeof(guint32);
+    gssize n;
+
+next_frame:
+    while (data->in_hdr_read < hdr_size) {
+        n = read_nonblocking (data, shm, (char *)&data->in_hdr + data->in_hdr_read,
+                              hdr_size - data->in_hdr_read);
+        if (n == 0) {
+            return -1;
         }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            g_warning("failed to read rpc request: %s\n", strerror(errno));
+            return -1;
+        }
+        data->in_hdr_read += n;
+
+        if (data->in_hdr_read == hdr_size) {
+            if (data->frame_version == 0) {
+                data->in_len = data->in_hdr.len;
+                if (data->in_len == 0)
+                    return -1;
+                data->in_read = 0;
+            } else if (!data->in_continued) {
+                if (!frame_header_is_valid (data->frame_version, &data->in_hdr.frame))
+                    return -1;
+                if (shm && (data->in_hdr.frame.flags & FRAME_FLAG_FDS) &&
+                    recv_fds_with_byte (data->connfd, data->in_fds, &data->n_in_fds) < 0) {
+                    g_warning("failed to read rpc request descriptors: %s\n", strerror(errno));
+                    return -1;
+                }
+                data->in_first = data->in_hdr.frame;
+                data->in_len = data->in_hdr.frame.len - FRAME_HEADER_REST(data->frame_version);
+                data->in_read = 0;
+            } else {
+                // The frame is appended to the earlier ones.
+                if (!continuation_is_valid (data->frame_version, &data->in_first,
+                                            &data->in_hdr.frame))
+                    return -1;
+                data->in_len += data->in_hdr.frame.len - FRAME_HEADER_REST(data->frame_version);
+            }
+            if (!message_size_is_valid (data->in_len, data->server->max_message_size))
+                return -1;
+            grow_buffer (&data->buf, &data->bufsize, data->in_len);
+        }
+    }
+
+    while (data->in_read < data->in_len) {
+        n = read_nonblocking (data, shm, data->buf + data->in_read,
+                              data->in_len - data->in_read);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            g_warning("failed to read rpc request: %s\n", strerror(errno));
+            return -1;
+        }
+        data->in_read += n;
+    }
+
+    if (data->frame_version > 0 &&
+        FRAME_IS_CONTINUED(data->frame_version, &data->in_hdr.frame)) {
+        data->in_continued = TRUE;
+        data->in_hdr_read = 0;
+        goto next_frame;
+    }
+
+    return 1;
+}
+
+// Move the request buffered by epoll_read_request() into a new call and
+// reset the read state for the next request.
+static PipeCall *
+epoll_take_request (ServerHandlerData *data)
+{
+    PipeCall *call = g_new0 (PipeCall, 1);
+
+    call->conn = data;
+    call->frame_version = data->frame_version;
+    call->service_id = -1;
+    if (data->frame_version > 0) {
+        call->service_len = FRAME_SERVICE_NAME_LEN(&data->in_first);
+        if (data->in_first.flags & FRAME_FLAG_SERVICE_ID)
+            call->service_id = data->in_first.service_len;
+    }
+    if (data->frame_version >= 2) {
+        call->req_id = data->in_first.req_id;
+        call->chunked = (data->in_first.flags & FRAME_FLAG_CHUNKS) != 0;
+    }
+    call->buf = data->buf;
+    call->len = data->in_len;
+    memcpy (call->fds, data->in_fds, data->n_in_fds * sizeof(int));
+    call->n_fds = data->n_in_fds;
+    data->n_in_fds = 0;
+    call->timing.received = g_get_monotonic_time ();
+    call->timing.accepted = data->accepted_at;
+    data->accepted_at = 0;
+
+    data->buf = NULL;
+    data->bufsize = 0;
+    data->in_hdr_read = 0;
+    data->in_continued = FALSE;
+
+    pthread_mutex_lock (&data->lock);
+    data->n_calls++;
+    data->ref_count++;
+    pthread_mutex_unlock (&data->lock);
+
+    return call;
+}
+
+// Decode the request of @call. The request takes over the call's buffer.
+static int
+epoll_decode_request (PipeCall *call, PipeRequest *req)
+{
+    req->legacy_body = NULL;
+    req->buf = call->buf;
+    req->req_id = call->req_id;
+    req->chunked = call->chunked;
+    req->service_id = -1;
+    req->n_ret_fds = 0;
+    req->timing = call->timing;
+    take_request_fds (call->fds, &call->n_fds, req);
+    call->buf = NULL;
+
+    if (call->frame_version == 0) {
+        return decode_legacy_request (req->buf, call->len, req);
+    }
+
+    memcpy (req->service, req->buf, call->service_len);
+    req->service[call->service_len] = '\0';
+    if (call->service_id >= 0) {
+        set_service_id (req, call->service_id);
+    }
+    req->body = req->buf + call->service_len;
+    req->body_len = call->len - call->service_len;
+    return 0;
+}
+
+static PipeResponse *
+make_response (int frame_version, guint32 req_id, guint8 flags,
+               char *ret_str, gsize ret_len)
+{
+    PipeResponse *resp = g_new0 (PipeResponse, 1);
+
+    if (frame_version == 0) {
+        resp->hdr.len = (guint32)ret_len;
+        resp->hdr_len = sizeof(guint32);
+    } else {
+        init_response_header (&resp->hdr.frame, frame_version, req_id, flags, ret_len);
+        resp->hdr_len = FRAME_HEADER_SIZE(frame_version);
+    }
+    resp->body = ret_str;
+    resp->body_len = ret_len;
+
+    return resp;
+}
+
+// Make the frames of a response, split like write_frames() does. The last
+// one owns @ret_str, and @fds go with the first. Returns NULL, freeing
+// @ret_str, if the response is too long for the frame version.
+static GList *
+make_responses (int frame_version, guint32 req_id, guint8 flags,
+                char *ret_str, gsize ret_len, const int *fds, int n_fds)
+{
+    GList *parts = NULL;
+    PipeResponse *resp;
+    gsize off = 0, part;
+
+    if (frame_version < 3 &&
+        ret_len > G_MAXUINT32 - FRAME_HEADER_REST(frame_version)) {
+        g_warning("rpc response of %" G_GSIZE_FORMAT " bytes is too long\n", ret_len);
+        g_free (ret_str);
+        return NULL;
+    }
+
+    while (frame_version >= 3 && ret_len - off > SEARPC_MAX_FRAME_BODY) {
+        part = SEARPC_MAX_FRAME_BODY;
+        resp = make_response (frame_version, req_id, off == 0 ? flags : 0,
+                              ret_str + off, part);
+        resp->hdr.frame.flags |= FRAME_FLAG_CONTINUED;
+        parts = g_list_prepend (parts, resp);
+        off += part;
+    }
+    resp = make_response (frame_version, req_id, off == 0 ? flags : 0,
+                          ret_str + off, ret_len - off);
+    resp->buf = ret_str;
+    parts = g_list_prepend (parts, resp);
+
+    parts = g_list_reverse (parts);
+    if (n_fds > 0 && frame_version > 0) {
+        resp = parts->data;
+        resp->hdr.frame.flags |= FRAME_FLAG_FDS;
+        resp->fds = fds;
+        resp->n_fds = n_fds;
+    }
+    return parts;
+}
+
+// Queue the frames of a response back to back. Called with the connection
+// locked.
+static void
+epoll_queue_responses (ServerHandlerData *data, GList *parts)
+{
+    GList *ptr;
+
+    for (ptr = parts; ptr; ptr = ptr->next)
+        g_queue_push_tail (data->out_queue, ptr->data);
+    g_list_free (parts);
+}
+
+#define FLUSH_IOV_MAX 64
+
+// Write queued responses as far as the socket accepts them, gathering
+// several responses into one call. Called with the connection locked.
+// Returns 0 when the queue is drained or the socket is full, and -1 on
+// errors.
+static int
+epoll_flush_responses (ServerHandlerData *data)
+{
+    struct iovec iov[FLUSH_IOV_MAX];
+    struct msghdr msg;
+    FdControl control;
+    PipeResponse *first;
+    GList *ptr;
+    gssize n;
+    gint64 now;
+
+    while (!g_queue_is_empty (data->out_queue)) {
+        int cnt = 0;
+        gsize off = data->out_sent;
+
+        for (ptr = data->out_queue->head; ptr && cnt < FLUSH_IOV_MAX - 1; ptr = ptr->next) {
+            PipeResponse *resp = ptr->data;
+
+            // Descriptors are received with the first bytes of the call
+            // they're sent with, so they can't come after other responses.
+            if (resp->n_fds > 0 && ptr != data->out_queue->head)
+                break;
+
+            if (off < resp->hdr_len) {
+                iov[cnt].iov_base = (char *)&resp->hdr + off;
+                iov[cnt++].iov_len = resp->hdr_len - off;
+                off = 0;
+            } else {
+                off -= resp->hdr_len;
+            }
+            if (resp->body_len > off) {
+                iov[cnt].iov_base = resp->body + off;
+                iov[cnt++].iov_len = resp->body_len - off;
+            }
+            off = 0;
+        }
+
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        first = g_queue_peek_head (data->out_queue);
+        set_fds_control (&msg, &control, first->fds, first->n_fds);
+        n = sendmsg (data->connfd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            g_warning("failed to send rpc response: %s\n", strerror(errno));
+            return -1;
+        }
+        first->n_fds = 0;
+
+        // Drop the responses that are completely sent.
+        now = g_get_monotonic_time ();
+        n += data->out_sent;
+        while (!g_queue_is_empty (data->out_queue)) {
+            PipeResponse *resp = g_queue_peek_head (data->out_queue);
+            gsize total = resp->hdr_len + resp->body_len;
+
+            if ((gsize)n < total)
+                break;
+            n -= total;
+            if (resp->req)
+                resp->req->timing.flushed = now;
+            free_response (g_queue_pop_head (data->out_queue));
+        }
+        data->out_sent = n;
+    }
+
+    return 0;
+}
+
+// Bytes of the queued responses not written yet. Called with the
+// connection locked.
+static gsize
+epoll_queued_bytes (ServerHandlerData *data)
+{
+    gsize total = 0;
+    GList *ptr;
+
+    for (ptr = data->out_queue->head; ptr; ptr = ptr->next) {
+        PipeResponse *resp = ptr->data;
+        total += resp->hdr_len + resp->body_len;
+    }
+
+    return total - data->out_sent;
+}
+
+// A streaming call waits for the listener to write the queued parts of
+// its response once they exceed this.
+#define SEARPC_MAX_QUEUED_CHUNK_BYTES (4 * SEARPC_STREAM_CHUNK_SIZE)
+
+typedef struct {
+    ServerHandlerData *conn;
+    int frame_version;
+    guint32 req_id;
+    // Set if the connection uses shared memory.
+    SearpcShmChannel *shm;
+} EpollChunkTarget;
+
+// Write a response to the ring of a connection using shared memory. The
+// worker waits while the ring is full, like in blocking mode.
+static int
+epoll_write_shm_response (ServerHandlerData *conn, SearpcShmChannel *shm,
+                          int frame_version, guint32 req_id, guint8 flags,
+                          const char *ret_str, gsize ret_len,
+                          const int *fds, int n_fds)
+{
+    SearpcFrameHeader hdr;
+    int ret;
+
+    init_response_header (&hdr, frame_version, req_id, flags, 0);
+    pthread_mutex_lock (&conn->shm_write_lock);
+    ret = write_frames (conn->connfd, shm, frame_version, &hdr,
+                        NULL, 0, ret_str, ret_len, fds, n_fds);
+    pthread_mutex_unlock (&conn->shm_write_lock);
+    if (ret < 0)
+        g_warning("failed to send rpc response: %s\n", strerror(errno));
+
+    return ret;
+}
+
+// Queue a part of a streamed response. If the client doesn't read fast
+// enough, wait until the listener thread has written earlier parts, so
+// the parts of the list don't pile up in memory.
+static int
+epoll_write_chunk (const char *chunk, gsize len, void *user_data)
+{
+    EpollChunkTarget *target = user_data;
+    ServerHandlerData *conn = target->conn;
+    char *body;
+    GList *parts;
+    int ret = 0;
+
+    if (target->shm) {
+        if (epoll_write_shm_response (conn, target->shm, target->frame_version,
+                                      target->req_id, FRAME_FLAG_CHUNKS,
+                                      chunk, len, NULL, 0) < 0) {
+            shutdown (conn->connfd, SHUT_RDWR);
+            return -1;
+        }
+        return 0;
+    }
+
+    body = g_malloc (len);
+    memcpy (body, chunk, len);
+    parts = make_responses (target->frame_version, target->req_id,
+                            FRAME_FLAG_CHUNKS, body, len, NULL, 0);
+
+    pthread_mutex_lock (&conn->lock);
+    if (conn->closed || !parts) {
+        ret = -1;
+    } else {
+        epoll_queue_responses (conn, parts);
+        parts = NULL;
+        if (epoll_flush_responses (conn) < 0) {
+            shutdown (conn->connfd, SHUT_RDWR);
+            ret = -1;
+        }
+        while (ret == 0 && epoll_queued_bytes (conn) > SEARPC_MAX_QUEUED_CHUNK_BYTES) {
+            if (conn->closed) {
+                ret = -1;
+                break;
+            }
+            epoll_rearm_locked (conn);
+            pthread_cond_wait (&conn->out_cond, &conn->lock);
+        }
+    }
+    pthread_mutex_unlock (&conn->lock);
+
+    free_responses (parts);
+    return ret;
+}
+
+static void epoll_handler(void *data)
+{
+    PipeCall *call = data;
+    ServerHandlerData *conn = call->conn;
+    GList *parts = NULL;
+    PipeRequest *req = g_new0 (PipeRequest, 1);
+    EpollChunkTarget target = { conn, call->frame_version, call->req_id, NULL };
+    char *ret_str;
+    gsize ret_len;
+    ConnSwitch sw = { 0, NULL };
+    // Responses to requests read from the ring are already written.
+    gboolean sent = FALSE;
+
+    // The listener reads from the ring once the connection moved there.
+    pthread_mutex_lock (&conn->lock);
+    target.shm = conn->shm;
+    pthread_mutex_unlock (&conn->lock);
+
+    call->timing.dequeued = g_get_monotonic_time ();
+    if (epoll_decode_request (call, req) == 0) {
+        ret_str = call_request (conn, call->frame_version, req, &ret_len, &sw,
+                                epoll_write_chunk, &target);
+        if (target.shm) {
+            if (epoll_write_shm_response (conn, target.shm, call->frame_version,
+                                          req->req_id, 0, ret_str, ret_len,
+                                          req->ret_fds, req->n_ret_fds) == 0) {
+                req->timing.flushed = g_get_monotonic_time ();
+                sent = TRUE;
+            }
+            finish_request (req);
+            g_free (req);
+            g_free (ret_str);
+        } else {
+            parts = make_responses (call->frame_version, req->req_id, 0, ret_str, ret_len,
+                                    req->ret_fds, req->n_ret_fds);
+            if (parts) {
+                ((PipeResponse *)g_list_last (parts)->data)->req = req;
+            } else {
+                finish_request (req);
+                g_free (req);
+            }
+        }
+    } else {
+        close_fds (req->fds, &req->n_fds);
+        g_free (req->legacy_body);
+        g_free (req->buf);
+        g_free (req);
+    }
+
+    pthread_mutex_lock (&conn->lock);
+    conn->n_calls--;
+    // Legacy connections run one request at a time, so the next request is
+    // only read after the new frame version is set here.
+    if (sw.frame_version > 0) {
+        conn->frame_version = sw.frame_version;
+    }
+    if (!parts && !sent) {
+        // Only the listener thread closes connections. Shutting the socket
+        // down makes it see the end of the stream.
+        shutdown (conn->connfd, SHUT_RDWR);
+    } else if (parts && !conn->closed) {
+        // Try to send the response right away. If the client doesn't read
+        // it fast enough, the listener thread flushes the rest.
+        epoll_queue_responses (conn, parts);
+        parts = NULL;
+        // The client writes its next requests to the ring once it has
+        // read the response from the socket.
+        if (sw.shm) {
+            conn->shm = sw.shm;
+            conn->shm_paused = TRUE;
+            sw.shm = NULL;
+        }
+        if (epoll_flush_responses (conn) < 0) {
+            shutdown (conn->connfd, SHUT_RDWR);
+        }
+    }
+    epoll_rearm_locked (conn);
+    pthread_mutex_unlock (&conn->lock);
+
+    searpc_shm_channel_free (sw.shm);
+    free_responses (parts);
+    g_free (call);
+    conn_unref (conn);
+}
+
+static void* handle_epoll_call_with_thread (void *arg)
+{
+    epoll_handler (arg);
+    return NULL;
+}
+
+// Handle an event on a client connection. Requests are read without
+// blocking and handed to workers once completely buffered, so slow clients
+// never hold a worker thread. With frame version 2 the next requests are
+// read while earlier ones are still running, and workers queue responses in
+// the order the requests complete. Connections using shared memory get
+// events from the eventfd of their ring too, and any event of their socket
+// but EPOLLOUT means the client is gone. Returns TRUE if the connection is
+// closed, its reference is then dropped after the other events.
+static gboolean
+epoll_handle_connection (SearpcNamedPipeServer *server, ServerHandlerData *data,
+                         guint32 events)
+{
+    gboolean close_conn = FALSE;
+    gboolean can_read;
+    SearpcShmChannel *shm;
+    int ret;
+
+    // Both descriptors of a connection using shared memory may have
+    // events at once.
+    pthread_mutex_lock (&data->lock);
+    if (data->closed) {
+        pthread_mutex_unlock (&data->lock);
+        return FALSE;
+    }
+    if (data->shm && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        close_conn = TRUE;
+    pthread_mutex_unlock (&data->lock);
+
+    if (!close_conn && (events & EPOLLOUT)) {
+        pthread_mutex_lock (&data->lock);
+        if (epoll_flush_responses (data) < 0)
+            close_conn = TRUE;
+        pthread_cond_broadcast (&data->out_cond);
+        pthread_mutex_unlock (&data->lock);
+    }
+
+    while (!close_conn && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        // A worker sets shm when the connection moves to shared memory.
+        // If it does after this, the socket has no more requests and the
+        // connection is rearmed for the ring below.
+        pthread_mutex_lock (&data->lock);
+        can_read = data->n_calls < epoll_max_calls (data);
+        shm = data->shm;
+        if (!can_read && shm)
+            data->shm_paused = TRUE;
+        pthread_mutex_unlock (&data->lock);
+        if (!can_read)
+            break;
+
+        ret = epoll_read_request (data, shm);
+        if (ret < 0)
+            close_conn = TRUE;
+        else if (ret == 0)
+            break;
+        else
+            server_dispatch (server, epoll_take_request (data),
+                             handle_epoll_call_with_thread);
+    }
+
+    pthread_mutex_lock (&data->lock);
+    if (close_conn) {
+        // Requests still running drop their responses, and the last
+        // reference closes the socket.
+        data->closed = TRUE;
+        epoll_unwatch_locked (data);
+        pthread_cond_broadcast (&data->out_cond);
+    } else {
+        epoll_rearm_locked (data);
+    }
+    pthread_mutex_unlock (&data->lock);
+
+    return close_conn;
+}
+
+static void
+epoll_listen (SearpcNamedPipeServer *server)
+{
+#define MAX_EVENTS 1000
+    struct epoll_event event;
+    struct epoll_event events[MAX_EVENTS];
+    int connfd;
+    int n_events;
+    int i;
+    GList *closed = NULL, *ptr;
+
+    while (!g_atomic_int_get (&server->stopping)) {
+        n_events = epoll_wait (server->epoll_fd, events, MAX_EVENTS, 1000);
+        if (n_events <= 0) {
+            if (n_events < 0) {
+                g_warning ("Failed to call waits for events on the epoll: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        for (i = 0; i < n_events; i++) {
+            if (events[i].data.ptr == server) {
+                if (!(events[i].events & EPOLLIN)) {
+                    continue;
+                }
+
+                // new client connection
+                // Accept all connections currently queued in the accept backlog.
+                while (1) {
+                    connfd = accept(server->pipe_fd, NULL, 0);
+                    if (connfd < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                            g_atomic_int_get (&server->stopping)) {
+                            break;
+                        } else {
+                            g_warning ("Failed to accept new client connection: %s\n", strerror(errno));
+                            break;
+                        }
+                    }
+
+                    ServerHandlerData *data = g_new0(ServerHandlerData, 1);
+                    data->use_epoll = TRUE;
+                    data->connfd = connfd;
+                    data->server = server;
+                    data->accepted_at = g_get_monotonic_time ();
+                    data->ref_count = 1;
+                    data->out_queue = g_queue_new ();
+                    pthread_mutex_init (&data->lock, NULL);
+                    pthread_cond_init (&data->out_cond, NULL);
+                    pthread_mutex_init (&data->shm_write_lock, NULL);
+                    server_add_connection (server, data);
+
+                    if (set_nonblocking(connfd) < 0) {
+                        g_warning ("Failed to set client fd to nonblocking: %s\n", strerror(errno));
+                        close_connection (data);
+                        continue;
+                    }
+
+                    event.events = EPOLL_CONN_EVENTS;
+                    event.data.ptr = (void *)data;
+                    if (epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, connfd, &event) == -1) {
+                        g_warning ("Failed to add client fd to epoll list: %s\n", strerror(errno));
+                        close_connection (data);
+                        continue;
+                    }
+                }
+            } else if (epoll_handle_connection (server, events[i].data.ptr,
+                                                events[i].events)) {
+                closed = g_list_prepend (closed, events[i].data.ptr);
+            }
+        }
+
+        for (ptr = closed; ptr; ptr = ptr->next)
+            conn_unref (ptr->data);
+        g_list_free (closed);
+        closed = NULL;
+    }
+}
+#endif
+
+static void* named_pipe_listen(void *arg)
+{
+    SearpcNamedPipeServer *server = arg;
+
+#if !defined(WIN32)
+#ifdef __linux__
+    if (server->use_epoll) {
+        epoll_listen (server);
+        return NULL;
+    }
+#endif
+    while (1) {
+        int connfd = accept (server->pipe_fd, NULL, 0);
+        if (g_atomic_int_get (&server->stopping)) {
+            if (connfd >= 0)
+                close (connfd);
+            break;
+        }
+        if (connfd < 0) {
+            g_warning ("Failed to accept new client connection: %s\n", strerror(errno));
+            continue;
+        }
+        ServerHandlerData *data = g_new0(ServerHandlerData, 1);
+        data->connfd = connfd;
+        data->server = server;
+        data->accepted_at = g_get_monotonic_time ();
+        data->use_epoll = FALSE;
+        server_add_connection (server, data);
+        server_dispatch (server, data, handle_named_pipe_client_with_thread);
+    }
+#else // !defined(WIN32)
+    while (1) {
+        HANDLE connfd = INVALID_HANDLE_VALUE;
+        BOOL connected = FALSE;
+
+        connfd = CreateNamedPipe(
+            server->path,             // pipe name
+            PIPE_ACCESS_DUPLEX,       // read/write access
+            PIPE_TYPE_MESSAGE |       // message type pipe
+            PIPE_READMODE_MESSAGE |   // message-read mode
+            PIPE_WAIT,                // blocking mode
+            PIPE_UNLIMITED_INSTANCES, // max. instances
+            kPipeBufSize,             // output buffer size
+            kPipeBufSize,             // input buffer size
+            0,                        // client time-out
+            NULL);                    // default security attribute
+
+        if (connfd == INVALID_HANDLE_VALUE) {
+            G_WARNING_WITH_LAST_ERROR ("Failed to create named pipe");
+            break;
+        }
+
+        /* listening on this pipe */
+        connected = ConnectNamedPipe(connfd, NULL) ?
+            TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+
+        if (!connected) {
+            G_WARNING_WITH_LAST_ERROR ("failed to ConnectNamedPipe()");
+            CloseHandle(connfd);
+            break;
+        }
+
+        if (g_atomic_int_get (&server->stopping)) {
+            DisconnectNamedPipe(connfd);
+            CloseHandle(connfd);
+            break;
+        }
+
+        /* g_debug ("Accepted a named pipe client\n"); */
+
+        ServerHandlerData *data = g_new0(ServerHandlerData, 1);
+        data->connfd = connfd;
+        data->server = server;
+        data->accepted_at = g_get_monotonic_time ();
+        data->use_epoll = FALSE;
+        server_add_connection (server, data);
+        server_dispatch (server, data, handle_named_pipe_client_with_thread);
+    }
+#endif // !defined(WIN32)
+    return NULL;
+}
+
+// Make the listener thread return from accept() or ConnectNamedPipe()
+// once the stopping flag is set.
+static void
+wake_listener (SearpcNamedPipeServer *server)
+{
+#if defined(__linux__)
+    // Pending and later accept() calls fail, and epoll reports the socket.
+    shutdown (server->pipe_fd, SHUT_RDWR);
+#elif !defined(WIN32)
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un saddr;
+
+    if (fd < 0)
+        return;
+    saddr.sun_family = AF_UNIX;
+    g_strlcpy (saddr.sun_path, server->path, sizeof(saddr.sun_path));
+    connect (fd, (struct sockaddr *)&saddr, sizeof(saddr));
+    close (fd);
+#else
+    HANDLE pipe = CreateFile(server->path, GENERIC_READ | GENERIC_WRITE,
+                             0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(pipe);
+#endif
+}
+
+// Make the handler of a connection see the end of the stream. In epoll
+// mode the connection also leaves the epoll set, and the reference of the
+// registration is added to @unref.
+static void
+stop_connection (ServerHandlerData *data, GList **unref)
+{
+#if !defined(WIN32)
+    shutdown (data->connfd, SHUT_RDWR);
+#else
+    DisconnectNamedPipe(data->connfd);
+#endif
+
+#ifdef __linux__
+    if (!data->use_epoll)
+        return;
+    pthread_mutex_lock (&data->lock);
+    if (!data->closed) {
+        data->closed = TRUE;
+        epoll_unwatch_locked (data);
+        pthread_cond_broadcast (&data->out_cond);
+        *unref = g_list_prepend (*unref, data);
+    }
+    pthread_mutex_unlock (&data->lock);
+#endif
+}
+
+void searpc_free_named_pipe_server(SearpcNamedPipeServer *server)
+{
+    GHashTableIter iter;
+    gpointer key;
+    GList *unref = NULL;
+
+    if (!server)
+        return;
+
+    if (server->started) {
+        g_atomic_int_set (&server->stopping, TRUE);
+        wake_listener (server);
+        pthread_join (server->listener_thread, NULL);
+    }
+
+    // The listener is gone, so no connection is added anymore.
+    pthread_mutex_lock (&server->lock);
+    g_hash_table_iter_init (&iter, server->connections);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        stop_connection (key, &unref);
+    pthread_mutex_unlock (&server->lock);
+
+#ifdef __linux__
+    GList *ptr;
+    for (ptr = unref; ptr; ptr = ptr->next)
+        conn_unref (ptr->data);
+#endif
+    g_list_free (unref);
+
+    // Wait for the handlers and the running requests to close them.
+    pthread_mutex_lock (&server->lock);
+    while (g_hash_table_size (server->connections) > 0)
+        pthread_cond_wait (&server->conns_cond, &server->lock);
+    pthread_mutex_unlock (&server->lock);
+
+    searpc_scheduler_free (server->scheduler);
+
+    if (server->started) {
+#if !defined(WIN32)
+        close (server->pipe_fd);
+#endif
+#ifdef __linux__
+        if (server->use_epoll)
+            close (server->epoll_fd);
+#endif
+    }
+    g_hash_table_destroy (server->connections);
+    pthread_mutex_destroy (&server->lock);
+    pthread_cond_destroy (&server->conns_cond);
+    g_free (server);
+}
+
+static void* handle_named_pipe_client_with_thread(void *arg)
+{
+    named_pipe_client_handler(arg);
+
+    return NULL;
+}
+
+static void handle_named_pipe_client_with_scheduler(void *data, void *user_data)
+{
+#ifdef __linux__
+    SearpcNamedPipeServer *server = user_data;
+    if (server->use_epoll) {
+        epoll_handler (data);
+        return;
+    }
+#endif
+    named_pipe_client_handler(data);
+}
+
+static void named_pipe_client_handler(void *data)
+{
+    ServerHandlerData *handler_data = data;
+    PipeRequest req;
+    gint64 started = g_get_monotonic_time ();
+
+    handler_data->bufsize = 4096;
+    handler_data->buf = g_malloc(handler_data->bufsize);
+
+    while (1) {
+        if (read_request (handler_data, &req) <= 0) {
+            break;
+        }
+
+        // The connection waited for a worker before its first call, which
+        // isn't the frame negotiation. Later calls are served right away.
+        if (handler_data->accepted_at) {
+            req.timing.accepted = handler_data->accepted_at;
+            req.timing.dequeued = started;
+            if (strcmp (req.service, SEARPC_TRANSPORT_SERVICE) != 0)
+                handler_data->accepted_at = 0;
+        } else {
+            req.timing.dequeued = req.timing.received;
+        }
+
+        if (serve_request (handler_data, &req) < 0) {
+            break;
+        }
+    }
+
+    close_connection (handler_data);
+}
+
+// Ask the server to switch this connection to binary frames. Servers that
+// don't support them reply with an error, and the connection keeps using the
+// legacy envelope.
+static int
+negotiate_frame_version (SearpcNamedPipeClient *client)
+{
+    char fcall_str[64];
+    int fcall_len = snprintf (fcall_str, sizeof(fcall_str), "[\"negotiate\",%d]",
+                              SEARPC_FRAME_VERSION);
+    size_t len;
+    char *buf;
+
+    client->frame_version = 0;
+    client->batch = -1;
+    g_atomic_int_set ((gint *)&client->last_req_id, 0);
+    client->last_resp_id = 0;
+    client->broken = FALSE;
+
+    if (searpc_named_pipe_client_send_request (client, SEARPC_TRANSPORT_SERVICE,
+                                               fcall_str, fcall_len, NULL) < 0) {
+        return -1;
+    }
+    buf = searpc_named_pipe_client_read_response (client, NULL, &len);
+    if (!buf) {
+        return -1;
+    }
+
+    json_error_t jerror;
+    json_t *object = json_loadb (buf, len, 0, &jerror);
+    json_t *version = json_object_get (object, "ret");
+    if (json_is_integer (version) &&
+        json_integer_value (version) > 0 &&
+        json_integer_value (version) <= SEARPC_FRAME_VERSION) {
+        client->frame_version = (int)json_integer_value (version);
+    }
+    json_decref (object);
+    g_free (buf);
+
+    return 0;
+}
+
+int searpc_named_pipe_client_connect(SearpcNamedPipeClient *client)
+{
+#if !defined(WIN32)
+    client->pipe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un servaddr;
+    servaddr.sun_family = AF_UNIX;
+
+    g_strlcpy (servaddr.sun_path, client->path, sizeof(servaddr.sun_path));
+    if (connect(client->pipe_fd, (struct sockaddr *)&servaddr, (socklen_t)sizeof(servaddr)) < 0) {
+        g_warning ("pipe client failed to connect to server: %s\n", strerror(errno));
+        close(client->pipe_fd);
+        return -1;
+    }
+
+#else // !defined(WIN32)
+    SearpcNamedPipe pipe_fd;
+
+    for (;;) {
+        pipe_fd = CreateFile(
+            client->path,           // pipe name
+            GENERIC_READ |          // read and write access
+            GENERIC_WRITE,
+            0,                      // no sharing
+            NULL,                   // default security attributes
+            OPEN_EXISTING,          // opens existing pipe
+            0,                      // default attributes
+            NULL);                  // no template file
+
+        if (pipe_fd != INVALID_HANDLE_VALUE) {
+            break;
+        }
+
+        /* wait with default timeout (approx. 50ms) */
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipe(client->path, NMPWAIT_USE_DEFAULT_WAIT)) {
+            G_WARNING_WITH_LAST_ERROR("Failed to connect to named pipe");
+            return -1;
+        }
+    }
+
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    if (!SetNamedPipeHandleState(pipe_fd, &mode, NULL, NULL)) {
+        G_WARNING_WITH_LAST_ERROR("Failed to set named pipe mode");
+        CloseHandle (pipe_fd);
+        return -1;
+    }
+
+    client->pipe_fd = pipe_fd;
+
+#endif // !defined(WIN32)
+
+    /* g_debug ("pipe client connected to server\n"); */
+    return negotiate_frame_version (client);
+}
+
+void searpc_named_pipe_client_free (SearpcNamedPipeClient *client)
+{
+    if (!client)
+        return;
+#if defined(WIN32)
+    CloseHandle(client->pipe_fd);
+#else
+    close(client->pipe_fd);
+#endif
+    searpc_shm_channel_free (client->shm);
+    pthread_mutex_destroy (&client->lock);
+    pthread_mutex_destroy (&client->write_lock);
+    pthread_cond_destroy (&client->cond);
+    g_hash_table_destroy (client->pending);
+    g_free (client);
+}
+
+void searpc_free_client_with_pipe_transport (SearpcClient *client)
+{
+    ClientTransportData *data = (ClientTransportData *)(client->arg);
+
+    searpc_named_pipe_client_free (data->client);
+    g_free (data->service);
+    if (data->func_ids)
+        g_hash_table_destroy (data->func_ids);
+    g_free (data);
+    searpc_client_free (client);
+}
+
+int
+searpc_client_load_pipe_function_ids (SearpcClient *client)
+{
+    ClientTransportData *data = client->arg;
+    ClientTransportData transport = { data->client, (char *)SEARPC_TRANSPORT_SERVICE, -1, NULL };
+    json_t *array, *object, *ret, *service_id, *functions;
+    json_error_t jerror;
+    GHashTable *func_ids;
+    void *iter;
+    char *fcall, *buf;
+    size_t len;
+
+    if (data->client->frame_version == 0)
+        return -1;
+
+    array = json_array ();
+    json_array_append_new (array, json_string ("function_ids"));
+    json_array_append_new (array, json_string (data->service));
+    fcall = json_dumps (array, JSON_COMPACT);
+    json_decref (array);
+
+    buf = searpc_named_pipe_send (&transport, fcall, strlen (fcall), &len);
+    free (fcall);
+    if (!buf)
+        return -1;
+    object = json_loadb (buf, len, 0, &jerror);
+    g_free (buf);
+
+    ret = json_object_get (object, "ret");
+    service_id = json_object_get (ret, "service");
+    functions = json_object_get (ret, "functions");
+    if (!json_is_integer (service_id) || !json_is_object (functions) ||
+        json_integer_value (service_id) < 0 ||
+        json_integer_value (service_id) > G_MAXUINT16) {
+        json_decref (object);
+        return -1;
+    }
+
+    func_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (iter = json_object_iter (functions); iter;
+         iter = json_object_iter_next (functions, iter)) {
+        json_t *id = json_object_iter_value (iter);
+        if (json_is_integer (id) && json_integer_value (id) >= 0 &&
+            json_integer_value (id) < G_MAXINT)
+            g_hash_table_insert (func_ids, g_strdup (json_object_iter_key (iter)),
+                                 GINT_TO_POINTER((int)json_integer_value (id) + 1));
+    }
+
+    if (data->func_ids)
+        g_hash_table_destroy (data->func_ids);
+    data->func_ids = func_ids;
+    data->service_id = (int)json_integer_value (service_id);
+    json_decref (object);
+
+    return 0;
+}
+
+// Ask the server whether it can run batches, once per connection. Servers
+// that only speak the legacy envelope predate batches.
+static gboolean
+searpc_named_pipe_supports_batch (void *arg)
+{
+    ClientTransportData *data = arg;
+    ClientTransportData transport = { data->client, (char *)SEARPC_TRANSPORT_SERVICE, -1, NULL };
+    static const char fcall[] = "[\"batch\"]";
+    json_error_t jerror;
+    json_t *object;
+    char *buf;
+    size_t len;
+    int batch = g_atomic_int_get (&data->client->batch);
+
+    if (batch >= 0)
+        return batch;
+    if (data->client->frame_version == 0) {
+        g_atomic_int_set (&data->client->batch, 0);
+        return FALSE;
+    }
+
+    buf = searpc_named_pipe_send (&transport, fcall, sizeof(fcall) - 1, &len);
+    // Ask again next time if the transport failed.
+    if (!buf)
+        return FALSE;
+    object = json_loadb (buf, len, 0, &jerror);
+    g_free (buf);
+    batch = json_integer_value (json_object_get (object, "ret")) == 1;
+    json_decref (object);
+
+    g_atomic_int_set (&data->client->batch, batch);
+    return batch;
+}
+
+// Requests are written by several threads, under different locks.
+static guint32
+next_req_id (SearpcNamedPipeClient *client)
+{
+    return (guint32)g_atomic_int_add ((gint *)&client->last_req_id, 1) + 1;
+}
+
+int
+searpc_named_pipe_client_enable_shm (SearpcNamedPipeClient *client,
+                                     gsize ring_size, int spin_us)
+{
+#ifdef __linux__
+    SearpcShmChannel *shm;
+    SearpcFrameHeader hdr;
+    int fds[SEARPC_SHM_N_FDS];
+    char fcall_str[64];
+    int fcall_len;
+    gsize service_len = strlen (SEARPC_TRANSPORT_SERVICE);
+    guint32 req_id, resp_id;
+    json_error_t jerror;
+    json_t *object;
+    char *buf;
+    size_t len;
+    int ret = -1;
+
+    if (client->frame_version < 2 || client->shm)
+        return -1;
+    if (ring_size == 0)
+        ring_size = SEARPC_SHM_DEFAULT_RING_SIZE;
+
+    shm = searpc_shm_channel_create (ring_size, spin_us, client->pipe_fd);
+    if (!shm)
+        return -1;
+    searpc_shm_channel_get_fds (shm, fds);
+    fcall_len = snprintf (fcall_str, sizeof(fcall_str), "[\"shm\",%" G_GSIZE_FORMAT "]",
+                          ring_size);
+
+    // The request and its response still go through the socket, which
+    // carries the descriptors.
+    pthread_mutex_lock (&client->write_lock);
+    req_id = next_req_id (client);
+    hdr.len = (guint32)(FRAME_HEADER_REST(client->frame_version) + service_len + fcall_len);
+    hdr.version = client->frame_version;
+    hdr.flags = FRAME_FLAG_FDS;
+    hdr.service_len = (guint16)service_len;
+    hdr.req_id = req_id;
+    if (pipe_write_frame_with_fds (client->pipe_fd, &hdr, FRAME_HEADER_SIZE(client->frame_version),
+                                   SEARPC_TRANSPORT_SERVICE, service_len,
+                                   fcall_str, fcall_len, fds, SEARPC_SHM_N_FDS) < 0) {
+        g_warning("failed to send rpc call: %s\n", strerror(errno));
+    } else if ((buf = searpc_named_pipe_client_read_response (client, &resp_id, &len)) != NULL) {
+        object = json_loadb (buf, len, 0, &jerror);
+        if (resp_id == req_id &&
+            json_integer_value (json_object_get (object, "ret")) == (json_int_t)ring_size) {
+            client->shm = shm;
+            ret = 0;
+        }
+        json_decref (object);
+        g_free (buf);
+    }
+    pthread_mutex_unlock (&client->write_lock);
+
+    if (ret < 0)
+        searpc_shm_channel_free (shm);
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+static int
+send_frame (SearpcNamedPipeClient *client, guint8 flags, guint16 service_len,
+            const char *prefix, gsize prefix_len,
+            const char *body, gsize body_len, guint32 req_id,
+            const int *fds, int n_fds)
+{
+    SearpcFrameHeader hdr;
+
+    hdr.version = client->frame_version;
+    hdr.flags = flags;
+    hdr.service_len = service_len;
+    hdr.req_id = req_id;
+
+    if (write_frames (client->pipe_fd, client->shm, client->frame_version, &hdr,
+                      prefix, prefix_len, body, body_len, fds, n_fds) < 0) {
+        g_warning("failed to send rpc call: %s\n", strerror(errno));
+        return -1;
+    }
 
-        char *service, *body;
-        if (request_from_json (buf, len, &service, &body) < 0) {
-            break;
-        }
+    return 0;
+}
 
-        gsize ret_len;
-        char *ret_str = searpc_server_call_function (service, body, strlen(body), &ret_len);
-        g_free (service);
-        g_free (body);
+static int
+send_request_with_id (SearpcNamedPipeClient *client, const char *service,
+                      const char *fcall_str, size_t fcall_len, guint8 flags,
+                      guint32 req_id, const int *fds, int n_fds)
+{
+    size_t service_len = strlen(service);
 
-        len = (guint32)ret_len;
-        if (pipe_write_n(connfd, &len, sizeof(guint32)) < 0) {
-            g_warning("failed to send rpc response(%s): %s\n", ret_str, strerror(errno));
-            g_free (ret_str);
-            break;
+    if (client->frame_version == 0) {
+        if (n_fds > 0) {
+            g_warning("rpc connection can't pass file descriptors\n");
+            return -1;
+        }
+        if (memchr(fcall_str, '\0', fcall_len)) {
+            g_warning("rpc connection can't pass bytes values\n");
+            return -1;
         }
 
-        if (pipe_write_n(connfd, ret_str, ret_len) < 0) {
-            g_warning("failed to send rpc response: %s\n", strerror(errno));
-            g_free (ret_str);
-            break;
+        char *json_str = request_to_json(service, fcall_str, fcall_len);
+        size_t json_len = strlen(json_str);
+        guint32 len = (guint32)json_len;
+
+        if (json_len > G_MAXUINT32) {
+            g_warning("rpc call of %" G_GSIZE_FORMAT " bytes is too long\n", json_len);
+            free (json_str);
+            return -1;
+        }
+        if (pipe_write_n(client->pipe_fd, &len, sizeof(guint32)) < 0 ||
+            pipe_write_n(client->pipe_fd, json_str, len) < 0) {
+            g_warning("failed to send rpc call: %s\n", strerror(errno));
+            free (json_str);
+            return -1;
         }
+        free (json_str);
+        return 0;
+    }
 
-        g_free (ret_str);
+    if (service_len > SEARPC_MAX_SERVICE_LEN) {
+        g_warning("service name %s is too long\n", service);
+        return -1;
     }
 
-#if !defined(WIN32)
-    close(connfd);
-#else // !defined(WIN32)
-    DisconnectNamedPipe(connfd);
-    CloseHandle(connfd);
-#endif // !defined(WIN32)
-    g_free (data);
-    g_free (buf);
+    return send_frame (client, flags, (guint16)service_len, service, service_len,
+                       fcall_str, fcall_len, req_id, fds, n_fds);
 }
 
-int searpc_named_pipe_client_connect(SearpcNamedPipeClient *client)
+// Send a call for the service of @data. If the ids of the service and the
+// function are known, the request names them by id.
+static int
+send_call (ClientTransportData *data, const char *fcall_str, size_t fcall_len,
+           guint8 flags, guint32 req_id, const int *fds, int n_fds)
 {
-#if !defined(WIN32)
-    client->pipe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    struct sockaddr_un servaddr;
-    servaddr.sun_family = AF_UNIX;
+    char fname[SEARPC_MAX_FUNC_NAME_LEN + 1];
+    char prefix[16];
+    const char *name, *end = NULL;
+    gpointer id = NULL;
+    int prefix_len;
+
+    // Calls start with ["<function name>".
+    if (data->func_ids && fcall_len > 2 && fcall_str[0] == '[' && fcall_str[1] == '"') {
+        name = fcall_str + 2;
+        end = memchr (name, '"', fcall_len - 2);
+        if (end && end - name <= SEARPC_MAX_FUNC_NAME_LEN &&
+            !memchr (name, '\\', end - name)) {
+            memcpy (fname, name, end - name);
+            fname[end - name] = '\0';
+            id = g_hash_table_lookup (data->func_ids, fname);
+        }
+    }
+    if (!id) {
+        return send_request_with_id (data->client, data->service,
+                                     fcall_str, fcall_len, flags, req_id,
+                                     fds, n_fds);
+    }
 
-    g_strlcpy (servaddr.sun_path, client->path, sizeof(servaddr.sun_path));
-    if (connect(client->pipe_fd, (struct sockaddr *)&servaddr, (socklen_t)sizeof(servaddr)) < 0) {
-        g_warning ("pipe client failed to connect to server: %s\n", strerror(errno));
-        close(client->pipe_fd);
+    prefix_len = snprintf (prefix, sizeof(prefix), "[%d", GPOINTER_TO_INT(id) - 1);
+    end++;
+    return send_frame (data->client, flags | FRAME_FLAG_SERVICE_ID, (guint16)data->service_id,
+                       prefix, prefix_len, end, fcall_str + fcall_len - end, req_id,
+                       fds, n_fds);
+}
+
+int
+searpc_named_pipe_client_send_request (SearpcNamedPipeClient *client,
+                                       const char *service,
+                                       const char *fcall_str, size_t fcall_len,
+                                       guint32 *req_id)
+{
+    guint32 id = next_req_id (client);
+
+    if (send_request_with_id (client, service, fcall_str, fcall_len, 0, id, NULL, 0) < 0)
         return -1;
-    }
 
-#else // !defined(WIN32)
-    SearpcNamedPipe pipe_fd;
+    if (req_id)
+        *req_id = id;
+    return 0;
+}
 
-    for (;;) {
-        pipe_fd = CreateFile(
-            client->path,           // pipe name
-            GENERIC_READ |          // read and write access
-            GENERIC_WRITE,
-            0,                      // no sharing
-            NULL,                   // default security attributes
-            OPEN_EXISTING,          // opens existing pipe
-            0,                      // default attributes
-            NULL);                  // no template file
+// Read from the server, keeping the descriptors passed with the data.
+static gssize
+client_read_n (SearpcNamedPipeClient *client, void *buf, size_t n,
+               int *fds, int *n_fds)
+{
+    if (client->shm)
+        return searpc_shm_channel_read_n (client->shm, buf, n);
+#if !defined(WIN32)
+    return recv_n (client->pipe_fd, buf, n, fds, n_fds);
+#else
+    return pipe_read_n (client->pipe_fd, buf, n);
+#endif
+}
 
-        if (pipe_fd != INVALID_HANDLE_VALUE) {
-            break;
+// Read a response frame, and its flags into @flags. The descriptors passed
+// with it are stored in @fds, which has room for SEARPC_MAX_REQUEST_FDS,
+// and owned by the caller.
+static char *
+read_response_frame (SearpcNamedPipeClient *client, guint32 *req_id,
+                     guint8 *flags, size_t *ret_len, int *fds, int *n_fds)
+{
+    SearpcFrameHeader hdr;
+    gsize hdr_size = FRAME_HEADER_SIZE(client->frame_version);
+    guint32 len;
+    guint32 id;
+    gsize total = 0;
+    char *buf = NULL;
+
+    *flags = 0;
+    *n_fds = 0;
+
+    if (client->frame_version == 0) {
+        if (client_read_n(client, &len, sizeof(guint32), fds, n_fds) < (gssize)sizeof(guint32)) {
+            g_warning("failed to read rpc response: %s\n", strerror(errno));
+            return NULL;
+        }
+        id = ++client->last_resp_id;
+    } else {
+        if (client_read_n(client, &hdr, hdr_size, fds, n_fds) < (gssize)hdr_size) {
+            g_warning("failed to read rpc response: %s\n", strerror(errno));
+            return NULL;
+        }
+#if !defined(WIN32)
+        if (client->shm && (hdr.flags & FRAME_FLAG_FDS) &&
+            recv_fds_with_byte (client->pipe_fd, fds, n_fds) < 0) {
+            g_warning("failed to read rpc response descriptors: %s\n", strerror(errno));
+            return NULL;
         }
+#endif
 
-        /* wait with default timeout (approx. 50ms) */
-        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipe(client->path, NMPWAIT_USE_DEFAULT_WAIT)) {
-            G_WARNING_WITH_LAST_ERROR("Failed to connect to named pipe");
-            return -1;
+        if (hdr.version != client->frame_version || hdr.service_len != 0 ||
+            hdr.len < FRAME_HEADER_REST(client->frame_version)) {
+            g_warning("invalid rpc response frame\n");
+            return NULL;
         }
+
+        len = hdr.len - FRAME_HEADER_REST(client->frame_version);
+        id = client->frame_version >= 2 ? hdr.req_id : ++client->last_resp_id;
+        *flags = hdr.flags;
     }
 
-    DWORD mode = PIPE_READMODE_MESSAGE;
-    if (!SetNamedPipeHandleState(pipe_fd, &mode, NULL, NULL)) {
-        G_WARNING_WITH_LAST_ERROR("Failed to set named pipe mode");
-        CloseHandle (pipe_fd);
-        return -1;
+    while (1) {
+        if (!message_size_is_valid (total + len, client->max_message_size)) {
+            // Shut the connection down, so that later reads fail instead
+            // of taking the rest of this response for a new one.
+#if !defined(WIN32)
+            shutdown (client->pipe_fd, SHUT_RDWR);
+#endif
+            g_free (buf);
+            return NULL;
+        }
+        // The buffer grows with the frames read, not the whole response at once.
+        buf = g_realloc (buf, total + len);
+        if (client_read_n(client, buf + total, len, fds, n_fds) < len) {
+            g_warning("failed to read rpc response: %s\n", strerror(errno));
+            g_free (buf);
+            return NULL;
+        }
+        total += len;
+        if (client->frame_version == 0 ||
+            !FRAME_IS_CONTINUED(client->frame_version, &hdr))
+            break;
+
+        SearpcFrameHeader first = hdr;
+        if (client_read_n(client, &hdr, hdr_size, fds, n_fds) < (gssize)hdr_size) {
+            g_warning("failed to read rpc response: %s\n", strerror(errno));
+            g_free (buf);
+            return NULL;
+        }
+        if (!continuation_is_valid (client->frame_version, &first, &hdr)) {
+            g_free (buf);
+            return NULL;
+        }
+        len = hdr.len - FRAME_HEADER_REST(client->frame_version);
     }
 
-    client->pipe_fd = pipe_fd;
+    if (req_id)
+        *req_id = id;
+    *ret_len = total;
+    return buf;
+}
 
-#endif // !defined(WIN32)
+char *
+searpc_named_pipe_client_read_response (SearpcNamedPipeClient *client,
+                                        guint32 *req_id, size_t *ret_len)
+{
+    guint8 flags;
+    int fds[SEARPC_MAX_REQUEST_FDS];
+    int n_fds;
+    char *buf;
 
-    /* g_debug ("pipe client connected to server\n"); */
-    return 0;
+    buf = read_response_frame (client, req_id, &flags, ret_len, fds, &n_fds);
+    close_fds (fds, &n_fds);
+    return buf;
 }
 
-void searpc_free_client_with_pipe_transport (SearpcClient *client)
+typedef struct {
+    char *buf;
+    size_t len;
+} ResponseChunk;
+
+// A call waiting for its response on a shared connection.
+typedef struct _PendingCall {
+    SearpcNamedPipeClient *client;
+    gboolean done;
+    char *buf;
+    size_t len;
+    // Parts of a streamed response not yet passed on, NULL unless the call
+    // accepts them, and their size.
+    GQueue *chunks;
+    size_t queued;
+    // Calls made by the chunk callback of this call and not answered yet.
+    int nested;
+    // Descriptors passed with the response.
+    int fds[SEARPC_MAX_REQUEST_FDS];
+    int n_fds;
+} PendingCall;
+
+// The streamed call whose chunk callback runs in this thread.
+static GPrivate running_stream;
+
+// The reading thread stops once this many bytes of a stream wait for
+// their caller, so that a slow caller slows the server down instead of
+// filling the memory of the client. It goes on if the caller waits for a
+// call of its own, which may be answered after more parts of the stream.
+#define SEARPC_MAX_PENDING_CHUNK_BYTES SEARPC_MAX_QUEUED_CHUNK_BYTES
+
+// Whether the caller of @call has something to handle.
+static gboolean
+call_is_ready (PendingCall *call)
 {
-    ClientTransportData *data = (ClientTransportData *)(client->arg);
-    SearpcNamedPipeClient *pipe_client = data->client;
-#if defined(WIN32)
-    CloseHandle(pipe_client->pipe_fd);
-#else
-    close(pipe_client->pipe_fd);
-#endif
-    g_free (pipe_client);
-    g_free (data->service);
-    g_free (data);
-    searpc_client_free (client);
+    return call->done || (call->chunks && !g_queue_is_empty (call->chunks));
 }
 
-char *searpc_named_pipe_send(void *arg, const gchar *fcall_str,
-                             size_t fcall_len, size_t *ret_len)
+// Complete all waiting calls with an error. Called with the client locked.
+static void
+fail_pending_calls (SearpcNamedPipeClient *client)
 {
-    /* g_debug ("searpc_named_pipe_send is called\n"); */
-    ClientTransportData *data = arg;
-    SearpcNamedPipeClient *client = data->client;
+    GHashTableIter iter;
+    gpointer value;
 
-    char *json_str = request_to_json(data->service, fcall_str, fcall_len);
-    guint32 len = (guint32)strlen(json_str);
+    client->broken = TRUE;
 
-    if (pipe_write_n(client->pipe_fd, &len, sizeof(guint32)) < 0) {
-        g_warning("failed to send rpc call: %s\n", strerror(errno));
-        free (json_str);
-        return NULL;
+    g_hash_table_iter_init (&iter, client->pending);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        PendingCall *call = value;
+        call->done = TRUE;
     }
+    g_hash_table_remove_all (client->pending);
+    pthread_cond_broadcast (&client->cond);
+}
 
-    if (pipe_write_n(client->pipe_fd, json_str, len) < 0) {
-        g_warning("failed to send rpc call: %s\n", strerror(errno));
-        free (json_str);
-        return NULL;
+// Wait for the response to @call, or for a part of it. One of the waiting
+// threads reads responses from the connection and hands them to their
+// callers, until something for its own call arrives. Then another waiting
+// thread takes over. Called with the client locked.
+static void
+wait_for_response (SearpcNamedPipeClient *client, PendingCall *call)
+{
+    while (!call_is_ready (call)) {
+        if (client->reading) {
+            pthread_cond_wait (&client->cond, &client->lock);
+            continue;
+        }
+
+        client->reading = TRUE;
+        while (!call_is_ready (call)) {
+            guint32 resp_id;
+            guint8 flags;
+            size_t len;
+            char *buf;
+            int fds[SEARPC_MAX_REQUEST_FDS];
+            int n_fds;
+            PendingCall *waiting;
+
+            pthread_mutex_unlock (&client->lock);
+            buf = read_response_frame (client, &resp_id, &flags, &len, fds, &n_fds);
+            pthread_mutex_lock (&client->lock);
+
+            if (!buf) {
+                close_fds (fds, &n_fds);
+                fail_pending_calls (client);
+                break;
+            }
+
+            waiting = g_hash_table_lookup (client->pending, GUINT_TO_POINTER(resp_id));
+            if (!waiting) {
+                g_warning("unexpected rpc response %u\n", resp_id);
+                close_fds (fds, &n_fds);
+                g_free (buf);
+                continue;
+            }
+            if (flags & FRAME_FLAG_CHUNKS) {
+                ResponseChunk *chunk;
+
+                // Only the last part of a response carries descriptors.
+                close_fds (fds, &n_fds);
+                if (!waiting->chunks) {
+                    g_warning("unexpected partial rpc response %u\n", resp_id);
+                    g_free (buf);
+                    continue;
+                }
+                chunk = g_new0 (ResponseChunk, 1);
+                chunk->buf = buf;
+                chunk->len = len;
+                g_queue_push_tail (waiting->chunks, chunk);
+                waiting->queued += len;
+                if (waiting != call) {
+                    pthread_cond_broadcast (&client->cond);
+                    // The call stays pending until its last part is read,
+                    // unless the connection fails.
+                    while (waiting->queued >= SEARPC_MAX_PENDING_CHUNK_BYTES &&
+                           waiting->nested == 0 && !client->broken &&
+                           g_hash_table_lookup (client->pending,
+                                                GUINT_TO_POINTER(resp_id)) == waiting)
+                        pthread_cond_wait (&client->cond, &client->lock);
+                    continue;
+                }
+            } else {
+                g_hash_table_remove (client->pending, GUINT_TO_POINTER(resp_id));
+                waiting->buf = buf;
+                waiting->len = len;
+                memcpy (waiting->fds, fds, n_fds * sizeof(int));
+                waiting->n_fds = n_fds;
+                waiting->done = TRUE;
+            }
+            if (waiting != call)
+                pthread_cond_broadcast (&client->cond);
+        }
+        client->reading = FALSE;
+        // Let another waiting thread read the responses.
+        pthread_cond_broadcast (&client->cond);
     }
+}
+
+// Calls from different threads may share a named pipe client. Requests are
+// written one at a time. With frame version 2 several calls wait for their
+// responses at once, otherwise each call keeps the connection until its
+// response is read. If @chunk_func is set and the connection uses frame
+// version 2, the parts of a streamed response are passed to it as they
+// arrive, outside the lock so that it may make calls itself. @fds are sent
+// with the request, and the descriptors passed with the response are
+// stored in @ret_fds if it's set, closed otherwise.
+static char *
+named_pipe_call (ClientTransportData *data, const gchar *fcall_str,
+                 size_t fcall_len, size_t *ret_len,
+                 SearpcResponseChunkFunc chunk_func, void *user_data,
+                 const int *fds, int n_fds, int *ret_fds, int *n_ret_fds)
+{
+    SearpcNamedPipeClient *client = data->client;
+    PendingCall call = { client, FALSE, NULL, 0, NULL };
+    PendingCall *outer;
+    ResponseChunk *chunk;
+    guint32 req_id;
+    int ret;
+
+    if (client->frame_version < 2) {
+        guint32 resp_id;
+        guint8 flags;
+        char *buf = NULL;
+
+        pthread_mutex_lock (&client->write_lock);
+        req_id = next_req_id (client);
+        if (send_call (data, fcall_str, fcall_len, 0, req_id, fds, n_fds) == 0) {
+            buf = read_response_frame (client, &resp_id, &flags, ret_len,
+                                       call.fds, &call.n_fds);
+        }
+        pthread_mutex_unlock (&client->write_lock);
 
-    free (json_str);
+        call.buf = buf;
+        goto out;
+    }
 
-    if (pipe_read_n(client->pipe_fd, &len, sizeof(guint32)) < 0) {
-        g_warning("failed to read rpc response: %s\n", strerror(errno));
+    // The call is registered before the request is written, since the
+    // response may be read by another thread right after.
+    pthread_mutex_lock (&client->lock);
+    if (client->broken) {
+        pthread_mutex_unlock (&client->lock);
+        g_warning("rpc connection is broken\n");
         return NULL;
     }
+    req_id = next_req_id (client);
+    if (chunk_func)
+        call.chunks = g_queue_new ();
+    g_hash_table_insert (client->pending, GUINT_TO_POINTER(req_id), &call);
+    // The response to a call made by the chunk callback of a stream may
+    // come after more parts of the stream.
+    outer = g_private_get (&running_stream);
+    if (outer && outer->client == client) {
+        outer->nested++;
+        pthread_cond_broadcast (&client->cond);
+    }
+    pthread_mutex_unlock (&client->lock);
 
-    char *buf = g_malloc(len);
+    pthread_mutex_lock (&client->write_lock);
+    ret = send_call (data, fcall_str, fcall_len,
+                     chunk_func ? FRAME_FLAG_CHUNKS : 0, req_id, fds, n_fds);
+    pthread_mutex_unlock (&client->write_lock);
 
-    if (pipe_read_n(client->pipe_fd, buf, len) < 0) {
-        g_warning("failed to read rpc response: %s\n", strerror(errno));
-        g_free (buf);
-        return NULL;
+    pthread_mutex_lock (&client->lock);
+    if (ret < 0) {
+        // A partly written request leaves the stream unusable.
+        fail_pending_calls (client);
     }
+    while (1) {
+        wait_for_response (client, &call);
+        if (!call.chunks || g_queue_is_empty (call.chunks))
+            break;
 
-    *ret_len = len;
-    return buf;
+        chunk = g_queue_pop_head (call.chunks);
+        call.queued -= chunk->len;
+        // Let the reading thread go on if it waits for room in the queue.
+        pthread_cond_broadcast (&client->cond);
+        pthread_mutex_unlock (&client->lock);
+        g_private_set (&running_stream, &call);
+        chunk_func (chunk->buf, chunk->len, user_data);
+        g_private_set (&running_stream, outer);
+        g_free (chunk->buf);
+        g_free (chunk);
+        pthread_mutex_lock (&client->lock);
+    }
+    if (outer && outer->client == client)
+        outer->nested--;
+    pthread_mutex_unlock (&client->lock);
+
+    if (call.chunks)
+        g_queue_free (call.chunks);
+    *ret_len = call.len;
+
+out:
+    if (ret_fds) {
+        memcpy (ret_fds, call.fds, call.n_fds * sizeof(int));
+        *n_ret_fds = call.n_fds;
+    } else {
+        close_fds (call.fds, &call.n_fds);
+    }
+    return call.buf;
+}
+
+char *searpc_named_pipe_send(void *arg, const gchar *fcall_str,
+                             size_t fcall_len, size_t *ret_len)
+{
+    return named_pipe_call (arg, fcall_str, fcall_len, ret_len, NULL, NULL,
+                            NULL, 0, NULL, NULL);
+}
+
+#if !defined(WIN32)
+static char *
+searpc_named_pipe_send_fds (void *arg, const gchar *fcall_str, size_t fcall_len,
+                            const int *fds, int n_fds, size_t *ret_len,
+                            int *ret_fds, int *n_ret_fds)
+{
+    return named_pipe_call (arg, fcall_str, fcall_len, ret_len, NULL, NULL,
+                            fds, n_fds, ret_fds, n_ret_fds);
+}
+#endif
+
+static char *
+searpc_named_pipe_send_chunked (void *arg, const gchar *fcall_str,
+                                size_t fcall_len, size_t *ret_len,
+                                SearpcResponseChunkFunc chunk_func,
+                                void *user_data)
+{
+    return named_pipe_call (arg, fcall_str, fcall_len, ret_len,
+                            chunk_func, user_data, NULL, 0, NULL, NULL);
 }
 
 static char *
@@ -744,6 +3022,233 @@ pipe_write_n(int fd, const void *vptr, size_t n)
     return(n);
 }
 
+// Attach @fds to @msg, using @control for the ancillary data.
+void
+set_fds_control(struct msghdr *msg, FdControl *control, const int *fds, int n_fds)
+{
+    struct cmsghdr *cmsg;
+
+    if (n_fds <= 0)
+        return;
+    memset (control, 0, sizeof(*control));
+    msg->msg_control = control->buf;
+    msg->msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy (CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+}
+
+// Write a frame header followed by @prefix, the service name or the start
+// of the body, and the body, using a single sendmsg() call when the socket
+// accepts everything at once. @fds are passed along with the first bytes.
+gssize
+pipe_write_frame_with_fds(int fd, const SearpcFrameHeader *hdr, gsize hdr_size,
+                          const char *prefix, gsize prefix_len,
+                          const char *body, size_t body_len,
+                          const int *fds, int n_fds)
+{
+    struct iovec iov[3];
+    struct iovec *vec = iov;
+    struct msghdr msg;
+    FdControl control;
+    int cnt = 0;
+    size_t total = hdr_size + prefix_len + body_len;
+    size_t left = total;
+    gssize nwritten;
+
+    iov[cnt].iov_base = (void *)hdr;
+    iov[cnt++].iov_len = hdr_size;
+    if (prefix_len > 0) {
+        iov[cnt].iov_base = (void *)prefix;
+        iov[cnt++].iov_len = prefix_len;
+    }
+    if (body_len > 0) {
+        iov[cnt].iov_base = (void *)body;
+        iov[cnt++].iov_len = body_len;
+    }
+
+    while (left > 0) {
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = cnt;
+        set_fds_control (&msg, &control, fds, n_fds);
+        if ( (nwritten = sendmsg(fd, &msg, 0)) <= 0) {
+            if (nwritten < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        n_fds = 0;
+
+        left -= nwritten;
+        while (cnt > 0 && (size_t)nwritten >= vec->iov_len) {
+            nwritten -= vec->iov_len;
+            vec++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            vec->iov_base = (char *)vec->iov_base + nwritten;
+            vec->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+
+gssize
+pipe_write_frame(int fd, const SearpcFrameHeader *hdr, gsize hdr_size,
+                 const char *prefix, gsize prefix_len,
+                 const char *body, size_t body_len)
+{
+    return pipe_write_frame_with_fds (fd, hdr, hdr_size, prefix, prefix_len,
+                                      body, body_len, NULL, 0);
+}
+
+// Read up to "n" bytes from a socket, and append the descriptors passed
+// with them to @fds. Descriptors beyond SEARPC_MAX_REQUEST_FDS are closed.
+gssize
+recv_with_fds(int fd, void *buf, size_t n, int *fds, int *n_fds)
+{
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    FdControl control;
+    gssize nread;
+    int flags = 0;
+    int received[SEARPC_MAX_REQUEST_FDS];
+    int i, count;
+
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    iov.iov_base = buf;
+    iov.iov_len = n;
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        nread = recvmsg (fd, &msg, flags);
+    } while (nread < 0 && errno == EINTR);
+    if (nread < 0)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        count = MIN(count, SEARPC_MAX_REQUEST_FDS);
+        memcpy (received, CMSG_DATA(cmsg), sizeof(int) * count);
+        for (i = 0; i < count; i++) {
+            if (*n_fds < SEARPC_MAX_REQUEST_FDS)
+                fds[(*n_fds)++] = received[i];
+            else
+                close (received[i]);
+        }
+    }
+
+    return nread;
+}
+
+// Read "n" bytes from a socket like pipe_read_n(), keeping the descriptors
+// passed with them.
+gssize
+recv_n(int fd, void *vptr, size_t n, int *fds, int *n_fds)
+{
+    size_t  nleft = n;
+    gssize nread;
+    char    *ptr = vptr;
+
+    while (nleft > 0) {
+        if ( (nread = recv_with_fds(fd, ptr, nleft, fds, n_fds)) < 0)
+            return -1;
+        if (nread == 0)
+            break;              /* EOF */
+
+        nleft -= nread;
+        ptr   += nread;
+    }
+    return(n - nleft);
+}
+
+// The byte with the descriptors of a request is sent before its frame is
+// written to the ring, so the epoll listener normally finds it right away.
+// It doesn't wait longer than this for it.
+#define FDS_BYTE_TIMEOUT_MS 1000
+
+// Wait until the socket @fd, which is non-blocking in epoll mode, is ready
+// for @events. Returns -1 on timeout or errors.
+static int
+wait_socket (int fd, short events, int timeout_ms)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        ret = poll (&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0)
+        errno = ETIMEDOUT;
+    return ret > 0 ? 0 : -1;
+}
+
+// Pass @fds on a connection whose frames go through shared memory, along
+// with a single byte.
+int
+send_fds_with_byte(int fd, const int *fds, int n_fds)
+{
+    char byte = 0;
+    struct iovec iov;
+    struct msghdr msg;
+    FdControl control;
+    gssize n;
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    set_fds_control (&msg, &control, fds, n_fds);
+
+    while (1) {
+        n = sendmsg (fd, &msg, flags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            wait_socket (fd, POLLOUT, -1) == 0)
+            continue;
+        break;
+    }
+    return n == 1 ? 0 : -1;
+}
+
+int
+recv_fds_with_byte(int fd, int *fds, int *n_fds)
+{
+    char byte;
+    gssize n;
+
+    while (1) {
+        n = recv_with_fds (fd, &byte, 1, fds, n_fds);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            wait_socket (fd, POLLIN, FDS_BYTE_TIMEOUT_MS) == 0)
+            continue;
+        break;
+    }
+
+    if (n == 0)
+        errno = ECONNRESET;
+    return n == 1 ? 0 : -1;
+}
+
 // Read "n" bytes from a descriptor.
 gssize
 pipe_read_n(int fd, void *vptr, size_t n)
@@ -811,6 +3316,32 @@ gssize pipe_write_n(SearpcNamedPipe fd, const void *vptr, size_t n)
     return 0;
 }
 
+// Message mode pipes need the reader to mirror the writes, so the header,
+// service name and body are written as separate messages. A prefix that
+// starts the body is joined with it.
+gssize pipe_write_frame(SearpcNamedPipe fd, const SearpcFrameHeader *hdr, gsize hdr_size,
+                        const char *prefix, gsize prefix_len,
+                        const char *body, size_t body_len)
+{
+    if (pipe_write_n(fd, hdr, hdr_size) < 0)
+        return -1;
+    if (hdr->flags & FRAME_FLAG_SERVICE_ID) {
+        char *joined = g_malloc (prefix_len + body_len);
+        gssize ret;
+
+        memcpy (joined, prefix, prefix_len);
+        memcpy (joined + prefix_len, body, body_len);
+        ret = pipe_write_n(fd, joined, prefix_len + body_len);
+        g_free (joined);
+        return ret < 0 ? -1 : 0;
+    }
+    if (prefix_len > 0 && pipe_write_n(fd, prefix, prefix_len) < 0)
+        return -1;
+    if (body_len > 0 && pipe_write_n(fd, body, body_len) < 0)
+        return -1;
+    return 0;
+}
+
 // http://stackoverflow.com/questions/3006229/get-a-text-from-the-error-code-returns-from-the-getlasterror-function
 // The caller is responsible to free the returned message.
 char* formatErrorMessage()
@@ -24,10 +24,16 @@ extern "C" {
 // sockets on linux/osx, and named pipes on windows.
 //
 // On the server side, there is a thread that listens for incoming connections,
-// and it would create a new thread to handle each connection. Thus the RPC
+// and it would create a new thread to handle each connection, or hand it to a
+// pool of worker threads, until the server is freed. Thus the RPC
 // functions on the server side may be called from different threads, and it's
 // the RPC functions implementation's responsibility to guarantee thread safety
 // of the RPC calls. (e.g. using mutexes).
+//
+// On the client side, a SearpcClient created with
+// searpc_client_with_named_pipe_transport() may be called from several
+// threads at once. If the server supports request ids, their calls are
+// multiplexed on the connection, otherwise they take turns.
 
 #if defined(WIN32)
 typedef HANDLE SearpcNamedPipe;
@@ -37,14 +43,39 @@ typedef int SearpcNamedPipe;
 
 // Server side interface.
 
+struct _SearpcScheduler;
+
+// Default limit on the size of a request or a response, which may be
+// split in several frames. Connections receiving a longer one are closed.
+#define SEARPC_DEFAULT_MAX_MESSAGE_SIZE ((gsize)1 << 30)
+
 struct _SearpcNamedPipeServer {
     char path[4096];
     pthread_t listener_thread;
     SearpcNamedPipe pipe_fd;
     gboolean use_epoll;
     int epoll_fd;
+    // Deprecated and unused, requests run on the scheduler's workers.
     GThreadPool *named_pipe_server_thread_pool;
+    // Number of workers.
     int pool_size;
+    struct _SearpcScheduler *scheduler;
+    // How long a connection using shared memory spins before sleeping
+    // while it waits for the client, in microseconds. In epoll mode the
+    // listener reads requests without waiting, and only workers writing
+    // to a full ring spin.
+    int shm_spin_us;
+    // Largest request read, in bytes, or 0 for no limit. Defaults to
+    // SEARPC_DEFAULT_MAX_MESSAGE_SIZE.
+    gsize max_message_size;
+
+    // Open connections, so that they can be closed when the server is
+    // freed. Protected by the lock.
+    pthread_mutex_t lock;
+    pthread_cond_t conns_cond;
+    GHashTable *connections;
+    gboolean started;
+    gboolean stopping;
 };
 
 typedef struct _SearpcNamedPipeServer LIBSEARPC_API SearpcNamedPipeServer;
@@ -55,14 +86,52 @@ SearpcNamedPipeServer* searpc_create_named_pipe_server(const char *path);
 LIBSEARPC_API
 SearpcNamedPipeServer* searpc_create_named_pipe_server_with_threadpool(const char *path, int named_pipe_server_thread_pool_size);
 
+// Run the connections (or, in epoll mode, the requests) on @n_workers
+// threads. Each worker has its own queue and idle workers steal from busy
+// ones. If @n_workers is not positive, one worker is started per CPU core.
+// With @pin_workers each worker is bound to a core (only on Linux).
+// Returns NULL if the workers can't be started.
+LIBSEARPC_API
+SearpcNamedPipeServer* searpc_create_named_pipe_server_with_scheduler(const char *path, int n_workers, gboolean pin_workers);
+
 LIBSEARPC_API
 int searpc_named_pipe_server_start(SearpcNamedPipeServer *server);
 
+// Stop accepting connections, close the open ones and wait for the
+// requests they are running, then stop the workers and free @server.
+LIBSEARPC_API
+void searpc_free_named_pipe_server(SearpcNamedPipeServer *server);
+
 // Client side interface.
 
 struct _SearpcNamedPipeClient {
     char path[4096];
     SearpcNamedPipe pipe_fd;
+    // Binary frame version negotiated on connect, 0 for the legacy protocol.
+    int frame_version;
+    // Largest response read, in bytes, or 0 for no limit. Defaults to
+    // SEARPC_DEFAULT_MAX_MESSAGE_SIZE.
+    gsize max_message_size;
+    // Whether the server can run batches, -1 until it's asked.
+    int batch;
+    // Id of the last request sent, and of the last response read when
+    // responses come in request order.
+    guint32 last_req_id;
+    guint32 last_resp_id;
+
+    // The client may be shared by several threads. The lock protects the
+    // fields below, and the write lock keeps requests from interleaving.
+    pthread_mutex_t lock;
+    pthread_mutex_t write_lock;
+    pthread_cond_t cond;
+    // Calls waiting for their responses, by request id.
+    GHashTable *pending;
+    // TRUE while a thread reads responses for the waiting calls.
+    gboolean reading;
+    // Set when the connection fails; later calls fail right away.
+    gboolean broken;
+    // Set by searpc_named_pipe_client_enable_shm().
+    struct _SearpcShmChannel *shm;
 };
 
 typedef struct _SearpcNamedPipeClient LIBSEARPC_API SearpcNamedPipeClient;
@@ -76,9 +145,50 @@ SearpcClient * searpc_client_with_named_pipe_transport(SearpcNamedPipeClient *cl
 LIBSEARPC_API
 int searpc_named_pipe_client_connect(SearpcNamedPipeClient *client);
 
+// Close the connection of @client and free it. Clients used by a
+// SearpcClient are freed with searpc_free_client_with_pipe_transport().
+LIBSEARPC_API
+void searpc_named_pipe_client_free (SearpcNamedPipeClient *client);
+
 LIBSEARPC_API
 void searpc_free_client_with_pipe_transport (SearpcClient *client);
 
+// Ask the server for the ids of the service of @client and its functions,
+// so that later calls send ids instead of names. Functions registered after
+// this are still called by name. It must be called before @client is used
+// from several threads. Returns -1 if the server doesn't support it, and
+// calls keep using names.
+LIBSEARPC_API
+int searpc_client_load_pipe_function_ids (SearpcClient *client);
+
+// Move the connection of @client to a pair of rings of @ring_size bytes in
+// shared memory, a power of two or 0 for the default of 1MB. Requests and
+// responses then skip the socket. While waiting, the client spins for
+// @spin_us microseconds before sleeping. It must be called right after
+// connecting, before @client is used from several threads. Returns -1 if
+// the server or the platform doesn't support it (only Linux does), or if
+// requests sent before are still running, and calls keep using the socket.
+LIBSEARPC_API
+int searpc_named_pipe_client_enable_shm (SearpcNamedPipeClient *client,
+                                         gsize ring_size, int spin_us);
+
+// Lower level interface to keep several requests in flight on one
+// connection. It must not be mixed with calls through a SearpcClient on the
+// same connection. The request id assigned to a request is stored in @req_id.
+// Returns 0 on success.
+LIBSEARPC_API
+int searpc_named_pipe_client_send_request (SearpcNamedPipeClient *client,
+                                           const char *service,
+                                           const char *fcall_str, size_t fcall_len,
+                                           guint32 *req_id);
+
+// Read the next response, and store the id of the request it answers in
+// @req_id. If the server supports frame version 2, responses may arrive in
+// a different order than the requests. Returns NULL on errors.
+LIBSEARPC_API
+char *searpc_named_pipe_client_read_response (SearpcNamedPipeClient *client,
+                                              guint32 *req_id, size_t *ret_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,362 @@
+#include <string.h>
+
+#include <glib.h>
+
+#include "searpc-param-reader.h"
+
+typedef struct {
+    char *p;
+    char *end;
+} Scanner;
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static void
+skip_space (Scanner *s)
+{
+    while (s->p < s->end && IS_SPACE (*s->p))
+        s->p++;
+}
+
+static gboolean
+read_hex4 (const char *p, gunichar *ret)
+{
+    gunichar c = 0;
+    int i, v;
+
+    for (i = 0; i < 4; i++) {
+        v = g_ascii_xdigit_value (p[i]);
+        if (v < 0)
+            return FALSE;
+        c = (c << 4) | v;
+    }
+    *ret = c;
+    return TRUE;
+}
+
+// Check the escape at @p, and return the position after it, or NULL if
+// jansson would reject it.
+static const char *
+check_escape (const char *p, const char *end)
+{
+    gunichar c, low;
+
+    if (end - p < 2)
+        return NULL;
+    if (p[1] != '\0' && strchr ("\"\\/bfnrt", p[1]))
+        return p + 2;
+    if (p[1] != 'u' || end - p < 6 || !read_hex4 (p + 2, &c))
+        return NULL;
+    p += 6;
+
+    if (c == 0 || (c >= 0xDC00 && c <= 0xDFFF))
+        return NULL;
+    if (c >= 0xD800 && c <= 0xDBFF) {
+        if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !read_hex4 (p + 2, &low) ||
+            low < 0xDC00 || low > 0xDFFF)
+            return NULL;
+        p += 6;
+    }
+    return p;
+}
+
+// Unescape the string between @start and @end, which was checked by
+// read_string(). Escapes are never shorter than what they stand for.
+static char *
+unescape (const char *start, const char *end)
+{
+    char *ret = g_malloc (end - start + 1);
+    char *out = ret;
+    const char *p = start;
+    gunichar c, low;
+
+    while (p < end) {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        switch (p[1]) {
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+            read_hex4 (p + 2, &c);
+            if (c >= 0xD800 && c <= 0xDBFF) {
+                read_hex4 (p + 8, &low);
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            }
+            out += g_unichar_to_utf8 (c, out);
+            p += 4;
+            break;
+        default: *out++ = p[1]; break;
+        }
+        p += 2;
+    }
+    *out = '\0';
+
+    return ret;
+}
+
+static gboolean
+read_string (SearpcParamReader *reader, Scanner *s, Param *param)
+{
+    char *start = ++s->p;
+    char *p = start;
+    gboolean escaped = FALSE;
+
+    while (1) {
+        if (p >= s->end || (guchar)*p < 0x20)
+            return FALSE;
+        if (*p == '"')
+            break;
+        if (*p == '\\') {
+            p = (char *)check_escape (p, s->end);
+            if (!p)
+                return FALSE;
+            escaped = TRUE;
+            continue;
+        }
+        p++;
+    }
+    if (!g_utf8_validate (start, p - start, NULL))
+        return FALSE;
+
+    param->kind = PARAM_STRING;
+    if (escaped) {
+        param->str = unescape (start, p);
+        reader->unescaped[reader->n_unescaped++] = (char *)param->str;
+    } else {
+        *p = '\0';
+        reader->patched[reader->n_patched++] = p;
+        param->str = start;
+    }
+    s->p = p + 1;
+
+    return TRUE;
+}
+
+static gboolean
+read_int (Scanner *s, Param *param)
+{
+    gboolean negative = FALSE;
+    guint64 value = 0, limit;
+    char *p = s->p;
+
+    if (*p == '-') {
+        negative = TRUE;
+        p++;
+    }
+    limit = negative ? (guint64)G_MAXINT64 + 1 : G_MAXINT64;
+
+    if (p >= s->end || !IS_DIGIT (*p))
+        return FALSE;
+    if (*p == '0') {
+        p++;
+    } else {
+        while (p < s->end && IS_DIGIT (*p)) {
+            int digit = *p - '0';
+            // jansson fails to load integers that don't fit in json_int_t.
+            if (value > (limit - digit) / 10)
+                return FALSE;
+            value = value * 10 + digit;
+            p++;
+        }
+    }
+    // Real numbers are never passed by searpc clients.
+    if (p < s->end && (*p == '.' || *p == 'e' || *p == 'E'))
+        return FALSE;
+
+    param->kind = PARAM_INT;
+    if (negative && value > 0)
+        param->value = -(gint64)(value - 1) - 1;
+    else
+        param->value = (gint64)value;
+    s->p = p;
+
+    return TRUE;
+}
+
+static gboolean
+read_literal (Scanner *s, const char *word, Param *param)
+{
+    gsize len = strlen (word);
+
+    if ((gsize)(s->end - s->p) < len || memcmp (s->p, word, len) != 0)
+        return FALSE;
+    param->kind = PARAM_OTHER;
+    s->p += len;
+
+    return TRUE;
+}
+
+static gboolean
+read_value (SearpcParamReader *reader, Scanner *s, Param *param)
+{
+    if (s->p >= s->end)
+        return FALSE;
+
+    param->str = NULL;
+    param->value = 0;
+
+    switch (*s->p) {
+    case '"':
+        return read_string (reader, s, param);
+    case 't':
+        return read_literal (s, "true", param);
+    case 'f':
+        return read_literal (s, "false", param);
+    case 'n':
+        return read_literal (s, "null", param);
+    default:
+        if (*s->p == '-' || IS_DIGIT (*s->p))
+            return read_int (s, param);
+        // Nested arrays and objects are left to jansson.
+        return FALSE;
+    }
+}
+
+gboolean
+searpc_param_reader_init (SearpcParamReader *reader, char *buf, gsize len)
+{
+    Scanner s = { buf, buf + len };
+
+    reader->n_params = 0;
+    reader->n_patched = 0;
+    reader->n_unescaped = 0;
+
+    skip_space (&s);
+    if (s.p >= s.end || *s.p != '[')
+        return FALSE;
+    s.p++;
+
+    while (1) {
+        skip_space (&s);
+        if (reader->n_params == SEARPC_PARAM_READER_MAX_PARAMS ||
+            !read_value (reader, &s, &reader->params[reader->n_params]))
+            goto fail;
+        reader->n_params++;
+
+        skip_space (&s);
+        if (s.p < s.end && *s.p == ',') {
+            s.p++;
+        } else if (s.p < s.end && *s.p == ']') {
+            s.p++;
+            break;
+        } else {
+            goto fail;
+        }
+    }
+
+    skip_space (&s);
+    // The call starts with the name or the id of the function.
+    if (s.p != s.end || reader->params[0].kind == PARAM_OTHER)
+        goto fail;
+
+    return TRUE;
+
+fail:
+    searpc_param_reader_clear (reader);
+    return FALSE;
+}
+
+void
+searpc_param_reader_clear (SearpcParamReader *reader)
+{
+    int i;
+
+    for (i = 0; i < reader->n_patched; i++)
+        *reader->patched[i] = '"';
+    for (i = 0; i < reader->n_unescaped; i++)
+        g_free (reader->unescaped[i]);
+
+    reader->n_params = 0;
+    reader->n_patched = 0;
+    reader->n_unescaped = 0;
+}
+
+const char *
+searpc_param_reader_get_string (SearpcParamReader *reader, int index)
+{
+    if (index < 0 || index >= reader->n_params ||
+        reader->params[index].kind != PARAM_STRING)
+        return NULL;
+
+    return reader->params[index].str;
+}
+
+gint64
+searpc_param_reader_get_int (SearpcParamReader *reader, int index)
+{
+    if (index < 0 || index >= reader->n_params ||
+        reader->params[index].kind != PARAM_INT)
+        return 0;
+
+    return reader->params[index].value;
+}
+
+static const char *
+skip_json_space (const char *p, const char *end)
+{
+    while (p < end && g_ascii_isspace (*p))
+        p++;
+    return p;
+}
+
+int
+searpc_json_array_next (const char *data, gsize len, gsize *pos,
+                        const char **elem, gsize *elem_len)
+{
+    const char *end = data + len;
+    const char *p = skip_json_space (data + *pos, end);
+    const char *start;
+    int depth = 0;
+
+    if (*pos == 0) {
+        if (p == end || *p != '[')
+            return -1;
+        p = skip_json_space (p + 1, end);
+    } else if (p < end && *p == ',') {
+        p = skip_json_space (p + 1, end);
+        if (p < end && *p == ']')
+            return -1;
+    } else if (p == end || *p != ']') {
+        return -1;
+    }
+
+    if (p < end && *p == ']') {
+        *pos = len;
+        return skip_json_space (p + 1, end) == end ? 0 : -1;
+    }
+
+    for (start = p; p < end; p++) {
+        if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\')
+                    p++;
+            }
+            if (p >= end)
+                return -1;
+        } else if (*p == '[' || *p == '{') {
+            depth++;
+        } else if (*p == ']' || *p == '}') {
+            if (depth == 0)
+                break;
+            depth--;
+        } else if (*p == ',' && depth == 0) {
+            break;
+        }
+    }
+    if (p == end || p == start)
+        return -1;
+
+    *pos = p - data;
+    while (g_ascii_isspace (p[-1]))
+        p--;
+    *elem = start;
+    *elem_len = p - start;
+    return 1;
+}
@@ -0,0 +1,63 @@
+#ifndef SEARPC_PARAM_READER_H
+#define SEARPC_PARAM_READER_H
+
+#include <glib.h>
+
+#include "searpc-server.h"
+
+// Reads the [fname, param1, ...] array of a call in one pass, without
+// building a json_t tree. Strings without escapes are returned in place:
+// their closing quote is replaced with a NUL, and put back by
+// searpc_param_reader_clear(). Only calls whose parameters are strings,
+// integers, booleans or null are read, the others must be loaded with
+// json_loadb().
+
+#define SEARPC_PARAM_READER_MAX_PARAMS 16
+
+typedef enum {
+    // null, true or false, read as NULL or 0 like json_t values.
+    PARAM_OTHER,
+    PARAM_INT,
+    PARAM_STRING,
+} ParamKind;
+
+typedef struct {
+    ParamKind kind;
+    gint64 value;
+    const char *str;
+} Param;
+
+struct _SearpcParamReader {
+    int n_params;
+    Param params[SEARPC_PARAM_READER_MAX_PARAMS];
+    // Closing quotes replaced with a NUL.
+    char *patched[SEARPC_PARAM_READER_MAX_PARAMS];
+    int n_patched;
+    // Unescaped copies of the strings with escapes.
+    char *unescaped[SEARPC_PARAM_READER_MAX_PARAMS];
+    int n_unescaped;
+};
+
+// Read the call in @buf. Returns FALSE, leaving @buf unchanged, if it isn't
+// an array starting with a string or an integer, if it has nested arrays,
+// objects or real numbers, or if it isn't valid JSON.
+G_GNUC_INTERNAL
+gboolean
+searpc_param_reader_init (SearpcParamReader *reader, char *buf, gsize len);
+
+// Restore the buffer and free the unescaped strings.
+G_GNUC_INTERNAL
+void
+searpc_param_reader_clear (SearpcParamReader *reader);
+
+// Walk the elements of the JSON array in @data without parsing them, for
+// batches of calls and their responses. Start with *@pos at 0. Returns 1
+// and stores the text of the next element in @elem, or 0 after the last
+// one. Returns -1 if @data isn't an array, though the elements themselves
+// aren't checked.
+G_GNUC_INTERNAL
+int
+searpc_json_array_next (const char *data, gsize len, gsize *pos,
+                        const char **elem, gsize *elem_len);
+
+#endif
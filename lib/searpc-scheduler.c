@@ -0,0 +1,298 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+#include "searpc-scheduler.h"
+
+typedef struct {
+    SearpcTaskFunc func;
+    void *data;
+} SearpcTask;
+
+typedef struct {
+    SearpcScheduler *sched;
+    int index;
+    pthread_t thread;
+
+    // Ring buffer of tasks. The worker takes the oldest task, thieves take
+    // the newest one.
+    pthread_mutex_t lock;
+    SearpcTask *tasks;
+    int capacity;
+    int head;
+    int count;
+} SearpcWorker;
+
+struct _SearpcScheduler {
+    SearpcTaskFunc func;
+    void *user_data;
+    int n_workers;
+    SearpcWorker *workers;
+
+    // Tasks pushed but not taken yet, and workers running a task.
+    gint n_queued;
+    gint n_busy;
+    // Picks the worker for tasks pushed from other threads.
+    gint next_worker;
+
+    // Workers sleep here when there's nothing to run or steal.
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    gint n_idle;
+    // Set by searpc_scheduler_free(). Workers leave once the queues are
+    // empty.
+    gboolean stopping;
+};
+
+// The worker running on the current thread, if any.
+static GPrivate current_worker = G_PRIVATE_INIT (NULL);
+
+static void
+worker_push (SearpcWorker *worker, SearpcTask task)
+{
+    pthread_mutex_lock (&worker->lock);
+    if (worker->count == worker->capacity) {
+        int i;
+        int capacity = worker->capacity ? worker->capacity * 2 : 64;
+        SearpcTask *tasks = g_new (SearpcTask, capacity);
+
+        for (i = 0; i < worker->count; i++) {
+            tasks[i] = worker->tasks[(worker->head + i) % worker->capacity];
+        }
+        g_free (worker->tasks);
+        worker->tasks = tasks;
+        worker->capacity = capacity;
+        worker->head = 0;
+    }
+    worker->tasks[(worker->head + worker->count) % worker->capacity] = task;
+    worker->count++;
+    pthread_mutex_unlock (&worker->lock);
+}
+
+static gboolean
+worker_pop (SearpcWorker *worker, SearpcTask *task)
+{
+    gboolean found = FALSE;
+
+    pthread_mutex_lock (&worker->lock);
+    if (worker->count > 0) {
+        *task = worker->tasks[worker->head];
+        worker->head = (worker->head + 1) % worker->capacity;
+        worker->count--;
+        found = TRUE;
+    }
+    pthread_mutex_unlock (&worker->lock);
+
+    return found;
+}
+
+static gboolean
+worker_steal (SearpcWorker *victim, SearpcTask *task)
+{
+    gboolean found = FALSE;
+
+    // Don't wait behind the owner or another thief.
+    if (pthread_mutex_trylock (&victim->lock) != 0)
+        return FALSE;
+    if (victim->count > 0) {
+        victim->count--;
+        *task = victim->tasks[(victim->head + victim->count) % victim->capacity];
+        found = TRUE;
+    }
+    pthread_mutex_unlock (&victim->lock);
+
+    return found;
+}
+
+static gboolean
+find_task (SearpcWorker *worker, SearpcTask *task)
+{
+    SearpcScheduler *sched = worker->sched;
+    int i;
+
+    if (worker_pop (worker, task))
+        return TRUE;
+
+    for (i = 1; i < sched->n_workers; i++) {
+        if (worker_steal (&sched->workers[(worker->index + i) % sched->n_workers], task))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+pin_worker (SearpcWorker *worker)
+{
+#ifdef __linux__
+    int n_cores = g_get_num_processors ();
+    cpu_set_t cpus;
+    int ret;
+
+    CPU_ZERO (&cpus);
+    CPU_SET (worker->index % n_cores, &cpus);
+    ret = pthread_setaffinity_np (worker->thread, sizeof(cpus), &cpus);
+    if (ret != 0) {
+        g_warning ("Failed to set cpu affinity of rpc worker %d: %s\n",
+                   worker->index, strerror(ret));
+    }
+#endif
+}
+
+static void *
+worker_thread (void *arg)
+{
+    SearpcWorker *worker = arg;
+    SearpcScheduler *sched = worker->sched;
+    SearpcTask task;
+
+    g_private_set (&current_worker, worker);
+
+    while (1) {
+        if (find_task (worker, &task)) {
+            g_atomic_int_add (&sched->n_queued, -1);
+            g_atomic_int_inc (&sched->n_busy);
+            task.func (task.data, sched->user_data);
+            g_atomic_int_add (&sched->n_busy, -1);
+            continue;
+        }
+
+        // A task may be pushed after the search, so the queued count is
+        // checked again after announcing the worker as idle.
+        pthread_mutex_lock (&sched->idle_lock);
+        g_atomic_int_inc (&sched->n_idle);
+        while (g_atomic_int_get (&sched->n_queued) == 0 && !sched->stopping) {
+            pthread_cond_wait (&sched->idle_cond, &sched->idle_lock);
+        }
+        g_atomic_int_add (&sched->n_idle, -1);
+        if (sched->stopping && g_atomic_int_get (&sched->n_queued) == 0) {
+            pthread_mutex_unlock (&sched->idle_lock);
+            break;
+        }
+        pthread_mutex_unlock (&sched->idle_lock);
+    }
+
+    return NULL;
+}
+
+// Stop the first @n_started workers and free @sched.
+static void
+stop_workers (SearpcScheduler *sched, int n_started)
+{
+    int i;
+
+    pthread_mutex_lock (&sched->idle_lock);
+    sched->stopping = TRUE;
+    pthread_cond_broadcast (&sched->idle_cond);
+    pthread_mutex_unlock (&sched->idle_lock);
+
+    for (i = 0; i < n_started; i++)
+        pthread_join (sched->workers[i].thread, NULL);
+
+    for (i = 0; i < sched->n_workers; i++) {
+        pthread_mutex_destroy (&sched->workers[i].lock);
+        g_free (sched->workers[i].tasks);
+    }
+    pthread_mutex_destroy (&sched->idle_lock);
+    pthread_cond_destroy (&sched->idle_cond);
+    g_free (sched->workers);
+    g_free (sched);
+}
+
+SearpcScheduler *
+searpc_scheduler_new (SearpcTaskFunc func, void *user_data,
+                      int n_workers, gboolean pin_workers)
+{
+    SearpcScheduler *sched = g_new0 (SearpcScheduler, 1);
+    int i, ret;
+
+    if (n_workers <= 0)
+        n_workers = g_get_num_processors ();
+
+    sched->func = func;
+    sched->user_data = user_data;
+    sched->n_workers = n_workers;
+    sched->workers = g_new0 (SearpcWorker, n_workers);
+    pthread_mutex_init (&sched->idle_lock, NULL);
+    pthread_cond_init (&sched->idle_cond, NULL);
+
+    for (i = 0; i < n_workers; i++) {
+        SearpcWorker *worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->index = i;
+        pthread_mutex_init (&worker->lock, NULL);
+    }
+
+    for (i = 0; i < n_workers; i++) {
+        SearpcWorker *worker = &sched->workers[i];
+
+        ret = pthread_create (&worker->thread, NULL, worker_thread, worker);
+        if (ret != 0) {
+            g_warning ("Failed to start rpc worker %d: %s\n", i, strerror(ret));
+            stop_workers (sched, i);
+            return NULL;
+        }
+
+        if (pin_workers)
+            pin_worker (worker);
+    }
+
+    return sched;
+}
+
+void
+searpc_scheduler_free (SearpcScheduler *sched)
+{
+    if (!sched)
+        return;
+    stop_workers (sched, sched->n_workers);
+}
+
+void
+searpc_scheduler_push (SearpcScheduler *sched, void *data)
+{
+    searpc_scheduler_push_func (sched, sched->func, data);
+}
+
+void
+searpc_scheduler_push_func (SearpcScheduler *sched, SearpcTaskFunc func,
+                            void *data)
+{
+    SearpcTask task = { func, data };
+    SearpcWorker *worker = g_private_get (&current_worker);
+
+    // Tasks pushed by a worker stay on its own queue.
+    if (!worker || worker->sched != sched) {
+        guint next = (guint)g_atomic_int_add (&sched->next_worker, 1);
+        worker = &sched->workers[next % sched->n_workers];
+    }
+    worker_push (worker, task);
+
+    g_atomic_int_inc (&sched->n_queued);
+    if (g_atomic_int_get (&sched->n_idle) > 0) {
+        pthread_mutex_lock (&sched->idle_lock);
+        pthread_cond_signal (&sched->idle_cond);
+        pthread_mutex_unlock (&sched->idle_lock);
+    }
+}
+
+int
+searpc_scheduler_get_num_workers (SearpcScheduler *sched)
+{
+    return sched->n_workers;
+}
+
+int
+searpc_scheduler_get_num_busy (SearpcScheduler *sched)
+{
+    return g_atomic_int_get (&sched->n_busy);
+}
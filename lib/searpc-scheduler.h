@@ -0,0 +1,50 @@
+#ifndef SEARPC_SCHEDULER_H
+#define SEARPC_SCHEDULER_H
+
+#include <glib.h>
+
+// A fixed set of worker threads, each with its own task queue. Tasks pushed
+// from outside are spread over the workers, and idle workers steal tasks
+// from the others, so there's no single queue lock shared by all workers.
+
+typedef struct _SearpcScheduler SearpcScheduler;
+
+typedef void (*SearpcTaskFunc) (void *data, void *user_data);
+
+// Start @n_workers threads running @func on pushed tasks. If @n_workers is
+// not positive, one worker is started per CPU core. With @pin_workers each
+// worker is bound to one core (only supported on Linux). Returns NULL if
+// the threads can't be started.
+G_GNUC_INTERNAL
+SearpcScheduler *
+searpc_scheduler_new (SearpcTaskFunc func, void *user_data,
+                      int n_workers, gboolean pin_workers);
+
+// Run the tasks still queued, then stop the workers and free @sched. It
+// must not be called from a worker, and nothing may be pushed meanwhile
+// but by the tasks themselves.
+G_GNUC_INTERNAL
+void
+searpc_scheduler_free (SearpcScheduler *sched);
+
+G_GNUC_INTERNAL
+void
+searpc_scheduler_push (SearpcScheduler *sched, void *data);
+
+// Like searpc_scheduler_push(), running @func instead of the function the
+// scheduler was created with.
+G_GNUC_INTERNAL
+void
+searpc_scheduler_push_func (SearpcScheduler *sched, SearpcTaskFunc func,
+                            void *data);
+
+G_GNUC_INTERNAL
+int
+searpc_scheduler_get_num_workers (SearpcScheduler *sched);
+
+// Number of workers currently running a task.
+G_GNUC_INTERNAL
+int
+searpc_scheduler_get_num_busy (SearpcScheduler *sched);
+
+#endif
@@ -8,46 +8,81 @@
 
 #include "searpc-server.h"
 #include "searpc-utils.h"
+#include "searpc-stats.h"
+#include "searpc-param-reader.h"
+#include "searpc-slow-log.h"
 
 #ifdef __linux__
-#include <sys/time.h>
 #include <sys/errno.h>
-#include <pthread.h>
+#include <sys/syscall.h>
+#endif
+
+#if !defined(WIN32)
+#include <unistd.h>
 #endif
 
 struct FuncItem;
 
 typedef struct MarshalItem {
     SearpcMarshalFunc mfunc;
+    SearpcRawMarshalFunc raw_mfunc;
     gchar *signature;
 } MarshalItem;
 
+// A table registered with searpc_server_register_marshal_table(). Its
+// entries are looked up where they are, generated tables are sorted by
+// signature.
+typedef struct {
+    const SearpcMarshalEntry *entries;
+    int n_entries;
+    gboolean sorted;
+} MarshalTable;
+
 typedef struct FuncItem {
     void        *func;
-    gchar       *fname;
-    MarshalItem *marshal;
+    const gchar *fname;
+    SearpcMarshalFunc mfunc;
+    SearpcRawMarshalFunc raw_mfunc;
+    int          stats_id;
+    // Index in the functions of the service.
+    int          id;
 } FuncItem;
 
 typedef struct {
     char *name;
+    int id;
     GHashTable *func_table;
+    // Functions by id, in the order they were first registered.
+    GPtrArray *funcs;
+    gboolean columnar_objlists;
 } SearpcService;
 
 static GHashTable *marshal_table;
+static GPtrArray *marshal_tables;
 static GHashTable *service_table;
+// Services by id. Ids aren't reused, removed services leave a NULL.
+static GPtrArray *service_array;
+
+// Timing of the call running on this thread. Errors returned by the
+// marshal are noted in it.
+static GPrivate current_call;
+// Service of the call running on this thread.
+static GPrivate current_service;
 
 #ifdef __linux__
-static FILE *slow_log_fp = NULL;
+static gboolean slow_log_enabled = FALSE;
 static gint64 slow_threshold;
 static GList *filtered_funcs;
-static pthread_mutex_t slow_log_lock;
 static gboolean log_to_stdout = FALSE;
+static double slow_log_sample_rate = 1.0;
+
+static GPrivate sample_rand = G_PRIVATE_INIT ((GDestroyNotify)g_rand_free);
+static GPrivate thread_id = G_PRIVATE_INIT (NULL);
 #endif
 
 static void
 func_item_free (FuncItem *item)
 {
-    g_free (item->fname);
     g_free (item);
 }
 
@@ -73,6 +108,9 @@ searpc_create_service (const char *svc_name)
     service->name = g_strdup(svc_name);
     service->func_table = g_hash_table_new_full (g_str_hash, g_str_equal, 
                                                  NULL, (GDestroyNotify)func_item_free);
+    service->funcs = g_ptr_array_new ();
+    service->id = service_array->len;
+    g_ptr_array_add (service_array, service);
 
     g_hash_table_insert (service_table, service->name, service);
 
@@ -82,8 +120,10 @@ searpc_create_service (const char *svc_name)
 static void
 service_free (SearpcService *service)
 {
+    g_ptr_array_index (service_array, service->id) = NULL;
     g_free (service->name);
     g_hash_table_destroy (service->func_table);
+    g_ptr_array_free (service->funcs, TRUE);
     g_free (service);
 }
 
@@ -95,6 +135,17 @@ searpc_remove_service (const char *svc_name)
     g_hash_table_remove (service_table, svc_name);
 }
 
+int
+searpc_server_set_columnar_objlists (const char *svc_name, gboolean columnar)
+{
+    SearpcService *service = g_hash_table_lookup (service_table, svc_name);
+
+    if (!service)
+        return -1;
+    service->columnar_objlists = columnar;
+    return 0;
+}
+
 /* Marshal functions */
 void
 searpc_set_string_to_ret_object (json_t *object, char *ret)
@@ -152,6 +203,17 @@ searpc_set_json_to_ret_object (json_t *object, json_t *ret)
         json_object_set_new (object, "ret", ret);
 }
 
+static void
+note_call_error (GError *error)
+{
+    SearpcCallTiming *timing = g_private_get (&current_call);
+
+    if (timing) {
+        timing->failed = TRUE;
+        timing->err_code = error->code;
+    }
+}
+
 char *
 searpc_marshal_set_ret_common (json_t *object, gsize *len,  GError *error)
 {
@@ -159,6 +221,7 @@ searpc_marshal_set_ret_common (json_t *object, gsize *len,  GError *error)
     char *data;
 
     if (error) {
+        note_call_error (error);
         json_object_set_new (object, "err_code", json_integer((json_int_t)error->code));
         json_object_set_new (object, "err_msg", json_string(error->message));
         g_error_free (error);
@@ -171,7 +234,381 @@ searpc_marshal_set_ret_common (json_t *object, gsize *len,  GError *error)
     return data;
 }
 
+/* Streaming marshal returns. The response is written into a buffer kept
+ * by each thread, so only the returned copy is allocated per call. */
+
+// Larger buffers are freed after the call instead of kept for the next one.
+#define RET_BUFFER_KEEP_SIZE (1 << 20)
+
+static void
+free_ret_buffer (gpointer data)
+{
+    g_string_free (data, TRUE);
+}
+
+static GPrivate ret_buffer = G_PRIVATE_INIT (free_ret_buffer);
+
+static GString *
+begin_ret (void)
+{
+    GString *buf = g_private_get (&ret_buffer);
+
+    if (!buf) {
+        buf = g_string_sized_new (4096);
+        g_private_set (&ret_buffer, buf);
+    }
+    g_string_truncate (buf, 0);
+    g_string_append (buf, "{\"ret\":");
+
+    return buf;
+}
+
+// Finish the response in @buf and return a copy of it, followed by the
+// section holding @bytes if it's set.
+static char *
+end_ret_with_bytes (GString *buf, gsize *len, GError *error, GBytes *bytes)
+{
+    char *data;
+    guint32 size = bytes ? (guint32)g_bytes_get_size (bytes) : 0;
+
+    if (error) {
+        note_call_error (error);
+        g_string_append (buf, ",\"err_code\":");
+        searpc_json_write_int (buf, error->code);
+        g_string_append (buf, ",\"err_msg\":");
+        if (!searpc_json_write_string (buf, error->message))
+            g_string_append (buf, "null");
+        g_error_free (error);
+    }
+    g_string_append_c (buf, '}');
+
+    *len = buf->len;
+    if (bytes)
+        *len += 1 + sizeof(guint32) + size;
+    data = g_malloc (*len + 1);
+    // The NUL after the JSON text starts the section.
+    memcpy (data, buf->str, buf->len + 1);
+    if (bytes) {
+        memcpy (data + buf->len + 1, &size, sizeof(guint32));
+        memcpy (data + buf->len + 1 + sizeof(guint32),
+                g_bytes_get_data (bytes, NULL), size);
+        data[*len] = '\0';
+    }
+
+    if (buf->allocated_len > RET_BUFFER_KEEP_SIZE) {
+        g_private_set (&ret_buffer, NULL);
+        g_string_free (buf, TRUE);
+    }
+
+    return data;
+}
+
+static char *
+end_ret (GString *buf, gsize *len, GError *error)
+{
+    return end_ret_with_bytes (buf, len, error, NULL);
+}
+
+char *
+searpc_marshal_write_ret_string (char *ret, gsize *len, GError *error)
+{
+    GString *buf = begin_ret ();
+
+    if (!searpc_json_write_string (buf, ret))
+        g_string_append (buf, "null");
+    g_free (ret);
+
+    return end_ret (buf, len, error);
+}
+
+char *
+searpc_marshal_write_ret_int (gint64 ret, gsize *len, GError *error)
+{
+    GString *buf = begin_ret ();
+
+    searpc_json_write_int (buf, ret);
+
+    return end_ret (buf, len, error);
+}
+
+char *
+searpc_marshal_write_ret_object (GObject *ret, gsize *len, GError *error)
+{
+    GString *buf = begin_ret ();
+
+    if (ret == NULL)
+        g_string_append (buf, "null");
+    else {
+        searpc_json_write_gobject (buf, ret);
+        g_object_unref (ret);
+    }
+
+    return end_ret (buf, len, error);
+}
+
+char *
+searpc_marshal_write_ret_objlist (GList *ret, gsize *len, GError *error)
+{
+    GString *buf = begin_ret ();
+    GList *ptr;
+
+    SearpcService *service = g_private_get (&current_service);
+
+    if (ret == NULL)
+        g_string_append (buf, "null");
+    else {
+        if (!service || !service->columnar_objlists ||
+            !searpc_json_write_gobject_rows (buf, ret)) {
+            g_string_append_c (buf, '[');
+            for (ptr = ret; ptr; ptr = ptr->next) {
+                if (ptr != ret)
+                    g_string_append_c (buf, ',');
+                searpc_json_write_gobject (buf, ptr->data);
+            }
+            g_string_append_c (buf, ']');
+        }
+        for (ptr = ret; ptr; ptr = ptr->next)
+            g_object_unref (ptr->data);
+        g_list_free (ret);
+    }
+
+    return end_ret (buf, len, error);
+}
+
+struct _SearpcObjStream {
+    SearpcObjStreamNextFunc next;
+    void *state;
+    GDestroyNotify free_state;
+};
+
+typedef struct {
+    SearpcChunkFunc func;
+    void *user_data;
+} ChunkSink;
+
+// Where the transport serving the call on this thread takes the parts of
+// a streamed response.
+static GPrivate chunk_sink = G_PRIVATE_INIT (g_free);
+
+SearpcObjStream *
+searpc_obj_stream_new (SearpcObjStreamNextFunc next, void *state,
+                       GDestroyNotify free_state)
+{
+    SearpcObjStream *stream = g_new0 (SearpcObjStream, 1);
+
+    stream->next = next;
+    stream->state = state;
+    stream->free_state = free_state;
+
+    return stream;
+}
+
+void
+searpc_server_set_chunk_func (SearpcChunkFunc func, void *user_data)
+{
+    ChunkSink *sink = g_private_get (&chunk_sink);
+
+    if (!sink) {
+        if (!func)
+            return;
+        sink = g_new0 (ChunkSink, 1);
+        g_private_set (&chunk_sink, sink);
+    }
+    sink->func = func;
+    sink->user_data = user_data;
+}
+
+char *
+searpc_marshal_write_ret_objstream (SearpcObjStream *ret, gsize *len,
+                                    GError *error)
+{
+    GString *buf = begin_ret ();
+    ChunkSink *sink = g_private_get (&chunk_sink);
+    GObject *obj;
+    gboolean empty = TRUE;
+
+    if (ret == NULL) {
+        g_string_append (buf, "null");
+        return end_ret (buf, len, error);
+    }
+
+    g_string_append_c (buf, '[');
+    while (!error && (obj = ret->next (ret->state, &error)) != NULL) {
+        if (!empty)
+            g_string_append_c (buf, ',');
+        searpc_json_write_gobject (buf, obj);
+        g_object_unref (obj);
+        empty = FALSE;
+
+        // Send each full chunk as a response of its own, so only one chunk
+        // is in memory. Without a sink the whole list is written.
+        if (sink && sink->func && buf->len >= SEARPC_STREAM_CHUNK_SIZE) {
+            g_string_append (buf, "]}");
+            if (sink->func (buf->str, buf->len, sink->user_data) < 0) {
+                // The connection is gone, the rest would be dropped.
+                g_set_error (&error, DFT_DOMAIN, 500,
+                             "Failed to send streamed response");
+            }
+            g_string_truncate (buf, 0);
+            g_string_append (buf, "{\"ret\":[");
+            empty = TRUE;
+        }
+    }
+    g_string_append_c (buf, ']');
+
+    if (ret->free_state)
+        ret->free_state (ret->state);
+    g_free (ret);
+
+    return end_ret (buf, len, error);
+}
+
+// The descriptors of the call running on this thread, if its transport
+// can pass them.
+static GPrivate call_fds;
+
+void
+searpc_server_set_call_fds (SearpcCallFds *fds)
+{
+    g_private_set (&call_fds, fds);
+}
+
+static int
+lookup_call_fd (gint64 index)
+{
+    SearpcCallFds *fds = g_private_get (&call_fds);
+
+    if (!fds || index < 0 || index >= fds->n_fds)
+        return -1;
+    return fds->fds[index];
+}
+
+int
+searpc_marshal_get_fd_param (json_t *param_array, int index)
+{
+    json_t *param = json_array_get (param_array, index);
+
+    if (!json_is_integer (param))
+        return -1;
+    return lookup_call_fd (json_integer_value (param));
+}
+
+int
+searpc_param_reader_get_fd (SearpcParamReader *params, int index)
+{
+    if (index < 0 || index >= params->n_params ||
+        params->params[index].kind != PARAM_INT)
+        return -1;
+    return lookup_call_fd (params->params[index].value);
+}
+
+static void
+close_fd (int fd)
+{
+#if !defined(WIN32)
+    close (fd);
+#endif
+}
+
+char *
+searpc_marshal_write_ret_fd (int ret, gsize *len, GError *error)
+{
+    SearpcCallFds *fds = g_private_get (&call_fds);
+    GString *buf = begin_ret ();
+
+    if (ret >= 0 && !error) {
+        if (fds && fds->n_ret_fds < SEARPC_MAX_CALL_FDS) {
+            fds->ret_fds[fds->n_ret_fds] = ret;
+            searpc_json_write_int (buf, fds->n_ret_fds++);
+            return end_ret (buf, len, error);
+        }
+        g_set_error (&error, DFT_DOMAIN, 500,
+                     "Can't return a file descriptor on this transport");
+    }
+    if (ret >= 0)
+        close_fd (ret);
+    g_string_append (buf, "-1");
+
+    return end_ret (buf, len, error);
+}
+
+// The bytes values of the call running on this thread. Parameters point
+// into the request, and are wrapped in a GBytes the first time they're
+// read.
+typedef struct {
+    SearpcBytesSection section;
+    GBytes *params[SEARPC_MAX_CALL_BYTES];
+} CallBytes;
+
+static GPrivate call_bytes;
+
+static GBytes *
+lookup_call_bytes (gint64 index)
+{
+    CallBytes *bytes = g_private_get (&call_bytes);
+
+    if (!bytes || index < 0 || index >= bytes->section.n_values)
+        return NULL;
+    if (!bytes->params[index])
+        bytes->params[index] = g_bytes_new_static (bytes->section.values[index],
+                                                   bytes->section.sizes[index]);
+    return bytes->params[index];
+}
+
+GBytes *
+searpc_marshal_get_bytes_param (json_t *param_array, int index)
+{
+    json_t *param = json_array_get (param_array, index);
+
+    if (!json_is_integer (param))
+        return NULL;
+    return lookup_call_bytes (json_integer_value (param));
+}
+
+GBytes *
+searpc_param_reader_get_bytes (SearpcParamReader *params, int index)
+{
+    if (index < 0 || index >= params->n_params ||
+        params->params[index].kind != PARAM_INT)
+        return NULL;
+    return lookup_call_bytes (params->params[index].value);
+}
+
+char *
+searpc_marshal_write_ret_bytes (GBytes *ret, gsize *len, GError *error)
+{
+    GString *buf = begin_ret ();
+    GBytes *value = NULL;
+    char *data;
+
+    if (ret && !error && g_bytes_get_size (ret) > G_MAXUINT32)
+        g_set_error (&error, DFT_DOMAIN, 500, "Returned bytes are too long");
+    if (ret && !error) {
+        value = ret;
+        g_string_append_c (buf, '0');
+    } else {
+        g_string_append (buf, "-1");
+    }
+
+    data = end_ret_with_bytes (buf, len, error, value);
+    if (ret)
+        g_bytes_unref (ret);
+    return data;
+}
+
 char *
+searpc_marshal_write_ret_json (json_t *ret, gsize *len, GError *error)
+{
+    GString *buf = begin_ret ();
+
+    searpc_json_write_json (buf, ret);
+    if (ret)
+        json_decref (ret);
+
+    return end_ret (buf, len, error);
+}
+
+static char *
 error_to_json (int code, const char *msg, gsize *len)
 {
     json_t *object = json_object ();
@@ -192,8 +629,10 @@ searpc_server_init (RegisterMarshalFunc register_func)
 {
     marshal_table = g_hash_table_new_full (g_str_hash, g_str_equal,
                                            NULL, (GDestroyNotify)marshal_item_free);
+    marshal_tables = g_ptr_array_new_with_free_func (g_free);
     service_table = g_hash_table_new_full (g_str_hash, g_str_equal,
                                            NULL, (GDestroyNotify)service_free);
+    service_array = g_ptr_array_new ();
 
     register_func ();
 }
@@ -207,6 +646,8 @@ searpc_server_init_with_slow_log (RegisterMarshalFunc register_func,
                                   GList *filtered_funcs_in)
 {
     const char *log_to_stdout_env = g_getenv("SEAFILE_LOG_TO_STDOUT");
+    FILE *slow_log_fp = NULL;
+
     if (g_strcmp0(log_to_stdout_env, "true") == 0) {
         slow_log_fp = stdout;
         log_to_stdout = TRUE;
@@ -221,38 +662,41 @@ searpc_server_init_with_slow_log (RegisterMarshalFunc register_func,
     slow_threshold = slow_threshold_in;
     filtered_funcs = filtered_funcs_in;
 
-    pthread_mutex_init (&slow_log_lock, NULL);
+    // Slow calls are written by a background thread.
+    if (slow_log_fp) {
+        searpc_slow_log_start (slow_log_fp, log_to_stdout ? "[seafile-slow-rpc] " : NULL);
+        slow_log_enabled = TRUE;
+    }
 
     searpc_server_init (register_func);
 
     return 0;
 }
 
+void
+searpc_server_set_slow_log_options (gboolean json, gssize max_request_len,
+                                    double sample_rate)
+{
+    slow_log_sample_rate = CLAMP (sample_rate, 0.0, 1.0);
+    searpc_slow_log_set_format (json, max_request_len);
+}
+
 int
 searpc_server_reopen_slow_log (const char *slow_log_path)
 {
-    FILE *fp, *oldfp;
-
     if (log_to_stdout) {
         return 0;
     }
 
-    if ((fp = fopen (slow_log_path, "a+")) == NULL) {
-        g_warning ("Failed to open RPC slow log file %s\n", slow_log_path);
-        return -1;
-    }
-
-    pthread_mutex_lock (&slow_log_lock);
-    oldfp = slow_log_fp;
-    slow_log_fp = fp;
-    pthread_mutex_unlock (&slow_log_lock);
+    return searpc_slow_log_reopen (slow_log_path);
+}
 
-    if (fclose(oldfp) < 0) {
-        g_warning ("Failed to close old RPC slow log file\n");
-        return -1;
+void
+searpc_server_flush_slow_log (void)
+{
+    if (slow_log_enabled) {
+        searpc_slow_log_flush ();
     }
-
-    return 0;
 }
 
 #endif
@@ -262,16 +706,76 @@ searpc_server_final(void)
 {
     g_hash_table_destroy (service_table);
     g_hash_table_destroy (marshal_table);
+    g_ptr_array_free (marshal_tables, TRUE);
+    g_ptr_array_free (service_array, TRUE);
+    searpc_stats_reset ();
+}
+
+static int
+compare_marshal_entries (const void *a, const void *b)
+{
+    return strcmp (((const SearpcMarshalEntry *)a)->signature,
+                   ((const SearpcMarshalEntry *)b)->signature);
+}
+
+// Find the marshal of @signature, registered alone or in a table.
+static gboolean
+lookup_marshal (const char *signature, SearpcMarshalFunc *mfunc,
+                SearpcRawMarshalFunc *raw_mfunc)
+{
+    SearpcMarshalEntry key = { signature, NULL, NULL };
+    const SearpcMarshalEntry *entry = NULL;
+    MarshalItem *mitem;
+    guint i;
+    int j;
+
+    mitem = g_hash_table_lookup (marshal_table, signature);
+    if (mitem) {
+        *mfunc = mitem->mfunc;
+        *raw_mfunc = mitem->raw_mfunc;
+        return TRUE;
+    }
+
+    for (i = 0; i < marshal_tables->len && !entry; i++) {
+        MarshalTable *table = g_ptr_array_index (marshal_tables, i);
+        if (table->sorted) {
+            entry = bsearch (&key, table->entries, table->n_entries,
+                             sizeof(SearpcMarshalEntry), compare_marshal_entries);
+            continue;
+        }
+        for (j = 0; j < table->n_entries; j++) {
+            if (strcmp (table->entries[j].signature, signature) == 0) {
+                entry = &table->entries[j];
+                break;
+            }
+        }
+    }
+    if (!entry)
+        return FALSE;
+
+    *mfunc = entry->marshal;
+    *raw_mfunc = entry->raw_marshal;
+    return TRUE;
 }
 
 gboolean 
 searpc_server_register_marshal (gchar *signature, SearpcMarshalFunc marshal)
+{
+    return searpc_server_register_marshal_full (signature, marshal, NULL);
+}
+
+gboolean
+searpc_server_register_marshal_full (gchar *signature,
+                                     SearpcMarshalFunc marshal,
+                                     SearpcRawMarshalFunc raw_marshal)
 {
     MarshalItem *mitem;
+    SearpcMarshalFunc old;
+    SearpcRawMarshalFunc old_raw;
 
     g_assert (signature != NULL && marshal != NULL);
 
-    if (g_hash_table_lookup (marshal_table, signature) != NULL) {
+    if (lookup_marshal (signature, &old, &old_raw)) {
         g_warning ("[Sea RPC] cannot register duplicate marshal.\n");
         g_free (signature);
         return FALSE;
@@ -279,19 +783,65 @@ searpc_server_register_marshal (gchar *signature, SearpcMarshalFunc marshal)
 
     mitem = g_new0 (MarshalItem, 1);
     mitem->mfunc = marshal;
+    mitem->raw_mfunc = raw_marshal;
     mitem->signature = signature;
     g_hash_table_insert (marshal_table, (gpointer)mitem->signature, mitem);
 
     return TRUE;
 }
 
+void
+searpc_server_register_marshal_table (const SearpcMarshalEntry *table,
+                                      int n_entries)
+{
+    MarshalTable *mtable = g_new0 (MarshalTable, 1);
+    int i;
+
+    mtable->entries = table;
+    mtable->n_entries = n_entries;
+    mtable->sorted = TRUE;
+    for (i = 1; i < n_entries && mtable->sorted; i++) {
+        if (compare_marshal_entries (&table[i - 1], &table[i]) >= 0)
+            mtable->sorted = FALSE;
+    }
+    g_ptr_array_add (marshal_tables, mtable);
+}
+
+static void
+add_function (SearpcService *service, void *func, const gchar *fname,
+              SearpcMarshalFunc mfunc, SearpcRawMarshalFunc raw_mfunc)
+{
+    FuncItem *item, *old;
+
+    item = g_new0 (FuncItem, 1);
+    // A function registered again keeps its id.
+    old = g_hash_table_lookup (service->func_table, fname);
+    if (old) {
+        item->id = old->id;
+        g_ptr_array_index (service->funcs, item->id) = item;
+    } else {
+        item->id = service->funcs->len;
+        g_ptr_array_add (service->funcs, item);
+    }
+    item->mfunc = mfunc;
+    item->raw_mfunc = raw_mfunc;
+    // Interned, so slow log records can refer to it after the function is
+    // removed.
+    item->fname = g_intern_string (fname);
+    item->func = func;
+    // And its statistics.
+    item->stats_id = old ? old->stats_id : searpc_stats_new_function_id ();
+
+    g_hash_table_insert (service->func_table, (gpointer)item->fname, item);
+}
+
 gboolean 
 searpc_server_register_function (const char *svc_name,
                                  void *func, const gchar *fname, gchar *signature)
 {
     SearpcService *service;
-    FuncItem *item;
-    MarshalItem *mitem;
+    SearpcMarshalFunc mfunc;
+    SearpcRawMarshalFunc raw_mfunc;
 
     g_assert (svc_name != NULL && func != NULL && fname != NULL && signature != NULL);
 
@@ -299,23 +849,34 @@ searpc_server_register_function (const char *svc_name,
     if (!service)
         return FALSE;
 
-    mitem = g_hash_table_lookup (marshal_table, signature);
-    if (!mitem) {
+    if (!lookup_marshal (signature, &mfunc, &raw_mfunc)) {
         g_free (signature);
         return FALSE;
     }
 
-    item = g_new0 (FuncItem, 1);
-    item->marshal = mitem;
-    item->fname = g_strdup(fname);
-    item->func = func;
-
-    g_hash_table_insert (service->func_table, (gpointer)item->fname, item);
+    add_function (service, func, fname, mfunc, raw_mfunc);
 
     g_free (signature);
     return TRUE;
 }
 
+gboolean
+searpc_server_register_function_with_marshal (const char *svc_name,
+                                              void *func, const gchar *fname,
+                                              const SearpcMarshalEntry *marshal)
+{
+    SearpcService *service;
+
+    g_assert (svc_name != NULL && func != NULL && fname != NULL && marshal != NULL);
+
+    service = g_hash_table_lookup (service_table, svc_name);
+    if (!service)
+        return FALSE;
+
+    add_function (service, func, fname, marshal->marshal, marshal->raw_marshal);
+    return TRUE;
+}
+
 #ifdef __linux__
 
 static gboolean
@@ -333,97 +894,618 @@ rpc_include_passwd (const char *fname) {
     return FALSE;
 }
 
+static long
+get_thread_id (void)
+{
+    long tid = GPOINTER_TO_SIZE (g_private_get (&thread_id));
+
+    if (!tid) {
+        tid = (long)syscall (SYS_gettid);
+        g_private_set (&thread_id, GSIZE_TO_POINTER (tid));
+    }
+    return tid;
+}
+
+static gboolean
+slow_call_is_sampled (void)
+{
+    GRand *rand;
+
+    if (slow_log_sample_rate >= 1.0)
+        return TRUE;
+
+    // Each thread has its own generator, g_random_double() takes a lock.
+    rand = g_private_get (&sample_rand);
+    if (!rand) {
+        rand = g_rand_new ();
+        g_private_set (&sample_rand, rand);
+    }
+    return g_rand_double (rand) < slow_log_sample_rate;
+}
+
 static void
 print_slow_log_if_necessary (const char *svc_name, const char *func, gsize len,
-                             const struct timeval *start,
-                             const struct timeval *intv)
+                             const SearpcCallTiming *timing,
+                             gint64 queue_usec, gint64 exec_usec,
+                             gint64 write_usec)
 {
-    char time_buf[64];
-    gint64 intv_in_usec = ((gint64)intv->tv_sec) * G_USEC_PER_SEC + (gint64)intv->tv_usec;
+    SearpcSlowCall call;
+    gint64 intv_in_usec = queue_usec + exec_usec + write_usec;
     gint64 intv_in_msec = intv_in_usec/1000;
-    double intv_in_sec = ((double)intv_in_usec)/G_USEC_PER_SEC;
 
-    if (intv_in_msec < slow_threshold)
+    if (intv_in_msec < slow_threshold || !slow_call_is_sampled ())
         return;
 
-    strftime(time_buf, 64, "%Y/%m/%d %H:%M:%S", localtime(&start->tv_sec));
+    call.service = svc_name;
+    call.function = timing->fname;
+    call.request = func;
+    call.request_len = len;
+    call.response_len = timing->ret_len;
+    call.thread_id = timing->thread_id;
+    call.failed = timing->failed;
+    call.err_code = timing->err_code;
+    call.start_usec = g_get_real_time () - intv_in_usec;
+    call.queue_usec = queue_usec;
+    call.exec_usec = exec_usec;
+    call.write_usec = write_usec;
+    searpc_slow_log_push (&call);
+}
+
+#endif
 
-    pthread_mutex_lock (&slow_log_lock);
+static json_t *
+service_stats_to_json (SearpcService *service)
+{
+    GHashTableIter iter;
+    gpointer value;
+    json_t *object = json_object ();
 
-    if (log_to_stdout) {
-        fprintf (slow_log_fp, "[seafile-slow-rpc] ");
+    g_hash_table_iter_init (&iter, service->func_table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        FuncItem *fitem = value;
+        json_t *stats = searpc_stats_function_to_json (fitem->stats_id);
+        if (stats)
+            json_object_set_new (object, fitem->fname, stats);
+    }
+
+    return object;
+}
+
+// Handle calls to SEARPC_STATS_SERVICE. The only function is get_stats,
+// which returns the statistics of every function that has been called,
+// grouped by service.
+static char *
+stats_call_function (const gchar *func, gsize len, gsize *ret_len)
+{
+    GHashTableIter iter;
+    gpointer value;
+    json_error_t jerror;
+    json_t *array = json_loadb (func, len, 0, &jerror);
+    const char *fname = json_string_value (json_array_get (array, 0));
+    json_t *object;
+
+    if (g_strcmp0 (fname, "get_stats") != 0) {
+        char buf[256];
+        snprintf (buf, 255, "cannot find function %s.", fname ? fname : "");
+        json_decref (array);
+        return error_to_json (500, buf, ret_len);
     }
+    json_decref (array);
 
-    fprintf (slow_log_fp, "[%s] \"%s\" %.*s %.3f\n",
-             time_buf, svc_name, (int)len, func, intv_in_sec);
-    fflush (slow_log_fp);
+    json_t *services = json_object ();
+    g_hash_table_iter_init (&iter, service_table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        SearpcService *service = value;
+        json_object_set_new (services, service->name, service_stats_to_json (service));
+    }
 
-    pthread_mutex_unlock (&slow_log_lock);
+    object = json_object ();
+    json_object_set_new (object, "ret", services);
+    return searpc_marshal_set_ret_common (object, ret_len, NULL);
 }
 
-#endif
+static json_t *
+load_call (const gchar *func, gsize len, char **error_ret, gsize *ret_len)
+{
+    json_error_t jerror;
+    GError *error = NULL;
+    json_t *array = json_loadb (func, len, 0 ,&jerror);
+
+    if (!array) {
+        char buf[512];
+        setjetoge(&jerror,&error);
+        snprintf (buf, 511, "failed to load RPC call: %s\n", error->message);
+        g_error_free(error);
+        *error_ret = error_to_json (511, buf, ret_len);
+    }
+
+    return array;
+}
+
+char *
+searpc_server_call_function_in_place (const char *svc_name,
+                                      gchar *func, gsize len, gsize *ret_len)
+{
+    SearpcCallTiming timing;
+    char *ret;
+
+    memset (&timing, 0, sizeof(timing));
+    ret = searpc_server_call_function_with_timing (svc_name, func, len,
+                                                   ret_len, &timing);
+    searpc_server_call_finished (svc_name, func, len, &timing);
+
+    return ret;
+}
 
 /* Called by RPC transport. */
 char* 
 searpc_server_call_function (const char *svc_name,
                              gchar *func, gsize len, gsize *ret_len)
 {
-    SearpcService *service;
-    json_t *array;
-    char* ret;
-    json_error_t jerror;
-    GError *error = NULL;
+    char *copy, *ret;
 
-#ifdef __linux__
-    struct timeval start, end, intv;
+    // The call is read in place, and @func may be read-only or shared.
+    copy = g_malloc (len + 1);
+    memcpy (copy, func, len);
+    copy[len] = '\0';
 
-    if (slow_log_fp) {
-        gettimeofday(&start, NULL);
+    ret = searpc_server_call_function_in_place (svc_name, copy, len, ret_len);
+
+    g_free (copy);
+    return ret;
+}
+
+// Find the function named by the first element of a call, which is either
+// its name or its id.
+static FuncItem *
+lookup_function (SearpcService *service, const char *fname, gint64 func_id,
+                 char *buf, gsize size)
+{
+    FuncItem *fitem = NULL;
+
+    if (fname)
+        fitem = g_hash_table_lookup (service->func_table, fname);
+    else if (func_id >= 0 && func_id < service->funcs->len)
+        fitem = g_ptr_array_index (service->funcs, func_id);
+
+    if (!fitem && fname)
+        snprintf (buf, size, "cannot find function %s.", fname);
+    else if (!fitem)
+        snprintf (buf, size, "cannot find function %" G_GINT64_FORMAT ".", func_id);
+
+    return fitem;
+}
+
+static char *
+call_service_function (SearpcService *service, gchar *func, gsize len,
+                       gsize *ret_len, SearpcCallTiming *timing)
+{
+    SearpcParamReader reader;
+    gboolean use_reader;
+    json_t *array = NULL;
+    const char *fname;
+    gint64 func_id = -1;
+    char* ret = NULL;
+    CallBytes bytes;
+    gssize json_len;
+    int i;
+
+    json_len = searpc_bytes_section_read (func, len, &bytes.section);
+    if (json_len < 0)
+        return error_to_json (511, "failed to load RPC call: invalid bytes values",
+                              ret_len);
+    len = json_len;
+
+    // Most calls only pass strings and integers, and can be read without
+    // loading them into a json_t array.
+    use_reader = searpc_param_reader_init (&reader, func, len);
+    if (use_reader) {
+        fname = searpc_param_reader_get_string (&reader, 0);
+        if (reader.params[0].kind == PARAM_INT)
+            func_id = reader.params[0].value;
+    } else {
+        array = load_call (func, len, &ret, ret_len);
+        if (!array)
+            return ret;
+        fname = json_string_value (json_array_get(array, 0));
+        if (json_is_integer (json_array_get (array, 0)))
+            func_id = json_integer_value (json_array_get (array, 0));
+    }
+
+    char buf[256];
+    FuncItem *fitem = lookup_function (service, fname, func_id, buf, sizeof(buf));
+    if (!fitem) {
+        if (use_reader)
+            searpc_param_reader_clear (&reader);
+        else
+            json_decref (array);
+        return error_to_json (500, buf, ret_len);
+    }
+
+    if (use_reader && !fitem->raw_mfunc) {
+        searpc_param_reader_clear (&reader);
+        use_reader = FALSE;
+        array = load_call (func, len, &ret, ret_len);
+        if (!array)
+            return ret;
+    }
+
+    timing->failed = FALSE;
+    timing->err_code = 0;
+    g_private_set (&current_call, timing);
+    g_private_set (&current_service, service);
+    if (bytes.section.n_values > 0) {
+        memset (bytes.params, 0, sizeof(bytes.params));
+        g_private_set (&call_bytes, &bytes);
+    }
+    if (use_reader)
+        ret = fitem->raw_mfunc (fitem->func, &reader, ret_len);
+    else
+        ret = fitem->mfunc (fitem->func, array, ret_len);
+    g_private_set (&current_call, NULL);
+    g_private_set (&current_service, NULL);
+    if (bytes.section.n_values > 0) {
+        g_private_set (&call_bytes, NULL);
+        for (i = 0; i < bytes.section.n_values; i++) {
+            if (bytes.params[i])
+                g_bytes_unref (bytes.params[i]);
+        }
     }
+
+    timing->marshal_end = g_get_monotonic_time ();
+    timing->called = TRUE;
+    timing->ret_len = *ret_len;
+    timing->fname = fitem->fname;
+    timing->stats_id = fitem->stats_id;
+#ifdef __linux__
+    timing->hide_in_slow_log = filtered_funcs && rpc_include_passwd (fitem->fname);
+    if (slow_log_enabled)
+        timing->thread_id = get_thread_id ();
 #endif
 
+    if (use_reader)
+        searpc_param_reader_clear (&reader);
+    else
+        json_decref(array);
+
+    return ret;
+}
+
+// A batch, [[<call>], [<call>], ...], is answered with the array of the
+// responses to its calls.
+static gboolean
+is_batch (const char *func, gsize len)
+{
+    gsize i = 1;
+
+    if (len == 0 || func[0] != '[')
+        return FALSE;
+    while (i < len && g_ascii_isspace (func[i]))
+        i++;
+    return i < len && func[i] == '[';
+}
+
+typedef struct {
+    gchar *call;
+    gsize len;
+    char *ret;
+    gsize ret_len;
+} BatchCall;
+
+// Run a call of a batch, which is recorded in the statistics and the slow
+// log on its own.
+static void
+run_batch_call (SearpcService *service, BatchCall *bc,
+                const SearpcCallTiming *timing)
+{
+    SearpcCallTiming call_timing = *timing;
+
+    call_timing.marshal_start = g_get_monotonic_time ();
+    bc->ret = call_service_function (service, bc->call, bc->len,
+                                     &bc->ret_len, &call_timing);
+    if (memchr (bc->ret, '\0', bc->ret_len)) {
+        g_free (bc->ret);
+        bc->ret = error_to_json (500, "bytes values can't be returned in a batch",
+                                 &bc->ret_len);
+    }
+    searpc_server_call_finished (service->name, bc->call, bc->len, &call_timing);
+}
+
+// The calls of a batch being run. The thread that read the batch and the
+// helpers started on other threads take the calls in order until none is
+// left, and the batch is answered once they're all done.
+typedef struct {
+    SearpcService *service;
+    BatchCall *calls;
+    guint n_calls;
+    SearpcCallTiming timing;
+
+    GMutex lock;
+    GCond done_cond;
+    // The next call to take, and the number of calls done.
+    guint next;
+    guint n_done;
+    // Held by the thread of the batch and by each helper, which may start
+    // after all the calls are done.
+    int ref_count;
+} BatchRun;
+
+typedef struct {
+    SearpcBatchRunFunc func;
+    void *user_data;
+} BatchRunner;
+
+// How the transport serving the call on this thread runs helpers.
+static GPrivate batch_runner = G_PRIVATE_INIT (g_free);
+
+static gint batch_parallelism = 1;
+
+void
+searpc_server_set_batch_runner (SearpcBatchRunFunc func, void *user_data)
+{
+    BatchRunner *runner = g_private_get (&batch_runner);
+
+    if (!runner) {
+        if (!func)
+            return;
+        runner = g_new0 (BatchRunner, 1);
+        g_private_set (&batch_runner, runner);
+    }
+    runner->func = func;
+    runner->user_data = user_data;
+}
+
+void
+searpc_server_set_batch_parallelism (int max_calls)
+{
+    g_atomic_int_set (&batch_parallelism, MAX (max_calls, 1));
+}
+
+static void
+run_batch_calls (BatchRun *run)
+{
+    guint i;
+
+    g_mutex_lock (&run->lock);
+    while (run->next < run->n_calls) {
+        i = run->next++;
+        g_mutex_unlock (&run->lock);
+
+        run_batch_call (run->service, &run->calls[i], &run->timing);
+
+        g_mutex_lock (&run->lock);
+        if (++run->n_done == run->n_calls)
+            g_cond_signal (&run->done_cond);
+    }
+    g_mutex_unlock (&run->lock);
+}
+
+static void
+batch_run_unref (BatchRun *run)
+{
+    if (!g_atomic_int_dec_and_test (&run->ref_count))
+        return;
+    g_mutex_clear (&run->lock);
+    g_cond_clear (&run->done_cond);
+    g_free (run);
+}
+
+void
+searpc_server_run_batch_task (void *task)
+{
+    BatchRun *run = task;
+
+    run_batch_calls (run);
+    batch_run_unref (run);
+}
+
+// Run the calls of a batch once they've all been found. Up to the batch
+// parallelism, idle workers of the transport help.
+static char *
+call_batch (SearpcService *service, gchar *func, gsize len,
+            gsize *ret_len, SearpcCallTiming *timing)
+{
+    ChunkSink *sink = g_private_get (&chunk_sink);
+    SearpcChunkFunc chunk_func = sink ? sink->func : NULL;
+    SearpcCallFds *fds = g_private_get (&call_fds);
+    BatchRunner *runner = g_private_get (&batch_runner);
+    GArray *calls = g_array_new (FALSE, FALSE, sizeof(BatchCall));
+    GString *out;
+    BatchCall bc = { NULL, 0, NULL, 0 };
+    BatchRun *run;
+    const char *call;
+    gsize pos = 0;
+    guint i, n_helpers;
+    int r;
+
+    while ((r = searpc_json_array_next (func, len, &pos, &call, &bc.len)) > 0) {
+        bc.call = (gchar *)call;
+        g_array_append_val (calls, bc);
+    }
+    if (r < 0) {
+        g_array_free (calls, TRUE);
+        return error_to_json (511, "failed to load RPC batch", ret_len);
+    }
+
+    // Streams are returned whole, and descriptors can't be passed.
+    if (sink)
+        sink->func = NULL;
+    g_private_set (&call_fds, NULL);
+
+    run = g_new0 (BatchRun, 1);
+    run->service = service;
+    run->calls = (BatchCall *)calls->data;
+    run->n_calls = calls->len;
+    run->timing = *timing;
+    g_mutex_init (&run->lock);
+    g_cond_init (&run->done_cond);
+    run->ref_count = 1;
+
+    n_helpers = MIN ((guint)g_atomic_int_get (&batch_parallelism), calls->len) - 1;
+    for (i = 0; i < n_helpers && runner && runner->func; i++) {
+        g_atomic_int_inc (&run->ref_count);
+        if (!runner->func (run, runner->user_data)) {
+            g_atomic_int_add (&run->ref_count, -1);
+            break;
+        }
+    }
+
+    run_batch_calls (run);
+    g_mutex_lock (&run->lock);
+    while (run->n_done < run->n_calls)
+        g_cond_wait (&run->done_cond, &run->lock);
+    g_mutex_unlock (&run->lock);
+    batch_run_unref (run);
+
+    if (sink)
+        sink->func = chunk_func;
+    g_private_set (&call_fds, fds);
+
+    out = g_string_sized_new (256);
+    g_string_append_c (out, '[');
+    for (i = 0; i < calls->len; i++) {
+        BatchCall *done = &g_array_index (calls, BatchCall, i);
+        if (i > 0)
+            g_string_append_c (out, ',');
+        g_string_append_len (out, done->ret, done->ret_len);
+        g_free (done->ret);
+    }
+    g_string_append_c (out, ']');
+    g_array_free (calls, TRUE);
+
+    *ret_len = out->len;
+    return g_string_free (out, FALSE);
+}
+
+static char *
+call_service_or_batch (SearpcService *service, gchar *func, gsize len,
+                       gsize *ret_len, SearpcCallTiming *timing)
+{
+    if (is_batch (func, len))
+        return call_batch (service, func, len, ret_len, timing);
+    return call_service_function (service, func, len, ret_len, timing);
+}
+
+char *
+searpc_server_call_function_with_timing (const char *svc_name,
+                                         gchar *func, gsize len,
+                                         gsize *ret_len,
+                                         SearpcCallTiming *timing)
+{
+    SearpcService *service;
+
+    timing->marshal_start = g_get_monotonic_time ();
+    timing->called = FALSE;
+
     service = g_hash_table_lookup (service_table, svc_name);
+    if (!service && strcmp (svc_name, SEARPC_STATS_SERVICE) == 0) {
+        return stats_call_function (func, len, ret_len);
+    }
     if (!service) {
         char buf[256];
         snprintf (buf, 255, "cannot find service %s.", svc_name);
         return error_to_json (501, buf, ret_len);
     }
-    
-    array = json_loadb (func, len, 0 ,&jerror);
-    
-    if (!array) {
-        char buf[512];
-        setjetoge(&jerror,&error);
-        snprintf (buf, 511, "failed to load RPC call: %s\n", error->message);
-        json_decref (array);        
-        g_error_free(error);
-        return error_to_json (511, buf, ret_len);
-    }
 
-    const char *fname = json_string_value (json_array_get(array, 0));
-    FuncItem *fitem = g_hash_table_lookup(service->func_table, fname);
-    if (!fitem) {
+    return call_service_or_batch (service, func, len, ret_len, timing);
+}
+
+char *
+searpc_server_call_function_by_id_with_timing (int service_id,
+                                               gchar *func, gsize len,
+                                               gsize *ret_len,
+                                               SearpcCallTiming *timing)
+{
+    SearpcService *service = NULL;
+
+    timing->marshal_start = g_get_monotonic_time ();
+    timing->called = FALSE;
+
+    if (service_id >= 0 && service_id < service_array->len)
+        service = g_ptr_array_index (service_array, service_id);
+    if (!service) {
         char buf[256];
-        snprintf (buf, 255, "cannot find function %s.", fname);
-        json_decref (array);
-        return error_to_json (500, buf, ret_len);
+        snprintf (buf, 255, "cannot find service %d.", service_id);
+        return error_to_json (501, buf, ret_len);
     }
 
-    ret = fitem->marshal->mfunc (fitem->func, array, ret_len);
+    return call_service_or_batch (service, func, len, ret_len, timing);
+}
 
-#ifdef __linux__
-    if (slow_log_fp) {
-        if (!filtered_funcs || !rpc_include_passwd (fitem->fname)) {
-            gettimeofday(&end, NULL);
-            timersub(&end, &start, &intv);
-            print_slow_log_if_necessary (svc_name, func, len, &start, &intv);
-        }
+const char *
+searpc_server_get_service_name (int service_id)
+{
+    SearpcService *service = NULL;
+
+    if (service_id >= 0 && service_id < service_array->len)
+        service = g_ptr_array_index (service_array, service_id);
+
+    return service ? service->name : NULL;
+}
+
+json_t *
+searpc_server_get_function_ids (const char *svc_name)
+{
+    SearpcService *service = g_hash_table_lookup (service_table, svc_name);
+    json_t *object, *functions;
+    guint i;
+
+    if (!service)
+        return NULL;
+
+    functions = json_object ();
+    for (i = 0; i < service->funcs->len; i++) {
+        FuncItem *fitem = g_ptr_array_index (service->funcs, i);
+        json_object_set_new (functions, fitem->fname, json_integer (fitem->id));
     }
-#endif
 
-    json_decref(array);
+    object = json_object ();
+    json_object_set_new (object, "service", json_integer (service->id));
+    json_object_set_new (object, "functions", functions);
+    return object;
+}
 
-    return ret;
+void
+searpc_server_call_finished (const char *svc_name,
+                             const gchar *func, gsize len,
+                             SearpcCallTiming *timing)
+{
+    gint64 exec_usec, queue_usec = -1, write_usec = -1;
+    gint64 queued_at;
+
+    // Calls that failed before reaching a function aren't recorded.
+    if (!timing->called)
+        return;
+    timing->called = FALSE;
+
+    exec_usec = timing->marshal_end - timing->marshal_start;
+
+    // A request received after its connection was handed to a worker
+    // didn't wait for one, unless it's the first on the connection.
+    if (timing->received && timing->received <= timing->dequeued)
+        queued_at = timing->received;
+    else
+        queued_at = timing->accepted;
+    if (queued_at && timing->dequeued)
+        queue_usec = MAX (timing->dequeued - queued_at, 0);
+
+    if (timing->flushed)
+        write_usec = MAX (timing->flushed - timing->marshal_end, 0);
+
+    searpc_stats_record_call (timing->stats_id, exec_usec, queue_usec,
+                              write_usec, timing->failed);
+
+#ifdef __linux__
+    if (slow_log_enabled && !timing->hide_in_slow_log) {
+        // Bytes values aren't logged.
+        const char *end = memchr (func, '\0', len);
+        if (end)
+            len = end - func;
+        print_slow_log_if_necessary (svc_name, func, len, timing,
+                                     MAX (queue_usec, 0), exec_usec,
+                                     MAX (write_usec, 0));
+    }
+#endif
 }
 
 char* 
@@ -19,8 +19,36 @@ extern "C" {
 #define DFT_DOMAIN g_quark_from_string(G_LOG_DOMAIN)
 #endif
 
+/**
+ * SEARPC_STATS_SERVICE:
+ *
+ * Reserved service whose get_stats function returns, for every function
+ * that has been called, the number of calls and errors, the latency
+ * percentiles and the time spent waiting for a worker, grouped by
+ * service. It's only available if no service of
+ * this name is created.
+ */
+#define SEARPC_STATS_SERVICE "searpc-stats"
+
 typedef gchar* (*SearpcMarshalFunc) (void *func, json_t *param_array,
     gsize *ret_len);
+
+/**
+ * SearpcParamReader:
+ *
+ * The parameters of a call, read from the request without loading it into
+ * a json_t array. Index 0 is the function name, like in the array.
+ */
+typedef struct _SearpcParamReader SearpcParamReader;
+
+/**
+ * SearpcRawMarshalFunc:
+ *
+ * A marshal that gets its parameters from a #SearpcParamReader. It's only
+ * used for calls whose parameters are all strings or integers.
+ */
+typedef gchar* (*SearpcRawMarshalFunc) (void *func, SearpcParamReader *params,
+    gsize *ret_len);
 typedef void (*RegisterMarshalFunc) (void);
 
 LIBSEARPC_API
@@ -36,6 +64,143 @@ void searpc_set_json_to_ret_object (json_t *object, json_t *ret);
 LIBSEARPC_API
 char *searpc_marshal_set_ret_common (json_t *object, gsize *len, GError *error);
 
+/*
+ * Used by generated marshals to write the response for the value returned
+ * by an RPC function, and the error if @error is set. They take ownership of
+ * @ret and @error, like the functions above, but write the response text
+ * directly without building a json_t tree. The length of the response is
+ * stored in @len.
+ */
+LIBSEARPC_API
+char *searpc_marshal_write_ret_string (char *ret, gsize *len, GError *error);
+LIBSEARPC_API
+char *searpc_marshal_write_ret_int (gint64 ret, gsize *len, GError *error);
+LIBSEARPC_API
+char *searpc_marshal_write_ret_object (GObject *ret, gsize *len, GError *error);
+LIBSEARPC_API
+char *searpc_marshal_write_ret_objlist (GList *ret, gsize *len, GError *error);
+LIBSEARPC_API
+char *searpc_marshal_write_ret_json (json_t *ret, gsize *len, GError *error);
+
+/*
+ * Values of type "bytes", see SearpcBytesSection. Parameters point into
+ * the request and are only valid until the function returns, functions
+ * that keep the data must copy it. The returned value is unreferenced.
+ */
+LIBSEARPC_API
+GBytes *searpc_marshal_get_bytes_param (json_t *param_array, int index);
+LIBSEARPC_API
+char *searpc_marshal_write_ret_bytes (GBytes *ret, gsize *len, GError *error);
+
+/**
+ * SearpcObjStream:
+ *
+ * The value returned by functions of type "objstream": a list of objects
+ * produced one at a time, so that the whole list is never in memory. It's
+ * written like an objlist, in parts of about %SEARPC_STREAM_CHUNK_SIZE
+ * bytes if the transport can send them as they are written.
+ */
+typedef struct _SearpcObjStream SearpcObjStream;
+
+/**
+ * SearpcObjStreamNextFunc:
+ *
+ * Return the next object, which the stream takes ownership of, or NULL at
+ * the end of the list. Setting @error ends the list and fails the call.
+ */
+typedef GObject *(*SearpcObjStreamNextFunc) (void *state, GError **error);
+
+#define SEARPC_STREAM_CHUNK_SIZE (64 * 1024)
+
+/**
+ * searpc_obj_stream_new:
+ * @free_state: (nullable): called on @state once the stream is written.
+ */
+LIBSEARPC_API
+SearpcObjStream *searpc_obj_stream_new (SearpcObjStreamNextFunc next,
+                                        void *state,
+                                        GDestroyNotify free_state);
+
+LIBSEARPC_API
+char *searpc_marshal_write_ret_objstream (SearpcObjStream *ret, gsize *len,
+                                          GError *error);
+
+/**
+ * SearpcChunkFunc:
+ *
+ * Send @chunk, a complete response holding part of a streamed list, before
+ * the final response. Returns -1 if it couldn't be sent.
+ */
+typedef int (*SearpcChunkFunc) (const char *chunk, gsize len, void *user_data);
+
+/**
+ * searpc_server_set_chunk_func:
+ *
+ * Used by transports around a call on this thread to take the parts of
+ * streamed responses. The response returned by the call is the last part.
+ * Pass NULL to have streams written as one response again, which clients
+ * read like an objlist.
+ */
+LIBSEARPC_API
+void searpc_server_set_chunk_func (SearpcChunkFunc func, void *user_data);
+
+#define SEARPC_MAX_CALL_FDS 8
+
+/**
+ * SearpcCallFds:
+ * @fds: the descriptors passed with the call, owned by the transport.
+ * @ret_fds: the descriptors returned by the call, which the transport
+ * sends with the response and closes.
+ *
+ * File descriptors of parameters and values of type "fd", which go
+ * alongside the request and the response. In both directions, the call
+ * carries the index of the descriptor in these arrays, or -1.
+ */
+typedef struct {
+    const int *fds;
+    int n_fds;
+    int ret_fds[SEARPC_MAX_CALL_FDS];
+    int n_ret_fds;
+} SearpcCallFds;
+
+/**
+ * searpc_server_set_call_fds:
+ *
+ * Used by transports that can pass file descriptors around a call on this
+ * thread. Pass NULL after the call. Without it, "fd" parameters are -1
+ * and functions can't return descriptors.
+ */
+LIBSEARPC_API
+void searpc_server_set_call_fds (SearpcCallFds *fds);
+
+/*
+ * Get the descriptor passed as parameter @index, or -1. It's closed after
+ * the call, functions that keep it must dup() it.
+ */
+LIBSEARPC_API
+int searpc_marshal_get_fd_param (json_t *param_array, int index);
+
+/*
+ * Takes ownership of @ret, which is closed once sent. Returning a
+ * descriptor fails if the transport can't pass them.
+ */
+LIBSEARPC_API
+char *searpc_marshal_write_ret_fd (int ret, gsize *len, GError *error);
+
+/*
+ * Get parameter @index of a call, as json_string_value() and
+ * json_integer_value() would. The returned string is only valid until the
+ * marshal returns.
+ */
+LIBSEARPC_API
+const char *searpc_param_reader_get_string (SearpcParamReader *params, int index);
+LIBSEARPC_API
+gint64 searpc_param_reader_get_int (SearpcParamReader *params, int index);
+LIBSEARPC_API
+int searpc_param_reader_get_fd (SearpcParamReader *params, int index);
+LIBSEARPC_API
+GBytes *searpc_param_reader_get_bytes (SearpcParamReader *params, int index);
+
 /**
  * searpc_server_init:
  *
@@ -61,6 +226,30 @@ searpc_server_init_with_slow_log (RegisterMarshalFunc register_func,
 LIBSEARPC_API int
 searpc_server_reopen_slow_log (const char *slow_log_path);
 
+/**
+ * searpc_server_set_slow_log_options:
+ * @json: write one JSON object per line, with the function name, the
+ * request and response sizes, the thread id, the time breakdown and the
+ * error code of the call, instead of the text format.
+ * @max_request_len: cut requests after this many bytes. 0 leaves them out
+ * of JSON records, and -1 keeps them whole.
+ * @sample_rate: fraction of the slow calls that are logged, between 0 and 1.
+ *
+ * Only supported on Linux.
+ */
+LIBSEARPC_API void
+searpc_server_set_slow_log_options (gboolean json, gssize max_request_len,
+                                    double sample_rate);
+
+/**
+ * searpc_server_flush_slow_log:
+ *
+ * Slow calls are written to the slow log by a background thread. Write out
+ * the calls logged so far, e.g. before exiting.
+ */
+LIBSEARPC_API void
+searpc_server_flush_slow_log (void);
+
 /**
  * searpc_server_final:
  * 
@@ -88,6 +277,17 @@ int searpc_create_service (const char *svc_name);
 LIBSEARPC_API
 void searpc_remove_service (const char *svc_name);
 
+/**
+ * searpc_server_set_columnar_objlists:
+ *
+ * Return the objlist results of the functions of @svc_name in columnar
+ * form, see searpc_json_write_gobject_rows(). Clients of this version
+ * read both forms, older ones only the array of objects, so only enable
+ * it once the clients are updated. Returns -1 if there's no such service.
+ */
+LIBSEARPC_API
+int searpc_server_set_columnar_objlists (const char *svc_name, gboolean columnar);
+
 /**
  * searpc_server_register_marshal:
  *
@@ -100,6 +300,44 @@ LIBSEARPC_API
 gboolean searpc_server_register_marshal (gchar *signature,
                                          SearpcMarshalFunc marshal);
 
+/**
+ * searpc_server_register_marshal_full:
+ * @raw_marshal: (nullable): used instead of @marshal for calls that can be
+ * read with a #SearpcParamReader.
+ *
+ * Like searpc_server_register_marshal(), with a marshal that reads the
+ * parameters without building a json_t array.
+ */
+LIBSEARPC_API
+gboolean searpc_server_register_marshal_full (gchar *signature,
+                                              SearpcMarshalFunc marshal,
+                                              SearpcRawMarshalFunc raw_marshal);
+
+/**
+ * SearpcMarshalEntry:
+ *
+ * A marshal in the static table generated by searpc-codegen.py, with its
+ * precomputed signature.
+ */
+typedef struct {
+    const char *signature;
+    SearpcMarshalFunc marshal;
+    SearpcRawMarshalFunc raw_marshal;
+} SearpcMarshalEntry;
+
+/**
+ * searpc_server_register_marshal_table:
+ *
+ * Register the marshals in @table, which must stay valid until
+ * searpc_server_final() is called. The entries aren't copied, and are
+ * searched by bisection if they are sorted by signature like the table
+ * generated by searpc-codegen.py. A signature that is also registered
+ * with searpc_server_register_marshal() uses that marshal.
+ */
+LIBSEARPC_API
+void searpc_server_register_marshal_table (const SearpcMarshalEntry *table,
+                                           int n_entries);
+
 /**
  * searpc_server_register_function:
  *
@@ -114,6 +352,20 @@ gboolean searpc_server_register_function (const char *service,
                                           const gchar *fname,
                                           gchar *signature);
 
+/**
+ * searpc_server_register_function_with_marshal:
+ * @marshal: an entry of the generated marshal table, e.g.
+ * &searpc_marshal_table[SEARPC_MARSHAL_STRING__STRING_INT].
+ *
+ * Like searpc_server_register_function(), without computing and looking up
+ * the signature.
+ */
+LIBSEARPC_API
+gboolean searpc_server_register_function_with_marshal (const char *service,
+                                                       void *func,
+                                                       const gchar *fname,
+                                                       const SearpcMarshalEntry *marshal);
+
 /**
  * searpc_server_call_function:
  * @service: service name.
@@ -123,12 +375,161 @@ gboolean searpc_server_register_function (const char *service,
  *
  * Call a registered function @func of a service.
  *
+ * @func may also be a batch, the array of several calls, which are run in
+ * order and answered with the array of their responses. Streams are
+ * returned whole in a batch, and its calls can't pass descriptors or
+ * return bytes values. See searpc_server_set_batch_parallelism() to run
+ * them at the same time.
+ *
  * Returns the serialized representatio of the returned value.
  */
 LIBSEARPC_API
 gchar *searpc_server_call_function (const char *service,
                                     gchar *func, gsize len, gsize *ret_len);
 
+/**
+ * searpc_server_call_function_in_place:
+ *
+ * Like searpc_server_call_function(), for callers that own the buffer of
+ * the call, which is read in place instead of being copied: @func is
+ * modified during the call and restored before it returns, so it must be
+ * writable and not be read by other threads meanwhile.
+ */
+LIBSEARPC_API
+gchar *searpc_server_call_function_in_place (const char *service,
+                                             gchar *func, gsize len,
+                                             gsize *ret_len);
+
+/**
+ * SearpcCallTiming:
+ * @accepted: when the connection was accepted. Only set for the first
+ * request on a connection.
+ * @received: when the request was completely read.
+ * @dequeued: when a worker picked up the request, or the connection for
+ * transports that hand whole connections to workers.
+ * @marshal_start: when the server started to parse the request.
+ * @marshal_end: when the function returned and its result was serialized.
+ * @flushed: when the response was completely written.
+ *
+ * Timestamps of one call, in g_get_monotonic_time() microseconds, 0 when
+ * unknown. The time between @received (or @accepted) and @dequeued is the
+ * time the call waited for a free worker.
+ */
+typedef struct {
+    gint64 accepted;
+    gint64 received;
+    gint64 dequeued;
+    gint64 marshal_start;
+    gint64 marshal_end;
+    gint64 flushed;
+
+    /* < private > */
+    gboolean called;
+    gboolean failed;
+    int err_code;
+    gsize ret_len;
+    const char *fname;
+    long thread_id;
+    gboolean hide_in_slow_log;
+    int stats_id;
+} SearpcCallTiming;
+
+/**
+ * searpc_server_set_batch_parallelism:
+ *
+ * Run up to @max_calls calls of a batch at the same time, on the thread
+ * that read the batch and on idle workers of the transport. The responses
+ * keep the order of the calls. The default of 1 runs the calls one after
+ * the other, calls that depend on each other must then be sent in
+ * separate batches.
+ */
+LIBSEARPC_API
+void searpc_server_set_batch_parallelism (int max_calls);
+
+/**
+ * SearpcBatchRunFunc:
+ *
+ * Have searpc_server_run_batch_task() called with @task on another thread,
+ * without waiting for it. Returns FALSE if no thread is available.
+ */
+typedef gboolean (*SearpcBatchRunFunc) (void *task, void *user_data);
+
+/**
+ * searpc_server_set_batch_runner:
+ *
+ * Used by transports with a pool of workers around a call on this thread,
+ * so the calls of a batch can run on the workers. Pass NULL after the call.
+ */
+LIBSEARPC_API
+void searpc_server_set_batch_runner (SearpcBatchRunFunc func, void *user_data);
+
+LIBSEARPC_API
+void searpc_server_run_batch_task (void *task);
+
+/**
+ * searpc_server_call_function_with_timing:
+ * @timing: timestamps set by the transport, completed by the server.
+ *
+ * Like searpc_server_call_function(), but the call isn't counted in the
+ * statistics and the slow log until searpc_server_call_finished() is
+ * called, so the time spent waiting for a worker and writing the
+ * response can be included.
+ *
+ * Parameters are read in place: @func is modified during the call and
+ * restored before it returns, so it must be writable and not be read by
+ * other threads meanwhile.
+ */
+LIBSEARPC_API
+gchar *searpc_server_call_function_with_timing (const char *service,
+                                                gchar *func, gsize len,
+                                                gsize *ret_len,
+                                                SearpcCallTiming *timing);
+
+/**
+ * searpc_server_call_finished:
+ *
+ * Record a call made with searpc_server_call_function_with_timing() after
+ * its response has been written. @service, @func and @len must be the
+ * same as in that call.
+ */
+LIBSEARPC_API
+void searpc_server_call_finished (const char *service,
+                                  const gchar *func, gsize len,
+                                  SearpcCallTiming *timing);
+
+/**
+ * searpc_server_get_function_ids:
+ *
+ * Return the ids of @service and of its functions as a JSON object of the
+ * form {"service": <id>, "functions": {<name>: <id>, ...}}, or NULL if
+ * there's no such service. A call may name its function by id instead of
+ * name, as in [<id>, <param1>, ...]. Ids stay the same until the server is
+ * freed, and a function registered again keeps its id.
+ */
+LIBSEARPC_API
+json_t *searpc_server_get_function_ids (const char *service);
+
+/**
+ * searpc_server_get_service_name:
+ *
+ * Returns the name of the service with id @service_id, or NULL.
+ */
+LIBSEARPC_API
+const char *searpc_server_get_service_name (int service_id);
+
+/**
+ * searpc_server_call_function_by_id_with_timing:
+ *
+ * Like searpc_server_call_function_with_timing(), with the service given
+ * by its id. The service name to pass to searpc_server_call_finished()
+ * is returned by searpc_server_get_service_name().
+ */
+LIBSEARPC_API
+gchar *searpc_server_call_function_by_id_with_timing (int service_id,
+                                                      gchar *func, gsize len,
+                                                      gsize *ret_len,
+                                                      SearpcCallTiming *timing);
+
 /**
  * searpc_compute_signature:
  * @ret_type: the return type of the function.
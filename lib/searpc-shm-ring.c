@@ -0,0 +1,510 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#include <glib.h>
+
+#include "searpc-shm-ring.h"
+
+#ifdef __linux__
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ __volatile__ ("pause")
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__ ("yield")
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+// Room for the positions and flags before the data of a ring.
+#define RING_HEADER_SIZE 4096
+
+typedef struct {
+    // Written by the reader.
+    gint head;
+    gint reader_waiting;
+    // Keeps the fields of the reader and the writer on separate cache lines.
+    char padding[120];
+    // Written by the writer.
+    gint tail;
+    gint writer_waiting;
+} RingHeader;
+
+// One direction of the channel, as seen by one of the sides.
+typedef struct {
+    RingHeader *hdr;
+    char *data;
+    guint32 size;
+    // The head if we read the ring, the tail if we write it. The copy in
+    // shared memory is only written, since the peer may change it.
+    guint32 pos;
+    int data_fd;
+    int space_fd;
+} ShmRing;
+
+struct _SearpcShmChannel {
+    char *map;
+    gsize map_size;
+    ShmRing in;
+    ShmRing out;
+    int fds[SEARPC_SHM_N_FDS];
+    // Tells whether the peer is still there.
+    int sockfd;
+    int spin_us;
+};
+
+static gboolean
+ring_size_is_valid (gsize ring_size)
+{
+    return ring_size >= SEARPC_SHM_MIN_RING_SIZE &&
+        ring_size <= SEARPC_SHM_MAX_RING_SIZE &&
+        (ring_size & (ring_size - 1)) == 0;
+}
+
+static gsize
+channel_map_size (gsize ring_size)
+{
+    return 2 * (RING_HEADER_SIZE + ring_size);
+}
+
+static void
+close_fds (int fds[SEARPC_SHM_N_FDS])
+{
+    int i;
+
+    for (i = 0; i < SEARPC_SHM_N_FDS; i++) {
+        if (fds[i] >= 0)
+            close (fds[i]);
+    }
+}
+
+static void
+init_ring (ShmRing *ring, char *base, gsize ring_size, int data_fd, int space_fd)
+{
+    ring->hdr = (RingHeader *)base;
+    ring->data = base + RING_HEADER_SIZE;
+    ring->size = (guint32)ring_size;
+    ring->pos = 0;
+    ring->data_fd = data_fd;
+    ring->space_fd = space_fd;
+}
+
+// Map the memory of @fds. The client writes to the first ring and the
+// server to the second one. Closes @fds on failure.
+static SearpcShmChannel *
+map_channel (int fds[SEARPC_SHM_N_FDS], gsize ring_size, int spin_us,
+             int sockfd, gboolean is_client)
+{
+    SearpcShmChannel *channel;
+    gsize map_size = channel_map_size (ring_size);
+    char *map;
+    char *first, *second;
+
+    map = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        g_warning ("failed to map rpc shared memory: %s\n", strerror(errno));
+        close_fds (fds);
+        return NULL;
+    }
+
+    channel = g_new0 (SearpcShmChannel, 1);
+    channel->map = map;
+    channel->map_size = map_size;
+    memcpy (channel->fds, fds, sizeof(channel->fds));
+    channel->sockfd = sockfd;
+    // Spinning on the only CPU just delays the peer.
+    channel->spin_us = g_get_num_processors () > 1 ? MAX (spin_us, 0) : 0;
+
+    first = map;
+    second = map + RING_HEADER_SIZE + ring_size;
+    if (is_client) {
+        init_ring (&channel->out, first, ring_size, fds[1], fds[2]);
+        init_ring (&channel->in, second, ring_size, fds[3], fds[4]);
+    } else {
+        init_ring (&channel->in, first, ring_size, fds[1], fds[2]);
+        init_ring (&channel->out, second, ring_size, fds[3], fds[4]);
+    }
+
+    return channel;
+}
+
+SearpcShmChannel *
+searpc_shm_channel_create (gsize ring_size, int spin_us, int sockfd)
+{
+    int fds[SEARPC_SHM_N_FDS];
+    int i;
+
+    if (!ring_size_is_valid (ring_size)) {
+        g_warning ("invalid rpc shared memory ring size %" G_GSIZE_FORMAT "\n", ring_size);
+        return NULL;
+    }
+
+#ifdef SYS_memfd_create
+    fds[0] = (int)syscall (SYS_memfd_create, "searpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    fds[0] = -1;
+    errno = ENOSYS;
+#endif
+    if (fds[0] < 0) {
+        g_warning ("failed to create rpc shared memory: %s\n", strerror(errno));
+        return NULL;
+    }
+    for (i = 1; i < SEARPC_SHM_N_FDS; i++)
+        fds[i] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    for (i = 1; i < SEARPC_SHM_N_FDS; i++) {
+        if (fds[i] < 0) {
+            g_warning ("failed to create eventfd: %s\n", strerror(errno));
+            close_fds (fds);
+            return NULL;
+        }
+    }
+
+    if (ftruncate (fds[0], channel_map_size (ring_size)) < 0) {
+        g_warning ("failed to size rpc shared memory: %s\n", strerror(errno));
+        close_fds (fds);
+        return NULL;
+    }
+#ifdef F_ADD_SEALS
+    // The server refuses memory that could shrink under its mapping.
+    fcntl (fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+    return map_channel (fds, ring_size, spin_us, sockfd, TRUE);
+}
+
+void
+searpc_shm_channel_get_fds (SearpcShmChannel *channel, int fds[SEARPC_SHM_N_FDS])
+{
+    memcpy (fds, channel->fds, sizeof(channel->fds));
+}
+
+SearpcShmChannel *
+searpc_shm_channel_open (int fds[SEARPC_SHM_N_FDS], gsize ring_size,
+                         int spin_us, int sockfd)
+{
+    struct stat st;
+    int i;
+
+    if (!ring_size_is_valid (ring_size) ||
+        fstat (fds[0], &st) < 0 || !S_ISREG(st.st_mode) ||
+        (gsize)st.st_size != channel_map_size (ring_size)) {
+        g_warning ("invalid rpc shared memory\n");
+        close_fds (fds);
+        return NULL;
+    }
+#ifdef F_GET_SEALS
+    int seals = fcntl (fds[0], F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        g_warning ("rpc shared memory isn't sealed\n");
+        close_fds (fds);
+        return NULL;
+    }
+#endif
+    // Reading an eventfd must never block, whatever the client set.
+    for (i = 1; i < SEARPC_SHM_N_FDS; i++) {
+        int flags = fcntl (fds[i], F_GETFL, 0);
+        if (flags < 0 || fcntl (fds[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+            g_warning ("invalid rpc shared memory eventfd\n");
+            close_fds (fds);
+            return NULL;
+        }
+    }
+
+    return map_channel (fds, ring_size, spin_us, sockfd, FALSE);
+}
+
+// Bytes the reader of @ring may take, or -1 if the writer's position is
+// impossible.
+static gint64
+ring_readable (ShmRing *ring)
+{
+    guint32 n = (guint32)g_atomic_int_get (&ring->hdr->tail) - ring->pos;
+
+    return n <= ring->size ? n : -1;
+}
+
+// Bytes the writer of @ring may add, or -1 if the reader's position is
+// impossible.
+static gint64
+ring_writable (ShmRing *ring)
+{
+    guint32 used = ring->pos - (guint32)g_atomic_int_get (&ring->hdr->head);
+
+    return used <= ring->size ? ring->size - used : -1;
+}
+
+static gboolean
+ring_is_ready (ShmRing *ring, gboolean writing)
+{
+    return (writing ? ring_writable (ring) : ring_readable (ring)) != 0;
+}
+
+static void
+ring_kick (int fd)
+{
+    guint64 one = 1;
+
+    if (write (fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        g_warning ("failed to signal eventfd: %s\n", strerror(errno));
+}
+
+// Wait until @ring has data, or space if @writing. Returns 1 when it has
+// (or when its positions are corrupt, which the caller finds out), 0 if
+// the peer closed the socket, and -1 on errors.
+static int
+ring_wait (SearpcShmChannel *channel, ShmRing *ring, gboolean writing)
+{
+    gint *waiting = writing ? &ring->hdr->writer_waiting : &ring->hdr->reader_waiting;
+    int efd = writing ? ring->space_fd : ring->data_fd;
+    gint64 spin_until = g_get_monotonic_time () + channel->spin_us;
+    struct pollfd pfd[2];
+    guint64 count;
+    int ret;
+
+    // The peer usually answers sooner than a sleeping thread is woken up.
+    do {
+        if (ring_is_ready (ring, writing))
+            return 1;
+        cpu_relax ();
+    } while (g_get_monotonic_time () < spin_until);
+
+    while (1) {
+        // The peer only signals the eventfd if it sees the flag after
+        // moving its position, so check again once the flag is set.
+        g_atomic_int_set (waiting, 1);
+        if (ring_is_ready (ring, writing))
+            break;
+
+        pfd[0].fd = efd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = channel->sockfd;
+        pfd[1].events = POLLRDHUP;
+        ret = poll (pfd, 2, -1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            g_atomic_int_set (waiting, 0);
+            return -1;
+        }
+        if (pfd[0].revents & POLLIN) {
+            if (read (efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                g_atomic_int_set (waiting, 0);
+                return -1;
+            }
+        }
+        if (pfd[1].revents) {
+            g_atomic_int_set (waiting, 0);
+            return ring_is_ready (ring, writing) ? 1 : 0;
+        }
+    }
+    g_atomic_int_set (waiting, 0);
+
+    return 1;
+}
+
+// Take @n bytes the writer of @ring made available.
+static void
+ring_take (ShmRing *ring, char *ptr, gsize n)
+{
+    gsize off = ring->pos & (ring->size - 1);
+    gsize first = MIN (n, ring->size - off);
+
+    memcpy (ptr, ring->data + off, first);
+    memcpy (ptr + first, ring->data, n - first);
+    ring->pos += (guint32)n;
+
+    g_atomic_int_set (&ring->hdr->head, (gint)ring->pos);
+    if (g_atomic_int_get (&ring->hdr->writer_waiting))
+        ring_kick (ring->space_fd);
+}
+
+gssize
+searpc_shm_channel_read_n (SearpcShmChannel *channel, void *buf, gsize n)
+{
+    ShmRing *ring = &channel->in;
+    char *ptr = buf;
+    gsize done = 0, part;
+    gint64 avail;
+    int ret;
+
+    while (done < n) {
+        avail = ring_readable (ring);
+        if (avail < 0) {
+            g_warning ("invalid rpc shared memory ring position\n");
+            errno = EPROTO;
+            return -1;
+        }
+        if (avail == 0) {
+            ret = ring_wait (channel, ring, FALSE);
+            if (ret <= 0)
+                return ret < 0 ? -1 : (gssize)done;
+            continue;
+        }
+
+        part = MIN ((gsize)avail, n - done);
+        ring_take (ring, ptr + done, part);
+        done += part;
+    }
+
+    return n;
+}
+
+gssize
+searpc_shm_channel_read (SearpcShmChannel *channel, void *buf, gsize n)
+{
+    ShmRing *ring = &channel->in;
+    gint64 avail = ring_readable (ring);
+    guint64 count;
+
+    if (avail == 0) {
+        // Like in ring_wait(), the flag is set before checking again.
+        if (read (ring->data_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return -1;
+        g_atomic_int_set (&ring->hdr->reader_waiting, 1);
+        avail = ring_readable (ring);
+        if (avail == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    g_atomic_int_set (&ring->hdr->reader_waiting, 0);
+    if (avail < 0) {
+        g_warning ("invalid rpc shared memory ring position\n");
+        errno = EPROTO;
+        return -1;
+    }
+
+    n = MIN ((gsize)avail, n);
+    ring_take (ring, buf, n);
+    return n;
+}
+
+int
+searpc_shm_channel_get_read_fd (SearpcShmChannel *channel)
+{
+    return channel->in.data_fd;
+}
+
+gssize
+searpc_shm_channel_write_n (SearpcShmChannel *channel, const void *buf, gsize n,
+                            gboolean more)
+{
+    ShmRing *ring = &channel->out;
+    const char *ptr = buf;
+    gsize done = 0, part, first, off;
+    gint64 space;
+    int ret;
+
+    while (done < n) {
+        space = ring_writable (ring);
+        if (space < 0) {
+            g_warning ("invalid rpc shared memory ring position\n");
+            errno = EPROTO;
+            return -1;
+        }
+        if (space == 0) {
+            // The reader must take what's there before we can go on.
+            if (g_atomic_int_get (&ring->hdr->reader_waiting))
+                ring_kick (ring->data_fd);
+            ret = ring_wait (channel, ring, TRUE);
+            if (ret == 0)
+                errno = EPIPE;
+            if (ret <= 0)
+                return -1;
+            continue;
+        }
+
+        part = MIN ((gsize)space, n - done);
+        off = ring->pos & (ring->size - 1);
+        first = MIN (part, ring->size - off);
+        memcpy (ring->data + off, ptr + done, first);
+        memcpy (ring->data, ptr + done + first, part - first);
+        ring->pos += (guint32)part;
+        done += part;
+
+        g_atomic_int_set (&ring->hdr->tail, (gint)ring->pos);
+    }
+    if (!more && g_atomic_int_get (&ring->hdr->reader_waiting))
+        ring_kick (ring->data_fd);
+
+    return n;
+}
+
+void
+searpc_shm_channel_free (SearpcShmChannel *channel)
+{
+    if (!channel)
+        return;
+    munmap (channel->map, channel->map_size);
+    close_fds (channel->fds);
+    g_free (channel);
+}
+
+#else // __linux__
+
+SearpcShmChannel *
+searpc_shm_channel_create (gsize ring_size, int spin_us, int sockfd)
+{
+    return NULL;
+}
+
+void
+searpc_shm_channel_get_fds (SearpcShmChannel *channel, int fds[SEARPC_SHM_N_FDS])
+{
+}
+
+// Not called elsewhere, since only Linux servers accept the descriptors.
+SearpcShmChannel *
+searpc_shm_channel_open (int fds[SEARPC_SHM_N_FDS], gsize ring_size,
+                         int spin_us, int sockfd)
+{
+    return NULL;
+}
+
+gssize
+searpc_shm_channel_read_n (SearpcShmChannel *channel, void *buf, gsize n)
+{
+    return -1;
+}
+
+gssize
+searpc_shm_channel_read (SearpcShmChannel *channel, void *buf, gsize n)
+{
+    return -1;
+}
+
+int
+searpc_shm_channel_get_read_fd (SearpcShmChannel *channel)
+{
+    return -1;
+}
+
+gssize
+searpc_shm_channel_write_n (SearpcShmChannel *channel, const void *buf, gsize n,
+                            gboolean more)
+{
+    return -1;
+}
+
+void
+searpc_shm_channel_free (SearpcShmChannel *channel)
+{
+}
+
+#endif // __linux__
@@ -0,0 +1,79 @@
+#ifndef SEARPC_SHM_RING_H
+#define SEARPC_SHM_RING_H
+
+#include <glib.h>
+
+// A byte stream between two processes on the same host, carried by a pair
+// of single-producer single-consumer rings in shared memory. The named pipe
+// transport moves a connection onto it after the peers have exchanged the
+// file descriptors over the socket, and keeps the socket to tell whether
+// the peer is still there. Only supported on Linux, elsewhere creating or
+// opening a channel fails.
+//
+// The shared memory is a memfd holding the ring of the requests followed
+// by the ring of the responses. Each ring is a page of positions and
+// flags, followed by its data. Positions are free running 32-bit counters,
+// so the ring size must be a power of two. A reader or writer that finds
+// nothing to do spins for a while, then sets its waiting flag and sleeps on
+// an eventfd, which the other side signals after moving its position.
+// Each ring has an eventfd for data and one for space.
+
+// The memfd, then the data and space eventfds of each ring.
+#define SEARPC_SHM_N_FDS 5
+
+#define SEARPC_SHM_MIN_RING_SIZE 4096
+#define SEARPC_SHM_MAX_RING_SIZE (1 << 30)
+
+typedef struct _SearpcShmChannel SearpcShmChannel;
+
+// Create the shared memory and eventfds of a channel for the client of
+// the connection @sockfd. @ring_size must be a power of two. Spinning for
+// @spin_us microseconds before sleeping trades CPU for latency.
+G_GNUC_INTERNAL
+SearpcShmChannel *
+searpc_shm_channel_create (gsize ring_size, int spin_us, int sockfd);
+
+// The descriptors to send to the server. They stay owned by @channel.
+G_GNUC_INTERNAL
+void
+searpc_shm_channel_get_fds (SearpcShmChannel *channel, int fds[SEARPC_SHM_N_FDS]);
+
+// Map the channel created by the client of the connection @sockfd. Takes
+// over @fds, also on failure. Returns NULL if they don't describe a
+// channel with rings of @ring_size bytes.
+G_GNUC_INTERNAL
+SearpcShmChannel *
+searpc_shm_channel_open (int fds[SEARPC_SHM_N_FDS], gsize ring_size,
+                         int spin_us, int sockfd);
+
+// Like pipe_read_n(): returns @n, less if the peer is gone, or -1 on
+// errors. Only one thread may read at a time.
+G_GNUC_INTERNAL
+gssize
+searpc_shm_channel_read_n (SearpcShmChannel *channel, void *buf, gsize n);
+
+// Read up to @n bytes without waiting. If none is there, returns -1 with
+// errno set to EAGAIN, and the descriptor returned by
+// searpc_shm_channel_get_read_fd() becomes readable once the peer writes.
+// The peer going away isn't detected here, the socket tells.
+G_GNUC_INTERNAL
+gssize
+searpc_shm_channel_read (SearpcShmChannel *channel, void *buf, gsize n);
+
+G_GNUC_INTERNAL
+int
+searpc_shm_channel_get_read_fd (SearpcShmChannel *channel);
+
+// Returns @n, or -1 if the peer is gone or on errors. With @more, the
+// reader isn't woken up since the rest of the message follows right away.
+// Only one thread may write at a time.
+G_GNUC_INTERNAL
+gssize
+searpc_shm_channel_write_n (SearpcShmChannel *channel, const void *buf, gsize n,
+                            gboolean more);
+
+G_GNUC_INTERNAL
+void
+searpc_shm_channel_free (SearpcShmChannel *channel);
+
+#endif
@@ -0,0 +1,399 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "searpc-slow-log.h"
+
+// Each thread gets a ring when it first logs a call. A record takes at most
+// a quarter of it, longer requests are cut.
+#define RING_SIZE (256 * 1024)
+#define MAX_RECORD_SIZE (RING_SIZE / 4)
+#define MAX_NAME_LEN 1024
+
+// How often the writer thread looks for new records.
+#define WRITE_INTERVAL_USEC (200 * 1000)
+
+// A record in a ring is this header followed by the service name, the
+// function name and the request.
+typedef struct {
+    guint32 size;
+    guint32 service_len;
+    guint32 function_len;
+    guint32 request_len;
+    gboolean truncated;
+    gboolean failed;
+    int err_code;
+    long thread_id;
+    guint64 request_bytes;
+    guint64 response_bytes;
+    gint64 start_usec;
+    gint64 queue_usec;
+    gint64 exec_usec;
+    gint64 write_usec;
+} RecordHeader;
+
+// Single producer, single consumer ring. The positions keep growing and
+// wrap around; only the owner thread moves @head and only the thread
+// holding writer_lock moves @tail.
+typedef struct SlowLogRing {
+    char *buf;
+    guint head;
+    guint tail;
+    // Set when the owner thread exits. The ring is freed once it's empty.
+    gint orphaned;
+    gboolean can_free;
+    struct SlowLogRing *next;
+} SlowLogRing;
+
+// New rings are added at the head of the list under rings_lock. Only the
+// consumer removes them.
+static GMutex rings_lock;
+static SlowLogRing *rings;
+
+// Held while draining the rings. Also protects the file.
+static GMutex writer_lock;
+static FILE *log_fp;
+static char *line_prefix;
+static GThread *writer_thread;
+
+static gint n_dropped;
+static guint n_dropped_reported;
+
+// Only changed when the server is set up.
+static gboolean json_format;
+static gssize max_request_bytes = -1;
+
+static void
+release_ring (gpointer data)
+{
+    SlowLogRing *ring = data;
+
+    g_atomic_int_set (&ring->orphaned, 1);
+}
+
+static GPrivate current_ring = G_PRIVATE_INIT (release_ring);
+
+static SlowLogRing *
+get_ring (void)
+{
+    SlowLogRing *ring = g_private_get (&current_ring);
+
+    if (ring)
+        return ring;
+
+    ring = g_new0 (SlowLogRing, 1);
+    ring->buf = g_malloc (RING_SIZE);
+
+    g_mutex_lock (&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    g_mutex_unlock (&rings_lock);
+
+    g_private_set (&current_ring, ring);
+    return ring;
+}
+
+static void
+ring_copy_in (SlowLogRing *ring, guint pos, const void *data, gsize n)
+{
+    guint off = pos & (RING_SIZE - 1);
+    gsize first = MIN (n, RING_SIZE - off);
+
+    memcpy (ring->buf + off, data, first);
+    memcpy (ring->buf, (const char *)data + first, n - first);
+}
+
+static void
+ring_copy_out (SlowLogRing *ring, guint pos, void *data, gsize n)
+{
+    guint off = pos & (RING_SIZE - 1);
+    gsize first = MIN (n, RING_SIZE - off);
+
+    memcpy (data, ring->buf + off, first);
+    memcpy ((char *)data + first, ring->buf, n - first);
+}
+
+void
+searpc_slow_log_push (const SearpcSlowCall *call)
+{
+    SlowLogRing *ring = get_ring ();
+    RecordHeader hdr;
+    gsize service_len = MIN (strlen (call->service), MAX_NAME_LEN);
+    gsize function_len = call->function ? MIN (strlen (call->function), MAX_NAME_LEN) : 0;
+    gsize request_len = call->request_len;
+    gsize max_len = MAX_RECORD_SIZE - sizeof(hdr) - service_len - function_len;
+    guint head = ring->head;
+
+    if (max_request_bytes >= 0)
+        max_len = MIN (max_len, (gsize)max_request_bytes);
+
+    memset (&hdr, 0, sizeof(hdr));
+    if (request_len > max_len) {
+        // Don't cut a UTF-8 character in half.
+        request_len = max_len;
+        while (request_len > 0 && (call->request[request_len] & 0xC0) == 0x80)
+            request_len--;
+        hdr.truncated = TRUE;
+    }
+    hdr.size = (guint32)(sizeof(hdr) + service_len + function_len + request_len);
+    hdr.service_len = (guint32)service_len;
+    hdr.function_len = (guint32)function_len;
+    hdr.request_len = (guint32)request_len;
+    hdr.failed = call->failed;
+    hdr.err_code = call->err_code;
+    hdr.thread_id = call->thread_id;
+    hdr.request_bytes = call->request_len;
+    hdr.response_bytes = call->response_len;
+    hdr.start_usec = call->start_usec;
+    hdr.queue_usec = call->queue_usec;
+    hdr.exec_usec = call->exec_usec;
+    hdr.write_usec = call->write_usec;
+
+    if (RING_SIZE - (head - (guint)g_atomic_int_get (&ring->tail)) < hdr.size) {
+        g_atomic_int_inc (&n_dropped);
+        return;
+    }
+
+    ring_copy_in (ring, head, &hdr, sizeof(hdr));
+    ring_copy_in (ring, head + sizeof(hdr), call->service, service_len);
+    ring_copy_in (ring, head + sizeof(hdr) + service_len, call->function, function_len);
+    ring_copy_in (ring, head + sizeof(hdr) + service_len + function_len,
+                  call->request, request_len);
+    g_atomic_int_set (&ring->head, head + hdr.size);
+}
+
+static void
+format_time (gint64 usec, char *buf, gsize size)
+{
+    time_t t = (time_t)(usec / G_USEC_PER_SEC);
+
+    strftime (buf, size, "%Y/%m/%d %H:%M:%S", localtime (&t));
+}
+
+static void
+json_object_set_stringn (json_t *object, const char *key, const char *str, gsize len)
+{
+    char *copy = g_strndup (str, len);
+    // Requests that aren't valid UTF-8 are left out.
+    json_t *value = json_string (copy);
+
+    json_object_set_new (object, key, value ? value : json_null ());
+    g_free (copy);
+}
+
+static void
+write_json_record (const RecordHeader *hdr, const char *service,
+                   const char *function, const char *request,
+                   const char *time_buf, gint64 total_usec)
+{
+    json_t *object = json_object ();
+    char *line;
+
+    json_object_set_new (object, "time", json_string (time_buf));
+    json_object_set_stringn (object, "service", service, hdr->service_len);
+    if (hdr->function_len > 0)
+        json_object_set_stringn (object, "function", function, hdr->function_len);
+    json_object_set_new (object, "thread", json_integer (hdr->thread_id));
+    json_object_set_new (object, "request_bytes", json_integer ((json_int_t)hdr->request_bytes));
+    json_object_set_new (object, "response_bytes", json_integer ((json_int_t)hdr->response_bytes));
+    json_object_set_new (object, "total_usec", json_integer (total_usec));
+    json_object_set_new (object, "queue_usec", json_integer (hdr->queue_usec));
+    json_object_set_new (object, "exec_usec", json_integer (hdr->exec_usec));
+    json_object_set_new (object, "write_usec", json_integer (hdr->write_usec));
+    if (hdr->failed)
+        json_object_set_new (object, "err_code", json_integer (hdr->err_code));
+    if (max_request_bytes != 0) {
+        json_object_set_stringn (object, "request", request, hdr->request_len);
+        if (hdr->truncated)
+            json_object_set_new (object, "truncated", json_true ());
+    }
+
+    line = json_dumps (object, JSON_COMPACT | JSON_PRESERVE_ORDER);
+    fprintf (log_fp, "%s\n", line);
+    free (line);
+    json_decref (object);
+}
+
+static void
+write_record (const RecordHeader *hdr, const char *service,
+              const char *function, const char *request)
+{
+    char time_buf[64];
+    gint64 total_usec = hdr->queue_usec + hdr->exec_usec + hdr->write_usec;
+
+    format_time (hdr->start_usec, time_buf, sizeof(time_buf));
+
+    if (line_prefix) {
+        fputs (line_prefix, log_fp);
+    }
+    if (json_format) {
+        write_json_record (hdr, service, function, request, time_buf, total_usec);
+        return;
+    }
+    fprintf (log_fp, "[%s] \"%.*s\" %.*s%s %.3f queue=%.3f exec=%.3f write=%.3f\n",
+             time_buf, (int)hdr->service_len, service,
+             (int)hdr->request_len, request, hdr->truncated ? "..." : "",
+             (double)total_usec / G_USEC_PER_SEC,
+             (double)hdr->queue_usec / G_USEC_PER_SEC,
+             (double)hdr->exec_usec / G_USEC_PER_SEC,
+             (double)hdr->write_usec / G_USEC_PER_SEC);
+}
+
+// Write out the records of @ring. Returns the number of records.
+static int
+drain_ring (SlowLogRing *ring, GString *scratch)
+{
+    RecordHeader hdr;
+    guint head = (guint)g_atomic_int_get (&ring->head);
+    guint tail = ring->tail;
+    int n = 0;
+
+    while (tail != head) {
+        ring_copy_out (ring, tail, &hdr, sizeof(hdr));
+        g_string_set_size (scratch, hdr.size - sizeof(hdr));
+        ring_copy_out (ring, tail + sizeof(hdr), scratch->str, hdr.size - sizeof(hdr));
+        if (log_fp) {
+            const char *function = scratch->str + hdr.service_len;
+            write_record (&hdr, scratch->str, function, function + hdr.function_len);
+        }
+        tail += hdr.size;
+        g_atomic_int_set (&ring->tail, tail);
+        n++;
+    }
+
+    return n;
+}
+
+// Called with writer_lock held.
+static void
+drain_rings (void)
+{
+    static GString *scratch;
+    SlowLogRing *ring, **prev;
+    gboolean free_rings = FALSE;
+    guint dropped;
+    int n = 0;
+
+    if (!scratch)
+        scratch = g_string_new (NULL);
+
+    // The rings after the list head only change when we free them.
+    g_mutex_lock (&rings_lock);
+    ring = rings;
+    g_mutex_unlock (&rings_lock);
+
+    for (; ring; ring = ring->next) {
+        // The owner doesn't write after marking the ring, so it's really
+        // empty after the drain.
+        gboolean orphaned = g_atomic_int_get (&ring->orphaned);
+        n += drain_ring (ring, scratch);
+        if (orphaned) {
+            ring->can_free = TRUE;
+            free_rings = TRUE;
+        }
+    }
+
+    dropped = (guint)g_atomic_int_get (&n_dropped);
+    if (dropped != n_dropped_reported && log_fp) {
+        char time_buf[64];
+        format_time (g_get_real_time (), time_buf, sizeof(time_buf));
+        if (line_prefix) {
+            fputs (line_prefix, log_fp);
+        }
+        fprintf (log_fp, "[%s] %u slow RPC records dropped\n",
+                 time_buf, dropped - n_dropped_reported);
+        n_dropped_reported = dropped;
+        n++;
+    }
+
+    if (n > 0 && log_fp) {
+        fflush (log_fp);
+    }
+
+    if (free_rings) {
+        g_mutex_lock (&rings_lock);
+        prev = &rings;
+        while ((ring = *prev) != NULL) {
+            if (ring->can_free) {
+                *prev = ring->next;
+                g_free (ring->buf);
+                g_free (ring);
+            } else {
+                prev = &ring->next;
+            }
+        }
+        g_mutex_unlock (&rings_lock);
+    }
+}
+
+static gpointer
+writer_thread_func (gpointer unused)
+{
+    while (1) {
+        g_usleep (WRITE_INTERVAL_USEC);
+
+        g_mutex_lock (&writer_lock);
+        drain_rings ();
+        g_mutex_unlock (&writer_lock);
+    }
+
+    return NULL;
+}
+
+void
+searpc_slow_log_start (FILE *fp, const char *prefix)
+{
+    g_mutex_lock (&writer_lock);
+    log_fp = fp;
+    g_free (line_prefix);
+    line_prefix = g_strdup (prefix);
+    if (!writer_thread) {
+        writer_thread = g_thread_new ("searpc-slow-log", writer_thread_func, NULL);
+    }
+    g_mutex_unlock (&writer_lock);
+}
+
+void
+searpc_slow_log_set_format (gboolean json, gssize max_request_len)
+{
+    g_mutex_lock (&writer_lock);
+    json_format = json;
+    max_request_bytes = max_request_len;
+    g_mutex_unlock (&writer_lock);
+}
+
+int
+searpc_slow_log_reopen (const char *path)
+{
+    FILE *fp, *old_fp;
+
+    if ((fp = fopen (path, "a+")) == NULL) {
+        g_warning ("Failed to open RPC slow log file %s\n", path);
+        return -1;
+    }
+
+    // Records of calls made before the rotation go to the old file.
+    g_mutex_lock (&writer_lock);
+    drain_rings ();
+    old_fp = log_fp;
+    log_fp = fp;
+    g_mutex_unlock (&writer_lock);
+
+    if (old_fp && fclose (old_fp) < 0) {
+        g_warning ("Failed to close old RPC slow log file\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+searpc_slow_log_flush (void)
+{
+    g_mutex_lock (&writer_lock);
+    drain_rings ();
+    g_mutex_unlock (&writer_lock);
+}
@@ -0,0 +1,56 @@
+#ifndef SEARPC_SLOW_LOG_H
+#define SEARPC_SLOW_LOG_H
+
+#include <stdio.h>
+#include <glib.h>
+
+// Asynchronous slow log writer. RPC threads copy records into their own
+// ring buffer without taking locks, and a background thread formats them
+// and writes them out. When a ring is full, records are dropped and the
+// number of dropped records is written to the log instead.
+
+typedef struct {
+    const char *service;
+    const char *function;
+    const char *request;
+    gsize request_len;
+    gsize response_len;
+    // Id of the thread that ran the call.
+    long thread_id;
+    gboolean failed;
+    int err_code;
+    // Wall clock time when the call started.
+    gint64 start_usec;
+    gint64 queue_usec;
+    gint64 exec_usec;
+    gint64 write_usec;
+} SearpcSlowCall;
+
+// Start writing records to @fp, each line starting with @line_prefix if
+// it's not NULL. Later calls only replace the file.
+G_GNUC_INTERNAL
+void
+searpc_slow_log_start (FILE *fp, const char *line_prefix);
+
+// Write records as JSON objects, one per line, instead of the text format.
+// Requests are cut after @max_request_len bytes, unless it's negative.
+G_GNUC_INTERNAL
+void
+searpc_slow_log_set_format (gboolean json, gssize max_request_len);
+
+// Queue a record. Never blocks.
+G_GNUC_INTERNAL
+void
+searpc_slow_log_push (const SearpcSlowCall *call);
+
+// Write out the records queued so far, then switch to the file at @path.
+G_GNUC_INTERNAL
+int
+searpc_slow_log_reopen (const char *path);
+
+// Write out the records queued so far.
+G_GNUC_INTERNAL
+void
+searpc_slow_log_flush (void);
+
+#endif
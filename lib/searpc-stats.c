@@ -0,0 +1,325 @@
+#include <string.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "searpc-stats.h"
+
+// Latencies are counted in a log-linear histogram: values below 8us get a
+// bucket each, and every power of two above is split into 8 buckets. So a
+// bucket is at most 12.5% wide, and 256 buckets cover more than four hours.
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define N_BUCKETS 256
+#define MAX_USEC ((G_GINT64_CONSTANT(1) << (N_BUCKETS / SUB_BUCKETS + SUB_BUCKET_BITS - 1)) - 1)
+
+// Each thread has a histogram per function it calls, so the buckets are
+// kept small. A bucket stops counting once full, after four billion calls
+// of the function on the thread.
+typedef struct {
+    gint64 count;
+    gint64 total_usec;
+    gint64 max_usec;
+    guint32 buckets[N_BUCKETS];
+} Histogram;
+
+typedef struct {
+    gint64 errors;
+    // Time from the start of parsing to the end of marshaling the result.
+    Histogram exec;
+    // Time spent waiting for a worker, allocated once it's known.
+    Histogram *queue;
+    // Time spent writing the response, if known.
+    gint64 writes;
+    gint64 write_total_usec;
+    gint64 write_max_usec;
+} FuncStats;
+
+// Function statistics of one thread, indexed by function id. They're
+// allocated when the thread first calls a function, and only written by
+// that thread.
+#define STATS_CHUNK_SIZE 64
+#define STATS_MAX_CHUNKS 256
+
+typedef struct StatsBlock {
+    FuncStats **chunks[STATS_MAX_CHUNKS];
+    gboolean in_use;
+    struct StatsBlock *next;
+} StatsBlock;
+
+static gint last_function_id = -1;
+static gint ids_exhausted;
+
+// All blocks ever allocated. When a thread exits, its block is kept and
+// handed to the next new thread, so no counts are lost.
+static GMutex stats_lock;
+static StatsBlock *stats_blocks;
+
+static void
+release_stats_block (gpointer data)
+{
+    StatsBlock *block = data;
+
+    g_mutex_lock (&stats_lock);
+    block->in_use = FALSE;
+    g_mutex_unlock (&stats_lock);
+}
+
+static GPrivate current_block = G_PRIVATE_INIT (release_stats_block);
+
+static StatsBlock *
+get_stats_block (void)
+{
+    StatsBlock *block = g_private_get (&current_block);
+
+    if (block)
+        return block;
+
+    g_mutex_lock (&stats_lock);
+    for (block = stats_blocks; block; block = block->next) {
+        if (!block->in_use)
+            break;
+    }
+    if (!block) {
+        block = g_new0 (StatsBlock, 1);
+        block->next = stats_blocks;
+        stats_blocks = block;
+    }
+    block->in_use = TRUE;
+    g_mutex_unlock (&stats_lock);
+
+    g_private_set (&current_block, block);
+    return block;
+}
+
+static FuncStats *
+lookup_func_stats (StatsBlock *block, int id)
+{
+    FuncStats **chunk = g_atomic_pointer_get (&block->chunks[id / STATS_CHUNK_SIZE]);
+
+    if (!chunk)
+        return NULL;
+    return g_atomic_pointer_get (&chunk[id % STATS_CHUNK_SIZE]);
+}
+
+int
+searpc_stats_new_function_id (void)
+{
+    int id = g_atomic_int_add (&last_function_id, 1) + 1;
+
+    if (id >= STATS_CHUNK_SIZE * STATS_MAX_CHUNKS &&
+        g_atomic_int_compare_and_exchange (&ids_exhausted, 0, 1)) {
+        g_warning ("[Sea RPC] more than %d functions registered, calls of "
+                   "the others aren't counted in the statistics.\n",
+                   STATS_CHUNK_SIZE * STATS_MAX_CHUNKS);
+    }
+    return id;
+}
+
+void
+searpc_stats_reset (void)
+{
+    StatsBlock *block;
+    FuncStats *stats;
+    Histogram *queue;
+    int i, j;
+
+    g_mutex_lock (&stats_lock);
+    for (block = stats_blocks; block; block = block->next) {
+        for (i = 0; i < STATS_MAX_CHUNKS; i++) {
+            if (!block->chunks[i])
+                continue;
+            for (j = 0; j < STATS_CHUNK_SIZE; j++) {
+                stats = block->chunks[i][j];
+                if (!stats)
+                    continue;
+                queue = stats->queue;
+                memset (stats, 0, sizeof(FuncStats));
+                if (queue) {
+                    memset (queue, 0, sizeof(Histogram));
+                    stats->queue = queue;
+                }
+            }
+        }
+    }
+    g_mutex_unlock (&stats_lock);
+
+    g_atomic_int_set (&last_function_id, -1);
+    g_atomic_int_set (&ids_exhausted, 0);
+}
+
+static int
+bucket_index (gint64 usec)
+{
+    int msb = 0;
+
+    if (usec < SUB_BUCKETS)
+        return (int)usec;
+
+    // gulong is only 32 bits wide on Windows.
+    if (usec >> 32)
+        msb = 32;
+    msb += g_bit_storage ((gulong)(usec >> msb)) - 1;
+    return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+        (int)((usec >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// The largest value counted in bucket @index.
+static gint64
+bucket_max (int index)
+{
+    int shift;
+
+    if (index < SUB_BUCKETS)
+        return index;
+
+    shift = index / SUB_BUCKETS - 1;
+    return ((gint64)(SUB_BUCKETS + index % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void
+histogram_add (Histogram *hist, gint64 usec)
+{
+    usec = CLAMP (usec, 0, MAX_USEC);
+    hist->count++;
+    hist->total_usec += usec;
+    if (usec > hist->max_usec)
+        hist->max_usec = usec;
+    if (hist->buckets[bucket_index (usec)] < G_MAXUINT32)
+        hist->buckets[bucket_index (usec)]++;
+}
+
+// @sum has the buckets of a single histogram, which fit in 64 bits.
+static void
+histogram_merge (Histogram *sum, gint64 *sum_buckets, const Histogram *hist)
+{
+    int i;
+
+    sum->count += hist->count;
+    sum->total_usec += hist->total_usec;
+    sum->max_usec = MAX (sum->max_usec, hist->max_usec);
+    for (i = 0; i < N_BUCKETS; i++)
+        sum_buckets[i] += hist->buckets[i];
+}
+
+void
+searpc_stats_record_call (int id, gint64 usec, gint64 queue_usec,
+                          gint64 write_usec, gboolean failed)
+{
+    StatsBlock *block;
+    FuncStats *stats;
+
+    if (id < 0 || id >= STATS_CHUNK_SIZE * STATS_MAX_CHUNKS)
+        return;
+
+    block = get_stats_block ();
+    stats = lookup_func_stats (block, id);
+    if (!stats) {
+        FuncStats **chunk = block->chunks[id / STATS_CHUNK_SIZE];
+        if (!chunk) {
+            chunk = g_new0 (FuncStats *, STATS_CHUNK_SIZE);
+            g_atomic_pointer_set (&block->chunks[id / STATS_CHUNK_SIZE], chunk);
+        }
+        stats = g_new0 (FuncStats, 1);
+        g_atomic_pointer_set (&chunk[id % STATS_CHUNK_SIZE], stats);
+    }
+
+    if (failed)
+        stats->errors++;
+    histogram_add (&stats->exec, usec);
+    if (queue_usec >= 0) {
+        if (!stats->queue)
+            g_atomic_pointer_set (&stats->queue, g_new0 (Histogram, 1));
+        histogram_add (stats->queue, queue_usec);
+    }
+    if (write_usec >= 0) {
+        stats->writes++;
+        stats->write_total_usec += write_usec;
+        if (write_usec > stats->write_max_usec)
+            stats->write_max_usec = write_usec;
+    }
+}
+
+static gint64
+percentile (const Histogram *hist, const gint64 *buckets, double fraction)
+{
+    gint64 rank = (gint64)(hist->count * fraction);
+    gint64 seen = 0;
+    int i;
+
+    for (i = 0; i < N_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank)
+            return MIN (bucket_max (i), hist->max_usec);
+    }
+    return hist->max_usec;
+}
+
+json_t *
+searpc_stats_function_to_json (int id)
+{
+    FuncStats sum;
+    Histogram queue_sum;
+    gint64 exec_buckets[N_BUCKETS], queue_buckets[N_BUCKETS];
+    StatsBlock *block;
+    json_t *object;
+
+    if (id < 0 || id >= STATS_CHUNK_SIZE * STATS_MAX_CHUNKS)
+        return NULL;
+
+    // The counters are read while other threads update them, so the sums
+    // may be slightly behind.
+    memset (&sum, 0, sizeof(sum));
+    memset (&queue_sum, 0, sizeof(queue_sum));
+    memset (exec_buckets, 0, sizeof(exec_buckets));
+    memset (queue_buckets, 0, sizeof(queue_buckets));
+    g_mutex_lock (&stats_lock);
+    for (block = stats_blocks; block; block = block->next) {
+        FuncStats *stats = lookup_func_stats (block, id);
+        Histogram *queue;
+        if (!stats)
+            continue;
+        sum.errors += stats->errors;
+        histogram_merge (&sum.exec, exec_buckets, &stats->exec);
+        queue = g_atomic_pointer_get (&stats->queue);
+        if (queue)
+            histogram_merge (&queue_sum, queue_buckets, queue);
+        sum.writes += stats->writes;
+        sum.write_total_usec += stats->write_total_usec;
+        sum.write_max_usec = MAX (sum.write_max_usec, stats->write_max_usec);
+    }
+    g_mutex_unlock (&stats_lock);
+
+    if (sum.exec.count == 0)
+        return NULL;
+
+    object = json_object ();
+    json_object_set_new (object, "calls", json_integer (sum.exec.count));
+    json_object_set_new (object, "errors", json_integer (sum.errors));
+    json_object_set_new (object, "total_usec", json_integer (sum.exec.total_usec));
+    json_object_set_new (object, "mean_usec", json_integer (sum.exec.total_usec / sum.exec.count));
+    json_object_set_new (object, "max_usec", json_integer (sum.exec.max_usec));
+    json_object_set_new (object, "p50_usec",
+                         json_integer (percentile (&sum.exec, exec_buckets, 0.5)));
+    json_object_set_new (object, "p99_usec",
+                         json_integer (percentile (&sum.exec, exec_buckets, 0.99)));
+    json_object_set_new (object, "p999_usec",
+                         json_integer (percentile (&sum.exec, exec_buckets, 0.999)));
+
+    if (queue_sum.count > 0) {
+        json_object_set_new (object, "queue_mean_usec",
+                             json_integer (queue_sum.total_usec / queue_sum.count));
+        json_object_set_new (object, "queue_max_usec", json_integer (queue_sum.max_usec));
+        json_object_set_new (object, "queue_p50_usec",
+                             json_integer (percentile (&queue_sum, queue_buckets, 0.5)));
+        json_object_set_new (object, "queue_p99_usec",
+                             json_integer (percentile (&queue_sum, queue_buckets, 0.99)));
+    }
+    if (sum.writes > 0) {
+        json_object_set_new (object, "write_mean_usec",
+                             json_integer (sum.write_total_usec / sum.writes));
+        json_object_set_new (object, "write_max_usec", json_integer (sum.write_max_usec));
+    }
+
+    return object;
+}
@@ -0,0 +1,36 @@
+#ifndef SEARPC_STATS_H
+#define SEARPC_STATS_H
+
+#include <glib.h>
+#include <jansson.h>
+
+// Per-function call statistics. Each thread counts its calls in its own
+// block, so recording a call takes no locks and no atomic operations. The
+// blocks are only summed up when the statistics are read.
+
+// Allocate an id for a registered function.
+G_GNUC_INTERNAL
+int
+searpc_stats_new_function_id (void);
+
+// Forget all counts and start allocating ids from 0 again, when the
+// server is shut down. No call may be running.
+G_GNUC_INTERNAL
+void
+searpc_stats_reset (void);
+
+// Record a call of function @id that took @usec microseconds to execute,
+// after waiting @queue_usec for a worker and before its response took
+// @write_usec to be written. The last two are negative when unknown.
+G_GNUC_INTERNAL
+void
+searpc_stats_record_call (int id, gint64 usec, gint64 queue_usec,
+                          gint64 write_usec, gboolean failed);
+
+// Return the statistics of function @id as a JSON object, or NULL if it was
+// never called.
+G_GNUC_INTERNAL
+json_t *
+searpc_stats_function_to_json (int id);
+
+#endif
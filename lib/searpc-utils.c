@@ -1,4 +1,7 @@
 #include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 #include <glib-object.h>
 #include <jansson.h>
@@ -10,10 +13,181 @@
 #define g_value_get_schar g_value_get_char
 #endif
 
-static json_t *json_serialize_pspec (const GValue *value)
+/*
+ * Property plans. Listing the properties of a class and looking them up by
+ * name allocate and take global locks in GObject, so the properties of each
+ * type are collected once, and kept for the life of the process.
+ */
+
+typedef struct {
+    GParamSpec *pspec;
+    GType value_type;
+    GType fundamental;
+    // Set by json_gobject_deserialize().
+    gboolean settable;
+    // The escaped name followed by a colon, for searpc_json_write_gobject().
+    char *json_key;
+    gsize json_key_len;
+} PropertyPlan;
+
+typedef struct {
+    // Reference held so that the classes of the properties stay alive.
+    GObjectClass *klass;
+    guint n_props;
+    PropertyPlan *props;
+    // Property name -> PropertyPlan.
+    GHashTable *by_name;
+    // Set by searpc_register_object_serializer() after the plan is
+    // published, so they are only read with plans_lock held.
+    SearpcObjectWriteFunc write_object;
+    SearpcObjectReadFunc read_object;
+} TypePlan;
+
+static GRWLock plans_lock;
+static GHashTable *type_plans;
+
+static TypePlan *
+build_type_plan (GType gtype)
+{
+    TypePlan *plan = g_new0 (TypePlan, 1);
+    GParamSpec **pspecs;
+    GString *key = g_string_new (NULL);
+    guint i;
+
+    plan->klass = g_type_class_ref (gtype);
+    plan->by_name = g_hash_table_new (g_str_hash, g_str_equal);
+
+    pspecs = g_object_class_list_properties (plan->klass, &plan->n_props);
+    plan->props = g_new0 (PropertyPlan, plan->n_props);
+    for (i = 0; i < plan->n_props; i++) {
+        PropertyPlan *prop = &plan->props[i];
+        GParamSpec *pspec = pspecs[i];
+
+        prop->pspec = pspec;
+        prop->value_type = G_PARAM_SPEC_VALUE_TYPE (pspec);
+        prop->fundamental = G_TYPE_FUNDAMENTAL (prop->value_type);
+        prop->settable = (pspec->flags & G_PARAM_WRITABLE) &&
+            !(pspec->flags & G_PARAM_CONSTRUCT_ONLY);
+
+        g_string_truncate (key, 0);
+        searpc_json_write_string (key, pspec->name);
+        g_string_append_c (key, ':');
+        prop->json_key_len = key->len;
+        prop->json_key = g_strndup (key->str, key->len);
+
+        g_hash_table_insert (plan->by_name, (gpointer)pspec->name, prop);
+    }
+
+    g_free (pspecs);
+    g_string_free (key, TRUE);
+
+    return plan;
+}
+
+static void
+free_type_plan (TypePlan *plan)
+{
+    guint i;
+
+    for (i = 0; i < plan->n_props; i++)
+        g_free (plan->props[i].json_key);
+    g_free (plan->props);
+    g_hash_table_destroy (plan->by_name);
+    g_type_class_unref (plan->klass);
+    g_free (plan);
+}
+
+// Get the plan of @gtype, and the serializers registered for it if
+// @write_object or @read_object are set.
+static TypePlan *
+get_type_plan (GType gtype, SearpcObjectWriteFunc *write_object,
+               SearpcObjectReadFunc *read_object)
+{
+    TypePlan *plan = NULL, *existing;
+
+    g_rw_lock_reader_lock (&plans_lock);
+    if (type_plans)
+        plan = g_hash_table_lookup (type_plans, GSIZE_TO_POINTER (gtype));
+    if (plan) {
+        if (write_object)
+            *write_object = plan->write_object;
+        if (read_object)
+            *read_object = plan->read_object;
+    }
+    g_rw_lock_reader_unlock (&plans_lock);
+    if (plan)
+        return plan;
+
+    // Built without the lock, since referencing the class may run its
+    // class_init().
+    plan = build_type_plan (gtype);
+
+    g_rw_lock_writer_lock (&plans_lock);
+    if (!type_plans)
+        type_plans = g_hash_table_new (g_direct_hash, g_direct_equal);
+    existing = g_hash_table_lookup (type_plans, GSIZE_TO_POINTER (gtype));
+    if (existing) {
+        free_type_plan (plan);
+        plan = existing;
+    } else {
+        g_hash_table_insert (type_plans, GSIZE_TO_POINTER (gtype), plan);
+    }
+    if (write_object)
+        *write_object = plan->write_object;
+    if (read_object)
+        *read_object = plan->read_object;
+    g_rw_lock_writer_unlock (&plans_lock);
+
+    return plan;
+}
+
+void
+searpc_register_object_serializer (GType gtype,
+                                   SearpcObjectWriteFunc write_func,
+                                   SearpcObjectReadFunc read_func)
+{
+    TypePlan *plan = get_type_plan (gtype, NULL, NULL);
+
+    g_rw_lock_writer_lock (&plans_lock);
+    plan->write_object = write_func;
+    plan->read_object = read_func;
+    g_rw_lock_writer_unlock (&plans_lock);
+}
+
+// Like g_object_class_find_property(), which also accepts '_' in place of
+// '-'.
+static PropertyPlan *
+find_property (TypePlan *plan, const char *name)
+{
+    PropertyPlan *prop = g_hash_table_lookup (plan->by_name, name);
+    char *canonical;
+
+    if (prop || !strchr (name, '_'))
+        return prop;
+
+    canonical = g_strdup (name);
+    g_strdelimit (canonical, "_", '-');
+    prop = g_hash_table_lookup (plan->by_name, canonical);
+    g_free (canonical);
+
+    return prop;
+}
+
+// g_object_class_list_properties() returns the overridden pspec in place
+// of a GParamSpecOverride, so calling its owner's get_property() would
+// skip the subclass that overrides it. Go through the lookup by name,
+// which finds the override.
+static void
+read_property (GObject *gobject, const PropertyPlan *prop, GValue *value)
+{
+    g_value_init (value, prop->value_type);
+    g_object_get_property (gobject, prop->pspec->name, value);
+}
+
+static json_t *json_serialize_pspec (const GValue *value, GType fundamental)
 {
     /* Only types in json-glib but G_TYPE_BOXED */
-    switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value))) {
+    switch (fundamental) {
         case G_TYPE_STRING:
             if (!g_value_get_string (value))
         break;
@@ -62,34 +236,315 @@ static json_t *json_serialize_pspec (const GValue *value)
 
 json_t *json_gobject_serialize (GObject *gobject)
 {
-    json_t *object = json_object();
-    GParamSpec **pspecs;
-    guint n_pspecs, i;
+    json_t *object;
+    SearpcObjectWriteFunc write_object;
+    TypePlan *plan = get_type_plan (G_OBJECT_TYPE (gobject), &write_object, NULL);
+    guint i;
 
-    pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS (gobject), &n_pspecs);
+    if (write_object) {
+        GString *out = g_string_new (NULL);
+        json_error_t jerror;
 
-    for (i=0; i!=n_pspecs; ++i) {
+        write_object (out, gobject);
+        object = json_loadb (out->str, out->len, 0, &jerror);
+        g_string_free (out, TRUE);
+        if (object)
+            return object;
+        g_warning ("Invalid JSON written for an object of type \"%s\": %s",
+                   G_OBJECT_TYPE_NAME (gobject), jerror.text);
+    }
+
+    object = json_object();
+    for (i=0; i!=plan->n_props; ++i) {
         json_t *node;
-        GParamSpec *pspec = pspecs[i];
+        PropertyPlan *prop = &plan->props[i];
         GValue value = { 0, };
 
-        g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
-        g_object_get_property(gobject, pspec->name, &value);
-        node=json_serialize_pspec (&value);
+        read_property (gobject, prop, &value);
+        node=json_serialize_pspec (&value, prop->fundamental);
 
+        // Property names are always valid UTF-8.
         if (node)
-            json_object_set_new (object, pspec->name, node);
+            json_object_set_new_nocheck (object, prop->pspec->name, node);
 
         g_value_unset (&value);
     }
 
-    g_free (pspecs);
-
     return object;
 
 }
 
-static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t *node)
+gboolean
+searpc_json_write_string (GString *out, const char *str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const char *run;
+    const char *p;
+
+    if (!str) {
+        g_string_append (out, "null");
+        return TRUE;
+    }
+    if (!g_utf8_validate (str, -1, NULL))
+        return FALSE;
+
+    g_string_append_c (out, '"');
+    // Copy runs of characters that need no escaping at once.
+    for (run = p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        g_string_append_len (out, run, p - run);
+        run = p + 1;
+        switch (c) {
+        case '"':  g_string_append (out, "\\\""); break;
+        case '\\': g_string_append (out, "\\\\"); break;
+        case '\b': g_string_append (out, "\\b"); break;
+        case '\f': g_string_append (out, "\\f"); break;
+        case '\n': g_string_append (out, "\\n"); break;
+        case '\r': g_string_append (out, "\\r"); break;
+        case '\t': g_string_append (out, "\\t"); break;
+        default:
+            g_string_append (out, "\\u00");
+            g_string_append_c (out, hex[c >> 4]);
+            g_string_append_c (out, hex[c & 0xf]);
+        }
+    }
+    g_string_append_len (out, run, p - run);
+    g_string_append_c (out, '"');
+
+    return TRUE;
+}
+
+void
+searpc_json_write_int (GString *out, gint64 value)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    guint64 n = value < 0 ? -(guint64)value : (guint64)value;
+
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    if (value < 0)
+        *--p = '-';
+
+    g_string_append_len (out, p, buf + sizeof(buf) - p);
+}
+
+// Same format as jansson uses for reals.
+static gboolean
+write_real (GString *out, double value)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    if (isnan (value) || isinf (value))
+        return FALSE;
+
+    g_ascii_formatd (buf, sizeof(buf), "%.17g", value);
+    g_string_append (out, buf);
+    if (!strpbrk (buf, ".eE"))
+        g_string_append (out, ".0");
+    return TRUE;
+}
+
+// Whether write_pspec_value() has a representation for values of
+// @fundamental, other than null.
+static gboolean
+can_write_type (GType fundamental)
+{
+    switch (fundamental) {
+        case G_TYPE_STRING:
+        case G_TYPE_BOOLEAN:
+        case G_TYPE_INT:
+        case G_TYPE_UINT:
+        case G_TYPE_LONG:
+        case G_TYPE_ULONG:
+        case G_TYPE_INT64:
+        case G_TYPE_FLOAT:
+        case G_TYPE_DOUBLE:
+        case G_TYPE_CHAR:
+        case G_TYPE_UCHAR:
+        case G_TYPE_ENUM:
+        case G_TYPE_FLAGS:
+        case G_TYPE_OBJECT:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+// Streaming version of json_serialize_pspec(). Returns FALSE and appends
+// nothing if the value can't be represented.
+static gboolean
+write_pspec_value (GString *out, const GValue *value, GType fundamental)
+{
+    switch (fundamental) {
+        case G_TYPE_STRING:
+            return searpc_json_write_string (out, g_value_get_string (value));
+        case G_TYPE_BOOLEAN:
+            g_string_append (out, g_value_get_boolean (value) ? "true" : "false");
+            return TRUE;
+        case G_TYPE_INT:
+            searpc_json_write_int (out, g_value_get_int (value));
+            return TRUE;
+        case G_TYPE_UINT:
+            searpc_json_write_int (out, g_value_get_uint (value));
+            return TRUE;
+        case G_TYPE_LONG:
+            searpc_json_write_int (out, g_value_get_long (value));
+            return TRUE;
+        case G_TYPE_ULONG:
+            searpc_json_write_int (out, (json_int_t)g_value_get_ulong (value));
+            return TRUE;
+        case G_TYPE_INT64:
+            searpc_json_write_int (out, g_value_get_int64 (value));
+            return TRUE;
+        case G_TYPE_FLOAT:
+            return write_real (out, g_value_get_float (value));
+        case G_TYPE_DOUBLE:
+            return write_real (out, g_value_get_double (value));
+        case G_TYPE_CHAR:
+            searpc_json_write_int (out, g_value_get_schar (value));
+            return TRUE;
+        case G_TYPE_UCHAR:
+            searpc_json_write_int (out, g_value_get_uchar (value));
+            return TRUE;
+        case G_TYPE_ENUM:
+            searpc_json_write_int (out, g_value_get_enum (value));
+            return TRUE;
+        case G_TYPE_FLAGS:
+            searpc_json_write_int (out, g_value_get_flags (value));
+            return TRUE;
+        case G_TYPE_NONE:
+            break;
+        case G_TYPE_OBJECT:
+            {
+            GObject *object = g_value_get_object (value);
+            if (object) {
+                searpc_json_write_gobject (out, object);
+                return TRUE;
+            }
+            }
+            break;
+        default:
+            g_warning("Unsuppoted type `%s'",g_type_name (G_VALUE_TYPE (value)));
+    }
+    g_string_append (out, "null");
+    return TRUE;
+}
+
+void
+searpc_json_write_gobject (GString *out, GObject *gobject)
+{
+    SearpcObjectWriteFunc write_object;
+    TypePlan *plan = get_type_plan (G_OBJECT_TYPE (gobject), &write_object, NULL);
+    guint i;
+    gboolean first = TRUE;
+
+    if (write_object) {
+        write_object (out, gobject);
+        return;
+    }
+
+    g_string_append_c (out, '{');
+    for (i=0; i!=plan->n_props; ++i) {
+        PropertyPlan *prop = &plan->props[i];
+        GValue value = { 0, };
+        gsize start = out->len;
+
+        if (!first)
+            g_string_append_c (out, ',');
+        g_string_append_len (out, prop->json_key, prop->json_key_len);
+
+        read_property (gobject, prop, &value);
+        // Properties that can't be serialized are left out.
+        if (write_pspec_value (out, &value, prop->fundamental))
+            first = FALSE;
+        else
+            g_string_truncate (out, start);
+
+        g_value_unset (&value);
+    }
+    g_string_append_c (out, '}');
+}
+
+gssize
+searpc_bytes_section_read (const char *data, gsize len,
+                           SearpcBytesSection *section)
+{
+    const char *end = memchr (data, '\0', len);
+    const char *p;
+    guint32 size;
+
+    section->n_values = 0;
+    if (!end)
+        return len;
+
+    for (p = end + 1; p < data + len; p += size) {
+        if (section->n_values == SEARPC_MAX_CALL_BYTES ||
+            (gsize)(data + len - p) < sizeof(guint32))
+            return -1;
+        memcpy (&size, p, sizeof(guint32));
+        p += sizeof(guint32);
+        if (size > (gsize)(data + len - p))
+            return -1;
+        section->values[section->n_values] = p;
+        section->sizes[section->n_values++] = size;
+    }
+
+    return end - data;
+}
+
+gboolean
+searpc_bytes_section_write (GString *out, GBytes **values, int n_values)
+{
+    guint32 size;
+    int i;
+
+    for (i = 0; i < n_values; i++) {
+        if (g_bytes_get_size (values[i]) > G_MAXUINT32)
+            return FALSE;
+    }
+
+    g_string_append_c (out, '\0');
+    for (i = 0; i < n_values; i++) {
+        size = (guint32)g_bytes_get_size (values[i]);
+        g_string_append_len (out, (const char *)&size, sizeof(guint32));
+        g_string_append_len (out, g_bytes_get_data (values[i], NULL), size);
+    }
+    return TRUE;
+}
+
+void
+searpc_json_write_json (GString *out, const json_t *json)
+{
+    json_t *array;
+    char *data;
+
+    if (!json) {
+        g_string_append (out, "null");
+        return;
+    }
+
+    // Older jansson only dumps arrays and objects, so wrap the value in an
+    // array and strip the brackets.
+    array = json_array ();
+    json_array_append (array, (json_t *)json);
+    data = json_dumps (array, JSON_COMPACT);
+    json_decref (array);
+
+    if (data) {
+        g_string_append_len (out, data + 1, strlen (data) - 2);
+        free (data);
+    } else {
+        g_string_append (out, "null");
+    }
+}
+
+static gboolean json_deserialize_pspec (GValue *value, GType fundamental, json_t *node)
 {
     switch (json_typeof(node)) {
         case JSON_OBJECT:
@@ -105,7 +560,7 @@ static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t
             }
             break;
       case JSON_STRING:
-          if (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value)) == G_TYPE_STRING) {
+          if (fundamental == G_TYPE_STRING) {
               g_value_set_string(value, json_string_value(node));
               return TRUE;
           }
@@ -113,7 +568,7 @@ static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t
       case JSON_INTEGER:
           {
               json_int_t int_value = json_integer_value (node);
-              switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value))) {
+              switch (fundamental) {
                   case G_TYPE_CHAR:
                       g_value_set_schar(value, (gchar)int_value);
                       return TRUE;
@@ -147,7 +602,7 @@ static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t
       case JSON_REAL:
           {
               double real_value = json_real_value(node);
-              switch (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value))) {
+              switch (fundamental) {
                   case G_TYPE_FLOAT:
                     g_value_set_float(value,(gfloat)real_value);
                     return TRUE;
@@ -159,17 +614,17 @@ static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t
         break;
       case JSON_TRUE:
       case JSON_FALSE:
-          if (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value)) == G_TYPE_BOOLEAN) {
+          if (fundamental == G_TYPE_BOOLEAN) {
               g_value_set_boolean(value,(gboolean)json_is_true(node));
               return TRUE;
           }
           break;
       case JSON_NULL:
-          if (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value)) == G_TYPE_STRING) {
+          if (fundamental == G_TYPE_STRING) {
               g_value_set_string (value, NULL);
               return TRUE;
           }
-          else if (G_TYPE_FUNDAMENTAL (G_VALUE_TYPE (value)) == G_TYPE_OBJECT) {
+          else if (fundamental == G_TYPE_OBJECT) {
               g_value_set_object (value, NULL);
               return TRUE;
           }
@@ -185,59 +640,223 @@ static gboolean json_deserialize_pspec (GValue *value, GParamSpec *pspec, json_t
 
 }
 
+static void
+add_construct_param (GArray *params, GType gtype, const PropertyPlan *prop, json_t *val)
+{
+    GParameter param = { NULL, };
+
+    if (!prop || !prop->settable)
+        return;
+
+    g_value_init(&param.value, prop->value_type);
+
+    if (json_deserialize_pspec (&param.value, prop->fundamental, val)) {
+        // Names of installed properties are interned.
+        param.name = prop->pspec->name;
+        g_array_append_val (params, param);
+    }
+    else {
+        g_warning ("Failed to deserialize \"%s\" property of type \"%s\" for an object of type \"%s\"",
+                   prop->pspec->name, g_type_name (G_VALUE_TYPE (&param.value)), g_type_name (gtype));
+        g_value_unset (&param.value);
+    }
+}
+
+// Create an object with @params, and empty @params.
+static GObject *
+new_object_with_params (GType gtype, GArray *params)
+{
+    GObject *ret;
+    guint i;
+
+    ret = g_object_newv (gtype, params->len, (GParameter *) params->data);
+
+    for (i=0; i!= params->len; ++i) {
+        GParameter *param = &g_array_index (params, GParameter, i);
+        g_value_unset (&param->value);
+    }
+    g_array_set_size (params, 0);
+
+    return ret;
+}
+
 GObject *json_gobject_deserialize (GType gtype, json_t *object)
 {
-    GObjectClass *klass;
+    TypePlan *plan;
+    SearpcObjectReadFunc read_object;
     GObject *ret;
-    guint n_members, i;
     json_t *head, *member;
-    const char *member_name;
     GArray *construct_params;
 
-    klass = g_type_class_ref (gtype);
-    n_members = json_object_size (object);
-    construct_params = g_array_sized_new (FALSE, FALSE, sizeof (GParameter), n_members);
+    plan = get_type_plan (gtype, NULL, &read_object);
+    if (read_object)
+        return read_object (gtype, object);
+
+    construct_params = g_array_sized_new (FALSE, FALSE, sizeof (GParameter),
+                                          json_object_size (object));
     head = json_object_iter (object);
 
     for (member=head; member; member=json_object_iter_next (object, member)) {
-        GParamSpec *pspec;
-        GParameter param = { NULL, };
         const char *member_name = json_object_iter_key (member);
         json_t *val = json_object_iter_value(member);
 
-        pspec = g_object_class_find_property (klass, member_name);
+        add_construct_param (construct_params, gtype,
+                             find_property (plan, member_name), val);
+    }
 
-        if (!pspec)
-            continue;
+    ret = new_object_with_params (gtype, construct_params);
+    g_array_free(construct_params, TRUE);
 
-        if (pspec->flags & G_PARAM_CONSTRUCT_ONLY)
-            continue;
+    return ret;
 
-        if (!(pspec->flags & G_PARAM_WRITABLE))
-            continue;
+}
 
-        g_value_init(&param.value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+gboolean
+searpc_json_write_gobject_rows (GString *out, GList *objects)
+{
+    TypePlan *plan;
+    SearpcObjectWriteFunc write_object;
+    PropertyPlan **columns;
+    guint n_columns = 0;
+    GType gtype;
+    GList *ptr;
+    guint i;
+
+    if (!objects)
+        return FALSE;
+    gtype = G_OBJECT_TYPE (objects->data);
+    for (ptr = objects->next; ptr; ptr = ptr->next) {
+        if (G_OBJECT_TYPE (ptr->data) != gtype)
+            return FALSE;
+    }
+    plan = get_type_plan (gtype, &write_object, NULL);
+    if (write_object)
+        return FALSE;
+
+    // Properties of types that can't be serialized are left out, as
+    // searpc_json_write_gobject() leaves out values it can't write.
+    columns = g_new (PropertyPlan *, plan->n_props);
+    for (i = 0; i < plan->n_props; i++) {
+        if (can_write_type (plan->props[i].fundamental))
+            columns[n_columns++] = &plan->props[i];
+    }
+
+    g_string_append (out, "{\"columns\":[");
+    for (i = 0; i < n_columns; i++) {
+        if (i > 0)
+            g_string_append_c (out, ',');
+        searpc_json_write_string (out, columns[i]->pspec->name);
+    }
+    g_string_append (out, "],\"rows\":[");
 
-        if (json_deserialize_pspec (&param.value, pspec, val)) {
-            param.name = g_strdup (pspec->name);
-            g_array_append_val (construct_params, param);
+    for (ptr = objects; ptr; ptr = ptr->next) {
+        if (ptr != objects)
+            g_string_append_c (out, ',');
+        g_string_append_c (out, '[');
+        for (i = 0; i < n_columns; i++) {
+            PropertyPlan *prop = columns[i];
+            GValue value = { 0, };
+
+            if (i > 0)
+                g_string_append_c (out, ',');
+            read_property (ptr->data, prop, &value);
+            // A row has a value for each column, so a value that can't be
+            // written is null, which keeps the default when read.
+            if (!write_pspec_value (out, &value, prop->fundamental))
+                g_string_append (out, "null");
+            g_value_unset (&value);
         }
-        else
-            g_warning ("Failed to deserialize \"%s\" property of type \"%s\" for an object of type \"%s\"",
-                       pspec->name, g_type_name (G_VALUE_TYPE (&param.value)), g_type_name (gtype));
+        g_string_append_c (out, ']');
     }
+    g_free (columns);
+    g_string_append (out, "]}");
 
-    ret = g_object_newv (gtype, construct_params->len, (GParameter *) construct_params->data);
+    return TRUE;
+}
 
-    for (i=0; i!= construct_params->len; ++i) {
-        GParameter *param = &g_array_index (construct_params, GParameter, i);
-        g_free ((gchar *) param->name);
-        g_value_unset (&param->value);
+// searpc_json_write_gobject_rows() writes null for a value it can't
+// write, which searpc_json_write_gobject() would have left out. Skip it
+// so that the property keeps its default. Strings and objects write a
+// NULL value as null, so for them it is that value.
+static gboolean
+is_missing_cell (const PropertyPlan *prop, json_t *cell)
+{
+    return prop && json_is_null (cell) &&
+        prop->fundamental != G_TYPE_STRING &&
+        prop->fundamental != G_TYPE_OBJECT;
+}
+
+gboolean
+json_gobject_deserialize_rows (GType gtype, json_t *table, GList **objects)
+{
+    SearpcObjectReadFunc read_object;
+    TypePlan *plan = get_type_plan (gtype, NULL, &read_object);
+    json_t *columns = json_object_get (table, "columns");
+    json_t *rows = json_object_get (table, "rows");
+    guint n_columns = json_array_size (columns);
+    const char **names;
+    PropertyPlan **props;
+    GArray *construct_params;
+    GList *ret = NULL;
+    gboolean ok = FALSE;
+    guint i, j;
+
+    *objects = NULL;
+    if (!json_is_array (columns) || !json_is_array (rows))
+        return FALSE;
+
+    // Columns are looked up once for the whole list.
+    names = g_new0 (const char *, n_columns);
+    props = g_new0 (PropertyPlan *, n_columns);
+    construct_params = g_array_sized_new (FALSE, FALSE, sizeof (GParameter), n_columns);
+    for (i = 0; i < n_columns; i++) {
+        names[i] = json_string_value (json_array_get (columns, i));
+        if (!names[i])
+            goto out;
+        props[i] = find_property (plan, names[i]);
     }
 
-    g_array_free(construct_params, TRUE);
-    g_type_class_unref(klass);
+    for (j = 0; j < json_array_size (rows); j++) {
+        json_t *row = json_array_get (rows, j);
+        GObject *obj;
 
-    return ret;
+        if (!json_is_array (row) || json_array_size (row) != n_columns)
+            goto out;
 
+        if (read_object) {
+            json_t *object = json_object ();
+            for (i = 0; i < n_columns; i++) {
+                json_t *cell = json_array_get (row, i);
+                if (!is_missing_cell (props[i], cell))
+                    json_object_set (object, names[i], cell);
+            }
+            obj = read_object (gtype, object);
+            json_decref (object);
+        } else {
+            for (i = 0; i < n_columns; i++) {
+                json_t *cell = json_array_get (row, i);
+                if (!is_missing_cell (props[i], cell))
+                    add_construct_param (construct_params, gtype, props[i], cell);
+            }
+            obj = new_object_with_params (gtype, construct_params);
+        }
+        if (!obj)
+            goto out;
+        ret = g_list_prepend (ret, obj);
+    }
+    ok = TRUE;
+
+out:
+    g_free (names);
+    g_free (props);
+    g_array_free (construct_params, TRUE);
+    if (!ok) {
+        GList *ptr;
+        for (ptr = ret; ptr; ptr = ptr->next)
+            g_object_unref (ptr->data);
+        g_list_free (ret);
+        return FALSE;
+    }
+    *objects = g_list_reverse (ret);
+    return TRUE;
 }
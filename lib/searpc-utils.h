@@ -21,6 +21,89 @@ json_t *json_gobject_serialize (GObject *);
 LIBSEARPC_API
 GObject *json_gobject_deserialize (GType , json_t *);
 
+/*
+ * Streaming JSON output. These append JSON text to @out directly, with the
+ * same output as serializing a json_t tree with json_dumps().
+ */
+
+/* Append @str as a JSON string, or null if @str is NULL. Returns FALSE and
+ * appends nothing if @str isn't valid UTF-8. */
+LIBSEARPC_API
+gboolean searpc_json_write_string (GString *out, const char *str);
+LIBSEARPC_API
+void searpc_json_write_int (GString *out, gint64 value);
+/* Append the properties of @gobject as a JSON object, like
+ * json_gobject_serialize(). */
+LIBSEARPC_API
+void searpc_json_write_gobject (GString *out, GObject *gobject);
+LIBSEARPC_API
+void searpc_json_write_json (GString *out, const json_t *json);
+
+/*
+ * Columnar form of a list of objects of the same type, which names each
+ * property once instead of once per object:
+ *   {"columns": [<name>, ...], "rows": [[<value>, ...], ...]}
+ * Properties of types that can't be serialized have no column. Other
+ * values that can't be represented, such as a NaN, are written as null
+ * and leave the property at its default when read, the same as when
+ * searpc_json_write_gobject() leaves them out.
+ */
+
+/* Returns FALSE and appends nothing if @objects is empty, mixes types, or
+ * has a type with a registered writer. */
+LIBSEARPC_API
+gboolean searpc_json_write_gobject_rows (GString *out, GList *objects);
+/* Create the objects of @table in @objects. Returns FALSE if @table is
+ * malformed. */
+LIBSEARPC_API
+gboolean json_gobject_deserialize_rows (GType gtype, json_t *table, GList **objects);
+
+/*
+ * Native serializers for the objects of a GType, used instead of property
+ * reflection by json_gobject_serialize(), json_gobject_deserialize() and
+ * searpc_json_write_gobject(), and so by the object and objlist types.
+ * @write_func appends the object as a JSON object, @read_func creates an
+ * object of type @gtype from one. searpc-codegen.py generates them from
+ * the struct fields listed in object_table. Subtypes keep using
+ * reflection unless they are registered too.
+ *
+ * Register them before the type is used, for example along with the
+ * marshals. Passing NULL restores reflection for that direction.
+ */
+typedef void (*SearpcObjectWriteFunc) (GString *out, GObject *object);
+typedef GObject *(*SearpcObjectReadFunc) (GType gtype, json_t *object);
+
+LIBSEARPC_API
+void searpc_register_object_serializer (GType gtype,
+                                        SearpcObjectWriteFunc write_func,
+                                        SearpcObjectReadFunc read_func);
+
+/*
+ * Values of type "bytes". A call or a response may be followed by a NUL,
+ * which JSON text can't contain, and a section holding its bytes values,
+ * each as a 32-bit length in host byte order followed by the data. The
+ * JSON text holds the index of each value in the section, or -1 for NULL,
+ * so the data is neither escaped nor parsed.
+ */
+#define SEARPC_MAX_CALL_BYTES 16
+
+typedef struct {
+    int n_values;
+    const char *values[SEARPC_MAX_CALL_BYTES];
+    gsize sizes[SEARPC_MAX_CALL_BYTES];
+} SearpcBytesSection;
+
+/* Find the values following the JSON text in @data, which point into it.
+ * Returns the length of the JSON text, or -1 if the section is malformed
+ * or holds too many values. */
+LIBSEARPC_API
+gssize searpc_bytes_section_read (const char *data, gsize len,
+                                  SearpcBytesSection *section);
+/* Append a NUL and the section holding @values to @out. Returns FALSE,
+ * appending nothing, if a value is too long. */
+LIBSEARPC_API
+gboolean searpc_bytes_section_write (GString *out, GBytes **values, int n_values);
+
 inline static void setjetoge(const json_error_t *jerror, GError **error)
 {
     /* Load is the only function I use which reports errors */
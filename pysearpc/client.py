@@ -1,5 +1,5 @@
 import json
-from .common import SearpcError
+from .common import SearpcError, pack_bytes_section, split_bytes_section
 
 def _fret_int(ret_str):
     try:
@@ -79,8 +79,17 @@ def _fret_objlist(ret_str):
         raise SearpcError(dicts['err_msg'])
 
     l = []
-    if dicts['ret']:
-        for elt in dicts['ret']:
+    ret = dicts['ret']
+    if isinstance(ret, dict):
+        # Columnar form: {"columns": [...], "rows": [[...], ...]}
+        try:
+            columns = ret['columns']
+            for row in ret['rows']:
+                l.append(_SearpcObj(dict(zip(columns, row))))
+        except (KeyError, TypeError):
+            raise SearpcError('Invalid response format')
+    elif ret:
+        for elt in ret:
             l.append(_SearpcObj(elt))
 
     return l
@@ -99,6 +108,23 @@ def _fret_json(ret_str):
     else:
         return None
 
+def _fret_bytes(ret_str):
+    try:
+        ret_str, values = split_bytes_section(ret_str)
+        dicts = json.loads(ret_str)
+    except:
+        raise SearpcError('Invalid response format')
+
+    if 'err_code' in dicts:
+        raise SearpcError(dicts['err_msg'])
+
+    index = dicts.get('ret')
+    if not isinstance(index, int) or index < 0:
+        return None
+    if index >= len(values):
+        raise SearpcError('Invalid response format')
+    return values[index]
+
 def searpc_func(ret_type, param_types):
 
     def decorate(func):
@@ -116,12 +142,27 @@ def searpc_func(ret_type, param_types):
             fret = _fret_string
         elif ret_type == "json":
             fret = _fret_json
+        elif ret_type == "bytes":
+            fret = _fret_bytes
         else:
             raise SearpcError('Invial return type')
 
         def newfunc(self, *args):
-            array = [func.__name__] + list(args)
+            # bytes values are sent after the JSON text, which holds
+            # their index.
+            args = list(args)
+            values = []
+            for i, param_type in enumerate(param_types[:len(args)]):
+                if param_type == "bytes":
+                    if args[i] is None:
+                        args[i] = -1
+                    else:
+                        values.append(args[i])
+                        args[i] = len(values) - 1
+            array = [func.__name__] + args
             fcall_str = json.dumps(array)
+            if values:
+                fcall_str = fcall_str.encode('utf-8') + pack_bytes_section(values)
             ret_str = self.call_remote_func_sync(fcall_str)
             if fret:
                 return fret(ret_str)
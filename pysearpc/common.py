@@ -1,3 +1,6 @@
+import struct
+
+
 class SearpcError(Exception):
 
     def __init__(self, msg):
@@ -5,3 +8,32 @@ class SearpcError(Exception):
 
     def __str__(self):
         return self.msg
+
+
+# Values of type "bytes" follow the JSON text of a call or a response after
+# a NUL, each as a 32-bit length followed by the data, and the JSON text
+# holds their index, or -1 for None. See lib/searpc-utils.h.
+_BYTES_LEN = struct.Struct('=I')
+
+def pack_bytes_section(values):
+    return b'\0' + b''.join(_BYTES_LEN.pack(len(v)) + bytes(v) for v in values)
+
+def split_bytes_section(data):
+    """Return the JSON text of a message and the bytes values following it."""
+    if isinstance(data, str) or b'\0' not in data:
+        return data, []
+
+    end = data.index(b'\0')
+    values = []
+    pos = end + 1
+    while pos < len(data):
+        if pos + _BYTES_LEN.size > len(data):
+            raise SearpcError('Invalid bytes values')
+        size, = _BYTES_LEN.unpack_from(data, pos)
+        pos += _BYTES_LEN.size
+        if pos + size > len(data):
+            raise SearpcError('Invalid bytes values')
+        values.append(data[pos:pos + size])
+        pos += size
+
+    return data[:end], values
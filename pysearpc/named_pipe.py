@@ -18,6 +18,72 @@ from .utils import make_socket_closeonexec, recvall, sendall
 logger = logging.getLogger(__name__)
 
 
+# Reserved service used to negotiate binary frames, see
+# lib/searpc-named-pipe-transport.c for the protocol description.
+TRANSPORT_SERVICE = 'searpc-transport'
+FRAME_VERSION = 3
+# <32b length><8b version><8b flags><16b service length>, followed by a 32b
+# request id since version 2.
+FRAME_HEADERS = {
+    1: struct.Struct('=IBBH'),
+    2: struct.Struct('=IBBHI'),
+    3: struct.Struct('=IBBHI'),
+}
+# Since version 3, messages longer than this continue in the next frames.
+MAX_FRAME_BODY = 16 * 1024 * 1024
+FRAME_FLAG_CONTINUED = 0x04
+
+
+def encode_message(message):
+    return message if isinstance(message, bytes) else message.encode(encoding='utf-8')
+
+
+def decode_response(resp):
+    # Responses holding bytes values are returned as they are.
+    return resp if b'\0' in resp else resp.decode(encoding='utf-8')
+
+
+def pack_frame(version, service, body, req_id=0):
+    header = FRAME_HEADERS[version]
+    frames = []
+    while True:
+        more = version >= 3 and len(body) > MAX_FRAME_BODY
+        part = body[:MAX_FRAME_BODY] if more else body
+        fields = [header.size - 4 + len(service) + len(part),
+                  version, FRAME_FLAG_CONTINUED if more else 0, len(service)]
+        if version >= 2:
+            fields.append(req_id)
+        frames.append(header.pack(*fields) + service + part)
+        if not more:
+            return b''.join(frames)
+        body = body[MAX_FRAME_BODY:]
+        service = b''
+
+
+def read_frame(pipe, version):
+    """Read a message, and return (req_id, service, body). The request id is
+    None before frame version 2.
+    """
+    header = FRAME_HEADERS[version]
+    fields = header.unpack(recvall(pipe, header.size))
+    size, frame_version, flags, service_len = fields[:4]
+    if frame_version != version:
+        raise NamedPipeException('Invalid frame version')
+    data = recvall(pipe, size - (header.size - 4))
+    req_id = fields[4] if version >= 2 else None
+    service = data[:service_len]
+    parts = [data[service_len:]]
+
+    while version >= 3 and flags & FRAME_FLAG_CONTINUED:
+        fields = header.unpack(recvall(pipe, header.size))
+        size, frame_version, flags, service_len = fields[:4]
+        if frame_version != version or service_len or fields[4] != req_id:
+            raise NamedPipeException('Invalid continuation frame')
+        parts.append(recvall(pipe, size - (header.size - 4)))
+
+    return req_id, service, b''.join(parts)
+
+
 class NamedPipeException(Exception):
     pass
 
@@ -30,18 +96,32 @@ class NamedPipeTransport(SearpcTransport):
     It's compatible with the c implementation of named pipe transport.
     in lib/searpc-named-pipe-transport.[ch] files.
 
-    The protocol is:
+    The legacy protocol is:
     - request: <32b length header><json request>
     - response: <32b length header><json response>
+
+    After connecting, the transport tries to switch to binary frames:
+    - request: <frame header><service name><fcall string>
+    - response: <frame header><json response>
     """
 
     def __init__(self, socket_path):
         self.socket_path = socket_path
         self.pipe = None
+        self.frame_version = 0
+        self.req_id = 0
 
     def connect(self):
         self.pipe = socket.socket(socket.AF_UNIX)
         self.pipe.connect(self.socket_path)
+        self.negotiate()
+
+    def negotiate(self):
+        fcall_str = json.dumps(['negotiate', FRAME_VERSION])
+        resp = json.loads(self._send_legacy(TRANSPORT_SERVICE, fcall_str))
+        version = resp.get('ret')
+        if isinstance(version, int) and 0 < version <= FRAME_VERSION:
+            self.frame_version = version
 
     def stop(self):
         if self.pipe:
@@ -49,6 +129,13 @@ class NamedPipeTransport(SearpcTransport):
             self.pipe = None
 
     def send(self, service, fcall_str):
+        if self.frame_version:
+            return self._send_frame(service, fcall_str)
+        return self._send_legacy(service, fcall_str)
+
+    def _send_legacy(self, service, fcall_str):
+        if isinstance(fcall_str, bytes):
+            raise NamedPipeException("Legacy connections can't send bytes values")
         body = json.dumps({
             'service': service,
             'request': fcall_str,
@@ -65,7 +152,19 @@ class NamedPipeTransport(SearpcTransport):
         # logger.info('resp_size is %s', resp_size)
         resp = recvall(self.pipe, resp_size)
         # logger.info('resp is %s', resp)
-        return resp.decode(encoding='utf-8')
+        return decode_response(resp)
+
+    def _send_frame(self, service, fcall_str):
+        self.req_id = (self.req_id + 1) & 0xffffffff
+        sendall(self.pipe, pack_frame(self.frame_version,
+                                      service.encode(encoding='utf-8'),
+                                      encode_message(fcall_str),
+                                      self.req_id))
+
+        req_id, service, resp = read_frame(self.pipe, self.frame_version)
+        if service or req_id not in (None, self.req_id):
+            raise NamedPipeException('Invalid response frame')
+        return decode_response(resp)
 
 
 class NamedPipeClient(SearpcClient):
@@ -148,19 +247,52 @@ class PipeHandlerThread(Thread):
         self.setDaemon(True)
         self.pipe = pipe
 
+        self.frame_version = 0
+
     def run(self):
         while True:
-            req_header = recvall(self.pipe, 4)
-            # logger.info('Got req header %s', req_header)
-            req_size, = struct.unpack('I', req_header)
-            # logger.info('req size is %s', req_size)
-            req = recvall(self.pipe, req_size)
-            # logger.info('req is %s', req)
-
-            data = json.loads(req.decode(encoding='utf-8'))
+            if self.frame_version:
+                self.handle_frame()
+            else:
+                self.handle_legacy()
+
+    def handle_legacy(self):
+        req_header = recvall(self.pipe, 4)
+        # logger.info('Got req header %s', req_header)
+        req_size, = struct.unpack('I', req_header)
+        # logger.info('req size is %s', req_size)
+        req = recvall(self.pipe, req_size)
+        # logger.info('req is %s', req)
+
+        data = json.loads(req.decode(encoding='utf-8'))
+        version = 0
+        if data['service'] == TRANSPORT_SERVICE:
+            resp, version = self.call_transport_function(data['request'])
+        else:
             resp = searpc_server.call_function(data['service'], data['request'])
-            # logger.info('resp is %s', resp)
+        # logger.info('resp is %s', resp)
+
+        resp_utf8 = encode_message(resp)
+        resp_header = struct.pack('I', len(resp_utf8))
+        sendall(self.pipe, resp_header)
+        sendall(self.pipe, resp_utf8)
+        if version:
+            self.frame_version = version
+
+    def handle_frame(self):
+        req_id, service, fcall_str = read_frame(self.pipe, self.frame_version)
+
+        resp = searpc_server.call_function(service.decode(encoding='utf-8'),
+                                           fcall_str)
+
+        sendall(self.pipe, pack_frame(self.frame_version, b'',
+                                      encode_message(resp),
+                                      req_id or 0))
 
-            resp_header = struct.pack('I', len(resp))
-            sendall(self.pipe, resp_header)
-            sendall(self.pipe, resp.encode(encoding='utf-8'))
+    def call_transport_function(self, fcall_str):
+        argv = json.loads(fcall_str)
+        if argv[0] != 'negotiate' or argv[1] <= 0:
+            ret = {'err_code': 500, 'err_msg': 'unsupported transport request'}
+            return json.dumps(ret), 0
+        version = min(argv[1], FRAME_VERSION)
+        return json.dumps({'ret': version}), version
@@ -1,11 +1,12 @@
 import json
 
-from .common import SearpcError
+from .common import SearpcError, pack_bytes_section, split_bytes_section
 
 class SearpcService(object):
     def __init__(self, name):
         self.name = name
         self.func_table = {}
+        self.param_types = {}
 
 class SearpcServer(object):
     def __init__(self):
@@ -15,15 +16,20 @@ class SearpcServer(object):
         service = SearpcService(svcname)
         self.services[svcname] = service
 
-    def register_function(self, svcname, fn, fname=None):
+    def register_function(self, svcname, fn, fname=None, param_types=None):
+        """param_types is only needed to receive bytes values, see
+        searpc_func()."""
         service = self.services[svcname]
         if fname == None:
             fname = fn.__name__
         service.func_table[fname] = fn
+        if param_types:
+            service.param_types[fname] = param_types
 
     def _call_function(self, svcname, fcallstr):
         """input str -> output str"""
         try:
+            fcallstr, values = split_bytes_section(fcallstr)
             argv = json.loads(fcallstr)
         except Exception as e:
             raise SearpcError('bad call str: ' + str(e))
@@ -35,15 +41,27 @@ class SearpcServer(object):
         if fn is None:
             raise SearpcError('No such funtion %s' % fname)
 
+        param_types = service.param_types.get(fname, [])
+        for i, param_type in enumerate(param_types[:len(argv) - 1]):
+            if param_type == 'bytes':
+                index = argv[i + 1]
+                if not isinstance(index, int) or index >= len(values):
+                    raise SearpcError('bad call str: bytes value missing')
+                argv[i + 1] = values[index] if index >= 0 else None
+
         ret = fn(*argv[1:])
         return ret
 
     def call_function(self, svcname, fcallstr):
+        """Returns bytes when the function returned bytes, a str otherwise."""
         try:
             retVal = self._call_function(svcname, fcallstr)
         except Exception as e:
             ret = {'err_code': 555, 'err_msg': str(e)}
         else:
+            if isinstance(retVal, (bytes, bytearray)):
+                return (json.dumps({'ret': 0}).encode('utf-8') +
+                        pack_bytes_section([retVal]))
             ret = {'ret': retVal}
 
         return json.dumps(ret)
@@ -24,6 +24,9 @@ def init_server():
     searpc_server.register_function(SVCNAME, mul, 'multi')
     searpc_server.register_function(SVCNAME, json_func, 'json_func')
     searpc_server.register_function(SVCNAME, get_str, 'get_str')
+    searpc_server.register_function(SVCNAME, get_columnar_objlist, 'get_columnar_objlist')
+    searpc_server.register_function(SVCNAME, repeat_bytes, 'repeat_bytes',
+                                    ['bytes', 'int'])
 
 def json_func(a, b):
     return {'a': a, 'b': b}
@@ -31,6 +34,12 @@ def json_func(a, b):
 def get_str():
     return u'这是一个测试'
 
+def get_columnar_objlist():
+    return {'columns': ['name', 'papa-number'], 'rows': [['a', 1], ['b', 2]]}
+
+def repeat_bytes(data, n):
+    return None if data is None else data * n
+
 
 class DummyTransport(SearpcTransport):
     def connect(self):
@@ -56,6 +65,14 @@ class RpcMixin(object):
     def get_str(self):
         pass
 
+    @searpc_func("objlist", [])
+    def get_columnar_objlist(self):
+        pass
+
+    @searpc_func("bytes", ["bytes", "int"])
+    def repeat_bytes(self, x, y):
+        pass
+
 class DummyRpcClient(SearpcClient, RpcMixin):
     def __init__(self):
         self.transport = DummyTransport()
@@ -91,6 +108,12 @@ class SearpcTest(unittest.TestCase):
     def test_pipe_transport(self):
         self.run_common(self.named_pipe_client)
 
+    def test_pipe_large_message(self):
+        # Longer than one frame both ways.
+        s = 'abc' * (7 * 1024 * 1024)
+        v = self.named_pipe_client.multi(s, 2)
+        self.assertEqual(v, s * 2)
+
     def run_common(self, client):
         v = client.add(1, 2)
         self.assertEqual(v, 3)
@@ -107,6 +130,20 @@ class SearpcTest(unittest.TestCase):
         v = client.get_str()
         self.assertEqual(v, u'这是一个测试')
 
+        v = client.get_columnar_objlist()
+        self.assertEqual([obj.name for obj in v], ['a', 'b'])
+        self.assertEqual(v[1].papa_number, 2)
+
+        data = bytes(range(256)) + b'"\\\0'
+        v = client.repeat_bytes(data, 3)
+        self.assertEqual(v, data * 3)
+
+        v = client.repeat_bytes(b'', 3)
+        self.assertEqual(v, b'')
+
+        v = client.repeat_bytes(None, 3)
+        self.assertEqual(v, None)
+
 def setup_logging(level=logging.INFO):
     kw = {
         # 'format': '[%(asctime)s][%(pathname)s]: %(message)s',
@@ -7,6 +7,17 @@ func_table = [
     [ "string", ["string", "int"] ],
     [ "object", ["string"] ],
     [ "objlist", ["string", "int"] ],
+    [ "objstream", ["string", "int"] ],
     [ "json", ["string", "int"] ],
     [ "json", ["json"]],
+    [ "fd", ["string", "int"] ],
+    [ "int64", ["fd", "int"] ],
+    [ "bytes", ["bytes", "int"] ],
+    [ "int", ["bytes"] ],
+]
+
+# [ <struct type>, <GType>, [ [<json name>, <field type>, <struct field>] ] ]
+object_table = [
+    [ "MamanBar", "MAMAN_TYPE_BAR", [ ["name", "string", "name"],
+                                      ["papa-number", "int", "papa_number"] ] ],
 ]
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include <glib.h>
 #include <glib-object.h>
@@ -14,6 +15,7 @@
 
 #if !defined(WIN32)
 static const char *pipe_path = "/tmp/.searpc-test";
+static const char *epoll_pipe_path = "/tmp/.searpc-test-epoll";
 #else
 static const char *pipe_path = "\\\\.\\pipe\\libsearpc-test";
 #endif
@@ -151,10 +153,114 @@ maman_bar_init (MamanBar *self)
 
 }
 
+/* subclass overriding the "name" property, with properties of types
+ * that can't always be serialized */
+
+typedef struct {
+    MamanBar parent_instance;
+
+    gdouble  ratio;
+    gpointer data;
+} MamanBaz;
+typedef struct { MamanBarClass parent_class; } MamanBazClass;
+
+G_DEFINE_TYPE (MamanBaz, maman_baz, MAMAN_TYPE_BAR);
+
+enum
+{
+  PROP_BAZ_0,
+  PROP_BAZ_NAME,
+  PROP_BAZ_RATIO,
+  PROP_BAZ_DATA
+};
+
+static void
+maman_baz_set_property (GObject      *object,
+                        guint         property_id,
+                        const GValue *value,
+                        GParamSpec   *pspec)
+{
+    MamanBar *bar = MAMAN_BAR (object);
+    MamanBaz *self = (MamanBaz *) object;
+
+    switch (property_id) {
+    case PROP_BAZ_NAME:
+        g_free (bar->name);
+        bar->name = g_value_dup_string (value);
+        break;
+
+    case PROP_BAZ_RATIO:
+        self->ratio = g_value_get_double (value);
+        break;
+
+    case PROP_BAZ_DATA:
+        self->data = g_value_get_pointer (value);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+maman_baz_get_property (GObject    *object,
+                        guint       property_id,
+                        GValue     *value,
+                        GParamSpec *pspec)
+{
+    MamanBar *bar = MAMAN_BAR (object);
+    MamanBaz *self = (MamanBaz *) object;
+
+    switch (property_id) {
+    case PROP_BAZ_NAME:
+        // The overridden pspec is passed, not the override.
+        cl_assert (!G_IS_PARAM_SPEC_OVERRIDE (pspec));
+        g_value_take_string (value, g_strconcat ("baz-", bar->name, NULL));
+        break;
+
+    case PROP_BAZ_RATIO:
+        g_value_set_double (value, self->ratio);
+        break;
+
+    case PROP_BAZ_DATA:
+        g_value_set_pointer (value, self->data);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+maman_baz_class_init (MamanBazClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->set_property = maman_baz_set_property;
+    gobject_class->get_property = maman_baz_get_property;
+    g_object_class_override_property (gobject_class, PROP_BAZ_NAME, "name");
+    g_object_class_install_property (gobject_class, PROP_BAZ_RATIO,
+        g_param_spec_double ("ratio", "Ratio", "Ratio",
+                             -G_MAXDOUBLE, G_MAXDOUBLE, 1.5, G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class, PROP_BAZ_DATA,
+        g_param_spec_pointer ("data", "Data", "Data", G_PARAM_READWRITE));
+}
+
+static void
+maman_baz_init (MamanBaz *self)
+{
+    self->ratio = 1.5;
+}
+
 /* sample client */
 static SearpcClient *client;
 /* sample client with named pipe as transport */
 static SearpcClient *client_with_pipe_transport;
+/* servers freed after each test */
+static SearpcNamedPipeServer *pipe_server;
+static SearpcNamedPipeServer *epoll_server;
 
 char *
 sample_send(void *arg, const gchar *fcall_str,
@@ -164,8 +270,9 @@ sample_send(void *arg, const gchar *fcall_str,
 
     char *ret;
     /* directly call in memory, instead of send via network */
-    gchar *temp = g_strdup(fcall_str);
-    ret = searpc_server_call_function ("test", temp, fcall_len, ret_len);
+    gchar *temp = g_malloc (fcall_len + 1);
+    memcpy (temp, fcall_str, fcall_len + 1);
+    ret = searpc_server_call_function_in_place ("test", temp, fcall_len, ret_len);
     g_free (temp);
     return ret;
 }
@@ -180,7 +287,7 @@ sample_async_send (void *arg, gchar *fcall_str,
     size_t ret_len;
     gchar *temp = g_strdup(fcall_str);
 
-    ret = searpc_server_call_function ("test", temp, fcall_len, &ret_len);
+    ret = searpc_server_call_function_in_place ("test", temp, fcall_len, &ret_len);
     g_free (temp);
 
     searpc_client_generic_callback (ret, ret_len, rpc_priv, NULL);
@@ -203,14 +310,47 @@ get_substring (const gchar *orig_str, int sub_len, GError **error)
     return ret;
 }
 
+gchar *
+delayed_echo (const gchar *str, int delay_ms, GError **error)
+{
+    g_usleep (delay_ms * 1000);
+    return g_strdup (str);
+}
+
+// How many batch_echo calls are running, and the most seen at once.
+static gint batch_echo_running;
+static gint batch_echo_peak;
+
+gchar *
+batch_echo (const gchar *str, int delay_ms, GError **error)
+{
+    int running = g_atomic_int_add (&batch_echo_running, 1) + 1;
+    int peak;
+
+    do {
+        peak = g_atomic_int_get (&batch_echo_peak);
+    } while (running > peak &&
+             !g_atomic_int_compare_and_exchange (&batch_echo_peak, peak, running));
+
+    g_usleep (delay_ms * 1000);
+    g_atomic_int_add (&batch_echo_running, -1);
+    return g_strdup (str);
+}
+
 static SearpcClient *
-do_create_client_with_pipe_transport(void)
+do_create_client_with_pipe_path(const char *path)
 {
-    SearpcNamedPipeClient *pipe_client = searpc_create_named_pipe_client(pipe_path);
+    SearpcNamedPipeClient *pipe_client = searpc_create_named_pipe_client(path);
     cl_must_pass_(searpc_named_pipe_client_connect(pipe_client), "named pipe client failed to connect");
     return searpc_client_with_named_pipe_transport(pipe_client, "test");
 }
 
+static SearpcClient *
+do_create_client_with_pipe_transport(void)
+{
+    return do_create_client_with_pipe_path(pipe_path);
+}
+
 
 void
 test_searpc__simple_call (void)
@@ -315,6 +455,280 @@ test_searpc__objlist_call (void)
     g_list_free (result);
 }
 
+void
+test_searpc__columnar_objlist (void)
+{
+    char *fcall = g_strdup ("[\"get_maman_bar_list\",\"kitty\",3]");
+    GList *result, *ptr;
+    GError *error = NULL;
+    char *ret, buf[32];
+    size_t ret_len;
+    int i = 0;
+
+    cl_assert (searpc_server_set_columnar_objlists ("no-such-service", TRUE) < 0);
+    cl_must_pass (searpc_server_set_columnar_objlists ("test", TRUE));
+
+    ret = searpc_server_call_function ("test", fcall, strlen(fcall), &ret_len);
+    cl_assert_equal_s (ret, "{\"ret\":{\"columns\":[\"name\",\"papa-number\"],"
+                       "\"rows\":[[\"kitty0\",0],[\"kitty1\",0],[\"kitty2\",0]]}}");
+    g_free (ret);
+    g_free (fcall);
+
+    result = searpc_client_call__objlist (client, "get_maman_bar_list",
+                                          MAMAN_TYPE_BAR, &error,
+                                          2, "string", "kitty", "int", 3);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (g_list_length (result), 3);
+    for (ptr = result; ptr; ptr = ptr->next) {
+        snprintf (buf, sizeof(buf), "kitty%d", i++);
+        cl_assert_equal_s (MAMAN_BAR (ptr->data)->name, buf);
+        g_object_unref (ptr->data);
+    }
+    g_list_free (result);
+
+    // Empty lists are still null.
+    result = searpc_client_call__objlist (client, "get_maman_bar_list",
+                                          MAMAN_TYPE_BAR, &error,
+                                          2, "string", "kitty", "int", 0);
+    cl_assert (error == NULL && result == NULL);
+
+    // Rows that don't match the columns are rejected.
+    ret = "{\"ret\":{\"columns\":[\"name\"],\"rows\":[[\"a\",1]]}}";
+    result = searpc_client_fret__objlist (MAMAN_TYPE_BAR, ret, strlen(ret), &error);
+    cl_assert (result == NULL && error != NULL);
+    g_clear_error (&error);
+}
+
+static void
+count_warnings (const gchar *domain, GLogLevelFlags level,
+                const gchar *message, gpointer data)
+{
+    if (level & G_LOG_LEVEL_WARNING)
+        ++*(int *)data;
+}
+
+void
+test_searpc__columnar_unsupported (void)
+{
+    GObject *baz;
+    GList *objects;
+    GString *out = g_string_new (NULL);
+    GLogFunc old_handler;
+    json_t *table, *columns, *row;
+    int i, warnings = 0;
+
+    baz = g_object_new (maman_baz_get_type (), "name", "kitty", "papa-number", 5, NULL);
+    ((MamanBaz *) baz)->ratio = NAN;
+    objects = g_list_append (NULL, baz);
+
+    // Pointers have no column, and the NaN that can't be written is null.
+    cl_assert (searpc_json_write_gobject_rows (out, objects));
+    table = json_loads (out->str, 0, NULL);
+    columns = json_object_get (table, "columns");
+    row = json_array_get (json_object_get (table, "rows"), 0);
+    cl_assert_equal_i (json_array_size (columns), 3);
+    cl_assert_equal_i (json_array_size (row), 3);
+    for (i = 0; i < 3; i++) {
+        const char *name = json_string_value (json_array_get (columns, i));
+        cl_assert (strcmp (name, "data") != 0);
+        if (strcmp (name, "ratio") == 0)
+            cl_assert (json_is_null (json_array_get (row, i)));
+    }
+    json_decref (table);
+    g_list_free (objects);
+    g_object_unref (baz);
+
+    // Null keeps the default, quietly, except for strings and objects.
+    table = json_loads ("{\"columns\": [\"name\", \"papa-number\", \"ratio\"],"
+                        " \"rows\": [[null, null, null]]}", 0, NULL);
+    old_handler = g_log_set_default_handler (count_warnings, &warnings);
+    cl_assert (json_gobject_deserialize_rows (maman_baz_get_type (), table, &objects));
+    g_log_set_default_handler (old_handler, NULL);
+    cl_assert_equal_i (warnings, 0);
+    cl_assert_equal_i (g_list_length (objects), 1);
+    cl_assert (MAMAN_BAR (objects->data)->name == NULL);
+    cl_assert_equal_i (MAMAN_BAR (objects->data)->papa_number, 0);
+    cl_assert (((MamanBaz *) objects->data)->ratio == 1.5);
+    g_object_unref (objects->data);
+    g_list_free (objects);
+    json_decref (table);
+
+    g_string_free (out, TRUE);
+}
+
+void
+test_searpc__streaming_ret (void)
+{
+    const char *name = "tab\there \"quoted\" back\\slash \x01 \xc3\xa9";
+    MamanBar *bar;
+    GString *out;
+    json_t *streamed, *tree;
+    gchar *result;
+    GError *error = NULL;
+
+    // Objects are written the same way as json_gobject_serialize() does.
+    bar = g_object_new (MAMAN_TYPE_BAR, "name", name, "papa-number", 3, NULL);
+    out = g_string_new (NULL);
+    searpc_json_write_gobject (out, G_OBJECT(bar));
+    streamed = json_loads (out->str, 0, NULL);
+    tree = json_gobject_serialize (G_OBJECT(bar));
+    cl_assert (streamed != NULL);
+    cl_assert (json_equal (streamed, tree));
+    json_decref (streamed);
+    json_decref (tree);
+    g_string_free (out, TRUE);
+    g_object_unref (bar);
+
+    // Strings that need escaping survive a call.
+    result = searpc_client_call__string (client, "get_substring", &error,
+                                         2, "string", name, "int", (int)strlen(name));
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, name);
+    g_free (result);
+}
+
+static void *
+do_gobject_round_trips (void *arg)
+{
+    GObject *bar = arg;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        json_t *json = json_gobject_serialize (bar);
+        MamanBar *copy = MAMAN_BAR (json_gobject_deserialize (MAMAN_TYPE_BAR, json));
+        cl_assert_equal_s (copy->name, "kitty");
+        cl_assert_equal_i (copy->papa_number, 5);
+        g_object_unref (copy);
+        json_decref (json);
+    }
+    return NULL;
+}
+
+void
+test_searpc__gobject_property_plan (void)
+{
+    GObject *bar;
+    MamanBar *copy;
+    json_t *json;
+    pthread_t threads[4];
+    int i;
+
+    // Members may use '_' in place of '-', like g_object_set() allows.
+    json = json_loads ("{\"name\": \"cat\", \"papa_number\": 7, \"unknown\": 1}", 0, NULL);
+    copy = MAMAN_BAR (json_gobject_deserialize (MAMAN_TYPE_BAR, json));
+    cl_assert_equal_s (copy->name, "cat");
+    cl_assert_equal_i (copy->papa_number, 7);
+    g_object_unref (copy);
+    json_decref (json);
+
+    // The cached plans are shared by threads.
+    bar = g_object_new (MAMAN_TYPE_BAR, "name", "kitty", "papa-number", 5, NULL);
+    for (i = 0; i < G_N_ELEMENTS(threads); i++)
+        pthread_create (&threads[i], NULL, do_gobject_round_trips, bar);
+    for (i = 0; i < G_N_ELEMENTS(threads); i++)
+        pthread_join (threads[i], NULL);
+    g_object_unref (bar);
+}
+
+void
+test_searpc__gobject_property_override (void)
+{
+    GObject *baz;
+    GString *out = g_string_new (NULL);
+    json_t *json;
+
+    // The overriding class reads "name", the parent class reads the rest.
+    baz = g_object_new (maman_baz_get_type (), "name", "kitty", "papa-number", 5, NULL);
+
+    json = json_gobject_serialize (baz);
+    cl_assert_equal_s (json_string_value (json_object_get (json, "name")), "baz-kitty");
+    cl_assert_equal_i (json_integer_value (json_object_get (json, "papa-number")), 5);
+    json_decref (json);
+
+    searpc_json_write_gobject (out, baz);
+    json = json_loads (out->str, 0, NULL);
+    cl_assert_equal_s (json_string_value (json_object_get (json, "name")), "baz-kitty");
+    json_decref (json);
+
+    g_string_free (out, TRUE);
+    g_object_unref (baz);
+}
+
+// Call get_substring with @request and return what it returned, checking
+// that the request is left unchanged.
+static char *
+call_with_request (const char *request, int *err_code)
+{
+    gchar *buf = g_strdup (request);
+    gsize len = strlen (request), ret_len;
+    char *ret, *result = NULL;
+    json_t *object;
+
+    ret = searpc_server_call_function_in_place ("test", buf, len, &ret_len);
+    cl_assert_equal_s (buf, request);
+    object = json_loadb (ret, ret_len, 0, NULL);
+    cl_assert (object != NULL);
+
+    *err_code = (int)json_integer_value (json_object_get (object, "err_code"));
+    if (json_string_value (json_object_get (object, "ret")))
+        result = g_strdup (json_string_value (json_object_get (object, "ret")));
+
+    json_decref (object);
+    g_free (ret);
+    g_free (buf);
+    return result;
+}
+
+void
+test_searpc__param_reader (void)
+{
+    char *result;
+    int err_code;
+
+    result = call_with_request (" [ \"get_substring\" ,\"hello\", 2 ] ", &err_code);
+    cl_assert_equal_i (err_code, 0);
+    cl_assert_equal_s (result, "he");
+    g_free (result);
+
+    // Escapes, including a surrogate pair.
+    result = call_with_request ("[\"get_substring\", \"h\\u00e9\\\"\\ud83d\\ude00\\n\", 8]",
+                                &err_code);
+    cl_assert_equal_i (err_code, 0);
+    cl_assert_equal_s (result, "h\xc3\xa9\"\xf0\x9f\x98\x80");
+    g_free (result);
+
+    // Read as 0, like json_integer_value() does.
+    result = call_with_request ("[\"get_substring\", \"hello\", null]", &err_code);
+    cl_assert_equal_i (err_code, 0);
+    cl_assert_equal_s (result, "");
+    g_free (result);
+
+    // Calls the reader can't read are loaded by jansson.
+    result = call_with_request ("[\"get_substring\", \"hello\", 2, {\"a\": [1]}]", &err_code);
+    cl_assert_equal_i (err_code, 0);
+    cl_assert_equal_s (result, "he");
+    g_free (result);
+
+    // And rejected the same way.
+    result = call_with_request ("[\"get_substring\", \"hello\", 99999999999999999999]",
+                                &err_code);
+    cl_assert_equal_i (err_code, 511);
+    result = call_with_request ("[\"get_substring\", \"\\ud83d\", 1]", &err_code);
+    cl_assert_equal_i (err_code, 511);
+    result = call_with_request ("[\"get_substring\", \"hello\", 2] x", &err_code);
+    cl_assert_equal_i (err_code, 511);
+    result = call_with_request ("[\"get_substring\", \"hello\", 02]", &err_code);
+    cl_assert_equal_i (err_code, 511);
+
+    // The buffer of a call may be read-only.
+    static const char request[] = "[\"get_substring\", \"hello\", 2]";
+    gsize ret_len;
+    char *ret = searpc_server_call_function ("test", (gchar *)request,
+                                             strlen (request), &ret_len);
+    cl_assert_equal_s (ret, "{\"ret\":\"he\"}");
+    g_free (ret);
+}
+
 json_t *
 simple_json_rpc (const char *name, int num, GError **error)
 {
@@ -418,6 +832,56 @@ test_searpc__simple_call_async_json (void)
                                     2, "string", "hello", "int", 10);
 }
 
+void
+test_searpc__stats_service (void)
+{
+    char fcall[64];
+    gchar *result;
+    char *ret;
+    gsize ret_len;
+    GError *error = NULL;
+    json_t *object, *stats;
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        result = searpc_client_call__string (client, "get_substring", &error,
+                                             2, "string", "hello", "int", 2);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        g_free (result);
+    }
+    result = searpc_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 10);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+
+    snprintf (fcall, sizeof(fcall), "[\"get_stats\"]");
+    ret = searpc_server_call_function (SEARPC_STATS_SERVICE, fcall, strlen(fcall), &ret_len);
+    object = json_loadb (ret, ret_len, 0, NULL);
+    cl_assert (object != NULL);
+    g_free (ret);
+
+    stats = json_object_get (json_object_get (json_object_get (object, "ret"), "test"),
+                             "get_substring");
+    cl_assert (stats != NULL);
+    cl_assert (json_integer_value (json_object_get (stats, "calls")) == 11);
+    cl_assert (json_integer_value (json_object_get (stats, "errors")) == 1);
+    cl_assert (json_integer_value (json_object_get (stats, "p50_usec")) <=
+               json_integer_value (json_object_get (stats, "p99_usec")));
+    cl_assert (json_integer_value (json_object_get (stats, "p99_usec")) <=
+               json_integer_value (json_object_get (stats, "p999_usec")));
+    cl_assert (json_integer_value (json_object_get (stats, "p999_usec")) <=
+               json_integer_value (json_object_get (stats, "max_usec")));
+    // Functions that were never called are left out.
+    cl_assert (json_object_get (json_object_get (json_object_get (object, "ret"), "test"),
+                                "count_json_kvs") == NULL);
+    json_decref (object);
+
+    snprintf (fcall, sizeof(fcall), "[\"no_such_function\"]");
+    ret = searpc_server_call_function (SEARPC_STATS_SERVICE, fcall, strlen(fcall), &ret_len);
+    cl_assert (strstr (ret, "err_code") != NULL);
+    g_free (ret);
+}
+
 void
 test_searpc__pipe_simple_call (void)
 {
@@ -469,7 +933,8 @@ test_searpc__pipe_large_request (void)
 
 static void * do_pipe_connect_and_request(void *arg)
 {
-    SearpcClient *client = do_create_client_with_pipe_transport();
+    const char *path = arg ? arg : pipe_path;
+    SearpcClient *client = do_create_client_with_pipe_path(path);
 
     // 100KB
     int size = 100 * 1024;
@@ -519,25 +984,1732 @@ test_searpc__pipe_concurrent_clients (void)
     }
 }
 
+static void
+check_echo_response (const char *resp, size_t len, const char *expected)
+{
+    json_error_t jerror;
+    json_t *object = json_loadb (resp, len, 0, &jerror);
 
-#include "searpc-signature.h"
-#include "searpc-marshal.h"
+    cl_assert (object != NULL);
+    cl_assert_equal_s (json_string_value (json_object_get (object, "ret")), expected);
+    json_decref (object);
+}
 
 void
-test_searpc__initialize (void)
+test_searpc__pipe_pipelining (void)
 {
-    searpc_server_init (register_marshals);
-    searpc_create_service ("test");
-    searpc_server_register_function ("test", get_substring, "get_substring",
-                                     searpc_signature_string__string_int());
-    searpc_server_register_function ("test", get_maman_bar, "get_maman_bar",
-                                     searpc_signature_object__string());
-    searpc_server_register_function ("test", get_maman_bar_list, "get_maman_bar_list",
-                                     searpc_signature_objlist__string_int());
-    searpc_server_register_function ("test", simple_json_rpc, "simple_json_rpc",
-                                     searpc_signature_json__string_int());
-    searpc_server_register_function ("test", count_json_kvs, "count_json_kvs",
-                                     searpc_signature_json__json());
+    SearpcNamedPipeClient *pipe_client;
+    guint32 ids[3], resp_id;
+    char fcall[64];
+    char *resp;
+    size_t len;
+    int i;
+
+    // Without epoll, requests of a connection run in order.
+    pipe_client = searpc_create_named_pipe_client (pipe_path);
+    cl_must_pass (searpc_named_pipe_client_connect (pipe_client));
+
+    for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+        snprintf (fcall, sizeof(fcall), "[\"delayed_echo\", \"%d\", %d]",
+                  i, (int)(G_N_ELEMENTS(ids) - i) * 10);
+        cl_must_pass (searpc_named_pipe_client_send_request (pipe_client, "test", fcall,
+                                                             strlen(fcall), &ids[i]));
+    }
+    for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+        resp = searpc_named_pipe_client_read_response (pipe_client, &resp_id, &len);
+        cl_assert (resp != NULL);
+        cl_assert (resp_id == ids[i]);
+        snprintf (fcall, sizeof(fcall), "%d", i);
+        check_echo_response (resp, len, fcall);
+        g_free (resp);
+    }
+
+    searpc_named_pipe_client_free (pipe_client);
+}
+
+static void *
+do_shared_client_calls (void *arg)
+{
+    SearpcClient *shared_client = arg;
+    GError *error = NULL;
+    char expected[64];
+    gchar *result;
+    int i;
+
+    for (i = 0; i < 50; i++) {
+        snprintf (expected, sizeof(expected), "%p-%d", (void *)pthread_self(), i);
+        result = searpc_client_call__string (shared_client, "delayed_echo", &error,
+                                             2, "string", expected, "int", i % 3);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, expected);
+        g_free (result);
+    }
+    return NULL;
+}
+
+static void
+run_shared_client_calls (SearpcClient *shared_client)
+{
+    pthread_t threads[8];
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(threads); i++) {
+        pthread_create (&threads[i], NULL, do_shared_client_calls, shared_client);
+    }
+    for (i = 0; i < G_N_ELEMENTS(threads); i++) {
+        pthread_join (threads[i], NULL);
+    }
+}
+
+void
+test_searpc__pipe_shared_client (void)
+{
+    run_shared_client_calls (client_with_pipe_transport);
+}
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Replaces the epoll server started earlier in the test, if any.
+static SearpcNamedPipeServer *
+start_epoll_server_with_pool_size (int pool_size)
+{
+    SearpcNamedPipeServer *server;
+
+    searpc_free_named_pipe_server (epoll_server);
+    epoll_server = NULL;
+    server = searpc_create_named_pipe_server_with_threadpool(epoll_pipe_path, pool_size);
+    cl_assert (server != NULL);
+    server->use_epoll = TRUE;
+    cl_must_pass_(searpc_named_pipe_server_start(server), "epoll named pipe server failed to start");
+    epoll_server = server;
+    return server;
+}
+
+static SearpcNamedPipeServer *
+start_epoll_server (void)
+{
+    return start_epoll_server_with_pool_size (NAMED_PIPE_SERVER_THREAD_POOL_SIZE);
+}
+
+void
+test_searpc__pipe_epoll_call (void)
+{
+    gchar* result;
+    GError *error = NULL;
+    SearpcClient *epoll_client;
+    int i, j;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+
+    // Each call re-arms the connection in the epoll set.
+    for (i = 0; i < 100; i++) {
+        result = searpc_client_call__string (epoll_client, "get_substring", &error,
+                                             2, "string", "hello", "int", 2);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert (strcmp(result, "he") == 0);
+        g_free (result);
+    }
+
+    result = searpc_client_call__string (epoll_client, "get_substring", &error,
+                                         2, "string", "hello", "int", 10);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+    g_free (result);
+
+    pthread_t threads[5];
+    for (i = 0; i < 5; i++) {
+        for (j = 0; j < G_N_ELEMENTS(threads); j++) {
+            pthread_create(&threads[j], NULL, do_pipe_connect_and_request,
+                           (void *)epoll_pipe_path);
+        }
+        for (j = 0; j < G_N_ELEMENTS(threads); j++) {
+            pthread_join(threads[j], NULL);
+        }
+    }
+
+    // Large requests and responses are read and flushed in several steps.
+    int size = 10 * 1024 * 1024;
+    GString *large_string = g_string_sized_new(size);
+    while (large_string->len < size) {
+        g_string_append(large_string, "aaaa");
+    }
+    result = searpc_client_call__string (epoll_client, "get_substring", &error,
+                                         2, "string", large_string->str, "int", size - 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (strlen(result) == size - 2);
+    g_free (result);
+    g_string_free (large_string, TRUE);
+
+    searpc_free_client_with_pipe_transport (epoll_client);
+}
+
+void
+test_searpc__free_pipe_server (void)
+{
+    gchar *result;
+    GError *error = NULL;
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    result = searpc_client_call__string (epoll_client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    g_free (result);
+
+    // The connections of freed servers are closed.
+    searpc_free_named_pipe_server (pipe_server);
+    pipe_server = NULL;
+    searpc_free_named_pipe_server (epoll_server);
+    epoll_server = NULL;
+
+    result = searpc_client_call__string (client_with_pipe_transport, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert (result == NULL && error != NULL);
+    g_clear_error (&error);
+    result = searpc_client_call__string (epoll_client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert (result == NULL && error != NULL);
+    g_clear_error (&error);
+    searpc_free_client_with_pipe_transport (epoll_client);
+}
+
+void
+test_searpc__pipe_epoll_slow_client (void)
+{
+    gchar* result;
+    GError *error = NULL;
+    struct sockaddr_un addr;
+    int slow_fd;
+
+    // A single worker must not be held by a client that stops in the
+    // middle of a request.
+    start_epoll_server_with_pool_size (1);
+
+    slow_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy (addr.sun_path, epoll_pipe_path, sizeof(addr.sun_path));
+    cl_must_pass (connect (slow_fd, (struct sockaddr *)&addr, sizeof(addr)));
+    cl_assert (write (slow_fd, "\x40\0", 2) == 2);
+
+    SearpcClient *epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    result = searpc_client_call__string (epoll_client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (strcmp(result, "he") == 0);
+    g_free (result);
+
+    close (slow_fd);
+    searpc_free_client_with_pipe_transport (epoll_client);
+}
+
+void
+test_searpc__pipe_epoll_pipelining (void)
+{
+    SearpcNamedPipeClient *pipe_client;
+    const char *slow_call = "[\"delayed_echo\", \"slow\", 300]";
+    const char *fast_call = "[\"delayed_echo\", \"fast\", 0]";
+    guint32 slow_id, fast_id, resp_id;
+    guint32 ids[100];
+    char fcall[64];
+    char *resp;
+    size_t len;
+    int i, j;
+
+    start_epoll_server_with_pool_size (4);
+
+    pipe_client = searpc_create_named_pipe_client (epoll_pipe_path);
+    cl_must_pass (searpc_named_pipe_client_connect (pipe_client));
+    cl_assert (pipe_client->frame_version >= 2);
+
+    // The fast call overtakes the slow one sent before it.
+    cl_must_pass (searpc_named_pipe_client_send_request (pipe_client, "test", slow_call,
+                                                         strlen(slow_call), &slow_id));
+    cl_must_pass (searpc_named_pipe_client_send_request (pipe_client, "test", fast_call,
+                                                         strlen(fast_call), &fast_id));
+    cl_assert (slow_id != fast_id);
+
+    resp = searpc_named_pipe_client_read_response (pipe_client, &resp_id, &len);
+    cl_assert (resp != NULL);
+    cl_assert (resp_id == fast_id);
+    check_echo_response (resp, len, "fast");
+    g_free (resp);
+
+    resp = searpc_named_pipe_client_read_response (pipe_client, &resp_id, &len);
+    cl_assert (resp != NULL);
+    cl_assert (resp_id == slow_id);
+    check_echo_response (resp, len, "slow");
+    g_free (resp);
+
+    // More requests in flight than the server runs at once on a connection.
+    for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+        snprintf (fcall, sizeof(fcall), "[\"delayed_echo\", \"%d\", %d]", i, i % 3);
+        cl_must_pass (searpc_named_pipe_client_send_request (pipe_client, "test", fcall,
+                                                             strlen(fcall), &ids[i]));
+    }
+    for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+        resp = searpc_named_pipe_client_read_response (pipe_client, &resp_id, &len);
+        cl_assert (resp != NULL);
+        for (j = 0; j < G_N_ELEMENTS(ids); j++) {
+            if (ids[j] == resp_id)
+                break;
+        }
+        cl_assert (j < G_N_ELEMENTS(ids));
+        snprintf (fcall, sizeof(fcall), "%d", j);
+        check_echo_response (resp, len, fcall);
+        ids[j] = 0;
+        g_free (resp);
+    }
+
+    searpc_named_pipe_client_free (pipe_client);
+}
+
+void
+test_searpc__pipe_epoll_shared_client (void)
+{
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+
+    // Calls of all threads are multiplexed on one connection.
+    run_shared_client_calls (epoll_client);
+
+    searpc_free_client_with_pipe_transport (epoll_client);
+}
+
+void
+test_searpc__pipe_epoll_scheduler_per_core (void)
+{
+    SearpcNamedPipeServer *server;
+    SearpcClient *epoll_client;
+
+    // One worker per core, each bound to its core.
+    searpc_free_named_pipe_server (epoll_server);
+    epoll_server = NULL;
+    server = searpc_create_named_pipe_server_with_scheduler (epoll_pipe_path, 0, TRUE);
+    cl_assert (server != NULL && server->pool_size > 0);
+    server->use_epoll = TRUE;
+    cl_must_pass (searpc_named_pipe_server_start (server));
+    epoll_server = server;
+
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    run_shared_client_calls (epoll_client);
+    searpc_free_client_with_pipe_transport (epoll_client);
+}
+
+void
+test_searpc__pipe_epoll_queue_time (void)
+{
+    SearpcNamedPipeClient *pipe_clients[2];
+    const char *fcall = "[\"delayed_echo\", \"queued\", 400]";
+    guint32 req_id;
+    char *resp;
+    size_t len;
+    json_t *object, *stats;
+    int i;
+
+    // With a single worker, the second call waits for the first one. It
+    // runs long enough for the check to leave room for a slow machine.
+    start_epoll_server_with_pool_size (1);
+    for (i = 0; i < G_N_ELEMENTS(pipe_clients); i++) {
+        pipe_clients[i] = searpc_create_named_pipe_client (epoll_pipe_path);
+        cl_must_pass (searpc_named_pipe_client_connect (pipe_clients[i]));
+    }
+    for (i = 0; i < G_N_ELEMENTS(pipe_clients); i++) {
+        cl_must_pass (searpc_named_pipe_client_send_request (pipe_clients[i], "test", fcall,
+                                                             strlen(fcall), &req_id));
+    }
+    for (i = 0; i < G_N_ELEMENTS(pipe_clients); i++) {
+        resp = searpc_named_pipe_client_read_response (pipe_clients[i], &req_id, &len);
+        cl_assert (resp != NULL);
+        check_echo_response (resp, len, "queued");
+        g_free (resp);
+        searpc_named_pipe_client_free (pipe_clients[i]);
+    }
+
+    // Calls are recorded after their responses are written, so the last
+    // one may not be counted yet. Freeing the server waits for them.
+    searpc_free_named_pipe_server (epoll_server);
+    epoll_server = NULL;
+
+    resp = searpc_server_call_function (SEARPC_STATS_SERVICE, "[\"get_stats\"]",
+                                        strlen("[\"get_stats\"]"), &len);
+    object = json_loadb (resp, len, 0, NULL);
+    cl_assert (object != NULL);
+    g_free (resp);
+    stats = json_object_get (json_object_get (json_object_get (object, "ret"), "test"),
+                             "delayed_echo");
+    cl_assert_equal_i (json_integer_value (json_object_get (stats, "calls")), 2);
+    cl_assert (json_integer_value (json_object_get (stats, "queue_max_usec")) >= 150000);
+    cl_assert (json_integer_value (json_object_get (stats, "max_usec")) >= 150000);
+    cl_assert (json_object_get (stats, "write_mean_usec") != NULL);
+    json_decref (object);
+}
+#endif
+
+
+#include "searpc-signature.h"
+#include "searpc-marshal.h"
+#include "searpc-client-stubs.h"
+#include "searpc-object-serializers.h"
+
+static gint64
+get_substring_calls (void)
+{
+    char *ret;
+    gsize ret_len;
+    json_t *object, *stats;
+    gint64 calls;
+
+    ret = searpc_server_call_function (SEARPC_STATS_SERVICE, "[\"get_stats\"]",
+                                       strlen("[\"get_stats\"]"), &ret_len);
+    object = json_loadb (ret, ret_len, 0, NULL);
+    cl_assert (object != NULL);
+    g_free (ret);
+    stats = json_object_get (json_object_get (json_object_get (object, "ret"), "test"),
+                             "get_substring");
+    calls = stats ? json_integer_value (json_object_get (stats, "calls")) : 0;
+    json_decref (object);
+    return calls;
+}
+
+void
+test_searpc__stats_reregister (void)
+{
+    gchar *result;
+    GError *error = NULL;
+
+    result = searpc_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    g_free (result);
+    cl_assert (get_substring_calls () == 1);
+
+    // Registering a function again keeps its statistics.
+    searpc_server_register_function ("test", get_substring, "get_substring",
+                                     searpc_signature_string__string_int());
+    cl_assert (get_substring_calls () == 1);
+
+    // And a new server starts from nothing.
+    searpc_server_final ();
+    searpc_server_init (register_marshals);
+    searpc_create_service ("test");
+    searpc_server_register_function ("test", get_substring, "get_substring",
+                                     searpc_signature_string__string_int());
+    cl_assert (get_substring_calls () == 0);
+}
+
+#ifdef __linux__
+static char *
+read_slow_log (const char *path)
+{
+    char *content = NULL;
+
+    searpc_server_flush_slow_log ();
+    cl_assert (g_file_get_contents (path, &content, NULL, NULL));
+    return content;
+}
+
+void
+test_searpc__slow_log (void)
+{
+    char *path = g_build_filename (g_get_tmp_dir (), "searpc-test-slow.log", NULL);
+    char *rotated = g_strconcat (path, ".1", NULL);
+    char *content;
+    gchar *result;
+    GError *error = NULL;
+
+    unlink (path);
+    unlink (rotated);
+
+    searpc_server_final ();
+    cl_must_pass (searpc_server_init_with_slow_log (register_marshals, path, 10, NULL));
+    searpc_create_service ("test");
+    searpc_server_register_function ("test", delayed_echo, "delayed_echo",
+                                     searpc_signature_string__string_int());
+
+    result = searpc_client_call__string (client, "delayed_echo", &error,
+                                         2, "string", "slow", "int", 20);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    g_free (result);
+    result = searpc_client_call__string (client, "delayed_echo", &error,
+                                         2, "string", "fast", "int", 0);
+    g_free (result);
+
+    content = read_slow_log (path);
+    cl_assert (strstr (content, "\"test\" [\"delayed_echo\",\"slow\",20]") != NULL);
+    cl_assert (strstr (content, "queue=") != NULL);
+    cl_assert (strstr (content, "fast") == NULL);
+    g_free (content);
+
+    // Calls after a rotation go to the new file.
+    cl_assert (rename (path, rotated) == 0);
+    cl_must_pass (searpc_server_reopen_slow_log (path));
+    result = searpc_client_call__string (client, "delayed_echo", &error,
+                                         2, "string", "rotated", "int", 20);
+    g_free (result);
+
+    content = read_slow_log (path);
+    cl_assert (strstr (content, "rotated") != NULL);
+    cl_assert (strstr (content, "slow") == NULL);
+    g_free (content);
+
+    unlink (path);
+    unlink (rotated);
+    g_free (path);
+    g_free (rotated);
+}
+
+void
+test_searpc__slow_log_json (void)
+{
+    char *path = g_build_filename (g_get_tmp_dir (), "searpc-test-slow.json", NULL);
+    char *content, **lines;
+    gchar *result;
+    GError *error = NULL;
+    json_t *record;
+
+    unlink (path);
+
+    searpc_server_final ();
+    cl_must_pass (searpc_server_init_with_slow_log (register_marshals, path, 0, NULL));
+    searpc_server_set_slow_log_options (TRUE, 8, 1.0);
+    searpc_create_service ("test");
+    searpc_server_register_function ("test", get_substring, "get_substring",
+                                     searpc_signature_string__string_int());
+
+    result = searpc_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 10);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+
+    // Sampled out.
+    searpc_server_set_slow_log_options (TRUE, 8, 0.0);
+    result = searpc_client_call__string (client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    g_free (result);
+
+    content = read_slow_log (path);
+    lines = g_strsplit (content, "\n", -1);
+    cl_assert (g_strv_length (lines) == 2);
+
+    record = json_loads (lines[0], 0, NULL);
+    cl_assert (record != NULL);
+    cl_assert_equal_s (json_string_value (json_object_get (record, "service")), "test");
+    cl_assert_equal_s (json_string_value (json_object_get (record, "function")), "get_substring");
+    cl_assert_equal_s (json_string_value (json_object_get (record, "request")), "[\"get_su");
+    cl_assert (json_is_true (json_object_get (record, "truncated")));
+    cl_assert (json_integer_value (json_object_get (record, "request_bytes")) ==
+               strlen ("[\"get_substring\",\"hello\",10]"));
+    cl_assert (json_integer_value (json_object_get (record, "response_bytes")) > 0);
+    cl_assert (json_integer_value (json_object_get (record, "thread")) > 0);
+    cl_assert (json_object_get (record, "queue_usec") != NULL);
+    cl_assert (json_object_get (record, "err_code") != NULL);
+    json_decref (record);
+
+    g_strfreev (lines);
+    g_free (content);
+    searpc_server_set_slow_log_options (FALSE, -1, 1.0);
+    unlink (path);
+    g_free (path);
+}
+#endif
+
+void
+test_searpc__static_marshal_table (void)
+{
+    char *signature;
+    char *result;
+    GError *error = NULL;
+
+    signature = searpc_compute_signature ("objlist", 2, "string", "int");
+    cl_assert_equal_s (signature, SEARPC_SIGNATURE_OBJLIST__STRING_INT);
+    g_free (signature);
+    signature = searpc_compute_signature ("json", 1, "json");
+    cl_assert_equal_s (signature, SEARPC_SIGNATURE_JSON__JSON);
+    g_free (signature);
+
+    cl_assert (searpc_server_register_function_with_marshal (
+                   "test", get_substring, "get_substring_static",
+                   &searpc_marshal_table[SEARPC_MARSHAL_STRING__STRING_INT]));
+    cl_assert (!searpc_server_register_function_with_marshal (
+                   "no-such-service", get_substring, "get_substring_static",
+                   &searpc_marshal_table[SEARPC_MARSHAL_STRING__STRING_INT]));
+
+    result = searpc_call_string__string_int (client, "get_substring_static",
+                                             &error, "hello", 3);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "hel");
+    g_free (result);
+
+    // The generated table is sorted, so it's searched by bisection.
+    int i;
+    for (i = 1; i < SEARPC_N_MARSHALS; i++)
+        cl_assert (strcmp (searpc_marshal_table[i - 1].signature,
+                           searpc_marshal_table[i].signature) < 0);
+
+    // Other tables are searched entry by entry.
+    static SearpcMarshalEntry unsorted[2];
+    unsorted[0] = searpc_marshal_table[SEARPC_MARSHAL_OBJECT__STRING];
+    unsorted[0].signature = "zz-unsorted";
+    unsorted[1] = searpc_marshal_table[SEARPC_MARSHAL_STRING__STRING_INT];
+    unsorted[1].signature = "aa-unsorted";
+    searpc_server_register_marshal_table (unsorted, G_N_ELEMENTS(unsorted));
+    cl_assert (searpc_server_register_function ("test", get_substring, "get_substring_unsorted",
+                                                g_strdup ("aa-unsorted")));
+    cl_assert (!searpc_server_register_function ("test", get_substring, "get_substring_unsorted",
+                                                 g_strdup ("no-such-signature")));
+    result = searpc_call_string__string_int (client, "get_substring_unsorted",
+                                             &error, "hello", 4);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "hell");
+    g_free (result);
+}
+
+static void
+check_calls_by_id (SearpcClient *pipe_client)
+{
+    char *result;
+    GError *error = NULL;
+
+    cl_must_pass (searpc_client_load_pipe_function_ids (pipe_client));
+
+    result = searpc_call_string__string_int (pipe_client, "get_substring",
+                                             &error, "hello", 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "he");
+    g_free (result);
+
+    result = searpc_call_string__string_int (pipe_client, "get_substring",
+                                             &error, "hello", 10);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+    g_free (result);
+
+    // Functions registered after the ids were loaded are called by name.
+    searpc_server_register_function ("test", get_substring, "get_substring_late",
+                                     searpc_signature_string__string_int());
+    result = searpc_call_string__string_int (pipe_client, "get_substring_late",
+                                             &error, "hello", 3);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "hel");
+    g_free (result);
+}
+
+void
+test_searpc__function_ids (void)
+{
+    json_t *ids;
+    char *fcall, *result;
+    size_t ret_len;
+    int id;
+
+    ids = searpc_server_get_function_ids ("test");
+    cl_assert (ids != NULL);
+    cl_assert (searpc_server_get_function_ids ("no-such-service") == NULL);
+    cl_assert_equal_s (searpc_server_get_service_name (
+                           json_integer_value (json_object_get (ids, "service"))),
+                       "test");
+    id = json_integer_value (json_object_get (json_object_get (ids, "functions"),
+                                              "get_substring"));
+    json_decref (ids);
+
+    fcall = g_strdup_printf ("[%d,\"hello\",2]", id);
+    result = searpc_server_call_function ("test", fcall, strlen(fcall), &ret_len);
+    cl_assert_equal_s (result, "{\"ret\":\"he\"}");
+    g_free (result);
+    g_free (fcall);
+
+    fcall = g_strdup_printf ("[%d,\"hello\",2]", 12345);
+    result = searpc_server_call_function ("test", fcall, strlen(fcall), &ret_len);
+    cl_assert (strstr (result, "err_code") != NULL);
+    g_free (result);
+    g_free (fcall);
+
+    check_calls_by_id (client_with_pipe_transport);
+
+#if !defined(WIN32)
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    check_calls_by_id (epoll_client);
+    searpc_free_client_with_pipe_transport (epoll_client);
+#endif
+}
+
+static char *
+write_maman_bar (const char *name, int papa_number)
+{
+    MamanBar *bar = g_object_new (MAMAN_TYPE_BAR, "name", name,
+                                  "papa-number", papa_number, NULL);
+    GString *out = g_string_new (NULL);
+
+    searpc_json_write_gobject (out, G_OBJECT(bar));
+    g_object_unref (bar);
+    return g_string_free (out, FALSE);
+}
+
+void
+test_searpc__object_serializer (void)
+{
+    const char *name = "quoted \" \xc3\xa9";
+    char *reflected, *generated;
+    MamanBar *bar;
+    GList *list, *ptr;
+    GError *error = NULL;
+    int i = 0;
+
+    reflected = write_maman_bar (name, 7);
+    register_object_serializers ();
+    generated = write_maman_bar (name, 7);
+    cl_assert_equal_s (generated, reflected);
+    g_free (reflected);
+    g_free (generated);
+
+    // Fields are set directly, without the range check of the property.
+    json_t *json = json_loads ("{\"papa-number\": 42}", 0, NULL);
+    bar = MAMAN_BAR (json_gobject_deserialize (MAMAN_TYPE_BAR, json));
+    cl_assert_equal_i (bar->papa_number, 42);
+    g_object_unref (bar);
+    json_decref (json);
+
+    bar = MAMAN_BAR (searpc_call_object__string (client, "get_maman_bar",
+                                                 MAMAN_TYPE_BAR, &error, name));
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (bar->name, name);
+    g_object_unref (bar);
+
+    list = searpc_call_objlist__string_int (client, "get_maman_bar_list",
+                                            MAMAN_TYPE_BAR, &error, "kitty", 3);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (g_list_length (list), 3);
+    for (ptr = list; ptr; ptr = ptr->next) {
+        char buf[32];
+        snprintf (buf, sizeof(buf), "kitty%d", i++);
+        cl_assert_equal_s (MAMAN_BAR (ptr->data)->name, buf);
+        g_object_unref (ptr->data);
+    }
+    g_list_free (list);
+
+    searpc_register_object_serializer (MAMAN_TYPE_BAR, NULL, NULL);
+}
+
+static GString *last_request;
+
+static char *
+recording_send (void *arg, const gchar *fcall_str,
+                size_t fcall_len, size_t *ret_len)
+{
+    g_string_truncate (last_request, 0);
+    g_string_append_len (last_request, fcall_str, fcall_len);
+    return sample_send (arg, fcall_str, fcall_len, ret_len);
+}
+
+void
+test_searpc__client_stubs (void)
+{
+    const char *name = "tab\t \"quoted\" \xc3\xa9";
+    SearpcClient *recording_client = searpc_client_new ();
+    char *varargs_request, *result;
+    GList *list, *ptr;
+    json_t *param, *json_result;
+    GError *error = NULL;
+
+    last_request = g_string_new (NULL);
+    recording_client->send = recording_send;
+    recording_client->arg = "test";
+
+    // Stubs send the same requests as the varargs functions.
+    result = searpc_client_call__string (recording_client, "get_substring", &error,
+                                         2, "string", name, "int", 4);
+    g_free (result);
+    varargs_request = g_strdup (last_request->str);
+    result = searpc_call_string__string_int (recording_client, "get_substring",
+                                             &error, name, 4);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (last_request->str, varargs_request);
+    cl_assert_equal_s (result, "tab\t");
+    g_free (result);
+    g_free (varargs_request);
+
+    result = searpc_call_string__string_int (client, "get_substring", &error,
+                                             "hello", 10);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL);
+    cl_assert_equal_i (error->code, 100);
+    g_clear_error (&error);
+
+    list = searpc_call_objlist__string_int (client, "get_maman_bar_list",
+                                            MAMAN_TYPE_BAR, &error, "kitty", 3);
+    cl_assert (error == NULL);
+    cl_assert_equal_i (g_list_length (list), 3);
+    for (ptr = list; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (list);
+
+    param = json_object ();
+    json_object_set_new (param, "a", json_integer (1));
+    json_result = searpc_call_json__json (client, "count_json_kvs", &error, param);
+    cl_assert (error == NULL);
+    cl_assert_equal_i (json_integer_value (json_object_get (json_result, "number_of_kvs")), 1);
+    json_decref (json_result);
+    json_decref (param);
+
+    // Calls with invalid UTF-8 aren't sent.
+    g_string_truncate (last_request, 0);
+    result = searpc_call_string__string_int (recording_client, "get_substring",
+                                             &error, "\xff", 1);
+    cl_assert (result == NULL);
+    cl_assert (error != NULL);
+    cl_assert_equal_i (last_request->len, 0);
+    g_clear_error (&error);
+
+    searpc_client_free (recording_client);
+    g_string_free (last_request, TRUE);
+}
+
+// Larger than one frame, so the request and the response are sent in
+// continuation frames, while other calls share the connection.
+static void
+check_continuation_frames (SearpcClient *pipe_client)
+{
+    int size = 40 * 1024 * 1024;
+    GError *error = NULL;
+    pthread_t thread;
+    char *large, *result;
+    int i;
+
+    large = g_malloc (size + 1);
+    for (i = 0; i < size; i++)
+        large[i] = 'a' + (i / 4096) % 26;
+    large[size] = '\0';
+
+    pthread_create (&thread, NULL, do_shared_client_calls, pipe_client);
+    result = searpc_client_call__string (pipe_client, "get_substring", &error,
+                                         2, "string", large, "int", size - 1);
+    pthread_join (thread, NULL);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (strlen (result), size - 1);
+    cl_assert (memcmp (result, large, size - 1) == 0);
+    g_free (result);
+    g_free (large);
+}
+
+void
+test_searpc__pipe_continuation_frames (void)
+{
+    check_continuation_frames (client_with_pipe_transport);
+
+#if defined(__linux__)
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    check_continuation_frames (epoll_client);
+    searpc_free_client_with_pipe_transport (epoll_client);
+#endif
+}
+
+static char *
+call_get_substring (SearpcClient *pipe_client, const char *str, int len, GError **error)
+{
+    return searpc_client_call__string (pipe_client, "get_substring", error,
+                                       2, "string", str, "int", len);
+}
+
+static void
+check_max_message_size (SearpcNamedPipeServer *server, const char *path)
+{
+    int size = 40 * 1024 * 1024;
+    SearpcClient *pipe_client;
+    SearpcNamedPipeClient *transport;
+    GError *error = NULL;
+    char *large, *result;
+
+    large = g_malloc (size + 1);
+    memset (large, 'a', size);
+    large[size] = '\0';
+
+    // The request is refused after its first frame, and the connection
+    // is closed.
+    server->max_message_size = 20 * 1024 * 1024;
+    pipe_client = do_create_client_with_pipe_path (path);
+    result = call_get_substring (pipe_client, large, 2, &error);
+    cl_assert (result == NULL && error != NULL);
+    g_clear_error (&error);
+    result = call_get_substring (pipe_client, "hello", 2, &error);
+    cl_assert (result == NULL && error != NULL);
+    g_clear_error (&error);
+    searpc_free_client_with_pipe_transport (pipe_client);
+
+    // The same for a response longer than the client accepts.
+    transport = searpc_create_named_pipe_client (path);
+    transport->max_message_size = 1024 * 1024;
+    cl_must_pass (searpc_named_pipe_client_connect (transport));
+    pipe_client = searpc_client_with_named_pipe_transport (transport, "test");
+    large[2 * 1024 * 1024] = '\0';
+    result = call_get_substring (pipe_client, large, 2 * 1024 * 1024 - 1, &error);
+    cl_assert (result == NULL && error != NULL);
+    g_clear_error (&error);
+    result = call_get_substring (pipe_client, "hello", 2, &error);
+    cl_assert (result == NULL && error != NULL);
+    g_clear_error (&error);
+    searpc_free_client_with_pipe_transport (pipe_client);
+
+    // Other connections go on.
+    pipe_client = do_create_client_with_pipe_path (path);
+    result = call_get_substring (pipe_client, "hello", 2, &error);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "he");
+    g_free (result);
+    searpc_free_client_with_pipe_transport (pipe_client);
+
+    server->max_message_size = SEARPC_DEFAULT_MAX_MESSAGE_SIZE;
+    g_free (large);
+}
+
+void
+test_searpc__pipe_max_message_size (void)
+{
+    check_max_message_size (pipe_server, pipe_path);
+
+#if defined(__linux__)
+    start_epoll_server ();
+    check_max_message_size (epoll_server, epoll_pipe_path);
+#endif
+}
+
+typedef struct {
+    char *name;
+    int num;
+    int next;
+} BarStream;
+
+static GObject *
+next_maman_bar (void *state, GError **error)
+{
+    BarStream *stream = state;
+    char buf[256];
+
+    if (stream->next == stream->num)
+        return NULL;
+    if (strcmp (stream->name, "fail") == 0 && stream->next == stream->num / 2) {
+        g_set_error (error, DFT_DOMAIN, 100, "failed in the middle");
+        return NULL;
+    }
+
+    snprintf (buf, sizeof(buf), "%s%d", stream->name, stream->next++);
+    return g_object_new (MAMAN_TYPE_BAR, "name", buf, NULL);
+}
+
+static void
+free_bar_stream (void *state)
+{
+    BarStream *stream = state;
+
+    g_free (stream->name);
+    g_free (stream);
+}
+
+SearpcObjStream *
+stream_maman_bars (const char *name, int num, GError **error)
+{
+    BarStream *stream;
+
+    if (num < 0) {
+        g_set_error (error, DFT_DOMAIN, 100, "num must be positive.");
+        return NULL;
+    }
+
+    stream = g_new0 (BarStream, 1);
+    stream->name = g_strdup (name);
+    stream->num = num;
+    return searpc_obj_stream_new (next_maman_bar, stream, free_bar_stream);
+}
+
+typedef struct {
+    SearpcClient *client;
+    const char *name;
+    int n_objects;
+    int n_chunks;
+} StreamResult;
+
+static void
+collect_maman_bars (GList *objects, void *user_data)
+{
+    StreamResult *result = user_data;
+    GError *error = NULL;
+    char buf[32], *ret;
+    GList *ptr;
+
+    for (ptr = objects; ptr; ptr = ptr->next) {
+        snprintf (buf, sizeof(buf), "%s%d", result->name, result->n_objects++);
+        cl_assert_equal_s (MAMAN_BAR (ptr->data)->name, buf);
+        g_object_unref (ptr->data);
+    }
+    g_list_free (objects);
+
+    // The connection can be used while the rest of the list arrives.
+    if (result->n_chunks++ == 0) {
+        ret = searpc_call_string__string_int (result->client, "get_substring",
+                                              &error, "hello", 2);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (ret, "he");
+        g_free (ret);
+    }
+}
+
+static void
+check_objstream (SearpcClient *stream_client, gboolean chunked)
+{
+    StreamResult result = { stream_client, "kitty", 0, 0 };
+    GError *error = NULL;
+    GList *list, *ptr;
+    int ret;
+
+    ret = searpc_call_objstream__string_int (stream_client, "stream_maman_bars",
+                                             MAMAN_TYPE_BAR, collect_maman_bars,
+                                             &result, &error, "kitty", 20000);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (ret, 0);
+    cl_assert_equal_i (result.n_objects, 20000);
+    if (chunked)
+        cl_assert (result.n_chunks > 1);
+    else
+        cl_assert_equal_i (result.n_chunks, 1);
+
+    // An error while the list is written fails the call after the parts
+    // sent before it.
+    result.name = "fail";
+    result.n_objects = result.n_chunks = 0;
+    ret = searpc_call_objstream__string_int (stream_client, "stream_maman_bars",
+                                             MAMAN_TYPE_BAR, collect_maman_bars,
+                                             &result, &error, "fail", 20000);
+    cl_assert_equal_i (ret, -1);
+    cl_assert (error != NULL && error->code == 100);
+    g_clear_error (&error);
+
+    ret = searpc_client_call__objstream (stream_client, "stream_maman_bars",
+                                         MAMAN_TYPE_BAR, collect_maman_bars,
+                                         &result, &error,
+                                         2, "string", "kitty", "int", -1);
+    cl_assert_equal_i (ret, -1);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+
+    // Clients that don't ask for parts get the whole list, like an objlist.
+    list = searpc_client_call__objlist (stream_client, "stream_maman_bars",
+                                        MAMAN_TYPE_BAR, &error,
+                                        2, "string", "kitty", "int", 20000);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (g_list_length (list), 20000);
+    for (ptr = list; ptr; ptr = ptr->next)
+        g_object_unref (ptr->data);
+    g_list_free (list);
+}
+
+void
+test_searpc__objstream (void)
+{
+    check_objstream (client, FALSE);
+    check_objstream (client_with_pipe_transport, TRUE);
+
+#if defined(__linux__)
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    check_objstream (epoll_client, TRUE);
+    searpc_free_client_with_pipe_transport (epoll_client);
+#endif
+}
+
+static void
+collect_maman_bars_slowly (GList *objects, void *user_data)
+{
+    StreamResult *result = user_data;
+
+    result->n_objects += g_list_length (objects);
+    result->n_chunks++;
+    g_list_free_full (objects, g_object_unref);
+    g_usleep (2000);
+}
+
+static void *
+do_slow_objstream (void *arg)
+{
+    StreamResult *result = arg;
+    GError *error = NULL;
+    int ret;
+
+    ret = searpc_call_objstream__string_int (result->client, "stream_maman_bars",
+                                             MAMAN_TYPE_BAR, collect_maman_bars_slowly,
+                                             result, &error, "kitty", 100000);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (ret, 0);
+    return NULL;
+}
+
+void
+test_searpc__pipe_shared_client_slow_stream (void)
+{
+    StreamResult result = { client_with_pipe_transport, "kitty", 0, 0 };
+    pthread_t thread;
+
+    // Other threads read the parts of the stream while the caller is slow
+    // to take them.
+    pthread_create (&thread, NULL, do_slow_objstream, &result);
+    run_shared_client_calls (client_with_pipe_transport);
+    pthread_join (thread, NULL);
+    cl_assert_equal_i (result.n_objects, 100000);
+    cl_assert (result.n_chunks > 8);
+}
+
+#if !defined(WIN32)
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Returns a file holding @count copies of @text, positioned at its start.
+int
+open_blob (const char *text, int count, GError **error)
+{
+    GString *content = g_string_new (NULL);
+    char *path;
+    int fd, i;
+
+    fd = g_file_open_tmp ("searpc-blob-XXXXXX", &path, error);
+    if (fd < 0)
+        return -1;
+    unlink (path);
+    g_free (path);
+
+    for (i = 0; i < count; i++)
+        g_string_append (content, text);
+    if (write (fd, content->str, content->len) != (gssize)content->len ||
+        lseek (fd, 0, SEEK_SET) < 0) {
+        g_set_error (error, DFT_DOMAIN, 500, "failed to write blob");
+        close (fd);
+        fd = -1;
+    }
+    g_string_free (content, TRUE);
+    return fd;
+}
+
+gint64
+count_byte (int fd, int byte, GError **error)
+{
+    char buf[4096];
+    gint64 count = 0;
+    gssize n, i;
+
+    if (fd < 0) {
+        g_set_error (error, DFT_DOMAIN, 500, "no file");
+        return -1;
+    }
+    while ((n = read (fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++)
+            if (buf[i] == byte)
+                count++;
+    }
+    return count;
+}
+
+// Pass descriptors both ways while other calls share the connection, so
+// they must stay with their own request and response.
+static void
+check_fd_calls (SearpcClient *pipe_client)
+{
+    GError *error = NULL;
+    pthread_t thread;
+    struct stat st;
+    gint64 count;
+    int fd;
+
+    pthread_create (&thread, NULL, do_shared_client_calls, pipe_client);
+
+    fd = searpc_call_fd__string_int (pipe_client, "open_blob", &error, "abc", 100000);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (fd >= 0);
+    cl_must_pass (fstat (fd, &st));
+    cl_assert_equal_i (st.st_size, 300000);
+
+    // The server reads the same open file.
+    count = searpc_call_int64__fd_int (pipe_client, "count_byte", &error, fd, 'b');
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (count, 100000);
+    close (fd);
+
+    count = searpc_call_int64__fd_int (pipe_client, "count_byte", &error, -1, 'b');
+    cl_assert (error != NULL);
+    cl_assert_equal_i (count, -1);
+    g_clear_error (&error);
+
+    pthread_join (thread, NULL);
+}
+
+void
+test_searpc__fd_params (void)
+{
+    GError *error = NULL;
+    char *result;
+    int err_code;
+
+    // Without a transport that can pass descriptors, calls fail.
+    cl_assert_equal_i (searpc_call_fd__string_int (client, "open_blob", &error, "abc", 1), -1);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+    result = call_with_request ("[\"open_blob\", \"abc\", 1]", &err_code);
+    cl_assert_equal_i (err_code, 500);
+    cl_assert (result == NULL);
+
+    check_fd_calls (client_with_pipe_transport);
+
+#if defined(__linux__)
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    check_fd_calls (epoll_client);
+    searpc_free_client_with_pipe_transport (epoll_client);
+#endif
+}
+#endif
+
+GBytes *
+xor_bytes (GBytes *data, int key, GError **error)
+{
+    const guint8 *in;
+    guint8 *out;
+    gsize size, i;
+
+    if (key < 0) {
+        g_set_error (error, DFT_DOMAIN, 500, "invalid key");
+        return NULL;
+    }
+    if (!data)
+        return NULL;
+
+    in = g_bytes_get_data (data, &size);
+    out = g_malloc (size);
+    for (i = 0; i < size; i++)
+        out[i] = in[i] ^ key;
+    return g_bytes_new_take (out, size);
+}
+
+int
+count_nul_bytes (GBytes *data, GError **error)
+{
+    const char *in;
+    gsize size, i;
+    int count = 0;
+
+    if (!data) {
+        g_set_error (error, DFT_DOMAIN, 500, "no data");
+        return -1;
+    }
+    in = g_bytes_get_data (data, &size);
+    for (i = 0; i < size; i++)
+        if (in[i] == '\0')
+            count++;
+    return count;
+}
+
+// Data holding every byte value, which JSON strings couldn't carry as is.
+static void
+check_bytes_calls (SearpcClient *bytes_client)
+{
+    GError *error = NULL;
+    GBytes *data, *empty, *ret;
+    const guint8 *out;
+    guint8 *in;
+    gsize size, i;
+    int count;
+
+    size = 3 * 256 * 1024 + 5;
+    in = g_malloc (size);
+    for (i = 0; i < size; i++)
+        in[i] = (guint8)i;
+    data = g_bytes_new_take (in, size);
+
+    ret = searpc_call_bytes__bytes_int (bytes_client, "xor_bytes", &error, data, 0x5a);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (ret != NULL);
+    out = g_bytes_get_data (ret, NULL);
+    cl_assert_equal_i (g_bytes_get_size (ret), size);
+    for (i = 0; i < size; i++)
+        cl_assert_equal_i (out[i], in[i] ^ 0x5a);
+    g_bytes_unref (ret);
+
+    count = searpc_call_int__bytes (bytes_client, "count_nul_bytes", &error, data);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_i (count, size / 256 + 1);
+
+    // Empty values aren't NULL.
+    empty = g_bytes_new_static ("", 0);
+    ret = searpc_call_bytes__bytes_int (bytes_client, "xor_bytes", &error, empty, 1);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (ret != NULL);
+    cl_assert_equal_i (g_bytes_get_size (ret), 0);
+    g_bytes_unref (ret);
+    g_bytes_unref (empty);
+
+    ret = searpc_call_bytes__bytes_int (bytes_client, "xor_bytes", &error, NULL, 1);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert (ret == NULL);
+
+    count = searpc_call_int__bytes (bytes_client, "count_nul_bytes", &error, NULL);
+    cl_assert (error != NULL);
+    cl_assert_equal_i (count, -1);
+    g_clear_error (&error);
+
+    ret = searpc_call_bytes__bytes_int (bytes_client, "xor_bytes", &error, data, -1);
+    cl_assert (error != NULL);
+    cl_assert (ret == NULL);
+    g_clear_error (&error);
+
+    g_bytes_unref (data);
+}
+
+void
+test_searpc__bytes_params (void)
+{
+    static const char truncated[] = "[\"count_nul_bytes\",0]\0\5\0\0\0ab";
+    char *buf, *ret;
+    gsize ret_len;
+    json_t *object;
+
+    check_bytes_calls (client);
+    check_bytes_calls (client_with_pipe_transport);
+
+    // A value can't be longer than the rest of the section.
+    buf = g_memdup (truncated, sizeof(truncated));
+    ret = searpc_server_call_function ("test", buf, sizeof(truncated) - 1, &ret_len);
+    object = json_loadb (ret, ret_len, 0, NULL);
+    cl_assert (object != NULL);
+    cl_assert_equal_i (json_integer_value (json_object_get (object, "err_code")), 511);
+    json_decref (object);
+    g_free (ret);
+    g_free (buf);
+
+#if defined(__linux__)
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    check_bytes_calls (epoll_client);
+    searpc_free_client_with_pipe_transport (epoll_client);
+#endif
+}
+
+static void
+check_batch (SearpcClient *batch_client)
+{
+    SearpcBatch *batch = searpc_client_batch_new (batch_client);
+    SearpcCallWriter *call;
+    GError *error = NULL;
+    char *response, *result;
+    size_t len;
+    GList *bars;
+    GBytes *data;
+    char buf[32];
+    int i, round;
+
+    call = searpc_client_begin_call ("get_substring");
+    searpc_call_writer_add_string (call, "hello");
+    searpc_call_writer_add_int (call, 2);
+    cl_assert_equal_i (searpc_client_batch_add (batch, call), 0);
+    cl_assert_equal_i (searpc_client_batch_add_call (batch, "get_substring", 2,
+                                                     "string", "hello", "int", 10), 1);
+    cl_assert_equal_i (searpc_client_batch_add_call (batch, "no_such_function", 0), 2);
+    // Streams are returned whole.
+    cl_assert_equal_i (searpc_client_batch_add_call (batch, "stream_maman_bars", 2,
+                                                     "string", "bar", "int", 300), 3);
+
+    // Bytes values can't be sent in a batch.
+    data = g_bytes_new_static ("abc", 3);
+    call = searpc_client_begin_call ("count_nul_bytes");
+    searpc_call_writer_add_bytes (call, data);
+    cl_assert_equal_i (searpc_client_batch_add (batch, call), -1);
+    g_bytes_unref (data);
+
+    cl_assert (searpc_client_batch_get_response (batch, 0, &len) == NULL);
+
+    // A batch can be executed again.
+    for (round = 0; round < 2; round++) {
+        cl_must_pass (searpc_client_batch_execute (batch, &error));
+        cl_assert_ (error == NULL, error ? error->message : "");
+
+        response = searpc_client_batch_get_response (batch, 0, &len);
+        result = searpc_client_fret__string (response, len, &error);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, "he");
+        g_free (result);
+
+        response = searpc_client_batch_get_response (batch, 1, &len);
+        cl_assert (searpc_client_fret__string (response, len, &error) == NULL);
+        cl_assert (error != NULL);
+        cl_assert_equal_i (error->code, 100);
+        g_clear_error (&error);
+
+        response = searpc_client_batch_get_response (batch, 2, &len);
+        cl_assert_equal_i (searpc_client_fret__int (response, len, &error), -1);
+        cl_assert (error != NULL);
+        cl_assert_equal_i (error->code, 500);
+        g_clear_error (&error);
+
+        response = searpc_client_batch_get_response (batch, 3, &len);
+        bars = searpc_client_fret__objlist (MAMAN_TYPE_BAR, response, len, &error);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_i (g_list_length (bars), 300);
+        g_list_free_full (bars, g_object_unref);
+
+        cl_assert (searpc_client_batch_get_response (batch, 4, &len) == NULL);
+    }
+    searpc_client_batch_free (batch);
+
+    // Many small calls answered at once.
+    batch = searpc_client_batch_new (batch_client);
+    for (i = 0; i < 1000; i++) {
+        snprintf (buf, sizeof(buf), "call %d", i);
+        call = searpc_client_begin_call ("get_substring");
+        searpc_call_writer_add_string (call, buf);
+        searpc_call_writer_add_int (call, strlen (buf));
+        cl_assert_equal_i (searpc_client_batch_add (batch, call), i);
+    }
+    cl_must_pass (searpc_client_batch_execute (batch, &error));
+    for (i = 0; i < 1000; i++) {
+        snprintf (buf, sizeof(buf), "call %d", i);
+        response = searpc_client_batch_get_response (batch, i, &len);
+        result = searpc_client_fret__string (response, len, &error);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, buf);
+        g_free (result);
+    }
+    searpc_client_batch_free (batch);
+
+    // Empty batches aren't sent.
+    batch = searpc_client_batch_new (batch_client);
+    cl_must_pass (searpc_client_batch_execute (batch, &error));
+    searpc_client_batch_free (batch);
+}
+
+static int split_sends;
+
+static char *
+split_send (void *arg, const gchar *fcall_str,
+            size_t fcall_len, size_t *ret_len)
+{
+    // Each call comes alone.
+    cl_assert (fcall_len > 1 && fcall_str[1] != '[');
+    split_sends++;
+    return sample_send (arg, fcall_str, fcall_len, ret_len);
+}
+
+static gboolean
+no_batch_support (void *arg)
+{
+    return FALSE;
+}
+
+void
+test_searpc__batch_calls (void)
+{
+    static const char *malformed[] = {
+        "[[\"get_substring\",\"hello\",1],",
+        "[[\"get_substring\",\"hello\",1],]",
+        "[[\"get_substring\",\"hello\",1]] x",
+    };
+    gsize ret_len;
+    char *buf, *ret;
+    json_t *object;
+    int i;
+
+    check_batch (client);
+    check_batch (client_with_pipe_transport);
+    cl_assert (client_with_pipe_transport->supports_batch (client_with_pipe_transport->arg));
+
+    // Servers that can't run batches get the calls one at a time.
+    SearpcClient *split_client = searpc_client_new ();
+    split_client->send = split_send;
+    split_client->arg = "test";
+    split_client->supports_batch = no_batch_support;
+    split_sends = 0;
+    check_batch (split_client);
+    cl_assert (split_sends > 0);
+    searpc_client_free (split_client);
+
+    for (i = 0; i < G_N_ELEMENTS (malformed); i++) {
+        buf = g_strdup (malformed[i]);
+        ret = searpc_server_call_function ("test", buf, strlen (buf), &ret_len);
+        object = json_loadb (ret, ret_len, 0, NULL);
+        cl_assert (object != NULL);
+        cl_assert_equal_i (json_integer_value (json_object_get (object, "err_code")), 511);
+        json_decref (object);
+        g_free (ret);
+        g_free (buf);
+    }
+
+#if defined(__linux__)
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    check_batch (epoll_client);
+    searpc_free_client_with_pipe_transport (epoll_client);
+#endif
+}
+
+// Returns the most calls of a batch of slow calls that ran at once.
+static int
+run_slow_batch (SearpcClient *batch_client, int n_calls)
+{
+    SearpcBatch *batch = searpc_client_batch_new (batch_client);
+    GError *error = NULL;
+    char *response, *result;
+    char buf[32];
+    size_t len;
+    int i;
+
+    for (i = 0; i < n_calls; i++) {
+        snprintf (buf, sizeof(buf), "call %d", i);
+        searpc_client_batch_add_call (batch, "batch_echo", 2,
+                                      "string", buf, "int", 50);
+    }
+
+    g_atomic_int_set (&batch_echo_peak, 0);
+    cl_must_pass (searpc_client_batch_execute (batch, &error));
+
+    // The responses keep the order of the calls.
+    for (i = 0; i < n_calls; i++) {
+        snprintf (buf, sizeof(buf), "call %d", i);
+        response = searpc_client_batch_get_response (batch, i, &len);
+        result = searpc_client_fret__string (response, len, &error);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, buf);
+        g_free (result);
+    }
+    searpc_client_batch_free (batch);
+
+    return g_atomic_int_get (&batch_echo_peak);
+}
+
+void
+test_searpc__parallel_batch (void)
+{
+    int peak;
+
+    searpc_server_set_batch_parallelism (8);
+    // Without workers to help, the calls run one after the other.
+    cl_assert_equal_i (run_slow_batch (client, 4), 1);
+    peak = run_slow_batch (client_with_pipe_transport, 8);
+    cl_assert (peak > 1 && peak <= 8);
+    searpc_server_set_batch_parallelism (4);
+    peak = run_slow_batch (client_with_pipe_transport, 8);
+    cl_assert (peak > 1 && peak <= 4);
+
+#if defined(__linux__)
+    SearpcClient *epoll_client;
+
+    start_epoll_server ();
+    epoll_client = do_create_client_with_pipe_path (epoll_pipe_path);
+    peak = run_slow_batch (epoll_client, 8);
+    cl_assert (peak > 1 && peak <= 4);
+    check_batch (epoll_client);
+    searpc_free_client_with_pipe_transport (epoll_client);
+#endif
+
+    searpc_server_set_batch_parallelism (1);
+    cl_assert_equal_i (run_slow_batch (client_with_pipe_transport, 4), 1);
+}
+
+#if defined(__linux__)
+static void
+check_shm_client (const char *path)
+{
+    SearpcNamedPipeClient *pipe_client = searpc_create_named_pipe_client (path);
+    SearpcClient *shm_client;
+    GError *error = NULL;
+    gchar *result;
+
+    cl_must_pass (searpc_named_pipe_client_connect (pipe_client));
+    shm_client = searpc_client_with_named_pipe_transport (pipe_client, "test");
+
+    // Rings must be a power of two, and the connection keeps the socket.
+    cl_assert_equal_i (searpc_named_pipe_client_enable_shm (pipe_client, 5000, 0), -1);
+    cl_assert (pipe_client->shm == NULL);
+    result = searpc_client_call__string (shm_client, "get_substring", &error,
+                                         2, "string", "hello", "int", 2);
+    cl_assert_ (error == NULL, error ? error->message : "");
+    cl_assert_equal_s (result, "he");
+    g_free (result);
+
+    // A small ring makes most messages wrap around and wait for space.
+    cl_must_pass (searpc_named_pipe_client_enable_shm (pipe_client, 16384, 20));
+    cl_assert (pipe_client->shm != NULL);
+    cl_assert_equal_i (searpc_named_pipe_client_enable_shm (pipe_client, 16384, 20), -1);
+
+    result = searpc_client_call__string (shm_client, "get_substring", &error,
+                                         2, "string", "hello", "int", 10);
+    cl_assert (error != NULL);
+    g_clear_error (&error);
+    g_free (result);
+
+    cl_must_pass (searpc_client_load_pipe_function_ids (shm_client));
+    run_shared_client_calls (shm_client);
+    check_objstream (shm_client, TRUE);
+    check_continuation_frames (shm_client);
+    check_fd_calls (shm_client);
+    check_bytes_calls (shm_client);
+
+    searpc_free_client_with_pipe_transport (shm_client);
+}
+
+static int
+count_threads (void)
+{
+    GDir *dir = g_dir_open ("/proc/self/task", 0, NULL);
+    int n = 0;
+
+    cl_assert (dir != NULL);
+    while (g_dir_read_name (dir))
+        n++;
+    g_dir_close (dir);
+    return n;
+}
+
+void
+test_searpc__pipe_shm (void)
+{
+    SearpcNamedPipeClient *pipe_clients[4];
+    SearpcClient *shm_clients[4];
+    GError *error = NULL;
+    gchar *result;
+    int n_threads, i;
+
+    check_shm_client (pipe_path);
+
+    start_epoll_server ();
+    check_shm_client (epoll_pipe_path);
+    check_shm_client (epoll_pipe_path);
+    test_searpc__pipe_epoll_call ();
+
+    // In epoll mode, connections using shared memory are served by the
+    // workers like the others, without threads of their own.
+    start_epoll_server_with_pool_size (1);
+    n_threads = count_threads ();
+    for (i = 0; i < G_N_ELEMENTS(shm_clients); i++) {
+        pipe_clients[i] = searpc_create_named_pipe_client (epoll_pipe_path);
+        cl_must_pass (searpc_named_pipe_client_connect (pipe_clients[i]));
+        shm_clients[i] = searpc_client_with_named_pipe_transport (pipe_clients[i], "test");
+        cl_must_pass (searpc_named_pipe_client_enable_shm (pipe_clients[i], 0, 0));
+    }
+    for (i = 0; i < G_N_ELEMENTS(shm_clients) * 10; i++) {
+        result = searpc_client_call__string (shm_clients[i % G_N_ELEMENTS(shm_clients)],
+                                             "get_substring", &error,
+                                             2, "string", "hello", "int", 2);
+        cl_assert_ (error == NULL, error ? error->message : "");
+        cl_assert_equal_s (result, "he");
+        g_free (result);
+    }
+    cl_assert_equal_i (count_threads (), n_threads);
+    for (i = 0; i < G_N_ELEMENTS(shm_clients); i++)
+        searpc_free_client_with_pipe_transport (shm_clients[i]);
+}
+
+void
+test_searpc__pipe_epoll_shm_in_flight (void)
+{
+    SearpcNamedPipeClient *pipe_client;
+    const char *slow_call = "[\"delayed_echo\",\"slow\",300]";
+    char fcall[64];
+    guint32 ids[8], resp_id;
+    size_t len;
+    char *resp;
+    int round, i, j;
+
+    start_epoll_server ();
+    for (round = 0; round < 5; round++) {
+        pipe_client = searpc_create_named_pipe_client (epoll_pipe_path);
+        cl_must_pass (searpc_named_pipe_client_connect (pipe_client));
+
+        // The move is refused while earlier requests are running, and
+        // their responses still come through the socket.
+        for (i = 0; i < 2; i++)
+            cl_must_pass (searpc_named_pipe_client_send_request (pipe_client, "test", slow_call,
+                                                                 strlen (slow_call), &ids[i]));
+        cl_assert_equal_i (searpc_named_pipe_client_enable_shm (pipe_client, 0, 0), -1);
+        for (i = 0; i < 2; i++) {
+            resp = searpc_named_pipe_client_read_response (pipe_client, &resp_id, &len);
+            cl_assert (resp != NULL);
+            cl_assert (resp_id == ids[0] || resp_id == ids[1]);
+            check_echo_response (resp, len, "slow");
+            g_free (resp);
+        }
+
+        // Once they're done it's accepted, and requests sent right after
+        // are read from the ring.
+        cl_must_pass (searpc_named_pipe_client_enable_shm (pipe_client, 0, 0));
+        for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+            snprintf (fcall, sizeof(fcall), "[\"delayed_echo\",\"%d\",%d]", i, i % 3);
+            cl_must_pass (searpc_named_pipe_client_send_request (pipe_client, "test", fcall,
+                                                                 strlen (fcall), &ids[i]));
+        }
+        for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+            resp = searpc_named_pipe_client_read_response (pipe_client, &resp_id, &len);
+            cl_assert (resp != NULL);
+            for (j = 0; j < G_N_ELEMENTS(ids); j++) {
+                if (ids[j] == resp_id)
+                    break;
+            }
+            cl_assert (j < G_N_ELEMENTS(ids));
+            snprintf (fcall, sizeof(fcall), "%d", j);
+            check_echo_response (resp, len, fcall);
+            ids[j] = 0;
+            g_free (resp);
+        }
+
+        searpc_named_pipe_client_free (pipe_client);
+    }
+}
+#endif
+
+void
+test_searpc__initialize (void)
+{
+    searpc_server_init (register_marshals);
+    searpc_create_service ("test");
+    searpc_server_register_function ("test", get_substring, "get_substring",
+                                     searpc_signature_string__string_int());
+    searpc_server_register_function ("test", delayed_echo, "delayed_echo",
+                                     searpc_signature_string__string_int());
+    searpc_server_register_function ("test", batch_echo, "batch_echo",
+                                     searpc_signature_string__string_int());
+    searpc_server_register_function ("test", get_maman_bar, "get_maman_bar",
+                                     searpc_signature_object__string());
+    searpc_server_register_function ("test", get_maman_bar_list, "get_maman_bar_list",
+                                     searpc_signature_objlist__string_int());
+    searpc_server_register_function ("test", stream_maman_bars, "stream_maman_bars",
+                                     searpc_signature_objstream__string_int());
+    searpc_server_register_function ("test", simple_json_rpc, "simple_json_rpc",
+                                     searpc_signature_json__string_int());
+    searpc_server_register_function ("test", count_json_kvs, "count_json_kvs",
+                                     searpc_signature_json__json());
+#if !defined(WIN32)
+    searpc_server_register_function ("test", open_blob, "open_blob",
+                                     searpc_signature_fd__string_int());
+    searpc_server_register_function ("test", count_byte, "count_byte",
+                                     searpc_signature_int64__fd_int());
+#endif
+    searpc_server_register_function ("test", xor_bytes, "xor_bytes",
+                                     searpc_signature_bytes__bytes_int());
+    searpc_server_register_function ("test", count_nul_bytes, "count_nul_bytes",
+                                     searpc_signature_int__bytes());
 
     /* sample client */
     client = searpc_client_new();
@@ -547,7 +2719,8 @@ test_searpc__initialize (void)
     client->async_send = sample_async_send;
     client->async_arg = "test_async";
 
-    SearpcNamedPipeServer *pipe_server = searpc_create_named_pipe_server_with_threadpool(pipe_path, NAMED_PIPE_SERVER_THREAD_POOL_SIZE);
+    pipe_server = searpc_create_named_pipe_server_with_threadpool(pipe_path, NAMED_PIPE_SERVER_THREAD_POOL_SIZE);
+    cl_assert (pipe_server != NULL);
     cl_must_pass_(searpc_named_pipe_server_start(pipe_server), "named pipe server failed to start");
 #if defined(WIN32)
     // Wait for the server thread to start
@@ -561,6 +2734,11 @@ void
 test_searpc__cleanup (void)
 {
     searpc_free_client_with_pipe_transport(client_with_pipe_transport);
+    searpc_free_named_pipe_server (pipe_server);
+    pipe_server = NULL;
+    searpc_free_named_pipe_server (epoll_server);
+    epoll_server = NULL;
+    searpc_server_set_batch_parallelism (1);
 
     /* free memory for memory debug with valgrind */
     searpc_server_final();